@@ -3,474 +3,4112 @@
 
 // Tabla de Descriptores de Interrupción (IDT)
 irq_descriptor_t idt[MAX_INTERRUPTS];
+irq_meta_t irq_meta[MAX_INTERRUPTS];
 
-// Sistema de trazabilidad
-trace_entry_t trace_log[MAX_TRACE_LINES];
-int trace_index = 0;
+// Sistema de trazabilidad: un anillo privado por hilo productor.
+// Cada hilo escribe solo en su buffer y publica cada slot con su número de
+// secuencia; los lectores hacen un merge k-way por timestamp monotónico.
+// Los buffers viven en una región mmap (anónima o respaldada por archivo),
+// nunca en el heap del proceso.
+unsigned long trace_capacity = 0;
+unsigned long trace_dropped = 0;
+static unsigned long trace_capacity_mask = 0;
+static int trace_buffers = 0;              // Buffers reservados en la región
+static trace_ring_header_t *trace_region = NULL;
+static size_t trace_region_size = 0;
+static int trace_region_fd = -1;
+static pthread_mutex_t trace_init_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int trace_generation = 0;  // Cambia en cada trace_init()
+static __thread trace_buffer_t *thread_trace_buffer = NULL;
+static __thread unsigned int thread_trace_generation = 0;
+static pthread_key_t trace_buffer_key;
+static pthread_once_t trace_buffer_key_once = PTHREAD_ONCE_INIT;
+
+// Logger de consola: los productores encolan la entrada binaria en una cola
+// MPMC acotada (celdas con número de secuencia) y un hilo dedicado la
+// formatea y la escribe por lotes con un único write(). Así ningún ISR
+// bloquea en la terminal dentro de dispatch_interrupt().
+typedef struct {
+    unsigned long seq;
+    trace_entry_t entry;
+    int with_irq_tag;
+} log_cell_t;
+
+static struct {
+    unsigned long enqueue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+    unsigned long dequeue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+    log_cell_t cells[LOG_QUEUE_SIZE] __attribute__((aligned(CACHE_LINE_SIZE)));
+} log_queue;
+
+unsigned long log_dropped = 0;
+static unsigned long log_written = 0;       // Líneas ya escritas (para logger_flush)
+static int logger_running = 0;
+static int logger_sleeping = 0;
+static log_policy_t logger_policy = LOG_POLICY_BLOCK;
+static pthread_t logger_thread;
+static pthread_mutex_t logger_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t logger_cond = PTHREAD_COND_INITIALIZER;
+static char logger_batch[LOG_BATCH_BYTES];
+
+// Modo SMP: cada CPU simulada es un hilo con su cola de IRQs pendientes.
+// dispatch_interrupt() solo encola en una CPU de la afinidad de la IRQ y
+// el handler corre en el hilo de esa CPU.
+sim_cpu_t sim_cpus[MAX_SIM_CPUS];
+int smp_cpu_count = 0;                      // 0 = modo UP (despacho en línea)
+static int smp_running = 0;
+static int smp_work_stealing = 0;
+static __thread int current_cpu = -1;       // CPU simulada del hilo actual (-1 = ninguna)
+
+// Registros del controlador de interrupciones: bit n = IRQ n, en palabras de
+// 64 bits como el IRR/ISR de 256 bits del APIC local.
+// IRR = peticiones pendientes, ISR = vectores en servicio.
+static uint64_t pic_irr[IRQ_BITMAP_WORDS];
+static uint64_t pic_isr[IRQ_BITMAP_WORDS];
+static void pic_deliver_pending(void);
+static int smp_enqueue_irq(int irq_num, uint64_t raised_ns, int from_irr);
+
+// Vectores de la IDT. vector_irq[] traduce vector -> IRQ en O(1) (-1 =
+// excepción, vector del sistema o libre); vector_used marca los vectores ya
+// ocupados para el asignador (solo con vector_mutex).
+int vector_irq[IDT_VECTORS];
+static uint64_t vector_used[IDT_VECTORS / 64];
+static pthread_mutex_t vector_mutex = PTHREAD_MUTEX_INITIALIZER;
+// IRQs con handler: los informes recorren este bitmap en lugar de la tabla
+uint64_t irq_active[IRQ_BITMAP_WORDS];
+
+// Hilos irq/N de los handlers en hilo (request_threaded_irq)
+static int irq_thread_start(int irq_num);
+static void irq_thread_stop(int irq_num);
+
+// Bottom halves: colas de softirqs por CPU y workqueue compartido
+static deferred_queue_t softirq_queues[MAX_SIM_CPUS];
+static deferred_queue_t workqueue;
+static int softirq_queue_count = 0;
+static int workqueue_started = 0;
+static int deferred_running = 0;
+static __thread int in_hardirq = 0;         // El hilo está dentro de una ISR
+static void softirq_irq_exit(void);
+
+// Motor de eventos discretos: con sim_virtual_time, monotonic_ns() devuelve
+// sim_vclock_ns. Solo lo avanza el hilo del bucle de eventos.
+int sim_virtual_time = 0;
+uint64_t sim_vclock_ns = 0;
+
+// Los microbenchmarks que despachan IRQs solo guardan la traza: imprimirla falsearía la medida
+static int trace_console_muted = 0;
 
 // Variables globales del sistema
 int system_running = 1;
 int timer_counter = 0;
+static uint64_t timer_period = TIMER_INTERVAL_SEC * 1000000000ULL;  // ns (atómico)
+static int timer_hz = 0;                    // 0 = periodo por defecto de TIMER_INTERVAL_SEC
+
+// Modo tickless: el hilo del timer duerme en timer_cond con el tick detenido
+// y lo despiertan la actividad (dispatch_interrupt), un evento más temprano o la salida
+static int timer_tickless = 0;
+static int timer_idle = 0;                  // El tick está detenido (atómico)
+static uint64_t nohz_stop_ns = 0;           // Inicio de la parada en curso (0 = tick activo)
+static unsigned long nohz_activity = 0;     // IRQs no-timer despachadas (atómico)
+static unsigned long nohz_timer_queued = 0; // Ticks de la IRQ0 en colas de CPU sin atender (atómico)
+static uint64_t timer_next_event = UINT64_MAX; // Evento one-shot programado (atómico)
+static pthread_mutex_t timer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timer_cond;
+
+// Timers de software: jiffies avanza con el tiempo real (también con el
+// tick detenido), no con los ticks disparados. Solo lo escribe el hilo del
+// timer; jiffies_seq (seqcount) mantiene el par jiffies/stamp coherente.
+static uint64_t jiffies = 0;
+static uint64_t jiffies_stamp_ns = 0;       // Inicio del jiffy `jiffies`
+static unsigned long jiffies_seq = 0;
+static timer_base_t timer_base = { .lock = PTHREAD_MUTEX_INITIALIZER };
 pthread_t timer_thread;
-pthread_mutex_t idt_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t idt_mutex = PTHREAD_MUTEX_INITIALIZER;  // Solo serializa operaciones en bloque sobre la IDT
 system_stats_t stats;
 
 // Variables globales adicionales
 log_level_t current_log_level = LOG_LEVEL_USER_ONLY;  // Por defecto, solo acciones del usuario
 int show_timer_logs = 0;  // Timer logs ocultos por defecto
+sim_options_t sim_options = {
+    .trace_capacity = TRACE_DEFAULT_CAPACITY,
+    .trace_file = NULL,
+    .trace_export = NULL,
+    .log_policy = LOG_POLICY_BLOCK,
+    .cpu_count = 0,
+    .work_stealing = 0,
+    .seed = SIM_DEFAULT_SEED
+};
 
 
-// Función para obtener timestamp
-void get_timestamp(char *buffer, size_t size) {
-    time_t rawtime;
-    struct tm *timeinfo;
-    time(&rawtime);
-    timeinfo = localtime(&rawtime);
-    strftime(buffer, size, "%H:%M:%S", timeinfo);
+// Diferencia entre CLOCK_REALTIME y CLOCK_MONOTONIC, capturada una sola vez:
+// las trazas guardan solo el valor monotónico y la hora de pared se deriva al mostrar
+static int64_t realtime_offset_ns;
+static pthread_once_t realtime_offset_once = PTHREAD_ONCE_INIT;
+
+static void realtime_offset_init(void) {
+    struct timespec real;
+    uint64_t mono = monotonic_ns();
+    clock_gettime(CLOCK_REALTIME, &real);
+    realtime_offset_ns = ((int64_t)real.tv_sec * 1000000000LL + real.tv_nsec) - (int64_t)mono;
 }
 
-// Función para agregar entrada a la traza (thread-safe)
-void add_trace(const char *event) {
-    pthread_mutex_lock(&trace_mutex);
-    get_timestamp(trace_log[trace_index].timestamp, sizeof(trace_log[trace_index].timestamp));
-    strncpy(trace_log[trace_index].event, event, sizeof(trace_log[trace_index].event) - 1);
-    trace_log[trace_index].event[sizeof(trace_log[trace_index].event) - 1] = '\0';
-    trace_log[trace_index].irq_num = -1;
-    trace_index = (trace_index + 1) % MAX_TRACE_LINES;
-    pthread_mutex_unlock(&trace_mutex);
-    
-    printf("[%s] %s\n", trace_log[(trace_index - 1 + MAX_TRACE_LINES) % MAX_TRACE_LINES].timestamp, event);
-    fflush(stdout);
+// Offset CLOCK_REALTIME - CLOCK_MONOTONIC usado para renderizar horas de pared
+int64_t realtime_offset(void) {
+    pthread_once(&realtime_offset_once, realtime_offset_init);
+    return realtime_offset_ns;
 }
 
-// Función para agregar entrada a la traza con IRQ específico (thread-safe)
-void add_trace_with_irq(const char *event, int irq_num) {
-    pthread_mutex_lock(&trace_mutex);
-    get_timestamp(trace_log[trace_index].timestamp, sizeof(trace_log[trace_index].timestamp));
-    strncpy(trace_log[trace_index].event, event, sizeof(trace_log[trace_index].event) - 1);
-    trace_log[trace_index].event[sizeof(trace_log[trace_index].event) - 1] = '\0';
-    trace_log[trace_index].irq_num = irq_num;
-    trace_index = (trace_index + 1) % MAX_TRACE_LINES;
-    pthread_mutex_unlock(&trace_mutex);
-    
-    printf("[%s] %s\n", trace_log[(trace_index - 1 + MAX_TRACE_LINES) % MAX_TRACE_LINES].timestamp, event);
-    fflush(stdout);
+// Formatear un timestamp monotónico como HH:MM:SS.uuuuuu.
+// El prefijo HH:MM:SS se cachea por hilo y solo se recalcula (localtime_r +
+// strftime) cuando cambia el segundo.
+void format_monotonic_timestamp(uint64_t timestamp_ns, char *buffer, size_t size) {
+    static __thread time_t cached_second = (time_t)-1;
+    static __thread char cached_prefix[16];
+    
+    int64_t wall_ns = (int64_t)timestamp_ns + realtime_offset();
+    time_t second = (time_t)(wall_ns / 1000000000LL);
+    
+    if (second != cached_second) {
+        struct tm timeinfo;
+        localtime_r(&second, &timeinfo);
+        strftime(cached_prefix, sizeof(cached_prefix), "%H:%M:%S", &timeinfo);
+        cached_second = second;
+    }
+    snprintf(buffer, size, "%s.%06d", cached_prefix, (int)((wall_ns % 1000000000LL) / 1000));
 }
 
-// Función para logging silencioso (solo guarda en traza, no imprime)
-void add_trace_silent(const char *event) {
-    pthread_mutex_lock(&trace_mutex);
-    get_timestamp(trace_log[trace_index].timestamp, sizeof(trace_log[trace_index].timestamp));
-    strncpy(trace_log[trace_index].event, event, sizeof(trace_log[trace_index].event) - 1);
-    trace_log[trace_index].event[sizeof(trace_log[trace_index].event) - 1] = '\0';
-    trace_log[trace_index].irq_num = -1;
-    trace_index = (trace_index + 1) % MAX_TRACE_LINES;
-    pthread_mutex_unlock(&trace_mutex);
-    // NO imprime nada
+// Función para obtener timestamp
+void get_timestamp(char *buffer, size_t size) {
+    format_monotonic_timestamp(monotonic_ns(), buffer, size);
 }
 
-void add_trace_with_irq_silent(const char *event, int irq_num) {
-    pthread_mutex_lock(&trace_mutex);
-    get_timestamp(trace_log[trace_index].timestamp, sizeof(trace_log[trace_index].timestamp));
-    strncpy(trace_log[trace_index].event, event, sizeof(trace_log[trace_index].event) - 1);
-    trace_log[trace_index].event[sizeof(trace_log[trace_index].event) - 1] = '\0';
-    trace_log[trace_index].irq_num = irq_num;
-    trace_index = (trace_index + 1) % MAX_TRACE_LINES;
-    pthread_mutex_unlock(&trace_mutex);
-    // NO imprime nada
+// Plantillas de texto de cada evento (indexadas por trace_event_id_t)
+static const char *const trace_templates[TRACE_EV_COUNT] = {
+    [TRACE_EV_TEXT]             = "%s",
+    [TRACE_EV_ISR_REGISTERED]   = "📝 KERNEL: ISR registrada en IDT[%d] -> Handler: \"%s\"",
+    [TRACE_EV_IRQ_CONNECTED]    = "🔗 HARDWARE: IRQ %d ahora conectada al kernel - Lista para recibir señales",
+    [TRACE_EV_ISR_REMOVED]      = "🗑️  KERNEL: ISR removida de IDT[%d] - Era: \"%s\"",
+    [TRACE_EV_IRQ_DISCONNECTED] = "🚫 HARDWARE: IRQ %d desconectada - Interrupciones no serán procesadas",
+    [TRACE_EV_IRQ_REJECTED]     = "❌ HARDWARE: IRQ %d RECHAZADA - Número fuera del rango válido (0-%d)",
+    [TRACE_EV_IRQ_NO_HANDLER]   = "❌ KERNEL: IRQ %d SIN HANDLER - Estado: %s",
+    [TRACE_EV_IRQ_REENTRANT]    = "⚠️  KERNEL: IRQ %d ya ejecutándose - Interrupción ignorada (reentrancy)",
+    [TRACE_EV_IRQ_RAISED]       = "🔥 HARDWARE: IRQ %d disparada - Línea de interrupción activada",
+    [TRACE_EV_CONTEXT_SAVE]     = "🚨 CPU: Guardando contexto actual - Registros y estado del procesador",
+    [TRACE_EV_IDT_LOOKUP]       = "🔍 KERNEL: Consultando IDT[%d] - Vector de interrupción encontrado",
+    [TRACE_EV_ISR_EXEC]         = "⚡ KERNEL: Ejecutando ISR \"%s\" - Llamada #%d [Modo Kernel]",
+    [TRACE_EV_CONTEXT_RESTORE]  = "🔄 CPU: Restaurando contexto - Volviendo al proceso interrumpido (%d μs)",
+    [TRACE_EV_IRQ_DONE]         = "✅ KERNEL: IRQ %d procesada - Sistema listo para nuevas interrupciones",
+    [TRACE_EV_TIMER_TICK]       = "    ⏰ TIMER_ISR: Tick del sistema #%d - Actualizando jiffies del kernel",
+    [TRACE_EV_TIMER_QUANTUM]    = "    📊 SCHEDULER: Verificando quantum de procesos - Time slice check",
+    [TRACE_EV_TIMER_DONE]       = "    🔄 TIMER_ISR: Completada - Sistema de tiempo actualizado",
+    [TRACE_EV_KBD_SCANCODE]     = "    ⌨️  KEYBOARD_ISR: Leyendo scancode del controlador 8042",
+    [TRACE_EV_KBD_KEYCODE]      = "    🔤 INPUT_LAYER: Traduciendo scancode a keycode",
+    [TRACE_EV_KBD_EVENT]        = "    📤 EVENT_QUEUE: Enviando evento de teclado a /dev/input/eventX",
+    [TRACE_EV_CUSTOM_BEGIN]     = "    🔧 CUSTOM_ISR: Procesando interrupción de dispositivo personalizado",
+    [TRACE_EV_CUSTOM_DATA]      = "    💾 DEVICE_DRIVER: Intercambiando datos con hardware específico",
+    [TRACE_EV_CUSTOM_DONE]      = "    ✅ CUSTOM_ISR: Operación completada - Hardware listo para nuevas operaciones",
+    [TRACE_EV_ERROR_ISR]        = "    ERROR ISR: Manejando error en IRQ %d",
+    [TRACE_EV_PIT_FIRE]         = "⏲️  HARDWARE: Timer PIT disparando IRQ0 (tick #%d, %d μs de retraso) - Señal de reloj del sistema",
+    [TRACE_EV_TEST_CLEANUP]     = "🧼 KERNEL: %d ISRs de prueba limpiadas - Solo ISRs del sistema preservadas",
+    [TRACE_EV_IRQ_QUEUE_FULL]   = "⚠️  APIC: IRQ %d perdida - Cola de pendientes de CPU%d llena",
+    [TRACE_EV_SMP_STARTED]      = "🖥️  KERNEL: %d CPUs simuladas en línea - IRQs repartidas según smp_affinity",
+    [TRACE_EV_IRQ_AFFINITY]     = "🎯 APIC: IRQ %d redirigida - smp_affinity = %s",
+    [TRACE_EV_IRQ_STOLEN]       = "🤝 SCHED: IRQ %d robada de la cola de CPU%d - CPU origen ocupada",
+    [TRACE_EV_IRQ_LATCHED]      = "📥 PIC: IRQ %d en servicio - Petición retenida en el IRR hasta el EOI",
+    [TRACE_EV_IRQ_COALESCED]    = "🔁 PIC: IRQ %d ya pendiente en el IRR - Petición fusionada (coalesced)",
+    [TRACE_EV_IRQ_PENDING_DELIVERED] = "📬 PIC: IRQ %d entregada desde el IRR - Vector de nuevo disponible",
+    [TRACE_EV_IRQ_LOST]         = "💨 PIC: IRQ %d perdida - Vector liberado con la petición pendiente",
+    [TRACE_EV_SOFTIRQ_HANDOFF]  = "🧵 SOFTIRQ: Presupuesto de irq_exit agotado en CPU%d - ksoftirqd/%d toma el relevo",
+    [TRACE_EV_DEFERRED_STARTED] = "🧵 KERNEL: %d hilos ksoftirqd y %d kworkers listos para bottom halves",
+    [TRACE_EV_IRQ_THREAD_REGISTERED] = "🧶 KERNEL: IRQ %d con handler en hilo - irq/%d atenderá \"%s\"",
+    [TRACE_EV_IRQ_THREAD_WAKE]  = "🧶 KERNEL: Handler primario de IRQ %d completado - Despertando irq/%d, línea enmascarada",
+    [TRACE_EV_IRQ_THREAD_DONE]  = "🧶 irq/%d: Handler en hilo completado (%d μs) - Línea desenmascarada",
+    [TRACE_EV_NAPI_CONFIG]      = "📶 NAPI: IRQ %d pasará a polling por encima de %d IRQs/s (budget %d)",
+    [TRACE_EV_NAPI_POLL_ON]     = "📶 NAPI: IRQ %d supera %d IRQs/s - Línea enmascarada, modo polling",
+    [TRACE_EV_NAPI_POLL_OFF]    = "📶 NAPI: IRQ %d sin eventos pendientes - %d eventos en %d pasadas, interrupciones reactivadas",
+    [TRACE_EV_TIMER_CONFIG]     = "⚙️  TIMER: IRQ0 cada %d μs (HZ=%d) - Deadlines absolutos con clock_nanosleep",
+    [TRACE_EV_TIMER_MISSED]     = "⚠️  TIMER: %d ticks perdidos - El tick anterior superó su periodo (%d μs tarde)",
+    [TRACE_EV_NOHZ_STOP]        = "💤 NO_HZ: Sistema ocioso - Tick detenido (próximo evento en %d ms, -1 = ninguno)",
+    [TRACE_EV_NOHZ_RESTART]     = "⏰ NO_HZ: Tick reanudado tras %d ms ocioso - %d ticks ahorrados",
+    [TRACE_EV_NOHZ_ONESHOT]     = "⏲️  HARDWARE: Timer one-shot disparando IRQ0 (%d μs de retraso) - Evento programado con el tick detenido",
+    [TRACE_EV_TIMERS_EXPIRED]   = "⏱️  TIMERS: %d timers de la rueda caducados (jiffy %d)",
+    [TRACE_EV_HRTIMERS_EXPIRED] = "⏱️  HRTIMERS: %d hrtimers caducados en la IRQ0 (%d μs de retraso máximo)",
+    [TRACE_EV_IRQ_SPURIOUS]     = "👻 KERNEL: IRQ %d espuria - Ninguno de sus %d handlers la reclamó",
+    [TRACE_EV_SHARED_REGISTERED] = "🔗 KERNEL: \"%s\" comparte la IRQ %d - %d handlers en la cadena",
+    [TRACE_EV_SHARED_HANDLED]   = "    🔗 SHARED_ISR: \"%s\" reclama la IRQ %d - Su registro de estado indicaba actividad",
+    [TRACE_EV_VECTOR_UNASSIGNED] = "⚠️  IDT: Vector %d (%s) sin IRQ asignada - Interrupción ignorada",
+    [TRACE_EV_MSIX_ALLOCATED]   = "📡 KERNEL: \"%s\" habilita MSI-X - %d vectores desde la IRQ %d",
+    [TRACE_EV_MSIX_FAILED]      = "❌ KERNEL: \"%s\" sin MSI-X - No quedan %d IRQs dinámicas libres",
+    [TRACE_EV_MSIX_QUEUE]       = "    📡 MSIX_ISR: Cola de la IRQ %d atendida en su propio vector %d - Sin consultar al dispositivo"
+};
+
+// Pool de cadenas internadas (texto libre y descripciones de handlers).
+// Tabla hash de direccionamiento abierto, inserción lock-free:
+// state 0 = libre, 1 = reservado (copiando texto), 2 = publicado.
+typedef struct {
+    unsigned int state;
+    unsigned int hash;
+    char text[MAX_TRACE_MSG_LEN];
+} trace_string_t;
+
+static trace_string_t trace_strings[TRACE_STRING_POOL_SIZE];
+
+// Hash FNV-1a del texto
+static unsigned int trace_string_hash(const char *text) {
+    unsigned int hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)text; *p; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return hash;
 }
 
-// Función para controlar el nivel de logging
-void set_log_level(log_level_t level) {
-    current_log_level = level;
-    const char* level_names[] = {"SILENCIOSO", "SOLO USUARIO", "VERBOSE"};
-    printf("Nivel de logging cambiado a: %s\n", level_names[level]);
+// Internar una cadena y devolver su id (>= 1); 0 si el pool está lleno
+int trace_intern_string(const char *text) {
+    unsigned int hash = trace_string_hash(text);
+    
+    for (int probe = 0; probe < TRACE_STRING_POOL_SIZE; probe++) {
+        int idx = (hash + probe) % TRACE_STRING_POOL_SIZE;
+        trace_string_t *slot = &trace_strings[idx];
+        unsigned int state = ATOMIC_LOAD_ACQ(&slot->state);
+        
+        if (state == 0) {
+            unsigned int expected = 0;
+            if (__atomic_compare_exchange_n(&slot->state, &expected, 1, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                strncpy(slot->text, text, sizeof(slot->text) - 1);
+                slot->text[sizeof(slot->text) - 1] = '\0';
+                slot->hash = hash;
+                ATOMIC_STORE_REL(&slot->state, 2);
+                return idx + 1;
+            }
+            state = expected;
+        }
+        
+        // Otro hilo está publicando este slot: esperar a que termine
+        while (state == 1) {
+            CPU_RELAX();
+            state = ATOMIC_LOAD_ACQ(&slot->state);
+        }
+        if (slot->hash == hash && strncmp(slot->text, text, sizeof(slot->text) - 1) == 0) {
+            return idx + 1;
+        }
+    }
+    return 0;
 }
 
-void toggle_timer_logs(void) {
-    show_timer_logs = !show_timer_logs;
-    printf("Logs del timer: %s\n", show_timer_logs ? "HABILITADOS" : "DESHABILITADOS");
+// Texto de una cadena internada
+const char* trace_string_text(int string_id) {
+    if (string_id < 1 || string_id > TRACE_STRING_POOL_SIZE ||
+        ATOMIC_LOAD_ACQ(&trace_strings[string_id - 1].state) != 2) {
+        return "<texto no disponible>";
+    }
+    return trace_strings[string_id - 1].text;
 }
 
-// Función de logging inteligente
-void add_trace_smart(const char *event, int irq_num, int is_timer_related) {
-    // Siempre guardar en la traza para el historial
-    if (irq_num >= 0) {
-        add_trace_with_irq_silent(event, irq_num);
-    } else {
-        add_trace_silent(event);
+// Buffers de trazas que necesitan los hilos del simulador: menú, timer y
+// margen, un hilo y un ksoftirqd por CPU simulada (un ksoftirqd en UP), los
+// kworkers, un irq/N por IRQ legacy con --threaded-irqs y los de reserva.
+int trace_thread_budget(int cpu_count, int threaded_irqs) {
+    int budget = TRACE_CORE_THREADS + cpu_count + (cpu_count > 0 ? cpu_count : 1) +
+                 KWORKER_THREADS + (threaded_irqs ? NR_IRQS_LEGACY : 0) + TRACE_SPARE_BUFFERS;
+    return budget < MAX_TRACE_THREADS ? budget : MAX_TRACE_THREADS;
+}
+
+// Reservar el anillo de trazas: buffers hilos con capacity entradas cada uno
+// (redondeado a potencia de 2). Con file_path el anillo vive en un archivo
+// mapeado con MAP_SHARED: el SO pagina las entradas y el contenido sobrevive
+// a un crash.
+int trace_init(unsigned long capacity, const char *file_path, int buffers) {
+    pthread_mutex_lock(&trace_init_mutex);
+    if (trace_region) {
+        pthread_mutex_unlock(&trace_init_mutex);
+        return ERROR_TRACE_STORAGE;  // Ya inicializado: la capacidad es fija
     }
     
-    // Decidir si mostrar en pantalla
-    int should_print = 0;
+    if (capacity < 2) capacity = 2;
+    if (capacity > TRACE_MAX_CAPACITY) capacity = TRACE_MAX_CAPACITY;
+    if (buffers < 1) buffers = trace_thread_budget(0, 0);
+    if (buffers > MAX_TRACE_THREADS) buffers = MAX_TRACE_THREADS;
+    unsigned long rounded = 1;
+    while (rounded < capacity) rounded <<= 1;
     
-    switch (current_log_level) {
-        case LOG_LEVEL_SILENT:
-            should_print = 0;
-            break;
-            
-        case LOG_LEVEL_USER_ONLY:
-            // Solo mostrar si no es del timer, o si los logs del timer están habilitados
-            if (is_timer_related) {
-                should_print = show_timer_logs;
-            } else {
-                should_print = 1;
-            }
-            break;
-            
-        case LOG_LEVEL_VERBOSE:
-            should_print = 1;
-            break;
+    size_t stride = sizeof(trace_buffer_t) + rounded * sizeof(trace_slot_t);
+    stride = (stride + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+    size_t size = sizeof(trace_ring_header_t) + stride * (size_t)buffers;
+    void *region;
+    int fd = -1;
+    
+    if (file_path) {
+        fd = open(file_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, (off_t)size) != 0) {
+            if (fd >= 0) close(fd);
+            pthread_mutex_unlock(&trace_init_mutex);
+            return ERROR_TRACE_STORAGE;
+        }
+        region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    } else {
+        region = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+    if (region == MAP_FAILED) {
+        if (fd >= 0) close(fd);
+        pthread_mutex_unlock(&trace_init_mutex);
+        return ERROR_TRACE_STORAGE;
     }
     
-    if (should_print) {
-        if (irq_num >= 0) {
-            printf("[%s] [IRQ%d] %s\n", 
-                   trace_log[(trace_index - 1 + MAX_TRACE_LINES) % MAX_TRACE_LINES].timestamp,
-                   irq_num, event);
-        } else {
-            printf("[%s] %s\n", 
-                   trace_log[(trace_index - 1 + MAX_TRACE_LINES) % MAX_TRACE_LINES].timestamp,
-                   event);
+    // Las páginas nuevas ya vienen a cero: solo hace falta la cabecera
+    trace_ring_header_t *header = region;
+    memcpy(header->magic, TRACE_RING_MAGIC, sizeof(header->magic));
+    header->version = TRACE_RING_VERSION;
+    header->slot_size = sizeof(trace_slot_t);
+    header->capacity = rounded;
+    header->buffer_stride = stride;
+    header->buffer_count = (uint32_t)buffers;
+    header->clean_shutdown = 0;
+    header->realtime_offset_ns = realtime_offset();
+    
+    trace_region_size = size;
+    trace_region_fd = fd;
+    trace_capacity = rounded;
+    trace_capacity_mask = rounded - 1;
+    trace_buffers = buffers;
+    ATOMIC_FETCH_ADD(&trace_generation, 1U);
+    ATOMIC_STORE_REL(&trace_region, header);
+    pthread_mutex_unlock(&trace_init_mutex);
+    return SUCCESS;
+}
+
+// Liberar el anillo: en modo archivo solo se marca el cierre limpio y se
+// desmapea; las entradas ya están en el archivo, no se copian.
+void trace_shutdown(void) {
+    pthread_mutex_lock(&trace_init_mutex);
+    if (trace_region) {
+        trace_region->clean_shutdown = 1;
+        if (trace_region_fd >= 0) {
+            msync(trace_region, trace_region_size, MS_ASYNC);
         }
-        fflush(stdout);
+        munmap(trace_region, trace_region_size);
+        ATOMIC_STORE_REL(&trace_region, NULL);
     }
+    if (trace_region_fd >= 0) {
+        close(trace_region_fd);
+        trace_region_fd = -1;
+    }
+    pthread_mutex_unlock(&trace_init_mutex);
 }
 
-// Validación de número de IRQ
-int validate_irq_num(int irq_num) {
-    return IS_VALID_IRQ(irq_num) ? SUCCESS : ERROR_INVALID_IRQ;
+// Buffer número index dentro de la región mapeada (NULL si no hay anillo)
+trace_buffer_t *trace_buffer_at(int index) {
+    trace_ring_header_t *header = ATOMIC_LOAD_ACQ(&trace_region);
+    if (!header) {
+        return NULL;
+    }
+    return (trace_buffer_t *)((char *)(header + 1) + (size_t)index * header->buffer_stride);
 }
 
-// Verificar si IRQ está disponible
-int is_irq_available(int irq_num) {
-    if (!IS_VALID_IRQ(irq_num)) return 0;
-    LOCK_IDT();
-    int available = (idt[irq_num].state == IRQ_STATE_FREE);
-    UNLOCK_IDT();
-    return available;
+// Al terminar un hilo su buffer queda huérfano: conserva el historial
+static void trace_buffer_release(void *arg) {
+    trace_buffer_t *buffer = arg;
+    ATOMIC_STORE_REL(&buffer->state, TRACE_BUFFER_ORPHANED);
 }
 
-// Obtener string del estado del IRQ
-const char* get_irq_state_string(irq_state_t state) {
-    switch (state) {
-        case IRQ_STATE_FREE: return "LIBRE";
-        case IRQ_STATE_REGISTERED: return "REGISTRADO";
-        case IRQ_STATE_EXECUTING: return "EJECUTANDO";
-        default: return "DESCONOCIDO";
-    }
+static void trace_buffer_key_create(void) {
+    pthread_key_create(&trace_buffer_key, trace_buffer_release);
 }
 
-// Inicialización de la IDT
-void init_idt() {
-    LOCK_IDT();
-    for (int i = 0; i < MAX_INTERRUPTS; i++) {
-        idt[i].isr = NULL;
-        idt[i].state = IRQ_STATE_FREE;
-        idt[i].call_count = 0;
-        idt[i].last_call = 0;
-        idt[i].total_execution_time = 0;
-        snprintf(idt[i].description, sizeof(idt[i].description), 
-            "IRQ %d - Vector libre en IDT", i);
+// Obtener (o reservar la primera vez) el buffer privado del hilo actual
+static trace_buffer_t *trace_thread_buffer(void) {
+    if (thread_trace_buffer && thread_trace_generation == ATOMIC_LOAD_ACQ(&trace_generation)) {
+        return thread_trace_buffer;
     }
-    UNLOCK_IDT();
+    pthread_once(&trace_buffer_key_once, trace_buffer_key_create);
     
-    add_trace("🚀 KERNEL: Tabla de Descriptores de Interrupción (IDT) inicializada");
-    add_trace("🎯 KERNEL: 16 vectores de interrupción disponibles para asignación");
-    add_trace("🔧 HARDWARE: Controlador de interrupciones (PIC/APIC) configurado");
+    // Sin trace_init() explícito se usa la capacidad por defecto en memoria anónima
+    if (!ATOMIC_LOAD_ACQ(&trace_region)) {
+        trace_init(TRACE_DEFAULT_CAPACITY, NULL, 0);
+        if (!ATOMIC_LOAD_ACQ(&trace_region)) {
+            return NULL;
+        }
+    }
+    
+    // Preferir buffers nunca usados; después reutilizar los de hilos terminados
+    const unsigned int candidates[] = { TRACE_BUFFER_FREE, TRACE_BUFFER_ORPHANED };
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < trace_buffers; i++) {
+            trace_buffer_t *buffer = trace_buffer_at(i);
+            unsigned int expected = candidates[pass];
+            if (__atomic_compare_exchange_n(&buffer->state, &expected, TRACE_BUFFER_OWNED,
+                                            0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                thread_trace_buffer = buffer;
+                thread_trace_generation = ATOMIC_LOAD_ACQ(&trace_generation);
+                if (pthread_getname_np(pthread_self(), thread_trace_buffer->owner_name,
+                                       sizeof(thread_trace_buffer->owner_name)) != 0) {
+                    snprintf(thread_trace_buffer->owner_name,
+                             sizeof(thread_trace_buffer->owner_name), "hilo-%d", i);
+                }
+                pthread_setspecific(trace_buffer_key, thread_trace_buffer);
+                return thread_trace_buffer;
+            }
+        }
+    }
+    return NULL;
 }
 
-// Inicialización de estadísticas del sistema
-void init_system_stats() {
-    memset(&stats, 0, sizeof(system_stats_t));
-    stats.system_start_time = time(NULL);
+// Nombrar el hilo actual (visible en debug_trace_buffer y en herramientas del SO)
+void trace_set_thread_name(const char *name) {
+    pthread_setname_np(pthread_self(), name);
+    trace_buffer_t *buffer = trace_thread_buffer();
+    if (buffer) {
+        strncpy(buffer->owner_name, name, sizeof(buffer->owner_name) - 1);
+        buffer->owner_name[sizeof(buffer->owner_name) - 1] = '\0';
+    }
 }
 
-// Actualizar estadísticas (thread-safe)
-void update_stats(int irq_num, unsigned long execution_time) {
-    static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Escribir una entrada en el buffer del hilo actual (único escritor, sin locks).
+// Devuelve el ticket asignado dentro de ese buffer.
+unsigned long trace_write(const trace_entry_t *entry) {
+    trace_buffer_t *buffer = trace_thread_buffer();
+    if (!buffer) {
+        // Todos los buffers pertenecen a hilos vivos: descartar y contabilizar
+        ATOMIC_FETCH_ADD(&trace_dropped, 1UL);
+        return 0;
+    }
     
-    pthread_mutex_lock(&stats_mutex);
-    stats.total_interrupts++;
+    unsigned long ticket = buffer->head;
+    trace_slot_t *slot = &buffer->slots[ticket & trace_capacity_mask];
     
-    if (irq_num == IRQ_TIMER) {
-        stats.timer_interrupts++;
-    } else if (irq_num == IRQ_KEYBOARD) {
-        stats.keyboard_interrupts++;
-    } else {
-        stats.custom_interrupts++;
-    }
+    __atomic_store_n(&slot->seq, 2 * ticket + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&slot->entry, entry, sizeof(slot->entry));
+    ATOMIC_STORE_REL(&slot->seq, 2 * ticket + 2);
+    ATOMIC_STORE_REL(&buffer->head, ticket + 1);
     
-    // Calcular tiempo promedio de respuesta
-    if (stats.total_interrupts > 0) {
-        stats.average_response_time = 
-            (stats.average_response_time * (stats.total_interrupts - 1) + execution_time) / 
-            stats.total_interrupts;
+    // Índice secundario: "últimas N trazas no-timer" sin recorrer el buffer
+    if (!(entry->flags & TRACE_FLAG_TIMER)) {
+        unsigned long pos = buffer->user_head;
+        ATOMIC_STORE_REL(&buffer->user_index[pos & (TRACE_USER_INDEX_SIZE - 1)], ticket);
+        ATOMIC_STORE_REL(&buffer->user_head, pos + 1);
     }
-    pthread_mutex_unlock(&stats_mutex);
+    return ticket;
 }
 
-// Registro de ISR en la IDT
-int register_isr(int irq_num, void (*isr_function)(int), const char *description) {
-    if (validate_irq_num(irq_num) != SUCCESS) {
-        add_trace("❌ KERNEL: Error en registro ISR - IRQ fuera de rango válido");
-        return ERROR_INVALID_IRQ;
-    }
+// Leer de forma consistente la entrada de un ticket sin detener al escritor.
+// Devuelve 0 si el ticket ya fue sobrescrito o aún no se ha publicado.
+int trace_read(const trace_buffer_t *buffer, unsigned long ticket, trace_entry_t *out) {
+    const trace_slot_t *slot = &buffer->slots[ticket & trace_capacity_mask];
+    unsigned long published = 2 * ticket + 2;
     
-    LOCK_IDT();
-    
-    if (idt[irq_num].state == IRQ_STATE_EXECUTING) {
-        UNLOCK_IDT();
-        add_trace("⚠️  KERNEL: Registro ISR fallido - IRQ actualmente en ejecución");
-        return ERROR_ISR_EXECUTING;
+    if (ATOMIC_LOAD_ACQ(&slot->seq) != published) {
+        return 0;
     }
+    memcpy(out, &slot->entry, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
     
-    idt[irq_num].isr = isr_function;
-    idt[irq_num].state = IRQ_STATE_REGISTERED;
-    idt[irq_num].call_count = 0;
-    idt[irq_num].total_execution_time = 0;
-    strncpy(idt[irq_num].description, description, sizeof(idt[irq_num].description) - 1);
-    idt[irq_num].description[sizeof(idt[irq_num].description) - 1] = '\0';
-    
-    UNLOCK_IDT();
-    
-    char trace_msg[MAX_TRACE_MSG_LEN];
-    snprintf(trace_msg, sizeof(trace_msg), 
-        "📝 KERNEL: ISR registrada en IDT[%d] -> Handler: \"%s\"", 
-        irq_num, description);
-    add_trace_with_irq(trace_msg, irq_num);
-    
-    snprintf(trace_msg, sizeof(trace_msg), 
-        "🔗 HARDWARE: IRQ %d ahora conectada al kernel - Lista para recibir señales", 
-        irq_num);
-    add_trace_with_irq(trace_msg, irq_num);
+    // Si el escritor reclamó el slot durante la copia, descartarla
+    if (ATOMIC_LOAD_RELAXED(&slot->seq) != published) {
+        return 0;
+    }
+    return out->event_id < TRACE_EV_COUNT;
+}
+
+// Leer la entrada no-timer en la posición pos del índice secundario.
+// Devuelve 0 si la posición ya fue reciclada o su ticket sobrescrito.
+static int trace_read_user(const trace_buffer_t *buffer, unsigned long pos, trace_entry_t *out) {
+    unsigned long ticket = ATOMIC_LOAD_ACQ(&buffer->user_index[pos & (TRACE_USER_INDEX_SIZE - 1)]);
     
-    return SUCCESS;
+    // Con user_head a TRACE_USER_INDEX_SIZE posiciones el escritor ya puede estar reciclándola
+    if (ATOMIC_LOAD_ACQ(&buffer->user_head) - pos >= TRACE_USER_INDEX_SIZE) {
+        return 0;
+    }
+    return trace_read(buffer, ticket, out);
 }
 
-// Desregistrar ISR
-int unregister_isr(int irq_num) {
-    if (validate_irq_num(irq_num) != SUCCESS) {
-        add_trace("❌ KERNEL: Error en desregistro ISR - IRQ fuera de rango válido");
-        return ERROR_INVALID_IRQ;
+// Ticket más antiguo que aún puede estar en un buffer
+unsigned long trace_oldest_ticket(unsigned long head) {
+    return (head > trace_capacity) ? head - trace_capacity : 0;
+}
+
+// Preparar un merge k-way tomando una instantánea del head de cada buffer
+static void trace_iter_setup(trace_iter_t *it, int user_only) {
+    it->buffer_count = ATOMIC_LOAD_ACQ(&trace_region) ? trace_buffers : 0;
+    it->user_only = user_only;
+    for (int i = 0; i < it->buffer_count; i++) {
+        trace_buffer_t *buffer = trace_buffer_at(i);
+        unsigned long head = 0;
+        if (ATOMIC_LOAD_ACQ(&buffer->state) != TRACE_BUFFER_FREE) {
+            head = ATOMIC_LOAD_ACQ(user_only ? &buffer->user_head : &buffer->head);
+        }
+        it->next[i] = head;
+        if (user_only) {
+            it->oldest[i] = (head >= TRACE_USER_INDEX_SIZE) ? head - (TRACE_USER_INDEX_SIZE - 1) : 0;
+        } else {
+            it->oldest[i] = trace_oldest_ticket(head);
+        }
+        it->has_pending[i] = 0;
     }
+}
+
+// Merge de todas las entradas
+void trace_iter_init(trace_iter_t *it) {
+    trace_iter_setup(it, 0);
+}
+
+// Merge solo de las entradas no-timer, usando el índice secundario de cada buffer
+void trace_iter_init_user(trace_iter_t *it) {
+    trace_iter_setup(it, 1);
+}
+
+// Leer la posición pos del buffer i según el modo del iterador
+static int trace_iter_read(trace_iter_t *it, int i, unsigned long pos) {
+    return it->user_only ? trace_read_user(trace_buffer_at(i), pos, &it->pending[i])
+                         : trace_read(trace_buffer_at(i), pos, &it->pending[i]);
+}
+
+// Siguiente entrada más reciente entre todos los buffers (orden por timestamp_ns).
+// Devuelve 0 cuando no quedan entradas.
+int trace_iter_prev(trace_iter_t *it, trace_entry_t *out) {
+    int best = -1;
     
-    LOCK_IDT();
-    
-    if (idt[irq_num].state == IRQ_STATE_EXECUTING) {
-        UNLOCK_IDT();
-        add_trace("⚠️  KERNEL: Desregistro ISR fallido - IRQ actualmente en ejecución");
-        return ERROR_ISR_EXECUTING;
+    for (int i = 0; i < it->buffer_count; i++) {
+        // Rellenar la cabeza de este buffer saltando entradas sobrescritas
+        while (!it->has_pending[i] && it->next[i] > it->oldest[i]) {
+            it->next[i]--;
+            it->has_pending[i] = trace_iter_read(it, i, it->next[i]);
+            
+            // En el índice no-timer un fallo significa que lo anterior también se perdió
+            if (!it->has_pending[i] && it->user_only) {
+                it->oldest[i] = it->next[i];
+            }
+        }
+        if (it->has_pending[i] &&
+            (best < 0 || it->pending[i].timestamp_ns > it->pending[best].timestamp_ns)) {
+            best = i;
+        }
     }
     
-    char old_description[MAX_DESCRIPTION_LEN];
-    strncpy(old_description, idt[irq_num].description, MAX_DESCRIPTION_LEN - 1);
-    old_description[MAX_DESCRIPTION_LEN - 1] = '\0';
-    
-    
-    idt[irq_num].isr = NULL;
-    idt[irq_num].state = IRQ_STATE_FREE;
-    idt[irq_num].call_count = 0;
-    idt[irq_num].total_execution_time = 0;
-    snprintf(idt[irq_num].description, sizeof(idt[irq_num].description), 
-        "IRQ %d - Disponible para asignación", irq_num);
-    
-    UNLOCK_IDT();
-    
-    char trace_msg[MAX_TRACE_MSG_LEN];
-    snprintf(trace_msg, sizeof(trace_msg), 
-        "🗑️  KERNEL: ISR removida de IDT[%d] - Era: \"%s\"", 
-        irq_num, old_description);
-    add_trace_with_irq(trace_msg, irq_num);
-    
-    snprintf(trace_msg, sizeof(trace_msg), 
-        "🚫 HARDWARE: IRQ %d desconectada - Interrupciones no serán procesadas", 
-        irq_num);
-    add_trace_with_irq(trace_msg, irq_num);
-    
-    return SUCCESS;
+    if (best < 0) {
+        return 0;
+    }
+    *out = it->pending[best];
+    it->has_pending[best] = 0;
+    return 1;
 }
 
-// Despacho de interrupciones - VERSIÓN CORREGIDA
-void dispatch_interrupt(int irq_num) {
-    char trace_msg[MAX_TRACE_MSG_LEN];
-    struct timespec start_time, end_time;
-    void (*isr_function)(int) = NULL;
-    int is_timer_irq = (irq_num == IRQ_TIMER);
+// Siguiente entrada más antigua entre todos los buffers (orden cronológico).
+// Devuelve 0 cuando no quedan entradas.
+int trace_iter_next(trace_iter_t *it, trace_entry_t *out) {
+    int best = -1;
     
-    if (validate_irq_num(irq_num) != SUCCESS) {
-        snprintf(trace_msg, sizeof(trace_msg), 
-            "❌ HARDWARE: IRQ %d RECHAZADA - Número fuera del rango válido (0-%d)", 
-            irq_num, MAX_INTERRUPTS-1);
-        add_trace_smart(trace_msg, -1, 0);
-        return;
+    for (int i = 0; i < it->buffer_count; i++) {
+        // Las entradas más antiguas pueden sobrescribirse mientras avanzamos: se saltan
+        while (!it->has_pending[i] && it->oldest[i] < it->next[i]) {
+            it->has_pending[i] = trace_iter_read(it, i, it->oldest[i]);
+            it->oldest[i]++;
+        }
+        if (it->has_pending[i] &&
+            (best < 0 || it->pending[i].timestamp_ns < it->pending[best].timestamp_ns)) {
+            best = i;
+        }
     }
     
-    LOCK_IDT();
-    
-    // ✅ VERIFICAR ESTADO CORRECTO
-    if (idt[irq_num].state != IRQ_STATE_REGISTERED || idt[irq_num].isr == NULL) {
-        UNLOCK_IDT();
-        snprintf(trace_msg, sizeof(trace_msg), 
-            "❌ KERNEL: IRQ %d SIN HANDLER - Estado: %s", 
-            irq_num, get_irq_state_string(idt[irq_num].state));
-        add_trace_smart(trace_msg, irq_num, is_timer_irq);
-        return;
+    if (best < 0) {
+        return 0;
     }
+    *out = it->pending[best];
+    it->has_pending[best] = 0;
+    return 1;
+}
+
+// Máscara de los argumentos de una plantilla que son ids de cadena (%s)
+static unsigned int trace_template_string_args(int event_id) {
+    unsigned int mask = 0;
+    int arg = 0;
     
-    // ✅ VERIFICAR SI YA SE ESTÁ EJECUTANDO (protección contra reentrancy)
-    if (idt[irq_num].state == IRQ_STATE_EXECUTING) {
-        UNLOCK_IDT();
-        snprintf(trace_msg, sizeof(trace_msg), 
-            "⚠️  KERNEL: IRQ %d ya ejecutándose - Interrupción ignorada (reentrancy)", irq_num);
-        add_trace_smart(trace_msg, irq_num, is_timer_irq);
-        return;
+    for (const char *fmt = trace_templates[event_id]; *fmt && arg < TRACE_MAX_ARGS; fmt++) {
+        if (fmt[0] == '%' && (fmt[1] == 'd' || fmt[1] == 's')) {
+            if (fmt[1] == 's') {
+                mask |= 1u << arg;
+            }
+            arg++;
+            fmt++;
+        }
     }
+    return mask;
+}
+
+// Escribir un texto de la tabla de plantillas o de cadenas del .trace
+static int export_trace_string(FILE *file, uint32_t id, const char *text) {
+    trace_file_string_t record;
     
-    // Simular el proceso real de Linux
-    snprintf(trace_msg, sizeof(trace_msg), 
-        "🔥 HARDWARE: IRQ %d disparada - Línea de interrupción activada", irq_num);
-    add_trace_smart(trace_msg, irq_num, is_timer_irq);
-    
-    snprintf(trace_msg, sizeof(trace_msg), 
-        "🚨 CPU: Guardando contexto actual - Registros y estado del procesador");
-    add_trace_smart(trace_msg, irq_num, is_timer_irq);
-    
-    snprintf(trace_msg, sizeof(trace_msg), 
-        "🔍 KERNEL: Consultando IDT[%d] - Vector de interrupción encontrado", irq_num);
-    add_trace_smart(trace_msg, irq_num, is_timer_irq);
-    
-    // ✅ CAMBIAR ESTADO A EJECUTANDO
-    idt[irq_num].state = IRQ_STATE_EXECUTING;
-    idt[irq_num].call_count++;
-    idt[irq_num].last_call = time(NULL);
-    isr_function = idt[irq_num].isr;
-    
-    snprintf(trace_msg, sizeof(trace_msg), 
-        "⚡ KERNEL: Ejecutando ISR \"%s\" - Llamada #%d [Modo Kernel]", 
-        idt[irq_num].description, idt[irq_num].call_count);
-    
-    UNLOCK_IDT();
-    add_trace_smart(trace_msg, irq_num, is_timer_irq);
+    memset(&record, 0, sizeof(record));
+    record.id = id;
+    strncpy(record.text, text, sizeof(record.text) - 1);
+    return fwrite(&record, sizeof(record), 1, file) == 1;
+}
+
+// Exportar la traza (merge cronológico de todos los hilos) al formato offline
+// de trace_format.h. Los registros se escriben en streaming; solo el índice
+// temporal (una entrada cada TRACE_TIME_INDEX_STRIDE registros) y el mapa de
+// cadenas citadas se acumulan en memoria. Detrás van las plantillas y el
+// texto de esas cadenas, para poder leer el archivo sin el simulador.
+// Devuelve el número de registros o ERROR_TRACE_STORAGE.
+long export_trace_file(const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        return ERROR_TRACE_STORAGE;
+    }
     
-    // ✅ EJECUTAR LA ISR
-    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    trace_file_header_t header;
+    trace_irq_index_t irq_index[MAX_INTERRUPTS];
+    trace_time_index_t *time_index = NULL;
+    size_t time_index_capacity = 0;
+    trace_iter_t it;
+    trace_entry_t entry;
+    unsigned int string_args[TRACE_EV_COUNT];
+    unsigned char string_used[TRACE_STRING_POOL_SIZE + 1];
+    int failed = 0;
     
-    if (isr_function) {
-        isr_function(irq_num);
+    memset(&header, 0, sizeof(header));
+    memset(irq_index, 0, sizeof(irq_index));
+    memset(string_used, 0, sizeof(string_used));
+    for (int ev = 0; ev < TRACE_EV_COUNT; ev++) {
+        string_args[ev] = trace_template_string_args(ev);
     }
     
-    clock_gettime(CLOCK_MONOTONIC, &end_time);
-    
-    unsigned long execution_time = 
-        (end_time.tv_sec - start_time.tv_sec) * 1000000 +
-        (end_time.tv_nsec - start_time.tv_nsec) / 1000;
+    // Cabecera provisional: se reescribe al final con los offsets reales
+    failed |= fwrite(&header, sizeof(header), 1, file) != 1;
     
-    // ✅ RESTAURAR ESTADO A REGISTRADO
-    LOCK_IDT();
-    idt[irq_num].state = IRQ_STATE_REGISTERED;  // ✅ VOLVER A REGISTRADO
-    idt[irq_num].total_execution_time += execution_time;
-    UNLOCK_IDT();
+    trace_iter_init(&it);
+    while (!failed && trace_iter_next(&it, &entry)) {
+        uint64_t record = header.record_count;
+        
+        if (record % TRACE_TIME_INDEX_STRIDE == 0) {
+            if (header.time_index_count == time_index_capacity) {
+                size_t new_capacity = time_index_capacity ? time_index_capacity * 2 : 64;
+                trace_time_index_t *grown = realloc(time_index, new_capacity * sizeof(*grown));
+                if (!grown) {
+                    failed = 1;
+                    break;
+                }
+                time_index = grown;
+                time_index_capacity = new_capacity;
+            }
+            time_index[header.time_index_count].timestamp_ns = entry.timestamp_ns;
+            time_index[header.time_index_count].record_number = record;
+            header.time_index_count++;
+        }
+        
+        if (IS_VALID_IRQ(entry.irq_num)) {
+            trace_irq_index_t *idx = &irq_index[entry.irq_num];
+            if (idx->record_count == 0) {
+                idx->first_record = record;
+                idx->first_timestamp_ns = entry.timestamp_ns;
+            }
+            idx->record_count++;
+            idx->last_record = record;
+            idx->last_timestamp_ns = entry.timestamp_ns;
+        } else {
+            header.untagged_count++;
+        }
+        
+        for (int arg = 0; arg < TRACE_MAX_ARGS; arg++) {
+            int string_id = entry.args[arg];
+            if ((string_args[entry.event_id] & (1u << arg)) &&
+                string_id >= 1 && string_id <= TRACE_STRING_POOL_SIZE) {
+                string_used[string_id] = 1;
+            }
+        }
+        
+        if (record == 0) {
+            header.first_timestamp_ns = entry.timestamp_ns;
+        }
+        header.last_timestamp_ns = entry.timestamp_ns;
+        header.record_count++;
+        failed |= fwrite(&entry, sizeof(entry), 1, file) != 1;
+    }
     
-    update_stats(irq_num, execution_time);
+    memcpy(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_FILE_VERSION;
+    header.header_size = sizeof(header);
+    header.record_size = sizeof(trace_entry_t);
+    header.irq_count = MAX_INTERRUPTS;
+    header.records_offset = sizeof(header);
+    header.irq_index_offset = header.records_offset + header.record_count * sizeof(trace_entry_t);
+    header.time_index_offset = header.irq_index_offset + sizeof(irq_index);
+    header.time_index_stride = TRACE_TIME_INDEX_STRIDE;
+    header.event_count = TRACE_EV_COUNT;
+    header.realtime_offset_ns = realtime_offset();
+    header.event_table_offset = header.time_index_offset +
+                                header.time_index_count * sizeof(trace_time_index_t);
+    header.string_table_offset = header.event_table_offset +
+                                 TRACE_EV_COUNT * sizeof(trace_file_string_t);
     
-    snprintf(trace_msg, sizeof(trace_msg), 
-        "🔄 CPU: Restaurando contexto - Volviendo al proceso interrumpido (%lu μs)", 
-        execution_time);
-    add_trace_smart(trace_msg, irq_num, is_timer_irq);
+    if (!failed) {
+        failed |= fwrite(irq_index, sizeof(irq_index), 1, file) != 1;
+        if (header.time_index_count > 0) {
+            failed |= fwrite(time_index, sizeof(*time_index), header.time_index_count, file)
+                      != header.time_index_count;
+        }
+        for (int ev = 0; ev < TRACE_EV_COUNT && !failed; ev++) {
+            failed |= !export_trace_string(file, (uint32_t)ev, trace_templates[ev]);
+        }
+        for (int id = 1; id <= TRACE_STRING_POOL_SIZE && !failed; id++) {
+            if (string_used[id]) {
+                failed |= !export_trace_string(file, (uint32_t)id, trace_string_text(id));
+                header.string_count++;
+            }
+        }
+        failed |= fseek(file, 0, SEEK_SET) != 0;
+        failed |= fwrite(&header, sizeof(header), 1, file) != 1;
+    }
     
-    snprintf(trace_msg, sizeof(trace_msg), 
-        "✅ KERNEL: IRQ %d procesada - Sistema listo para nuevas interrupciones", irq_num);
-    add_trace_smart(trace_msg, irq_num, is_timer_irq);
+    free(time_index);
+    failed |= fclose(file) != 0;
+    return failed ? ERROR_TRACE_STORAGE : (long)header.record_count;
 }
 
+// Generar el texto de una entrada a partir de su plantilla (solo al mostrarla)
+void format_trace_entry(const trace_entry_t *entry, char *buffer, size_t size) {
+    const char *fmt = trace_templates[entry->event_id];
+    size_t pos = 0;
+    int arg = 0;
+    
+    while (*fmt && pos + 1 < size) {
+        if (fmt[0] == '%' && (fmt[1] == 'd' || fmt[1] == 's') && arg < TRACE_MAX_ARGS) {
+            int written = (fmt[1] == 'd')
+                ? snprintf(buffer + pos, size - pos, "%d", (int)entry->args[arg])
+                : snprintf(buffer + pos, size - pos, "%s", trace_string_text(entry->args[arg]));
+            if (written < 0) {
+                break;
+            }
+            pos += (size_t)written < size - pos ? (size_t)written : size - pos - 1;
+            arg++;
+            fmt += 2;
+        } else {
+            buffer[pos++] = *fmt++;
+        }
+    }
+    buffer[pos] = '\0';
+}
 
+// Generar la hora de pared de una entrada (solo al mostrarla)
+void format_trace_timestamp(const trace_entry_t *entry, char *buffer, size_t size) {
+    format_monotonic_timestamp(entry->timestamp_ns, buffer, size);
+}
 
-// ISR del Timer del Sistema (IRQ 0)
-void timer_isr(int irq_num) {
-    timer_counter++;
-    char trace_msg[MAX_TRACE_MSG_LEN];
+// Formatear una entrada como línea de consola. Devuelve los bytes escritos
+// en buffer (sin contar el terminador).
+int format_trace_line(const char *prefix, const trace_entry_t *entry, int with_irq_tag,
+                      char *buffer, size_t size) {
+    char timestamp[24];
+    char event[MAX_TRACE_MSG_LEN];
+    int len;
     
-    snprintf(trace_msg, sizeof(trace_msg), 
-        "    ⏰ TIMER_ISR: Tick del sistema #%d - Actualizando jiffies del kernel", 
-        timer_counter);
-    add_trace_smart(trace_msg, irq_num, 1);
+    char cpu_tag[12] = "";
+    int cpu = (entry->flags & TRACE_FLAG_CPU_MASK) >> TRACE_FLAG_CPU_SHIFT;
     
-    snprintf(trace_msg, sizeof(trace_msg), 
-        "    📊 SCHEDULER: Verificando quantum de procesos - Time slice check");
-    add_trace_smart(trace_msg, irq_num, 1);
-    
-    usleep(ISR_SIMULATION_DELAY_US);
+    format_trace_timestamp(entry, timestamp, sizeof(timestamp));
+    format_trace_entry(entry, event, sizeof(event));
+    if (cpu > 0) {
+        snprintf(cpu_tag, sizeof(cpu_tag), "[CPU%d] ", cpu - 1);
+    }
     
-    snprintf(trace_msg, sizeof(trace_msg), 
-        "    🔄 TIMER_ISR: Completada - Sistema de tiempo actualizado");
-    add_trace_smart(trace_msg, irq_num, 1);
+    if (with_irq_tag && entry->irq_num >= 0) {
+        len = snprintf(buffer, size, "%s[%s] %s[IRQ%d] %s\n", prefix, timestamp, cpu_tag,
+                       entry->irq_num, event);
+    } else {
+        len = snprintf(buffer, size, "%s[%s] %s%s\n", prefix, timestamp, cpu_tag, event);
+    }
+    if (len < 0) {
+        return 0;
+    }
+    return (size_t)len < size ? len : (int)size - 1;
 }
 
-// ISR del Teclado (IRQ 1)
-void keyboard_isr(int irq_num) {
-    char trace_msg[MAX_TRACE_MSG_LEN];
-    
-    snprintf(trace_msg, sizeof(trace_msg), 
-        "    ⌨️  KEYBOARD_ISR: Leyendo scancode del controlador 8042");
-    add_trace_with_irq(trace_msg, irq_num);
-    
-    snprintf(trace_msg, sizeof(trace_msg), 
-        "    🔤 INPUT_LAYER: Traduciendo scancode a keycode");
-    add_trace_with_irq(trace_msg, irq_num);
-    
-    snprintf(trace_msg, sizeof(trace_msg), 
-        "    📤 EVENT_QUEUE: Enviando evento de teclado a /dev/input/eventX");
-    add_trace_with_irq(trace_msg, irq_num);
+// Imprimir una entrada de traza ya formateada
+void print_trace_entry(const char *prefix, const trace_entry_t *entry, int with_irq_tag) {
+    char line[MAX_TRACE_MSG_LEN + 64];
     
-    usleep(KEYBOARD_DELAY_US);
+    format_trace_line(prefix, entry, with_irq_tag, line, sizeof(line));
+    fputs(line, stdout);
+}
+
+// Encolar una entrada para el logger. Devuelve 0 si la cola está llena.
+static int log_queue_push(const trace_entry_t *entry, int with_irq_tag) {
+    unsigned long pos = ATOMIC_LOAD_RELAXED(&log_queue.enqueue_pos);
+    log_cell_t *cell;
+    
+    for (;;) {
+        cell = &log_queue.cells[pos & (LOG_QUEUE_SIZE - 1)];
+        long diff = (long)ATOMIC_LOAD_ACQ(&cell->seq) - (long)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&log_queue.enqueue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = ATOMIC_LOAD_RELAXED(&log_queue.enqueue_pos);
+        }
+    }
+    
+    cell->entry = *entry;
+    cell->with_irq_tag = with_irq_tag;
+    ATOMIC_STORE_REL(&cell->seq, pos + 1);
+    return 1;
+}
+
+// Desencolar la siguiente entrada. Devuelve 0 si la cola está vacía.
+static int log_queue_pop(trace_entry_t *entry, int *with_irq_tag) {
+    unsigned long pos = ATOMIC_LOAD_RELAXED(&log_queue.dequeue_pos);
+    log_cell_t *cell;
+    
+    for (;;) {
+        cell = &log_queue.cells[pos & (LOG_QUEUE_SIZE - 1)];
+        long diff = (long)ATOMIC_LOAD_ACQ(&cell->seq) - (long)(pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&log_queue.dequeue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = ATOMIC_LOAD_RELAXED(&log_queue.dequeue_pos);
+        }
+    }
+    
+    *entry = cell->entry;
+    *with_irq_tag = cell->with_irq_tag;
+    ATOMIC_STORE_REL(&cell->seq, pos + LOG_QUEUE_SIZE);
+    return 1;
+}
+
+// Despertar al logger solo si está dormido (sin syscalls en el caso común)
+static void logger_wake(void) {
+    if (__atomic_load_n(&logger_sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&logger_mutex);
+        pthread_cond_signal(&logger_cond);
+        pthread_mutex_unlock(&logger_mutex);
+    }
+}
+
+// Escribir un lote completo en stdout, reintentando escrituras parciales
+static void logger_write_batch(const char *data, size_t len) {
+    // Vaciar antes lo que el menú dejó en el buffer de stdio para conservar el orden
+    flockfile(stdout);
+    fflush(stdout);
+    while (len > 0) {
+        ssize_t written = write(STDOUT_FILENO, data, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        data += written;
+        len -= (size_t)written;
+    }
+    funlockfile(stdout);
+}
+
+// Hilo del logger: drena la cola por lotes hasta que se detiene y queda vacía
+static void *logger_thread_func(void *arg) {
+    (void)arg;
+    trace_entry_t entry;
+    int with_irq_tag;
+    
+    pthread_setname_np(pthread_self(), "logger");
+    
+    for (;;) {
+        size_t len = 0;
+        unsigned long lines = 0;
+        
+        while (len + MAX_TRACE_MSG_LEN + 64 <= sizeof(logger_batch) &&
+               log_queue_pop(&entry, &with_irq_tag)) {
+            len += format_trace_line("", &entry, with_irq_tag,
+                                     logger_batch + len, sizeof(logger_batch) - len);
+            lines++;
+        }
+        if (lines > 0) {
+            logger_write_batch(logger_batch, len);
+            __atomic_fetch_add(&log_written, lines, __ATOMIC_RELEASE);
+            continue;
+        }
+        if (!ATOMIC_LOAD_ACQ(&logger_running)) {
+            break;
+        }
+        
+        // Cola vacía: dormir hasta que un productor avise (o como mucho 100ms)
+        pthread_mutex_lock(&logger_mutex);
+        __atomic_store_n(&logger_sleeping, 1, __ATOMIC_SEQ_CST);
+        unsigned long pos = ATOMIC_LOAD_RELAXED(&log_queue.dequeue_pos);
+        if (ATOMIC_LOAD_ACQ(&log_queue.cells[pos & (LOG_QUEUE_SIZE - 1)].seq) != pos + 1 &&
+            ATOMIC_LOAD_ACQ(&logger_running)) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 100000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&logger_cond, &logger_mutex, &deadline);
+        }
+        __atomic_store_n(&logger_sleeping, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&logger_mutex);
+    }
+    return NULL;
+}
+
+// Arrancar el hilo del logger; hasta entonces las trazas se imprimen en línea
+int logger_start(log_policy_t policy) {
+    for (unsigned long i = 0; i < LOG_QUEUE_SIZE; i++) {
+        log_queue.cells[i].seq = i;
+    }
+    log_queue.enqueue_pos = 0;
+    log_queue.dequeue_pos = 0;
+    log_written = 0;
+    logger_policy = policy;
+    
+    ATOMIC_STORE_REL(&logger_running, 1);
+    if (pthread_create(&logger_thread, NULL, logger_thread_func, NULL) != 0) {
+        ATOMIC_STORE_REL(&logger_running, 0);
+        return ERROR_TRACE_STORAGE;
+    }
+    return SUCCESS;
+}
+
+// Detener el logger tras escribir todo lo pendiente
+void logger_stop(void) {
+    if (!ATOMIC_LOAD_ACQ(&logger_running)) {
+        return;
+    }
+    ATOMIC_STORE_REL(&logger_running, 0);
+    pthread_mutex_lock(&logger_mutex);
+    pthread_cond_signal(&logger_cond);
+    pthread_mutex_unlock(&logger_mutex);
+    pthread_join(logger_thread, NULL);
+}
+
+// Esperar a que el logger escriba todo lo encolado hasta ahora. Se usa en los
+// puntos del menú para que su salida no se intercale con trazas atrasadas.
+void logger_flush(void) {
+    if (!ATOMIC_LOAD_ACQ(&logger_running)) {
+        return;
+    }
+    unsigned long target = ATOMIC_LOAD_ACQ(&log_queue.enqueue_pos);
+    while (ATOMIC_LOAD_ACQ(&log_written) < target && ATOMIC_LOAD_ACQ(&logger_running)) {
+        pthread_mutex_lock(&logger_mutex);
+        pthread_cond_signal(&logger_cond);
+        pthread_mutex_unlock(&logger_mutex);
+        sched_yield();
+    }
+}
+
+// Entregar una línea al logger. Devuelve 0 si el logger no está activo y el
+// llamador debe imprimirla directamente.
+static int logger_submit(const trace_entry_t *entry, int with_irq_tag) {
+    if (!ATOMIC_LOAD_ACQ(&logger_running)) {
+        return 0;
+    }
+    while (!log_queue_push(entry, with_irq_tag)) {
+        if (!ATOMIC_LOAD_ACQ(&logger_running)) {
+            return 0;
+        }
+        if (logger_policy == LOG_POLICY_DROP) {
+            ATOMIC_FETCH_ADD(&log_dropped, 1UL);
+            return 1;
+        }
+        logger_wake();
+        sched_yield();
+    }
+    logger_wake();
+    return 1;
+}
+
+// Política de impresión de una entrada recién escrita
+typedef enum {
+    TRACE_PRINT_NEVER,
+    TRACE_PRINT_ALWAYS,
+    TRACE_PRINT_SMART
+} trace_print_mode_t;
+
+// Construir la entrada binaria, guardarla y, solo si se imprime, formatearla
+static void trace_emit(trace_event_id_t event_id, int irq_num, trace_print_mode_t mode,
+                       int is_timer_related, const int32_t *args) {
+    trace_entry_t entry;
+    
+    entry.timestamp_ns = monotonic_ns();
+    entry.event_id = (uint8_t)event_id;
+    entry.flags = is_timer_related ? TRACE_FLAG_TIMER : 0;
+    if (current_cpu >= 0) {
+        entry.flags |= (uint8_t)((current_cpu + 1) << TRACE_FLAG_CPU_SHIFT);
+    }
+    entry.irq_num = (int16_t)(irq_num >= 0 ? irq_num : -1);
+    memcpy(entry.args, args, sizeof(entry.args));
+    trace_write(&entry);
+    
+    // Decidir si mostrar en pantalla
+    int should_print = 0;
+    
+    switch (mode) {
+        case TRACE_PRINT_NEVER:
+            should_print = 0;
+            break;
+        case TRACE_PRINT_ALWAYS:
+            should_print = 1;
+            break;
+        case TRACE_PRINT_SMART:
+            switch (current_log_level) {
+                case LOG_LEVEL_SILENT:
+                    should_print = 0;
+                    break;
+                    
+                case LOG_LEVEL_USER_ONLY:
+                    // Solo mostrar si no es del timer, o si los logs del timer están habilitados
+                    should_print = is_timer_related ? show_timer_logs : 1;
+                    break;
+                    
+                case LOG_LEVEL_VERBOSE:
+                    should_print = 1;
+                    break;
+            }
+            break;
+    }
+    
+    // En tiempo virtual la traza solo se guarda: la consola frenaría el bucle de eventos
+    if (sim_virtual_time || trace_console_muted) {
+        should_print = 0;
+    }
+    
+    if (should_print && !logger_submit(&entry, mode == TRACE_PRINT_SMART)) {
+        print_trace_entry("", &entry, mode == TRACE_PRINT_SMART);
+        fflush(stdout);
+    }
+}
+
+// Recoger los argumentos variables según los especificadores de la plantilla
+static void trace_collect_args(trace_event_id_t event_id, int32_t *args, va_list ap) {
+    int arg = 0;
+    
+    memset(args, 0, sizeof(int32_t) * TRACE_MAX_ARGS);
+    for (const char *p = trace_templates[event_id]; *p && arg < TRACE_MAX_ARGS; p++) {
+        if (p[0] == '%' && (p[1] == 'd' || p[1] == 's')) {
+            args[arg++] = va_arg(ap, int);
+            p++;
+        }
+    }
+}
+
+// Traza con plantilla que siempre se imprime (equivalente a add_trace_with_irq)
+void add_trace_event(trace_event_id_t event_id, int irq_num, ...) {
+    int32_t args[TRACE_MAX_ARGS];
+    va_list ap;
+    va_start(ap, irq_num);
+    trace_collect_args(event_id, args, ap);
+    va_end(ap);
+    trace_emit(event_id, irq_num, TRACE_PRINT_ALWAYS, 0, args);
+}
+
+// Traza con plantilla sujeta al nivel de logging (equivalente a add_trace_smart)
+void add_trace_event_smart(trace_event_id_t event_id, int irq_num, int is_timer_related, ...) {
+    int32_t args[TRACE_MAX_ARGS];
+    va_list ap;
+    va_start(ap, is_timer_related);
+    trace_collect_args(event_id, args, ap);
+    va_end(ap);
+    trace_emit(event_id, irq_num, TRACE_PRINT_SMART, is_timer_related, args);
+}
+
+// Texto libre: se interna una sola vez y la entrada guarda solo su id
+static void trace_emit_text(const char *event, int irq_num, trace_print_mode_t mode,
+                            int is_timer_related) {
+    int32_t args[TRACE_MAX_ARGS] = { trace_intern_string(event), 0, 0 };
+    trace_emit(TRACE_EV_TEXT, irq_num, mode, is_timer_related, args);
+}
+
+// Función para agregar entrada a la traza (thread-safe)
+void add_trace(const char *event) {
+    trace_emit_text(event, -1, TRACE_PRINT_ALWAYS, 0);
+}
+
+// Función para agregar entrada a la traza con IRQ específico (thread-safe)
+void add_trace_with_irq(const char *event, int irq_num) {
+    trace_emit_text(event, irq_num, TRACE_PRINT_ALWAYS, 0);
+}
+
+// Función para logging silencioso (solo guarda en traza, no imprime)
+void add_trace_silent(const char *event) {
+    trace_emit_text(event, -1, TRACE_PRINT_NEVER, 0);
+}
+
+void add_trace_with_irq_silent(const char *event, int irq_num) {
+    trace_emit_text(event, irq_num, TRACE_PRINT_NEVER, 0);
+}
+
+// Función para controlar el nivel de logging
+void set_log_level(log_level_t level) {
+    current_log_level = level;
+    const char* level_names[] = {"SILENCIOSO", "SOLO USUARIO", "VERBOSE"};
+    printf("Nivel de logging cambiado a: %s\n", level_names[level]);
+}
+
+void toggle_timer_logs(void) {
+    show_timer_logs = !show_timer_logs;
+    printf("Logs del timer: %s\n", show_timer_logs ? "HABILITADOS" : "DESHABILITADOS");
+}
+
+// Función de logging inteligente
+void add_trace_smart(const char *event, int irq_num, int is_timer_related) {
+    trace_emit_text(event, irq_num, TRACE_PRINT_SMART, is_timer_related);
+}
+
+// Validación de número de IRQ
+int validate_irq_num(int irq_num) {
+    return IS_VALID_IRQ(irq_num) ? SUCCESS : ERROR_INVALID_IRQ;
+}
+
+// Verificar si IRQ está disponible
+int is_irq_available(int irq_num) {
+    if (!IS_VALID_IRQ(irq_num)) return 0;
+    return ATOMIC_LOAD_ACQ(&idt[irq_num].state) == IRQ_STATE_FREE;
+}
+
+// Obtener string del estado del IRQ
+const char* get_irq_state_string(irq_state_t state) {
+    switch (state) {
+        case IRQ_STATE_FREE: return "LIBRE";
+        case IRQ_STATE_REGISTERED: return "REGISTRADO";
+        case IRQ_STATE_EXECUTING: return "EJECUTANDO";
+        case IRQ_STATE_UPDATING: return "ACTUALIZANDO";
+        case IRQ_STATE_MASKED: return "ENMASCARADO";
+        default: return "DESCONOCIDO";
+    }
+}
+
+// Reservar un vector para modificar su descriptor (FREE/REGISTERED -> UPDATING).
+// Espera mientras otro hilo lo actualiza y, si wait_executing, también mientras
+// su ISR (o su hilo irq/N, con la línea enmascarada) corre. Devuelve el estado
+// previo, o IRQ_STATE_EXECUTING sin reservar.
+static irq_state_t irq_begin_update(int irq_num, int wait_executing) {
+    irq_state_t state = ATOMIC_LOAD_ACQ(&idt[irq_num].state);
+    
+    for (;;) {
+        int busy = (state == IRQ_STATE_EXECUTING || state == IRQ_STATE_MASKED);
+        if (state == IRQ_STATE_UPDATING || (busy && wait_executing)) {
+            sched_yield();
+            state = ATOMIC_LOAD_ACQ(&idt[irq_num].state);
+            continue;
+        }
+        if (busy) {
+            return IRQ_STATE_EXECUTING;
+        }
+        if (ATOMIC_CAS(&idt[irq_num].state, &state, IRQ_STATE_UPDATING)) {
+            return state;
+        }
+    }
+}
+
+// Asignar a una IRQ dinámica el primer vector libre (assign_irq_vector). Las
+// legacy tienen su vector fijo y hay un vector dinámico por IRQ dinámica, así
+// que el asignador nunca se queda sin vectores.
+static void irq_assign_vector(int irq_num) {
+    if (irq_num < NR_IRQS_LEGACY || ATOMIC_LOAD_RELAXED(&irq_meta[irq_num].vector) >= 0) {
+        return;
+    }
+    pthread_mutex_lock(&vector_mutex);
+    for (int w = 0; w < IDT_VECTORS / 64; w++) {
+        uint64_t free_bits = ~vector_used[w];
+        if (free_bits == 0) {
+            continue;
+        }
+        int vector = w * 64 + __builtin_ctzll(free_bits);
+        ATOMIC_STORE_REL(&vector_used[w], vector_used[w] | IRQ_BIT(vector));
+        ATOMIC_STORE_REL(&vector_irq[vector], irq_num);
+        ATOMIC_STORE_REL(&irq_meta[irq_num].vector, vector);
+        break;
+    }
+    pthread_mutex_unlock(&vector_mutex);
+}
+
+// Devolver al asignador el vector de una IRQ dinámica que queda libre
+static void irq_release_vector(int irq_num) {
+    int vector = ATOMIC_LOAD_RELAXED(&irq_meta[irq_num].vector);
+    
+    if (irq_num < NR_IRQS_LEGACY || vector < 0) {
+        return;
+    }
+    pthread_mutex_lock(&vector_mutex);
+    ATOMIC_STORE_REL(&vector_irq[vector], -1);
+    ATOMIC_STORE_REL(&vector_used[vector >> 6], vector_used[vector >> 6] & ~IRQ_BIT(vector));
+    ATOMIC_STORE_REL(&irq_meta[irq_num].vector, -1);
+    pthread_mutex_unlock(&vector_mutex);
+}
+
+// Mantener el bitmap de IRQs activas (y el vector de las dinámicas) al
+// publicar un descriptor: activa = con handler, es decir, no LIBRE
+static void irq_set_active(int irq_num, int active) {
+    uint64_t *word = &irq_active[IRQ_WORD(irq_num)];
+    uint64_t bit = IRQ_BIT(irq_num);
+    
+    if (active == ((ATOMIC_LOAD_RELAXED(word) & bit) != 0)) {
+        return;
+    }
+    if (active) {
+        irq_assign_vector(irq_num);
+        __atomic_fetch_or(word, bit, __ATOMIC_RELEASE);
+    } else {
+        __atomic_fetch_and(word, ~bit, __ATOMIC_RELEASE);
+        irq_release_vector(irq_num);
+    }
+}
+
+// Siguiente IRQ activa después de irq_num (-1 = ninguna): salta palabras
+// vacías del bitmap, así que el coste depende de las IRQs en uso
+int irq_next_active(int irq_num) {
+    int next = irq_num + 1;
+    
+    while (next < MAX_INTERRUPTS) {
+        int w = IRQ_WORD(next);
+        uint64_t bits = ATOMIC_LOAD_ACQ(&irq_active[w]) & (~0ULL << (next & 63));
+        if (bits != 0) {
+            return w * 64 + __builtin_ctzll(bits);
+        }
+        next = (w + 1) * 64;
+    }
+    return -1;
+}
+
+// Nombre de un vector para las trazas y la tabla de la IDT
+const char *idt_vector_name(int vector) {
+    static const char *const exceptions[32] = {
+        "#DE", "#DB", "NMI", "#BP", "#OF", "#BR", "#UD", "#NM",
+        "#DF", "CSO", "#TS", "#NP", "#SS", "#GP", "#PF", "reservada",
+        "#MF", "#AC", "#MC", "#XM", "#VE", "#CP", "reservada", "reservada",
+        "reservada", "reservada", "reservada", "reservada", "#HV", "#VC", "#SX", "reservada"
+    };
+    
+    if (vector < 0 || vector >= IDT_VECTORS) {
+        return "fuera de rango";
+    }
+    if (vector < IRQ0_VECTOR) {
+        return exceptions[vector];
+    }
+    if (vector < FIRST_DYNAMIC_VECTOR) {
+        return "legacy";
+    }
+    if (vector < FIRST_SYSTEM_VECTOR) {
+        return "dinámico";
+    }
+    return "sistema";
+}
+
+// Publicar el descriptor modificado con su nuevo estado y entregar (o dar por
+// perdidas) las peticiones que quedaron en el IRR durante la actualización
+static void irq_end_update(int irq_num, irq_state_t state) {
+    irq_set_active(irq_num, state != IRQ_STATE_FREE);
+    __atomic_store_n(&idt[irq_num].state, state, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pic_irr[IRQ_WORD(irq_num)], __ATOMIC_SEQ_CST) & IRQ_BIT(irq_num)) {
+        pic_deliver_pending();
+    }
+}
+
+// Poner a cero las latencias de una IRQ (con su vector reservado)
+static void irq_latency_reset(int irq_num) {
+    irq_meta_t *meta = &irq_meta[irq_num];
+    
+    lat_hist_reset(&isr_hist[irq_num]);
+    lat_hist_reset(&queue_hist[irq_num]);
+    meta->irr_raised_ns = 0;
+    meta->lat_samples = 0;
+    meta->lat_queue_ns = 0;
+    meta->lat_dispatch_ns = 0;
+    meta->lat_handler_ns = 0;
+}
+
+// Inicialización de la IDT
+void init_idt() {
+    LOCK_IDT();
+    // Vectores: excepciones, legacy y sistema quedan fuera del asignador
+    pthread_mutex_lock(&vector_mutex);
+    memset(vector_used, 0, sizeof(vector_used));
+    for (int v = 0; v < IDT_VECTORS; v++) {
+        vector_irq[v] = (v >= IRQ0_VECTOR && v < IRQ0_VECTOR + NR_IRQS_LEGACY) ? v - IRQ0_VECTOR : -1;
+        if (v < FIRST_DYNAMIC_VECTOR || v >= FIRST_SYSTEM_VECTOR) {
+            vector_used[v >> 6] |= IRQ_BIT(v);
+        }
+    }
+    pthread_mutex_unlock(&vector_mutex);
+    memset(irq_active, 0, sizeof(irq_active));
+    
+    for (int i = 0; i < MAX_INTERRUPTS; i++) {
+        idt[i].isr = NULL;
+        ATOMIC_STORE_REL(&idt[i].state, IRQ_STATE_FREE);
+        idt[i].call_count = 0;
+        irq_meta[i].last_call = 0;
+        idt[i].total_execution_time = 0;
+        irq_latency_reset(i);
+        snprintf(irq_meta[i].description, sizeof(irq_meta[i].description), 
+            "IRQ %d - Vector libre en IDT", i);
+        idt[i].description_id = 0;
+        irq_meta[i].vector = i < NR_IRQS_LEGACY ? IRQ0_VECTOR + i : -1;
+        ATOMIC_STORE_REL(&idt[i].smp_affinity, SMP_AFFINITY_ALL);
+        idt[i].smp_next_cpu = 0;
+        idt[i].handler = NULL;
+        idt[i].thread_fn = NULL;
+        irq_meta[i].thread_pending = 0;
+        irq_meta[i].thread_stop = 0;
+        irq_meta[i].thread_running = 0;
+        irq_meta[i].thread_runs = 0;
+        irq_meta[i].total_thread_time = 0;
+        idt[i].napi_rate = 0;
+        irq_meta[i].napi_budget = NAPI_DEFAULT_BUDGET;
+        idt[i].napi_scheduled = 0;
+        irq_meta[i].napi_pending = 0;
+        irq_meta[i].napi_window_start = 0;
+        irq_meta[i].napi_window_count = 0;
+        irq_meta[i].napi_switches = 0;
+        irq_meta[i].napi_polled = 0;
+        irq_meta[i].napi_episode_events = 0;
+        irq_meta[i].napi_episode_polls = 0;
+        idt[i].action_count = 0;
+        irq_meta[i].spurious_count = 0;
+        pthread_mutex_init(&irq_meta[i].thread_mutex, NULL);
+        pthread_cond_init(&irq_meta[i].thread_cond, NULL);
+    }
+    UNLOCK_IDT();
+    
+    add_trace("🚀 KERNEL: Tabla de Descriptores de Interrupción (IDT) inicializada");
+    add_trace("🎯 KERNEL: 256 vectores - 32 excepciones, 16 IRQs legacy y 192 vectores dinámicos para MSI/MSI-X");
+    add_trace("🔧 HARDWARE: Controlador de interrupciones (PIC/APIC) configurado");
+}
+
+// Inicialización de estadísticas del sistema
+void init_system_stats() {
+    memset(&stats, 0, sizeof(system_stats_t));
+    stats.system_start_time = time(NULL);
+    stats.system_start_ns = monotonic_ns();
+}
+
+// Histogramas de latencia de las ISRs: uno por IRQ. El global está repartido
+// en los shards de estadísticas (stats_read_isr_hist).
+lat_hist_t isr_hist[MAX_INTERRUPTS];
+// Espera de cada IRQ desde su inyección hasta que se despacha
+lat_hist_t queue_hist[MAX_INTERRUPTS];
+
+// Bucket de un valor: lineal hasta 2^SUB_BITS y después
+// 2^(SUB_BITS-1) buckets por octava según los bits altos tras el MSB. Los
+// valores fuera de escala van a un bucket propio, no al último de la escala.
+static unsigned int lat_hist_bucket(uint64_t value) {
+    if (value >> LAT_HIST_MAX_BITS) {
+        return LAT_HIST_OVERFLOW;
+    }
+    if (value < (1ULL << LAT_HIST_SUB_BITS)) {
+        return (unsigned int)value;
+    }
+    unsigned int shift = (unsigned int)(63 - __builtin_clzll(value)) - (LAT_HIST_SUB_BITS - 1);
+    return (shift << (LAT_HIST_SUB_BITS - 1)) + (unsigned int)(value >> shift);
+}
+
+// Mayor valor que cae en un bucket (el que se reporta, como HdrHistogram).
+// El de desbordamiento no tiene techo: se acota con el máximo exacto.
+static uint64_t lat_hist_bucket_high(unsigned int bucket) {
+    if (bucket == LAT_HIST_OVERFLOW) {
+        return UINT64_MAX;
+    }
+    if (bucket < (1u << LAT_HIST_SUB_BITS)) {
+        return bucket;
+    }
+    unsigned int shift = (bucket >> (LAT_HIST_SUB_BITS - 1)) - 1;
+    uint64_t mantissa = bucket - (shift << (LAT_HIST_SUB_BITS - 1));
+    return ((mantissa + 1) << shift) - 1;
+}
+
+// Registrar count muestras de value_ns (count > 1 para un lote de NAPI)
+void lat_hist_record(lat_hist_t *hist, uint64_t value_ns, unsigned long count) {
+    ATOMIC_FETCH_ADD(&hist->counts[lat_hist_bucket(value_ns)], count);
+    ATOMIC_FETCH_ADD(&hist->total, count);
+    ATOMIC_FETCH_ADD(&hist->sum_ns, value_ns * count);
+    
+    uint64_t max = ATOMIC_LOAD_RELAXED(&hist->max_ns);
+    while (value_ns > max &&
+           !__atomic_compare_exchange_n(&hist->max_ns, &max, value_ns, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void lat_hist_reset(lat_hist_t *hist) {
+    for (unsigned int i = 0; i < LAT_HIST_BUCKETS; i++) {
+        __atomic_store_n(&hist->counts[i], 0UL, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&hist->total, 0UL, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->sum_ns, 0ULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->max_ns, 0ULL, __ATOMIC_RELAXED);
+}
+
+
+// Percentiles de una instantánea del histograma. Los escritores siguen
+// registrando: el total sale de los buckets leídos para que sea coherente.
+void lat_hist_summary(const lat_hist_t *hist, lat_summary_t *out) {
+    static const double quantiles[] = { 0.50, 0.90, 0.99, 0.999 };
+    uint64_t *targets[] = { &out->p50_ns, &out->p90_ns, &out->p99_ns, &out->p999_ns };
+    unsigned long counts[LAT_HIST_BUCKETS];
+    unsigned long total = 0;
+    
+    for (unsigned int i = 0; i < LAT_HIST_BUCKETS; i++) {
+        counts[i] = ATOMIC_LOAD_RELAXED(&hist->counts[i]);
+        total += counts[i];
+    }
+    memset(out, 0, sizeof(*out));
+    out->count = total;
+    if (total == 0) {
+        return;
+    }
+    out->max_ns = ATOMIC_LOAD_RELAXED(&hist->max_ns);
+    out->overflow = counts[LAT_HIST_OVERFLOW];
+    // hist->total se lee aparte y puede ir por detrás de los buckets (0 con
+    // la primera muestra a medias): dividir por el total de la instantánea
+    out->mean_ns = (double)ATOMIC_LOAD_RELAXED(&hist->sum_ns) / total;
+    
+    unsigned long seen = 0;
+    unsigned int q = 0;
+    for (unsigned int i = 0; i < LAT_HIST_BUCKETS && q < 4; i++) {
+        seen += counts[i];
+        while (q < 4 && seen >= (unsigned long)(quantiles[q] * total + 0.999999)) {
+            uint64_t high = lat_hist_bucket_high(i);
+            *targets[q++] = high < out->max_ns ? high : out->max_ns;
+        }
+    }
+}
+
+// Exportar los histogramas no vacíos a CSV (irq -1 = global): una fila por
+// bucket ocupado con su rango en ns. Devuelve las filas o ERROR_TRACE_STORAGE.
+long export_latency_histograms(const char *path) {
+    FILE *out = fopen(path, "w");
+    long rows = 0;
+    
+    if (!out) {
+        return ERROR_TRACE_STORAGE;
+    }
+    lat_hist_t global;
+    stats_read_isr_hist(&global);
+    
+    // El global (-1) y las IRQs activas: las libres tienen el histograma a cero
+    int irqs[MAX_INTERRUPTS + 1];
+    int irq_count = 0;
+    irqs[irq_count++] = -1;
+    for_each_active_irq(i) {
+        irqs[irq_count++] = i;
+    }
+    
+    fprintf(out, "# irq,count,p50_ns,p90_ns,p99_ns,p999_ns,max_ns,overflow\n");
+    for (int n = 0; n < irq_count; n++) {
+        int irq = irqs[n];
+        lat_summary_t summary;
+        lat_hist_summary(irq < 0 ? &global : &isr_hist[irq], &summary);
+        if (summary.count > 0) {
+            fprintf(out, "# %d,%lu,%llu,%llu,%llu,%llu,%llu,%lu\n", irq, summary.count,
+                    (unsigned long long)summary.p50_ns, (unsigned long long)summary.p90_ns,
+                    (unsigned long long)summary.p99_ns, (unsigned long long)summary.p999_ns,
+                    (unsigned long long)summary.max_ns, summary.overflow);
+        }
+    }
+    fprintf(out, "irq,low_ns,high_ns,count\n");
+    for (int n = 0; n < irq_count; n++) {
+        int irq = irqs[n];
+        const lat_hist_t *hist = irq < 0 ? &global : &isr_hist[irq];
+        for (unsigned int i = 0; i < LAT_HIST_BUCKETS; i++) {
+            unsigned long count = ATOMIC_LOAD_RELAXED(&hist->counts[i]);
+            if (count == 0) {
+                continue;
+            }
+            uint64_t low = i > 0 ? lat_hist_bucket_high(i - 1) + 1 : 0;
+            uint64_t high = lat_hist_bucket_high(i);
+            if (i == LAT_HIST_OVERFLOW) {
+                uint64_t max = ATOMIC_LOAD_RELAXED(&hist->max_ns);
+                high = max > low ? max : low;
+            }
+            fprintf(out, "%d,%llu,%llu,%lu\n", irq, (unsigned long long)low,
+                    (unsigned long long)high, count);
+            rows++;
+        }
+    }
+    if (fclose(out) != 0) {
+        return ERROR_TRACE_STORAGE;
+    }
+    return rows;
+}
+
+// Shard de estadísticas del hilo actual: el de su CPU simulada o, fuera de
+// ellas, uno de los restantes asignado por round-robin la primera vez
+static __thread stats_shard_t *thread_stats_shard = NULL;
+static unsigned int stats_next_shard = 0;
+
+static stats_shard_t *stats_this_shard(void) {
+    if (current_cpu >= 0) {
+        return &stats.shards[current_cpu];
+    }
+    if (thread_stats_shard == NULL) {
+        unsigned int index = ATOMIC_FETCH_ADD(&stats_next_shard, 1u);
+        thread_stats_shard = &stats.shards[MAX_SIM_CPUS + index % (STATS_SHARDS - MAX_SIM_CPUS)];
+    }
+    return thread_stats_shard;
+}
+
+// Actualizar estadísticas (thread-safe)
+// Cada hilo suma en su shard con adds relajados: ningún lock ni línea de
+// caché compartida en el despacho
+void update_stats(int irq_num, uint64_t execution_ns) {
+    update_stats_batch(irq_num, 1, execution_ns);
+}
+
+// Contabilizar de una vez count interrupciones de la misma IRQ (un lote de
+// NAPI): execution_ns es el total del lote y cada una cuenta con la media
+void update_stats_batch(int irq_num, unsigned long count, uint64_t execution_ns) {
+    stats_shard_t *shard = stats_this_shard();
+    irq_counters_t *counters = &shard->counters;
+    
+    ATOMIC_FETCH_ADD(&counters->total_interrupts, count);
+    
+    if (irq_num == IRQ_TIMER) {
+        ATOMIC_FETCH_ADD(&counters->timer_interrupts, count);
+    } else if (irq_num == IRQ_KEYBOARD) {
+        ATOMIC_FETCH_ADD(&counters->keyboard_interrupts, count);
+    } else {
+        ATOMIC_FETCH_ADD(&counters->custom_interrupts, count);
+    }
+    
+    ATOMIC_FETCH_ADD(&counters->total_response_time, (unsigned long)(execution_ns / 1000));
+    lat_hist_record(&isr_hist[irq_num], execution_ns / count, count);
+    lat_hist_record(&shard->isr_hist, execution_ns / count, count);
+}
+
+// Sumar los contadores de todos los shards (solo al mostrar o exportar)
+void stats_read_counters(irq_counters_t *out) {
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; i < STATS_SHARDS; i++) {
+        const irq_counters_t *counters = &stats.shards[i].counters;
+        out->total_interrupts += ATOMIC_LOAD_RELAXED(&counters->total_interrupts);
+        out->timer_interrupts += ATOMIC_LOAD_RELAXED(&counters->timer_interrupts);
+        out->keyboard_interrupts += ATOMIC_LOAD_RELAXED(&counters->keyboard_interrupts);
+        out->custom_interrupts += ATOMIC_LOAD_RELAXED(&counters->custom_interrupts);
+        out->total_response_time += ATOMIC_LOAD_RELAXED(&counters->total_response_time);
+    }
+}
+
+// Histograma global de ISRs: fusión de las partes de todos los shards
+void stats_read_isr_hist(lat_hist_t *out) {
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; i < STATS_SHARDS; i++) {
+        const lat_hist_t *hist = &stats.shards[i].isr_hist;
+        if (ATOMIC_LOAD_RELAXED(&hist->total) == 0) {
+            continue;
+        }
+        for (unsigned int b = 0; b < LAT_HIST_BUCKETS; b++) {
+            out->counts[b] += ATOMIC_LOAD_RELAXED(&hist->counts[b]);
+        }
+        out->total += ATOMIC_LOAD_RELAXED(&hist->total);
+        out->sum_ns += ATOMIC_LOAD_RELAXED(&hist->sum_ns);
+        uint64_t max = ATOMIC_LOAD_RELAXED(&hist->max_ns);
+        if (max > out->max_ns) {
+            out->max_ns = max;
+        }
+    }
+}
+
+static int irq_setup_handler(int irq_num, void (*isr_function)(int), irqreturn_t (*handler)(int),
+                             irqreturn_t (*thread_fn)(int), const char *description);
+
+// Instalar un handler en el vector: isr_function para una ISR síncrona, o
+// handler/thread_fn para una IRQ con hilo (isr_function = NULL)
+static int install_handler(int irq_num, void (*isr_function)(int), irqreturn_t (*handler)(int),
+                           irqreturn_t (*thread_fn)(int), const char *description) {
+    irq_state_t prev = irq_begin_update(irq_num, 0);
+    if (prev == IRQ_STATE_EXECUTING) {
+        add_trace("⚠️  KERNEL: Registro ISR fallido - IRQ actualmente en ejecución");
+        return ERROR_ISR_EXECUTING;
+    }
+    if (idt[irq_num].action_count > 0) {
+        // Un handler exclusivo no puede sustituir a la cadena de una línea compartida
+        irq_end_update(irq_num, prev);
+        add_trace_with_irq("⚠️  KERNEL: Registro ISR fallido - Línea compartida por otros dispositivos", irq_num);
+        return ERROR_IRQ_BUSY;
+    }
+    
+    return irq_setup_handler(irq_num, isr_function, handler, thread_fn, description);
+}
+
+// Rellenar el descriptor de un vector ya reservado en ACTUALIZANDO y publicarlo
+static int irq_setup_handler(int irq_num, void (*isr_function)(int), irqreturn_t (*handler)(int),
+                             irqreturn_t (*thread_fn)(int), const char *description) {
+    irq_thread_stop(irq_num);
+    
+    idt[irq_num].isr = isr_function;
+    idt[irq_num].handler = handler;
+    idt[irq_num].thread_fn = thread_fn;
+    idt[irq_num].call_count = 0;
+    idt[irq_num].total_execution_time = 0;
+    irq_meta[irq_num].spurious_count = 0;
+    irq_latency_reset(irq_num);
+    irq_meta[irq_num].thread_runs = 0;
+    irq_meta[irq_num].total_thread_time = 0;
+    strncpy(irq_meta[irq_num].description, description, sizeof(irq_meta[irq_num].description) - 1);
+    irq_meta[irq_num].description[sizeof(irq_meta[irq_num].description) - 1] = '\0';
+    idt[irq_num].description_id = trace_intern_string(irq_meta[irq_num].description);
+    int description_id = idt[irq_num].description_id;
+    
+    if (thread_fn != NULL && irq_thread_start(irq_num) != SUCCESS) {
+        idt[irq_num].handler = NULL;
+        idt[irq_num].thread_fn = NULL;
+        irq_end_update(irq_num, IRQ_STATE_FREE);
+        add_trace_with_irq("❌ KERNEL: No se pudo crear el hilo irq/N - IRQ desconectada", irq_num);
+        return ERROR_TRACE_STORAGE;
+    }
+    
+    irq_end_update(irq_num, IRQ_STATE_REGISTERED);
+    
+    add_trace_event(TRACE_EV_ISR_REGISTERED, irq_num, irq_num, description_id);
+    if (thread_fn != NULL) {
+        add_trace_event(TRACE_EV_IRQ_THREAD_REGISTERED, irq_num, irq_num, irq_num, description_id);
+    }
+    add_trace_event(TRACE_EV_IRQ_CONNECTED, irq_num, irq_num);
+    
+    return SUCCESS;
+}
+
+// Registro de ISR en la IDT
+int register_isr(int irq_num, void (*isr_function)(int), const char *description) {
+    if (validate_irq_num(irq_num) != SUCCESS) {
+        add_trace("❌ KERNEL: Error en registro ISR - IRQ fuera de rango válido");
+        return ERROR_INVALID_IRQ;
+    }
+    
+    return install_handler(irq_num, isr_function, NULL, NULL, description);
+}
+
+// Registro de una IRQ con hilo (request_threaded_irq): handler corre en el
+// despacho y, si devuelve IRQ_WAKE_THREAD, thread_fn corre en el hilo irq/N
+// con la línea enmascarada. handler NULL = despertar siempre el hilo.
+int register_threaded_isr(int irq_num, irqreturn_t (*handler)(int),
+                          irqreturn_t (*thread_fn)(int), const char *description) {
+    if (validate_irq_num(irq_num) != SUCCESS) {
+        add_trace("❌ KERNEL: Error en registro ISR - IRQ fuera de rango válido");
+        return ERROR_INVALID_IRQ;
+    }
+    if (thread_fn == NULL) {
+        add_trace_with_irq("❌ KERNEL: Registro de IRQ con hilo sin thread_fn", irq_num);
+        return ERROR_NO_ISR;
+    }
+    
+    return install_handler(irq_num, NULL, handler, thread_fn, description);
+}
+
+// Descripción de una línea compartida: los nombres de sus dispositivos
+// separados por comas, como en /proc/interrupts
+static void irq_describe_actions(int irq_num) {
+    irq_descriptor_t *desc = &idt[irq_num];
+    irq_meta_t *meta = &irq_meta[irq_num];
+    size_t len = 0;
+    
+    meta->description[0] = '\0';
+    for (int i = 0; i < desc->action_count && len + 1 < sizeof(meta->description); i++) {
+        int written = snprintf(meta->description + len, sizeof(meta->description) - len, "%s%s",
+                               i > 0 ? ", " : "", trace_string_text(meta->actions[i].description_id));
+        if (written < 0) {
+            break;
+        }
+        len += (size_t)written;
+    }
+    desc->description_id = trace_intern_string(meta->description);
+}
+
+// Añadir un handler a la cadena de una línea compartida (request_irq con
+// IRQF_SHARED). Falla con ERROR_IRQ_BUSY si la línea tiene un handler
+// exclusivo o la cadena está llena.
+int request_shared_irq(int irq_num, shared_handler_t handler, void *dev_id, const char *description) {
+    if (validate_irq_num(irq_num) != SUCCESS) {
+        add_trace("❌ KERNEL: Error en registro ISR - IRQ fuera de rango válido");
+        return ERROR_INVALID_IRQ;
+    }
+    if (handler == NULL) {
+        return ERROR_NO_ISR;
+    }
+    
+    irq_state_t prev = irq_begin_update(irq_num, 0);
+    if (prev == IRQ_STATE_EXECUTING) {
+        add_trace("⚠️  KERNEL: Registro ISR fallido - IRQ actualmente en ejecución");
+        return ERROR_ISR_EXECUTING;
+    }
+    
+    irq_descriptor_t *desc = &idt[irq_num];
+    irq_meta_t *meta = &irq_meta[irq_num];
+    if (prev == IRQ_STATE_FREE) {
+        desc->action_count = 0;
+        desc->call_count = 0;
+        desc->total_execution_time = 0;
+        meta->spurious_count = 0;
+        irq_latency_reset(irq_num);
+    } else if (desc->action_count == 0 || desc->action_count == MAX_SHARED_HANDLERS) {
+        irq_end_update(irq_num, prev);
+        add_trace_with_irq("⚠️  KERNEL: Registro compartido fallido - Línea exclusiva o cadena llena", irq_num);
+        return ERROR_IRQ_BUSY;
+    }
+    
+    irq_action_t *action = &meta->actions[desc->action_count];
+    action->handler = handler;
+    action->dev_id = dev_id;
+    action->description_id = trace_intern_string(description);
+    action->handled = 0;
+    desc->action_count++;
+    irq_describe_actions(irq_num);
+    
+    irq_end_update(irq_num, IRQ_STATE_REGISTERED);
+    
+    add_trace_event(TRACE_EV_SHARED_REGISTERED, irq_num, action->description_id, irq_num,
+                    desc->action_count);
+    if (prev == IRQ_STATE_FREE) {
+        add_trace_event(TRACE_EV_IRQ_CONNECTED, irq_num, irq_num);
+    }
+    return SUCCESS;
+}
+
+// Quitar de la cadena el handler de dev_id. El resto se desplaza para que
+// la cadena siga contigua; sin handlers la línea queda libre.
+int free_shared_irq(int irq_num, void *dev_id) {
+    if (validate_irq_num(irq_num) != SUCCESS) {
+        add_trace("❌ KERNEL: Error en desregistro ISR - IRQ fuera de rango válido");
+        return ERROR_INVALID_IRQ;
+    }
+    
+    irq_state_t prev = irq_begin_update(irq_num, 0);
+    if (prev == IRQ_STATE_EXECUTING) {
+        add_trace("⚠️  KERNEL: Desregistro ISR fallido - IRQ actualmente en ejecución");
+        return ERROR_ISR_EXECUTING;
+    }
+    
+    irq_descriptor_t *desc = &idt[irq_num];
+    irq_meta_t *meta = &irq_meta[irq_num];
+    int found = -1;
+    for (int i = 0; i < desc->action_count; i++) {
+        if (meta->actions[i].dev_id == dev_id) {
+            found = i;
+            break;
+        }
+    }
+    if (found < 0) {
+        irq_end_update(irq_num, prev);
+        return ERROR_NO_ISR;
+    }
+    
+    int old_description_id = meta->actions[found].description_id;
+    memmove(&meta->actions[found], &meta->actions[found + 1],
+            (size_t)(desc->action_count - found - 1) * sizeof(meta->actions[0]));
+    desc->action_count--;
+    
+    if (desc->action_count > 0) {
+        irq_describe_actions(irq_num);
+        irq_end_update(irq_num, prev);
+        add_trace_event(TRACE_EV_ISR_REMOVED, irq_num, irq_num, old_description_id);
+        return SUCCESS;
+    }
+    
+    snprintf(meta->description, sizeof(meta->description),
+        "IRQ %d - Disponible para asignación", irq_num);
+    desc->description_id = 0;
+    irq_end_update(irq_num, IRQ_STATE_FREE);
+    
+    add_trace_event(TRACE_EV_ISR_REMOVED, irq_num, irq_num, old_description_id);
+    add_trace_event(TRACE_EV_IRQ_DISCONNECTED, irq_num, irq_num);
+    return SUCCESS;
+}
+
+// Desregistrar ISR (en una línea compartida, toda la cadena)
+int unregister_isr(int irq_num) {
+    if (validate_irq_num(irq_num) != SUCCESS) {
+        add_trace("❌ KERNEL: Error en desregistro ISR - IRQ fuera de rango válido");
+        return ERROR_INVALID_IRQ;
+    }
+    
+    if (irq_begin_update(irq_num, 0) == IRQ_STATE_EXECUTING) {
+        add_trace("⚠️  KERNEL: Desregistro ISR fallido - IRQ actualmente en ejecución");
+        return ERROR_ISR_EXECUTING;
+    }
+    
+    int old_description_id = trace_intern_string(irq_meta[irq_num].description);
+    
+    irq_thread_stop(irq_num);
+    
+    idt[irq_num].isr = NULL;
+    idt[irq_num].handler = NULL;
+    idt[irq_num].thread_fn = NULL;
+    idt[irq_num].action_count = 0;
+    idt[irq_num].call_count = 0;
+    idt[irq_num].total_execution_time = 0;
+    irq_meta[irq_num].spurious_count = 0;
+    irq_latency_reset(irq_num);
+    snprintf(irq_meta[irq_num].description, sizeof(irq_meta[irq_num].description), 
+        "IRQ %d - Disponible para asignación", irq_num);
+    idt[irq_num].description_id = 0;
+    
+    irq_end_update(irq_num, IRQ_STATE_FREE);
+    
+    add_trace_event(TRACE_EV_ISR_REMOVED, irq_num, irq_num, old_description_id);
+    add_trace_event(TRACE_EV_IRQ_DISCONNECTED, irq_num, irq_num);
+    
+    return SUCCESS;
+}
+
+// Habilitar MSI-X en un dispositivo con count colas (pci_alloc_irq_vectors
+// con PCI_IRQ_MSIX): cada cola recibe su propia IRQ dinámica, con su vector
+// en la IDT y, en modo SMP, su propia CPU (afinidad en round-robin, como
+// irq_create_affinity_masks). Todo o nada: sin count IRQs libres no se
+// registra ninguna. irqs recibe los números asignados.
+int msix_alloc_vectors(const char *device, int count, void (*isr)(int), int *irqs) {
+    if (isr == NULL) {
+        return ERROR_NO_ISR;
+    }
+    if (count < 1 || count > MAX_MSIX_VECTORS) {
+        return ERROR_INVALID_IRQ;
+    }
+    
+    // Reservar las IRQs con el mismo CAS que irq_begin_update(): LIBRE -> ACTUALIZANDO
+    int reserved = 0;
+    for (int irq = NR_IRQS_LEGACY; irq < MAX_INTERRUPTS && reserved < count; irq++) {
+        irq_state_t state = IRQ_STATE_FREE;
+        if (ATOMIC_CAS(&idt[irq].state, &state, IRQ_STATE_UPDATING)) {
+            irqs[reserved++] = irq;
+        }
+    }
+    if (reserved < count) {
+        for (int q = 0; q < reserved; q++) {
+            irq_end_update(irqs[q], IRQ_STATE_FREE);
+        }
+        add_trace_event(TRACE_EV_MSIX_FAILED, -1, trace_intern_string(device), count);
+        return ERROR_IRQ_BUSY;
+    }
+    
+    int result = SUCCESS;
+    for (int q = 0; q < count; q++) {
+        irq_descriptor_t *desc = &idt[irqs[q]];
+        char description[MAX_DESCRIPTION_LEN];
+        
+        snprintf(description, sizeof(description), "%s-msix-%d", device, q);
+        ATOMIC_STORE_REL(&desc->smp_affinity,
+                         smp_cpu_count > 0 ? 1u << (q % smp_cpu_count) : SMP_AFFINITY_ALL);
+        if (result == SUCCESS) {
+            result = irq_setup_handler(irqs[q], isr, NULL, NULL, description);
+        } else {
+            irq_end_update(irqs[q], IRQ_STATE_FREE);
+        }
+    }
+    if (result != SUCCESS) {
+        msix_free_vectors(irqs, count);
+        return result;
+    }
+    add_trace_event(TRACE_EV_MSIX_ALLOCATED, irqs[0], trace_intern_string(device), count, irqs[0]);
+    return SUCCESS;
+}
+
+// Liberar las IRQs de un dispositivo MSI-X; sus vectores vuelven al asignador
+int msix_free_vectors(const int *irqs, int count) {
+    int result = SUCCESS;
+    
+    for (int q = 0; q < count; q++) {
+        if (!IS_VALID_IRQ(irqs[q]) || irqs[q] < NR_IRQS_LEGACY) {
+            result = ERROR_INVALID_IRQ;
+            continue;
+        }
+        ATOMIC_STORE_REL(&idt[irqs[q]].smp_affinity, SMP_AFFINITY_ALL);
+        if (ATOMIC_LOAD_ACQ(&idt[irqs[q]].state) == IRQ_STATE_FREE) {
+            continue;
+        }
+        int freed = unregister_isr(irqs[q]);
+        if (freed != SUCCESS) {
+            result = freed;
+        }
+    }
+    return result;
+}
+
+// EOI: el vector sale del ISR y vuelve a REGISTRADO. El store es seq_cst
+// para que quien deje una petición en el IRR la vea o vea el vector libre.
+static void pic_end_of_interrupt(int irq_num) {
+    __atomic_fetch_and(&pic_isr[IRQ_WORD(irq_num)], ~IRQ_BIT(irq_num), __ATOMIC_RELAXED);
+    __atomic_store_n(&idt[irq_num].state, IRQ_STATE_REGISTERED, __ATOMIC_SEQ_CST);
+}
+
+// El handler primario pidió su hilo: el vector sale del ISR pero queda
+// ENMASCARADO (las nuevas peticiones esperan en el IRR) hasta que irq/N termine
+static void irq_wake_thread(int irq_num) {
+    irq_descriptor_t *desc = &idt[irq_num];
+    irq_meta_t *meta = &irq_meta[irq_num];
+    
+    __atomic_fetch_and(&pic_isr[IRQ_WORD(irq_num)], ~IRQ_BIT(irq_num), __ATOMIC_RELAXED);
+    __atomic_store_n(&desc->state, IRQ_STATE_MASKED, __ATOMIC_SEQ_CST);
+    
+    pthread_mutex_lock(&meta->thread_mutex);
+    meta->thread_pending = 1;
+    pthread_cond_signal(&meta->thread_cond);
+    pthread_mutex_unlock(&meta->thread_mutex);
+}
+
+// Ejecutar thread_fn en el hilo irq/N y desenmascarar la línea
+static void irq_thread_run(int irq_num) {
+    irq_descriptor_t *desc = &idt[irq_num];
+    irq_meta_t *meta = &irq_meta[irq_num];
+    int is_timer_irq = (irq_num == IRQ_TIMER);
+    
+    // Con la línea ENMASCARADA nadie puede modificar el descriptor
+    uint64_t start_ns = monotonic_ns();
+    desc->thread_fn(irq_num);
+    unsigned long elapsed_us = (unsigned long)((monotonic_ns() - start_ns) / 1000);
+    
+    ATOMIC_FETCH_ADD(&meta->thread_runs, 1);
+    ATOMIC_FETCH_ADD(&meta->total_thread_time, elapsed_us);
+    ATOMIC_FETCH_ADD(&stats.irq_thread_items, 1UL);
+    ATOMIC_FETCH_ADD(&stats.irq_thread_time, elapsed_us);
+    add_trace_event_smart(TRACE_EV_IRQ_THREAD_DONE, irq_num, is_timer_irq, irq_num, (int)elapsed_us);
+    
+    pic_end_of_interrupt(irq_num);
+    pic_deliver_pending();
+    softirq_irq_exit();
+}
+
+static void *irq_thread_func(void *arg) {
+    int irq_num = (int)(intptr_t)arg;
+    irq_meta_t *meta = &irq_meta[irq_num];
+    char name[16];
+    
+    snprintf(name, sizeof(name), "irq/%d", irq_num);
+    trace_set_thread_name(name);
+    
+    for (;;) {
+        pthread_mutex_lock(&meta->thread_mutex);
+        while (!meta->thread_pending && !meta->thread_stop) {
+            pthread_cond_wait(&meta->thread_cond, &meta->thread_mutex);
+        }
+        int pending = meta->thread_pending;
+        meta->thread_pending = 0;
+        pthread_mutex_unlock(&meta->thread_mutex);
+        
+        if (!pending) {
+            break;
+        }
+        irq_thread_run(irq_num);
+    }
+    return NULL;
+}
+
+// Crear el hilo irq/N. Solo con el vector reservado en ACTUALIZANDO.
+static int irq_thread_start(int irq_num) {
+    irq_meta_t *meta = &irq_meta[irq_num];
+    
+    meta->thread_pending = 0;
+    meta->thread_stop = 0;
+    if (pthread_create(&meta->thread, NULL, irq_thread_func, (void *)(intptr_t)irq_num) != 0) {
+        return ERROR_TRACE_STORAGE;
+    }
+    meta->thread_running = 1;
+    return SUCCESS;
+}
+
+// Detener el hilo irq/N si existe. Solo con el vector reservado: la línea no
+// está enmascarada, así que el hilo no tiene trabajo pendiente.
+static void irq_thread_stop(int irq_num) {
+    irq_meta_t *meta = &irq_meta[irq_num];
+    
+    if (!meta->thread_running) {
+        return;
+    }
+    pthread_mutex_lock(&meta->thread_mutex);
+    meta->thread_stop = 1;
+    pthread_cond_signal(&meta->thread_cond);
+    pthread_mutex_unlock(&meta->thread_mutex);
+    pthread_join(meta->thread, NULL);
+    meta->thread_running = 0;
+}
+
+// Esperar a que ningún hilo irq/N tenga su línea enmascarada
+void irq_threads_wait_idle(void) {
+    for (;;) {
+        int masked = 0;
+        for_each_active_irq(i) {
+            if (ATOMIC_LOAD_ACQ(&idt[i].state) == IRQ_STATE_MASKED) {
+                masked = 1;
+            }
+        }
+        if (!masked) {
+            return;
+        }
+        usleep(1000);
+    }
+}
+
+// Detener todos los hilos irq/N al apagar el simulador
+void shutdown_irq_threads(void) {
+    for (int i = 0; i < MAX_INTERRUPTS; i++) {
+        if (!irq_meta[i].thread_running) {
+            continue;
+        }
+        irq_state_t state = irq_begin_update(i, 1);
+        irq_thread_stop(i);
+        irq_end_update(i, state);
+    }
+}
+
+// Repartir la latencia de una IRQ atendida: espera desde la inyección hasta
+// que se reclamó el vector, despacho (CAS, lookup en la IDT, trazas, EOI y
+// estadísticas, antes y después del handler) y tiempo dentro del handler
+static void irq_account_latency(int irq_num, uint64_t raised_ns, uint64_t entry_ns,
+                                uint64_t start_ns, uint64_t handler_ns) {
+    irq_meta_t *meta = &irq_meta[irq_num];
+    uint64_t now = monotonic_ns();
+    uint64_t queue_ns = entry_ns > raised_ns ? entry_ns - raised_ns : 0;
+    uint64_t dispatch_ns = (start_ns - entry_ns) + (now - start_ns - handler_ns);
+    
+    ATOMIC_FETCH_ADD(&meta->lat_samples, 1UL);
+    ATOMIC_FETCH_ADD(&meta->lat_queue_ns, queue_ns);
+    ATOMIC_FETCH_ADD(&meta->lat_dispatch_ns, dispatch_ns);
+    ATOMIC_FETCH_ADD(&meta->lat_handler_ns, handler_ns);
+    lat_hist_record(&queue_hist[irq_num], queue_ns, 1);
+}
+
+// Recorrer la cadena de una línea compartida. Se llama a todos los handlers
+// (varios dispositivos pueden haber levantado la línea a la vez) y la IRQ
+// queda atendida si alguno la reclama.
+static irqreturn_t irq_run_actions(irq_meta_t *meta, int irq_num, int count) {
+    irqreturn_t ret = IRQ_NONE;
+    
+    for (int i = 0; i < count; i++) {
+        irq_action_t *action = &meta->actions[i];
+        if (action->handler(irq_num, action->dev_id) == IRQ_HANDLED) {
+            // Un único escritor (el dueño del vector o el poll de NAPI): sin RMW atómico
+            __atomic_store_n(&action->handled, action->handled + 1, __ATOMIC_RELAXED);
+            ret = IRQ_HANDLED;
+        }
+    }
+    return ret;
+}
+
+// Nadie reclamó la interrupción (note_interrupt() en Linux)
+static void irq_note_spurious(int irq_num, int handlers) {
+    ATOMIC_FETCH_ADD(&irq_meta[irq_num].spurious_count, 1UL);
+    ATOMIC_FETCH_ADD(&stats.irq_spurious, 1UL);
+    add_trace_event_smart(TRACE_EV_IRQ_SPURIOUS, irq_num, irq_num == IRQ_TIMER, irq_num, handlers);
+}
+
+// Ejecutar la ISR de un vector ya reservado en EJECUTANDO y publicar el EOI.
+// Las peticiones que llegaron mientras tanto quedan en el IRR y las entrega
+// pic_deliver_pending(). raised_ns es la inyección de la IRQ y entry_ns el
+// momento en que se empezó a reclamar el vector: separan la espera en cola,
+// el coste del despacho y el tiempo del handler. Devuelve 1 si se ejecutó un
+// handler (y se contó en call_count).
+static int run_isr(int irq_num, uint64_t raised_ns, uint64_t entry_ns) {
+    void (*isr_function)(int) = NULL;
+    irqreturn_t (*handler)(int) = NULL;
+    irqreturn_t (*thread_fn)(int) = NULL;
+    irqreturn_t ret = IRQ_HANDLED;
+    int is_timer_irq = (irq_num == IRQ_TIMER);
+    
+    __atomic_fetch_or(&pic_isr[IRQ_WORD(irq_num)], IRQ_BIT(irq_num), __ATOMIC_RELAXED);
+    
+    // Con el vector en EJECUTANDO nadie más puede modificar su descriptor
+    isr_function = idt[irq_num].isr;
+    handler = idt[irq_num].handler;
+    thread_fn = idt[irq_num].thread_fn;
+    int action_count = idt[irq_num].action_count;
+    if (isr_function == NULL && thread_fn == NULL && action_count == 0) {
+        pic_end_of_interrupt(irq_num);
+        add_trace_event_smart(TRACE_EV_IRQ_NO_HANDLER, irq_num, is_timer_irq, irq_num,
+                              trace_intern_string(get_irq_state_string(IRQ_STATE_REGISTERED)));
+        return 0;
+    }
+    
+    // Simular el proceso real de Linux
+    add_trace_event_smart(TRACE_EV_IRQ_RAISED, irq_num, is_timer_irq, irq_num);
+    add_trace_event_smart(TRACE_EV_CONTEXT_SAVE, irq_num, is_timer_irq);
+    add_trace_event_smart(TRACE_EV_IDT_LOOKUP, irq_num, is_timer_irq, irq_num);
+    
+    int call_count = ATOMIC_FETCH_ADD(&idt[irq_num].call_count, 1) + 1;
+    __atomic_store_n(&irq_meta[irq_num].last_call, time(NULL), __ATOMIC_RELAXED);
+    int description_id = idt[irq_num].description_id;
+    
+    add_trace_event_smart(TRACE_EV_ISR_EXEC, irq_num, is_timer_irq, description_id, call_count);
+    
+    // ✅ EJECUTAR LA ISR
+    uint64_t start_ns = monotonic_ns();
+    
+    in_hardirq = 1;
+    if (action_count > 0) {
+        ret = irq_run_actions(&irq_meta[irq_num], irq_num, action_count);
+    } else if (thread_fn != NULL) {
+        ret = (handler != NULL) ? handler(irq_num) : IRQ_WAKE_THREAD;
+    } else {
+        isr_function(irq_num);
+    }
+    in_hardirq = 0;
+    
+    uint64_t execution_ns = monotonic_ns() - start_ns;
+    unsigned long execution_time = (unsigned long)(execution_ns / 1000);
+    
+    if (ret == IRQ_NONE) {
+        irq_note_spurious(irq_num, action_count > 0 ? action_count : 1);
+    }
+    
+    // ✅ EOI: RESTAURAR ESTADO A REGISTRADO (o ENMASCARADO hasta que termine irq/N)
+    ATOMIC_FETCH_ADD(&idt[irq_num].total_execution_time, execution_time);
+    if (ret == IRQ_WAKE_THREAD) {
+        add_trace_event_smart(TRACE_EV_IRQ_THREAD_WAKE, irq_num, is_timer_irq, irq_num, irq_num);
+        irq_wake_thread(irq_num);
+    } else {
+        pic_end_of_interrupt(irq_num);
+    }
+    
+    update_stats(irq_num, execution_ns);
+    
+    add_trace_event_smart(TRACE_EV_CONTEXT_RESTORE, irq_num, is_timer_irq, (int)execution_time);
+    add_trace_event_smart(TRACE_EV_IRQ_DONE, irq_num, is_timer_irq, irq_num);
+    
+    irq_account_latency(irq_num, raised_ns, entry_ns, start_ns, execution_ns);
+    return 1;
+}
+
+// Dejar una petición en el IRR porque su vector está en servicio (o se está
+// actualizando). Si ya había una pendiente, ambas se fusionan (coalesced) y
+// se conserva la inyección de la más antigua, que es la que sigue esperando.
+static void pic_latch(int irq_num, uint64_t raised_ns) {
+    uint64_t *irr = &pic_irr[IRQ_WORD(irq_num)];
+    uint64_t bit = IRQ_BIT(irq_num);
+    int is_timer_irq = (irq_num == IRQ_TIMER);
+    uint64_t none = 0;
+    
+    ATOMIC_CAS(&irq_meta[irq_num].irr_raised_ns, &none, raised_ns);
+    if (__atomic_fetch_or(irr, bit, __ATOMIC_SEQ_CST) & bit) {
+        ATOMIC_FETCH_ADD(&stats.irq_coalesced, 1UL);
+        add_trace_event_smart(TRACE_EV_IRQ_COALESCED, irq_num, is_timer_irq, irq_num);
+    } else {
+        ATOMIC_FETCH_ADD(&stats.irq_latched, 1UL);
+        add_trace_event_smart(TRACE_EV_IRQ_LATCHED, irq_num, is_timer_irq, irq_num);
+    }
+}
+
+// Entregar las peticiones del IRR cuyo vector ya está libre, de mayor a menor
+// prioridad (número de IRQ más bajo primero, como el 8259). Quien borra el bit
+// del IRR es quien la entrega; si otro hilo ganó el vector entre tanto, la
+// petición vuelve al IRR y la entregará el EOI de ese hilo. El IRR se recorre
+// por palabras: con todo vacío son IRQ_BITMAP_WORDS lecturas.
+// En modo UP la ISR corre en el hilo que llama. En modo SMP la petición va,
+// con el vector ya reservado, a la cola de una CPU de su afinidad: la llamada
+// puede venir de irq_end_update(), de un hilo irq/N o del poll de NAPI, que
+// no son CPUs simuladas.
+static void pic_deliver_pending(void) {
+    for (;;) {
+        int progressed = 0;
+        
+        for (int w = 0; w < IRQ_BITMAP_WORDS && !progressed; w++) {
+            uint64_t irr = __atomic_load_n(&pic_irr[w], __ATOMIC_SEQ_CST);
+            
+            while (irr != 0 && !progressed) {
+                int irq_num = w * 64 + __builtin_ctzll(irr);
+                uint64_t bit = IRQ_BIT(irq_num);
+                irr &= irr - 1;
+                
+                irq_state_t state = __atomic_load_n(&idt[irq_num].state, __ATOMIC_SEQ_CST);
+                if (state == IRQ_STATE_EXECUTING || state == IRQ_STATE_UPDATING ||
+                    state == IRQ_STATE_MASKED) {
+                    continue;   // Su EOI, irq_end_update() o su hilo irq/N volverá a mirar el IRR
+                }
+                if (!(__atomic_fetch_and(&pic_irr[w], ~bit, __ATOMIC_SEQ_CST) & bit)) {
+                    continue;   // Otro hilo ya la tomó
+                }
+                progressed = 1;
+                
+                uint64_t entry_ns = monotonic_ns();
+                state = IRQ_STATE_REGISTERED;
+                if (ATOMIC_CAS(&idt[irq_num].state, &state, IRQ_STATE_EXECUTING)) {
+                    // Sin la inyección (otra entrega ya la consumió) la espera cuenta desde ahora
+                    uint64_t raised_ns = __atomic_exchange_n(&irq_meta[irq_num].irr_raised_ns, 0,
+                                                             __ATOMIC_RELAXED);
+                    if (!raised_ns) {
+                        raised_ns = entry_ns;
+                    }
+                    if (ATOMIC_LOAD_ACQ(&smp_running)) {
+                        if (!smp_enqueue_irq(irq_num, raised_ns, 1)) {
+                            __atomic_store_n(&idt[irq_num].state, IRQ_STATE_REGISTERED, __ATOMIC_SEQ_CST);
+                        }
+                        continue;
+                    }
+                    add_trace_event_smart(TRACE_EV_IRQ_PENDING_DELIVERED, irq_num,
+                                          irq_num == IRQ_TIMER, irq_num);
+                    run_isr(irq_num, raised_ns, entry_ns);
+                } else if (state == IRQ_STATE_FREE) {
+                    __atomic_store_n(&irq_meta[irq_num].irr_raised_ns, 0, __ATOMIC_RELAXED);
+                    ATOMIC_FETCH_ADD(&stats.irq_lost, 1UL);
+                    add_trace_event_smart(TRACE_EV_IRQ_LOST, irq_num, irq_num == IRQ_TIMER, irq_num);
+                } else {
+                    __atomic_fetch_or(&pic_irr[w], bit, __ATOMIC_SEQ_CST);
+                }
+            }
+        }
+        if (!progressed) {
+            return;
+        }
+    }
+}
+
+// Atender una IRQ inyectada en raised_ns en el hilo actual (la CPU simulada
+// o quien la dispara en modo UP). Devuelve 1 si se ejecutó su handler.
+static int handle_interrupt(int irq_num, uint64_t raised_ns) {
+    int is_timer_irq = (irq_num == IRQ_TIMER);
+    uint64_t entry_ns = monotonic_ns();
+    
+    // ✅ REGISTRADO -> EJECUTANDO con CAS: solo se sincroniza con este vector
+    irq_state_t state = IRQ_STATE_REGISTERED;
+    if (!ATOMIC_CAS(&idt[irq_num].state, &state, IRQ_STATE_EXECUTING)) {
+        if (state == IRQ_STATE_EXECUTING || state == IRQ_STATE_UPDATING ||
+            state == IRQ_STATE_MASKED) {
+            // ✅ VECTOR OCUPADO O ENMASCARADO: la petición queda pendiente en el IRR
+            pic_latch(irq_num, raised_ns);
+            pic_deliver_pending();
+            softirq_irq_exit();
+        } else {
+            add_trace_event_smart(TRACE_EV_IRQ_NO_HANDLER, irq_num, is_timer_irq, irq_num,
+                                  trace_intern_string(get_irq_state_string(state)));
+        }
+        return 0;
+    }
+    
+    int ran = run_isr(irq_num, raised_ns, entry_ns);
+    pic_deliver_pending();
+    softirq_irq_exit();
+    return ran;
+}
+
+// Atender en la CPU una petición que pic_deliver_pending() sacó del IRR con
+// el vector ya en EJECUTANDO. Devuelve 1 si se ejecutó su handler.
+static int handle_pending_interrupt(int irq_num, uint64_t raised_ns) {
+    add_trace_event_smart(TRACE_EV_IRQ_PENDING_DELIVERED, irq_num, irq_num == IRQ_TIMER, irq_num);
+    int ran = run_isr(irq_num, raised_ns, monotonic_ns());
+    pic_deliver_pending();
+    softirq_irq_exit();
+    return ran;
+}
+
+// Encolar una IRQ en la CPU. Devuelve 0 si su cola está llena.
+static int smp_queue_push(sim_cpu_t *cpu, int irq_num, uint64_t raised_ns, int from_irr) {
+    unsigned long pos = ATOMIC_LOAD_RELAXED(&cpu->enqueue_pos);
+    irq_queue_cell_t *cell;
+    
+    for (;;) {
+        cell = &cpu->cells[pos & (SMP_QUEUE_SIZE - 1)];
+        long diff = (long)ATOMIC_LOAD_ACQ(&cell->seq) - (long)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&cpu->enqueue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = ATOMIC_LOAD_RELAXED(&cpu->enqueue_pos);
+        }
+    }
+    
+    __atomic_store_n(&cell->irq_num, irq_num, __ATOMIC_RELAXED);
+    __atomic_store_n(&cell->from_irr, from_irr, __ATOMIC_RELAXED);
+    __atomic_store_n(&cell->raised_ns, raised_ns, __ATOMIC_RELAXED);
+    ATOMIC_STORE_REL(&cell->seq, pos + 1);
+    return 1;
+}
+
+// ¿Puede la CPU thief llevarse esta IRQ? Solo si su afinidad la incluye y el
+// vector no se está ejecutando ni enmascarado (solo quedaría pendiente en el
+// IRR), salvo que la celda venga del IRR: entonces el vector ya es suyo.
+static int smp_can_steal(int irq_num, int thief, int from_irr) {
+    irq_state_t state = ATOMIC_LOAD_RELAXED(&idt[irq_num].state);
+    return (ATOMIC_LOAD_RELAXED(&idt[irq_num].smp_affinity) & (1u << thief)) &&
+           (from_irr || (state != IRQ_STATE_EXECUTING && state != IRQ_STATE_MASKED));
+}
+
+// Desencolar la IRQ de la cabeza. thief < 0: la propia CPU; si no, la CPU
+// ladrona, que solo la reclama si smp_can_steal() lo permite.
+static int smp_queue_pop(sim_cpu_t *cpu, int thief, int *irq_num, uint64_t *raised_ns,
+                         int *from_irr) {
+    unsigned long pos = ATOMIC_LOAD_RELAXED(&cpu->dequeue_pos);
+    irq_queue_cell_t *cell;
+    
+    for (;;) {
+        cell = &cpu->cells[pos & (SMP_QUEUE_SIZE - 1)];
+        long diff = (long)ATOMIC_LOAD_ACQ(&cell->seq) - (long)(pos + 1);
+        if (diff == 0) {
+            *irq_num = __atomic_load_n(&cell->irq_num, __ATOMIC_RELAXED);
+            *raised_ns = __atomic_load_n(&cell->raised_ns, __ATOMIC_RELAXED);
+            *from_irr = __atomic_load_n(&cell->from_irr, __ATOMIC_RELAXED);
+            if (thief >= 0 && !smp_can_steal(*irq_num, thief, *from_irr)) {
+                return 0;
+            }
+            if (__atomic_compare_exchange_n(&cpu->dequeue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = ATOMIC_LOAD_RELAXED(&cpu->dequeue_pos);
+        }
+    }
+    
+    ATOMIC_STORE_REL(&cell->seq, pos + SMP_QUEUE_SIZE);
+    return 1;
+}
+
+// ¿Tiene la cola de la CPU alguna IRQ publicada sin atender?
+static int smp_queue_pending(sim_cpu_t *cpu) {
+    unsigned long pos = ATOMIC_LOAD_RELAXED(&cpu->dequeue_pos);
+    return ATOMIC_LOAD_ACQ(&cpu->cells[pos & (SMP_QUEUE_SIZE - 1)].seq) == pos + 1;
+}
+
+// Elegir CPU para una IRQ: round-robin dentro de su afinidad. Si la máscara
+// no contiene ninguna CPU en línea se usan todas.
+static int smp_select_cpu(int irq_num) {
+    unsigned int online = (smp_cpu_count >= 32) ? SMP_AFFINITY_ALL : (1u << smp_cpu_count) - 1;
+    unsigned int mask = ATOMIC_LOAD_RELAXED(&idt[irq_num].smp_affinity) & online;
+    if (mask == 0) {
+        mask = online;
+    }
+    
+    unsigned int start = ATOMIC_FETCH_ADD(&idt[irq_num].smp_next_cpu, 1u);
+    for (int i = 0; i < smp_cpu_count; i++) {
+        int cpu = (int)((start + (unsigned int)i) % (unsigned int)smp_cpu_count);
+        if (mask & (1u << cpu)) {
+            return cpu;
+        }
+    }
+    return 0;
+}
+
+// Despertar a la CPU solo si está dormida (sin syscalls en el caso común)
+static void smp_wake(sim_cpu_t *cpu) {
+    if (__atomic_load_n(&cpu->sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&cpu->mutex);
+        pthread_cond_signal(&cpu->cond);
+        pthread_mutex_unlock(&cpu->mutex);
+    }
+}
+
+// Tomar un evento pendiente de la cola de polling. Devuelve 0 si estaba vacía.
+static int napi_take(irq_meta_t *meta) {
+    unsigned long pending = __atomic_load_n(&meta->napi_pending, __ATOMIC_SEQ_CST);
+    while (pending != 0) {
+        if (__atomic_compare_exchange_n(&meta->napi_pending, &pending, pending - 1, 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// ¿Superan las llegadas de la ventana actual el umbral de napi_rate IRQs/s?
+static int napi_rate_exceeded(irq_meta_t *meta, unsigned int rate) {
+    uint64_t now = monotonic_ns();
+    uint64_t start = ATOMIC_LOAD_RELAXED(&meta->napi_window_start);
+    
+    if (now - start >= NAPI_RATE_WINDOW_NS &&
+        __atomic_compare_exchange_n(&meta->napi_window_start, &start, now, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&meta->napi_window_count, 0UL, __ATOMIC_RELAXED);
+    }
+    
+    unsigned long count = ATOMIC_FETCH_ADD(&meta->napi_window_count, 1UL) + 1;
+    unsigned long limit = (unsigned long)((uint64_t)rate * NAPI_RATE_WINDOW_NS / 1000000000ULL);
+    return count > (limit > 0 ? limit : 1);
+}
+
+// Atender un evento en el poll, sin el ciclo de despacho (trazas, IRR/ISR, EOI)
+static void napi_poll_one(int irq_num) {
+    irq_descriptor_t *desc = &idt[irq_num];
+    
+    if (desc->action_count > 0) {
+        if (irq_run_actions(&irq_meta[irq_num], irq_num, desc->action_count) == IRQ_NONE) {
+            irq_note_spurious(irq_num, desc->action_count);
+        }
+    } else if (desc->isr != NULL) {
+        desc->isr(irq_num);
+    } else if (desc->thread_fn != NULL &&
+               (desc->handler == NULL || desc->handler(irq_num) == IRQ_WAKE_THREAD)) {
+        desc->thread_fn(irq_num);
+    }
+}
+
+// Poll de NAPI (softirq): atiende hasta napi_budget eventos por pasada. Si
+// agota el budget cede la CPU y se reprograma; con la cola vacía reactiva las
+// interrupciones (napi_complete) y entrega lo que quedó en el IRR.
+static void napi_poll(int irq_num, void *data) {
+    irq_descriptor_t *desc = &idt[irq_num];
+    irq_meta_t *meta = &irq_meta[irq_num];
+    int is_timer_irq = (irq_num == IRQ_TIMER);
+    int budget = ATOMIC_LOAD_RELAXED(&meta->napi_budget);
+    (void)data;
+    
+    // Con la línea ENMASCARADA el poll es el único que toca el descriptor
+    for (;;) {
+        uint64_t start_ns = monotonic_ns();
+        int done = 0;
+        
+        while (done < budget && napi_take(meta)) {
+            napi_poll_one(irq_num);
+            done++;
+        }
+        
+        uint64_t elapsed_ns = monotonic_ns() - start_ns;
+        unsigned long elapsed_us = (unsigned long)(elapsed_ns / 1000);
+        if (done > 0) {
+            ATOMIC_FETCH_ADD(&desc->call_count, done);
+            ATOMIC_FETCH_ADD(&desc->total_execution_time, elapsed_us);
+            ATOMIC_FETCH_ADD(&meta->napi_polled, (unsigned long)done);
+            __atomic_store_n(&meta->last_call, time(NULL), __ATOMIC_RELAXED);
+            ATOMIC_FETCH_ADD(&stats.napi_polled, (unsigned long)done);
+            update_stats_batch(irq_num, (unsigned long)done, elapsed_ns);
+        }
+        meta->napi_episode_events += done;
+        meta->napi_episode_polls++;
+        ATOMIC_FETCH_ADD(&stats.napi_polls, 1UL);
+        
+        if (done == budget) {
+            ATOMIC_FETCH_ADD(&stats.napi_budget_exhausted, 1UL);
+            if (ATOMIC_LOAD_ACQ(&deferred_running)) {
+                tasklet_schedule(irq_num, napi_poll, NULL);
+                return;
+            }
+            continue;   // Sin ksoftirqd: seguir en línea
+        }
+        
+        // Cola vacía. Un evento que llegue tras el store lo ve este hilo o lo
+        // recupera su dispatch_interrupt() al ver napi_scheduled a 0.
+        __atomic_store_n(&desc->napi_scheduled, 0, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&meta->napi_pending, __ATOMIC_SEQ_CST) == 0) {
+            break;
+        }
+        __atomic_store_n(&desc->napi_scheduled, 1, __ATOMIC_SEQ_CST);
+    }
+    
+    ATOMIC_FETCH_ADD(&stats.napi_poll_exits, 1UL);
+    add_trace_event_smart(TRACE_EV_NAPI_POLL_OFF, irq_num, is_timer_irq, irq_num,
+                          (int)meta->napi_episode_events, (int)meta->napi_episode_polls);
+    meta->napi_episode_events = 0;
+    meta->napi_episode_polls = 0;
+    
+    pic_end_of_interrupt(irq_num);
+    pic_deliver_pending();
+}
+
+// Camino de despacho con NAPI. Devuelve 1 si el evento quedó en la cola de
+// polling, 0 si debe seguir el despacho normal.
+static int napi_dispatch(int irq_num) {
+    irq_descriptor_t *desc = &idt[irq_num];
+    irq_meta_t *meta = &irq_meta[irq_num];
+    unsigned int rate = ATOMIC_LOAD_RELAXED(&desc->napi_rate);
+    
+    if (rate == 0) {
+        return 0;
+    }
+    
+    // ✅ MODO POLLING: solo se cuenta el evento
+    if (__atomic_load_n(&desc->napi_scheduled, __ATOMIC_SEQ_CST)) {
+        __atomic_fetch_add(&meta->napi_pending, 1UL, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&desc->napi_scheduled, __ATOMIC_SEQ_CST)) {
+            return 1;
+        }
+        // El poll terminó entre tanto: si nadie se llevó el evento, va por interrupción
+        return !napi_take(meta);
+    }
+    
+    if (!napi_rate_exceeded(meta, rate)) {
+        return 0;
+    }
+    
+    // ✅ TASA SUPERADA: enmascarar la línea (REGISTRADO -> ENMASCARADO) y programar el poll
+    irq_state_t state = IRQ_STATE_REGISTERED;
+    if (!ATOMIC_CAS(&desc->state, &state, IRQ_STATE_MASKED)) {
+        return 0;   // Vector ocupado o libre: lo resuelve el despacho normal
+    }
+    __atomic_store_n(&desc->napi_scheduled, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&meta->napi_pending, 1UL, __ATOMIC_SEQ_CST);
+    ATOMIC_FETCH_ADD(&meta->napi_switches, 1UL);
+    ATOMIC_FETCH_ADD(&stats.napi_poll_entries, 1UL);
+    add_trace_event_smart(TRACE_EV_NAPI_POLL_ON, irq_num, irq_num == IRQ_TIMER, irq_num, (int)rate);
+    tasklet_schedule(irq_num, napi_poll, NULL);
+    return 1;
+}
+
+// Despacho de interrupciones: en modo SMP la IRQ se entrega a una CPU de su
+// afinidad; sin CPUs simuladas se atiende en el hilo que la dispara. Una
+// línea con NAPI en modo polling solo deja el evento en su cola.
+void dispatch_interrupt(int irq_num) {
+    dispatch_interrupt_at(irq_num, monotonic_ns());
+}
+
+// Despachar una IRQ que su dispositivo levantó en raised_ns (el motor de
+// tiempo virtual pasa el instante de la llegada, anterior al reloj actual)
+void dispatch_interrupt_at(int irq_num, uint64_t raised_ns) {
+    if (validate_irq_num(irq_num) != SUCCESS) {
+        add_trace_event_smart(TRACE_EV_IRQ_REJECTED, -1, 0, irq_num, MAX_INTERRUPTS - 1);
+        return;
+    }
+    
+    // irq_enter con el tick detenido: reanudarlo (tick_nohz_irq_enter)
+    if (irq_num != IRQ_TIMER && ATOMIC_LOAD_RELAXED(&timer_tickless)) {
+        __atomic_fetch_add(&nohz_activity, 1UL, __ATOMIC_SEQ_CST);
+        timer_kick();
+    }
+    
+    if (napi_dispatch(irq_num)) {
+        return;
+    }
+    
+    if (!ATOMIC_LOAD_ACQ(&smp_running)) {
+        handle_interrupt(irq_num, raised_ns);
+        return;
+    }
+    smp_enqueue_irq(irq_num, raised_ns, 0);
+}
+
+// Entregar una IRQ a una CPU de su afinidad. from_irr: viene del IRR con el
+// vector ya reservado. Devuelve 0 si la cola de la CPU estaba llena y la IRQ
+// se perdió.
+static int smp_enqueue_irq(int irq_num, uint64_t raised_ns, int from_irr) {
+    int cpu = smp_select_cpu(irq_num);
+    if (irq_num == IRQ_TIMER) {
+        __atomic_fetch_add(&nohz_timer_queued, 1UL, __ATOMIC_SEQ_CST);
+    }
+    if (!smp_queue_push(&sim_cpus[cpu], irq_num, raised_ns, from_irr)) {
+        if (irq_num == IRQ_TIMER) {
+            __atomic_fetch_sub(&nohz_timer_queued, 1UL, __ATOMIC_SEQ_CST);
+        }
+        ATOMIC_FETCH_ADD(&sim_cpus[cpu].queue_full, 1UL);
+        ATOMIC_FETCH_ADD(&stats.irq_lost, 1UL);
+        add_trace_event_smart(TRACE_EV_IRQ_QUEUE_FULL, irq_num, irq_num == IRQ_TIMER, irq_num, cpu);
+        return 0;
+    }
+    smp_wake(&sim_cpus[cpu]);
+    
+    // CPU destino ocupada: despertar a una CPU ociosa que pueda robar la IRQ
+    if (smp_work_stealing && ATOMIC_LOAD_ACQ(&sim_cpus[cpu].running_since_ns) != 0) {
+        for (int c = 0; c < smp_cpu_count; c++) {
+            if (c != cpu && smp_can_steal(irq_num, c, from_irr) &&
+                __atomic_load_n(&sim_cpus[c].sleeping, __ATOMIC_SEQ_CST)) {
+                smp_wake(&sim_cpus[c]);
+                break;
+            }
+        }
+    }
+    return 1;
+}
+
+// Entrada por vector, como la ve la CPU (un dispositivo MSI escribe su
+// vector en el APIC): vector_irq[] da la IRQ en O(1). Las excepciones, los
+// vectores del sistema y los libres no tienen IRQ y se ignoran como espurios.
+int dispatch_vector(int vector) {
+    return dispatch_vector_at(vector, monotonic_ns());
+}
+
+int dispatch_vector_at(int vector, uint64_t raised_ns) {
+    int irq_num = (vector >= 0 && vector < IDT_VECTORS) ? ATOMIC_LOAD_ACQ(&vector_irq[vector]) : -1;
+    
+    if (irq_num < 0) {
+        ATOMIC_FETCH_ADD(&stats.irq_spurious, 1UL);
+        add_trace_event_smart(TRACE_EV_VECTOR_UNASSIGNED, -1, 0, vector,
+                              trace_intern_string(idt_vector_name(vector)));
+        return vector >= 0 && vector < IDT_VECTORS ? ERROR_NO_ISR : ERROR_INVALID_IRQ;
+    }
+    dispatch_interrupt_at(irq_num, raised_ns);
+    return SUCCESS;
+}
+
+// Atender en la CPU una IRQ sacada de la cola de owner (ella misma o la víctima
+// de un robo). irq_count solo cuenta las que ejecutaron su handler, así que por
+// IRQ la suma de las CPUs coincide con call_count.
+static void smp_run_irq(sim_cpu_t *cpu, sim_cpu_t *owner, int irq_num, uint64_t raised_ns,
+                        int from_irr) {
+    uint64_t start_ns = monotonic_ns();
+    ATOMIC_STORE_REL(&cpu->running_since_ns, start_ns);
+    int ran = from_irr ? handle_pending_interrupt(irq_num, raised_ns)
+                       : handle_interrupt(irq_num, raised_ns);
+    uint64_t end_ns = monotonic_ns();
+    ATOMIC_STORE_REL(&cpu->running_since_ns, 0);
+    
+    // Contadores privados de la CPU: un único escritor, lectores relajados
+    if (ran) {
+        ATOMIC_FETCH_ADD(&cpu->irq_count[irq_num], 1UL);
+    }
+    ATOMIC_FETCH_ADD(&cpu->queue_wait_ns, start_ns - raised_ns);
+    ATOMIC_FETCH_ADD(&cpu->busy_ns, end_ns - start_ns);
+    ATOMIC_FETCH_ADD(&cpu->handled, 1UL);
+    __atomic_fetch_add(&owner->completed, 1UL, __ATOMIC_RELEASE);
+    if (irq_num == IRQ_TIMER) {
+        __atomic_fetch_sub(&nohz_timer_queued, 1UL, __ATOMIC_SEQ_CST);
+    }
+}
+
+// Robar la IRQ de la cabeza de alguna CPU ocupada en un handler. La espera
+// ahorrada se estima como lo que le falta a la víctima para terminar el
+// handler en curso, según su tiempo medio por IRQ.
+static int smp_try_steal(sim_cpu_t *thief) {
+    int irq_num, from_irr;
+    uint64_t raised_ns;
+    
+    for (int i = 1; i < smp_cpu_count; i++) {
+        sim_cpu_t *victim = &sim_cpus[(thief->id + i) % smp_cpu_count];
+        uint64_t victim_since = ATOMIC_LOAD_ACQ(&victim->running_since_ns);
+        if (victim_since == 0 || !smp_queue_pop(victim, thief->id, &irq_num, &raised_ns, &from_irr)) {
+            continue;
+        }
+        
+        uint64_t now = monotonic_ns();
+        unsigned long victim_handled = ATOMIC_LOAD_RELAXED(&victim->handled);
+        if (victim_handled > 0) {
+            uint64_t victim_end = victim_since + ATOMIC_LOAD_RELAXED(&victim->busy_ns) / victim_handled;
+            if (victim_end > now) {
+                ATOMIC_FETCH_ADD(&thief->steal_saved_ns, victim_end - now);
+            }
+        }
+        ATOMIC_FETCH_ADD(&thief->steals, 1UL);
+        add_trace_event_smart(TRACE_EV_IRQ_STOLEN, irq_num, irq_num == IRQ_TIMER,
+                              irq_num, victim->id);
+        smp_run_irq(thief, victim, irq_num, raised_ns, from_irr);
+        return 1;
+    }
+    return 0;
+}
+
+// Hilo de una CPU simulada: atiende su cola hasta que se detiene y queda vacía
+static void *smp_cpu_thread_func(void *arg) {
+    sim_cpu_t *cpu = arg;
+    char name[16];
+    int irq_num, from_irr;
+    uint64_t raised_ns;
+    
+    current_cpu = cpu->id;
+    snprintf(name, sizeof(name), "cpu%d", cpu->id);
+    trace_set_thread_name(name);
+    
+    for (;;) {
+        if (smp_queue_pop(cpu, -1, &irq_num, &raised_ns, &from_irr)) {
+            smp_run_irq(cpu, cpu, irq_num, raised_ns, from_irr);
+            continue;
+        }
+        if (smp_work_stealing && smp_try_steal(cpu)) {
+            continue;
+        }
+        if (!ATOMIC_LOAD_ACQ(&smp_running)) {
+            break;
+        }
+        
+        // Cola vacía: dormir hasta que llegue una IRQ (o como mucho 100ms)
+        pthread_mutex_lock(&cpu->mutex);
+        __atomic_store_n(&cpu->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (!smp_queue_pending(cpu) && ATOMIC_LOAD_ACQ(&smp_running)) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 100000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&cpu->cond, &cpu->mutex, &deadline);
+        }
+        __atomic_store_n(&cpu->sleeping, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&cpu->mutex);
+    }
+    return NULL;
+}
+
+// Arrancar cpu_count CPUs simuladas, opcionalmente con work stealing. Hasta
+// entonces (y con 0 CPUs) las IRQs se atienden en el hilo que las dispara.
+int smp_start(int cpu_count, int work_stealing) {
+    if (cpu_count <= 0) {
+        return SUCCESS;
+    }
+    if (cpu_count > MAX_SIM_CPUS) {
+        return ERROR_INVALID_IRQ;
+    }
+    
+    for (int c = 0; c < cpu_count; c++) {
+        sim_cpu_t *cpu = &sim_cpus[c];
+        memset(cpu, 0, sizeof(*cpu));
+        for (unsigned long i = 0; i < SMP_QUEUE_SIZE; i++) {
+            cpu->cells[i].seq = i;
+        }
+        cpu->id = c;
+        pthread_mutex_init(&cpu->mutex, NULL);
+        pthread_cond_init(&cpu->cond, NULL);
+    }
+    
+    smp_cpu_count = cpu_count;
+    smp_work_stealing = work_stealing;
+    ATOMIC_STORE_REL(&smp_running, 1);
+    for (int c = 0; c < cpu_count; c++) {
+        if (pthread_create(&sim_cpus[c].thread, NULL, smp_cpu_thread_func, &sim_cpus[c]) != 0) {
+            smp_cpu_count = c;
+            smp_stop();
+            return ERROR_TRACE_STORAGE;
+        }
+    }
+    
+    add_trace_event(TRACE_EV_SMP_STARTED, -1, cpu_count);
+    if (work_stealing) {
+        add_trace("🤝 KERNEL: Work stealing activo - CPUs ociosas atienden IRQs pendientes de CPUs ocupadas");
+    }
+    return SUCCESS;
+}
+
+// Detener las CPUs simuladas tras atender todo lo pendiente
+void smp_stop(void) {
+    if (!ATOMIC_LOAD_ACQ(&smp_running)) {
+        return;
+    }
+    ATOMIC_STORE_REL(&smp_running, 0);
+    for (int c = 0; c < smp_cpu_count; c++) {
+        pthread_mutex_lock(&sim_cpus[c].mutex);
+        pthread_cond_signal(&sim_cpus[c].cond);
+        pthread_mutex_unlock(&sim_cpus[c].mutex);
+        pthread_join(sim_cpus[c].thread, NULL);
+        pthread_mutex_destroy(&sim_cpus[c].mutex);
+        pthread_cond_destroy(&sim_cpus[c].cond);
+    }
+}
+
+// Esperar a que todas las CPUs hayan atendido lo encolado hasta ahora. Se usa
+// en el menú para que el resultado de un despacho se vea antes de continuar.
+void smp_wait_idle(void) {
+    if (!ATOMIC_LOAD_ACQ(&smp_running)) {
+        return;
+    }
+    // Una CPU puede entregar a otra ya revisada lo que quedó en el IRR: repetir
+    // la pasada hasta que ninguna tenga nada pendiente
+    int busy;
+    do {
+        busy = 0;
+        for (int c = 0; c < smp_cpu_count; c++) {
+            sim_cpu_t *cpu = &sim_cpus[c];
+            while (ATOMIC_LOAD_ACQ(&cpu->completed) < ATOMIC_LOAD_ACQ(&cpu->enqueue_pos) &&
+                   ATOMIC_LOAD_ACQ(&smp_running)) {
+                busy = 1;
+                smp_wake(cpu);
+                usleep(1000);
+            }
+        }
+    } while (busy && ATOMIC_LOAD_ACQ(&smp_running));
+}
+
+// Fijar la máscara smp_affinity de una IRQ (bit n = CPU n)
+int set_irq_affinity(int irq_num, unsigned int mask) {
+    if (validate_irq_num(irq_num) != SUCCESS || mask == 0) {
+        return ERROR_INVALID_IRQ;
+    }
+    if (smp_cpu_count > 0 && smp_cpu_count < 32 && (mask & ((1u << smp_cpu_count) - 1)) == 0) {
+        return ERROR_INVALID_IRQ;
+    }
+    char mask_text[16];
+    snprintf(mask_text, sizeof(mask_text), "%x", mask);
+    ATOMIC_STORE_REL(&idt[irq_num].smp_affinity, mask);
+    add_trace_event(TRACE_EV_IRQ_AFFINITY, irq_num, irq_num, trace_intern_string(mask_text));
+    return SUCCESS;
+}
+
+// Configurar NAPI en una IRQ: rate = IRQs/s a partir de las que pasa a polling
+// (0 = siempre por interrupción), budget = eventos por pasada (<= 0: por defecto)
+int set_irq_napi(int irq_num, unsigned int rate, int budget) {
+    if (validate_irq_num(irq_num) != SUCCESS) {
+        return ERROR_INVALID_IRQ;
+    }
+    if (budget <= 0) {
+        budget = NAPI_DEFAULT_BUDGET;
+    }
+    ATOMIC_STORE_REL(&irq_meta[irq_num].napi_budget, budget);
+    ATOMIC_STORE_REL(&idt[irq_num].napi_rate, rate);
+    if (rate > 0) {
+        add_trace_event(TRACE_EV_NAPI_CONFIG, irq_num, irq_num, (int)rate, budget);
+    }
+    return SUCCESS;
+}
+
+// Bottom halves. Cada CPU tiene una cola de softirqs/tasklets que se vacía por
+// lotes en irq_exit, justo después del EOI; si el lote o el presupuesto de
+// tiempo se agotan, el resto pasa al hilo ksoftirqd de esa CPU. El workqueue
+// es una cola compartida que atienden KWORKER_THREADS hilos kworker.
+
+// Cola de softirqs de la CPU simulada actual (0 fuera del modo SMP)
+static deferred_queue_t *softirq_this_queue(void) {
+    int cpu = current_cpu >= 0 ? current_cpu : 0;
+    return &softirq_queues[cpu < softirq_queue_count ? cpu : 0];
+}
+
+// Encolar un trabajo diferido. Devuelve 0 si la cola está llena.
+static int deferred_push(deferred_queue_t *q, int irq_num, deferred_fn_t fn, void *data) {
+    unsigned long pos = ATOMIC_LOAD_RELAXED(&q->enqueue_pos);
+    deferred_cell_t *cell;
+    
+    for (;;) {
+        cell = &q->cells[pos & (DEFERRED_QUEUE_SIZE - 1)];
+        long diff = (long)ATOMIC_LOAD_ACQ(&cell->seq) - (long)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = ATOMIC_LOAD_RELAXED(&q->enqueue_pos);
+        }
+    }
+    
+    cell->fn = fn;
+    cell->data = data;
+    cell->irq_num = irq_num;
+    ATOMIC_STORE_REL(&cell->seq, pos + 1);
+    return 1;
+}
+
+// Desencolar el siguiente trabajo. Devuelve 0 si la cola está vacía.
+static int deferred_pop(deferred_queue_t *q, deferred_cell_t *out) {
+    unsigned long pos = ATOMIC_LOAD_RELAXED(&q->dequeue_pos);
+    deferred_cell_t *cell;
+    
+    for (;;) {
+        cell = &q->cells[pos & (DEFERRED_QUEUE_SIZE - 1)];
+        long diff = (long)ATOMIC_LOAD_ACQ(&cell->seq) - (long)(pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->dequeue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = ATOMIC_LOAD_RELAXED(&q->dequeue_pos);
+        }
+    }
+    
+    *out = *cell;
+    ATOMIC_STORE_REL(&cell->seq, pos + DEFERRED_QUEUE_SIZE);
+    return 1;
+}
+
+static int deferred_pending(deferred_queue_t *q) {
+    unsigned long pos = ATOMIC_LOAD_RELAXED(&q->dequeue_pos);
+    return ATOMIC_LOAD_ACQ(&q->cells[pos & (DEFERRED_QUEUE_SIZE - 1)].seq) == pos + 1;
+}
+
+// Despertar a un hilo de la cola solo si hay alguno dormido
+static void deferred_wake(deferred_queue_t *q) {
+    if (__atomic_load_n(&q->sleeping, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&q->mutex);
+        pthread_cond_signal(&q->cond);
+        pthread_mutex_unlock(&q->mutex);
+    }
+}
+
+// Ejecutar un trabajo diferido acumulando su tiempo aparte del de hard IRQ
+static void deferred_exec(int irq_num, deferred_fn_t fn, void *data,
+                          unsigned long *count, unsigned long *time_us) {
+    uint64_t start_ns = monotonic_ns();
+    fn(irq_num, data);
+    ATOMIC_FETCH_ADD(time_us, (unsigned long)((monotonic_ns() - start_ns) / 1000));
+    ATOMIC_FETCH_ADD(count, 1UL);
+}
+
+// Ejecutar hasta SOFTIRQ_BATCH softirqs de la cola o hasta agotar el
+// presupuesto. Devuelve cuántos se ejecutaron.
+static int softirq_run_batch(deferred_queue_t *q, uint64_t budget_ns) {
+    uint64_t start_ns = monotonic_ns();
+    deferred_cell_t work;
+    int ran = 0;
+    
+    while (ran < SOFTIRQ_BATCH && monotonic_ns() - start_ns < budget_ns && deferred_pop(q, &work)) {
+        deferred_exec(work.irq_num, work.fn, work.data, &stats.softirq_items, &stats.softirq_time);
+        __atomic_fetch_add(&q->completed, 1UL, __ATOMIC_RELEASE);
+        ran++;
+    }
+    if (ran > 0) {
+        ATOMIC_FETCH_ADD(&stats.softirq_batches, 1UL);
+    }
+    return ran;
+}
+
+// irq_exit: vaciar los softirqs que dejó la ISR en esta CPU. Lo que no quepa
+// en un lote o en SOFTIRQ_BUDGET_NS lo termina ksoftirqd.
+static void softirq_irq_exit(void) {
+    if (softirq_queue_count == 0) {
+        return;
+    }
+    deferred_queue_t *q = softirq_this_queue();
+    if (!deferred_pending(q)) {
+        return;
+    }
+    softirq_run_batch(q, SOFTIRQ_BUDGET_NS);
+    if (deferred_pending(q)) {
+        int cpu = (int)(q - softirq_queues);
+        ATOMIC_FETCH_ADD(&q->handoffs, 1UL);
+        add_trace_event_smart(TRACE_EV_SOFTIRQ_HANDOFF, -1, 0, cpu, cpu);
+        deferred_wake(q);
+    }
+}
+
+// Programar un tasklet (softirq) para la CPU actual. Desde una ISR corre en
+// irq_exit; desde otro contexto se despierta directamente a ksoftirqd.
+int tasklet_schedule(int irq_num, deferred_fn_t fn, void *data) {
+    if (fn == NULL) {
+        return ERROR_NO_ISR;
+    }
+    if (!ATOMIC_LOAD_ACQ(&deferred_running)) {
+        deferred_exec(irq_num, fn, data, &stats.softirq_items, &stats.softirq_time);
+        return SUCCESS;
+    }
+    deferred_queue_t *q = softirq_this_queue();
+    if (!deferred_push(q, irq_num, fn, data)) {
+        ATOMIC_FETCH_ADD(&q->overflows, 1UL);
+        deferred_exec(irq_num, fn, data, &stats.softirq_items, &stats.softirq_time);
+        return SUCCESS;
+    }
+    if (!in_hardirq) {
+        deferred_wake(q);
+    }
+    return SUCCESS;
+}
+
+// Encolar un trabajo en el workqueue compartido (contexto de proceso: puede dormir)
+int queue_work(int irq_num, deferred_fn_t fn, void *data) {
+    if (fn == NULL) {
+        return ERROR_NO_ISR;
+    }
+    if (!ATOMIC_LOAD_ACQ(&deferred_running)) {
+        deferred_exec(irq_num, fn, data, &stats.work_items, &stats.work_time);
+        return SUCCESS;
+    }
+    if (!deferred_push(&workqueue, irq_num, fn, data)) {
+        ATOMIC_FETCH_ADD(&workqueue.overflows, 1UL);
+        deferred_exec(irq_num, fn, data, &stats.work_items, &stats.work_time);
+        return SUCCESS;
+    }
+    deferred_wake(&workqueue);
+    return SUCCESS;
+}
+
+// Dormir en la cola hasta que haya trabajo o se detenga el motor (como mucho 100ms)
+static void deferred_sleep(deferred_queue_t *q) {
+    pthread_mutex_lock(&q->mutex);
+    __atomic_fetch_add(&q->sleeping, 1, __ATOMIC_SEQ_CST);
+    if (!deferred_pending(q) && ATOMIC_LOAD_ACQ(&deferred_running)) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&q->cond, &q->mutex, &deadline);
+    }
+    __atomic_fetch_sub(&q->sleeping, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+// Hilo ksoftirqd/N: termina por lotes los softirqs que irq_exit no pudo atender
+static void *ksoftirqd_thread_func(void *arg) {
+    deferred_queue_t *q = arg;
+    int cpu = (int)(q - softirq_queues);
+    char name[16];
+    
+    if (smp_cpu_count > 0) {
+        current_cpu = cpu;
+    }
+    snprintf(name, sizeof(name), "ksoftirqd/%d", cpu);
+    trace_set_thread_name(name);
+    
+    for (;;) {
+        int ran = softirq_run_batch(q, UINT64_MAX);
+        if (ran > 0) {
+            ATOMIC_FETCH_ADD(&stats.ksoftirqd_items, (unsigned long)ran);
+            continue;
+        }
+        if (!ATOMIC_LOAD_ACQ(&deferred_running)) {
+            break;
+        }
+        deferred_sleep(q);
+    }
+    return NULL;
+}
+
+// Hilo kworker: ejecuta trabajos del workqueue de uno en uno
+static void *kworker_thread_func(void *arg) {
+    char name[16];
+    deferred_cell_t work;
+    
+    snprintf(name, sizeof(name), "kworker/u:%d", (int)(intptr_t)arg);
+    trace_set_thread_name(name);
+    
+    for (;;) {
+        if (deferred_pop(&workqueue, &work)) {
+            deferred_exec(work.irq_num, work.fn, work.data, &stats.work_items, &stats.work_time);
+            __atomic_fetch_add(&workqueue.completed, 1UL, __ATOMIC_RELEASE);
+            continue;
+        }
+        if (!ATOMIC_LOAD_ACQ(&deferred_running)) {
+            break;
+        }
+        deferred_sleep(&workqueue);
+    }
+    return NULL;
+}
+
+// Preparar una cola y arrancar thread_count hilos sobre ella
+static int deferred_queue_start(deferred_queue_t *q, int thread_count,
+                                void *(*thread_func)(void *), int per_queue_arg) {
+    memset(q, 0, sizeof(*q));
+    for (unsigned long i = 0; i < DEFERRED_QUEUE_SIZE; i++) {
+        q->cells[i].seq = i;
+    }
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    for (int t = 0; t < thread_count; t++) {
+        void *arg = per_queue_arg ? (void *)q : (void *)(intptr_t)t;
+        if (pthread_create(&q->threads[t], NULL, thread_func, arg) != 0) {
+            return ERROR_TRACE_STORAGE;
+        }
+        q->thread_count++;
+    }
+    return SUCCESS;
+}
+
+// Detener los hilos de una cola tras vaciarla
+static void deferred_queue_stop(deferred_queue_t *q) {
+    pthread_mutex_lock(&q->mutex);
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+    for (int t = 0; t < q->thread_count; t++) {
+        pthread_join(q->threads[t], NULL);
+    }
+    pthread_mutex_destroy(&q->mutex);
+    pthread_cond_destroy(&q->cond);
+}
+
+// Arrancar un ksoftirqd por CPU simulada (uno solo en modo UP) y los kworkers.
+// Hasta entonces los bottom halves se ejecutan en línea al programarlos.
+int deferred_start(int cpu_count) {
+    int queues = cpu_count > 0 ? cpu_count : 1;
+    int result = SUCCESS;
+    
+    ATOMIC_STORE_REL(&deferred_running, 1);
+    for (int c = 0; c < queues && result == SUCCESS; c++) {
+        result = deferred_queue_start(&softirq_queues[c], 1, ksoftirqd_thread_func, 1);
+        softirq_queue_count = c + 1;
+    }
+    if (result == SUCCESS) {
+        result = deferred_queue_start(&workqueue, KWORKER_THREADS, kworker_thread_func, 0);
+        workqueue_started = 1;
+    }
+    if (result != SUCCESS) {
+        deferred_stop();
+        return result;
+    }
+    
+    add_trace_event(TRACE_EV_DEFERRED_STARTED, -1, queues, KWORKER_THREADS);
+    return SUCCESS;
+}
+
+// Detener ksoftirqd y kworkers tras ejecutar todo lo pendiente
+void deferred_stop(void) {
+    if (!ATOMIC_LOAD_ACQ(&deferred_running)) {
+        return;
+    }
+    ATOMIC_STORE_REL(&deferred_running, 0);
+    for (int c = 0; c < softirq_queue_count; c++) {
+        deferred_queue_stop(&softirq_queues[c]);
+    }
+    if (workqueue_started) {
+        deferred_queue_stop(&workqueue);
+        workqueue_started = 0;
+    }
+    softirq_queue_count = 0;
+}
+
+// Esperar a que una cola termine lo encolado hasta ahora
+static void deferred_queue_wait(deferred_queue_t *q) {
+    unsigned long target = ATOMIC_LOAD_ACQ(&q->enqueue_pos);
+    while (ATOMIC_LOAD_ACQ(&q->completed) < target && ATOMIC_LOAD_ACQ(&deferred_running)) {
+        deferred_wake(q);
+        usleep(1000);
+    }
+}
+
+// Esperar a que terminen los bottom halves pendientes. Se usa en el menú
+// junto a smp_wait_idle() para no intercalar su salida con la siguiente acción.
+void deferred_wait_idle(void) {
+    if (!ATOMIC_LOAD_ACQ(&deferred_running)) {
+        return;
+    }
+    for (int c = 0; c < softirq_queue_count; c++) {
+        deferred_queue_wait(&softirq_queues[c]);
+    }
+    deferred_queue_wait(&workqueue);
+}
+
+
+
+// Enganchar un timer al principio de una ranura de la rueda
+static void wheel_link(soft_timer_t **head, soft_timer_t *timer) {
+    timer->next = *head;
+    if (timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+    *head = timer;
+    timer->pprev = head;
+}
+
+// Colocar un timer en el nivel que corresponde a su distancia al jiffy
+// actual (internal_add_timer). Las distancias de más de 32 bits se recortan.
+static void wheel_enqueue(timer_base_t *base, soft_timer_t *timer) {
+    uint64_t expires = timer->expires < base->clk ? base->clk : timer->expires;
+    uint64_t delta = expires - base->clk;
+    
+    if (delta > 0xFFFFFFFFULL) {
+        delta = 0xFFFFFFFFULL;
+        expires = base->clk + delta;
+    }
+    if (delta < (1ULL << TIMER_WHEEL_ROOT_BITS)) {
+        unsigned int slot = (unsigned int)(expires & ((1 << TIMER_WHEEL_ROOT_BITS) - 1));
+        timer->level = 0;
+        timer->slot = (uint16_t)slot;
+        wheel_link(&base->root[slot], timer);
+        base->root_bitmap[slot / 64] |= 1ULL << (slot % 64);
+        return;
+    }
+    for (int lvl = 0; lvl < TIMER_WHEEL_LEVELS - 1; lvl++) {
+        int shift = TIMER_WHEEL_ROOT_BITS + lvl * TIMER_WHEEL_LVL_BITS;
+        if (lvl == TIMER_WHEEL_LEVELS - 2 || delta < (1ULL << (shift + TIMER_WHEEL_LVL_BITS))) {
+            unsigned int slot = (unsigned int)((expires >> shift) & ((1 << TIMER_WHEEL_LVL_BITS) - 1));
+            timer->level = (uint8_t)(lvl + 1);
+            timer->slot = (uint16_t)slot;
+            wheel_link(&base->levels[lvl][slot], timer);
+            base->level_bitmap[lvl] |= 1ULL << slot;
+            return;
+        }
+    }
+}
+
+// Desenganchar un timer en O(1). Si era el último de su ranura se limpia su
+// bit de ocupación (no si ya estaba en la lista local de una pasada).
+static void wheel_unlink(timer_base_t *base, soft_timer_t *timer) {
+    soft_timer_t **pprev = timer->pprev;
+    
+    *pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+    if (*pprev != NULL) {
+        return;
+    }
+    if (timer->level == 0 && pprev == &base->root[timer->slot]) {
+        base->root_bitmap[timer->slot / 64] &= ~(1ULL << (timer->slot % 64));
+    } else if (timer->level > 0 && pprev == &base->levels[timer->level - 1][timer->slot]) {
+        base->level_bitmap[timer->level - 1] &= ~(1ULL << timer->slot);
+    }
+}
+
+// Bajar una ranura de un nivel superior: sus timers se recolocan según la
+// distancia que les queda (cascade)
+static void wheel_cascade(timer_base_t *base, int lvl, unsigned int slot) {
+    soft_timer_t *timer = base->levels[lvl][slot];
+    
+    base->levels[lvl][slot] = NULL;
+    base->level_bitmap[lvl] &= ~(1ULL << slot);
+    while (timer) {
+        soft_timer_t *next = timer->next;
+        wheel_enqueue(base, timer);
+        base->cascaded++;
+        timer = next;
+    }
+}
+
+static int wheel_empty(const timer_base_t *base) {
+    for (int w = 0; w < (1 << TIMER_WHEEL_ROOT_BITS) / 64; w++) {
+        if (base->root_bitmap[w]) {
+            return 0;
+        }
+    }
+    for (int lvl = 0; lvl < TIMER_WHEEL_LEVELS - 1; lvl++) {
+        if (base->level_bitmap[lvl]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Próximo jiffy con trabajo en la rueda (UINT64_MAX si está vacía). Si el
+// nivel 0 no tiene nada antes de dar la vuelta y hay timers en niveles
+// superiores, la vuelta (donde bajan en cascada) es el próximo punto a revisar.
+// Se llama con el lock de la base.
+static uint64_t wheel_next_expiry(const timer_base_t *base) {
+    const unsigned int root_size = 1 << TIMER_WHEEL_ROOT_BITS;
+    const unsigned int words = root_size / 64;
+    unsigned int index = (unsigned int)(base->clk & (root_size - 1));
+    uint64_t wrap = index == 0 ? base->clk : base->clk + (root_size - index);
+    uint64_t next = UINT64_MAX;
+    
+    // Búsqueda circular desde index, palabra a palabra del bitmap
+    for (unsigned int n = 0; n <= words; n++) {
+        unsigned int word = (index / 64 + n) % words;
+        uint64_t bits = base->root_bitmap[word];
+        if (n == 0) {
+            bits &= ~0ULL << (index % 64);
+        } else if (n == words) {
+            bits &= (index % 64) ? (1ULL << (index % 64)) - 1 : 0;
+        }
+        if (bits) {
+            unsigned int slot = word * 64 + (unsigned int)__builtin_ctzll(bits);
+            next = base->clk + ((slot - index) & (root_size - 1));
+            break;
+        }
+    }
+    for (int lvl = 0; lvl < TIMER_WHEEL_LEVELS - 1; lvl++) {
+        if (base->level_bitmap[lvl]) {
+            return wrap < next ? wrap : next;
+        }
+    }
+    return next;
+}
+
+// Armar o rearmar un timer de la rueda. Devuelve 1 si estaba armado.
+static int base_mod_timer(timer_base_t *base, soft_timer_t *timer, uint64_t expires) {
+    int was_pending;
+    
+    pthread_mutex_lock(&base->lock);
+    was_pending = timer->pprev != NULL;
+    if (was_pending) {
+        wheel_unlink(base, timer);
+    } else {
+        base->wheel_armed++;
+    }
+    timer->expires = expires;
+    wheel_enqueue(base, timer);
+    pthread_mutex_unlock(&base->lock);
+    return was_pending;
+}
+
+// Cancelar un timer de la rueda. Devuelve 1 si estaba armado.
+static int base_del_timer(timer_base_t *base, soft_timer_t *timer) {
+    int was_pending;
+    
+    pthread_mutex_lock(&base->lock);
+    was_pending = timer->pprev != NULL;
+    if (was_pending) {
+        wheel_unlink(base, timer);
+        base->wheel_armed--;
+    }
+    pthread_mutex_unlock(&base->lock);
+    return was_pending;
+}
+
+// Procesar la rueda hasta el jiffy target inclusive (__run_timers). Cada
+// ranura vencida pasa a una lista local y sus callbacks se ejecutan sin el
+// lock, así que pueden rearmar o cancelar timers. Devuelve los caducados.
+static unsigned long wheel_run(timer_base_t *base, uint64_t target) {
+    const unsigned int root_size = 1 << TIMER_WHEEL_ROOT_BITS;
+    unsigned long expired = 0;
+    
+    pthread_mutex_lock(&base->lock);
+    while (base->clk <= target) {
+        // Rueda vacía: saltar directamente (tras un periodo tickless largo)
+        if (wheel_empty(base)) {
+            base->clk = target + 1;
+            break;
+        }
+        
+        unsigned int index = (unsigned int)(base->clk & (root_size - 1));
+        if (index == 0) {
+            for (int lvl = 0; lvl < TIMER_WHEEL_LEVELS - 1; lvl++) {
+                int shift = TIMER_WHEEL_ROOT_BITS + lvl * TIMER_WHEEL_LVL_BITS;
+                unsigned int slot = (unsigned int)((base->clk >> shift) & ((1 << TIMER_WHEEL_LVL_BITS) - 1));
+                wheel_cascade(base, lvl, slot);
+                if (slot != 0) {
+                    break;
+                }
+            }
+        }
+        
+        soft_timer_t *pending = base->root[index];
+        base->root[index] = NULL;
+        base->root_bitmap[index / 64] &= ~(1ULL << (index % 64));
+        if (pending) {
+            pending->pprev = &pending;
+        }
+        base->clk++;
+        
+        while (pending) {
+            soft_timer_t *timer = pending;
+            soft_timer_fn_t fn = timer->fn;
+            void *data = timer->data;
+            
+            wheel_unlink(base, timer);
+            base->wheel_armed--;
+            pthread_mutex_unlock(&base->lock);
+            fn(data);
+            pthread_mutex_lock(&base->lock);
+            expired++;
+        }
+    }
+    pthread_mutex_unlock(&base->lock);
+    return expired;
+}
+
+static void hrtimer_heap_place(timer_base_t *base, hrtimer_t *timer, unsigned long index) {
+    base->heap[index] = timer;
+    timer->heap_index = (long)index;
+}
+
+static void hrtimer_sift_up(timer_base_t *base, unsigned long index) {
+    hrtimer_t *timer = base->heap[index];
+    
+    while (index > 0) {
+        unsigned long parent = (index - 1) / 2;
+        if (base->heap[parent]->expires <= timer->expires) {
+            break;
+        }
+        hrtimer_heap_place(base, base->heap[parent], index);
+        index = parent;
+    }
+    hrtimer_heap_place(base, timer, index);
+}
+
+static void hrtimer_sift_down(timer_base_t *base, unsigned long index) {
+    hrtimer_t *timer = base->heap[index];
+    
+    while (1) {
+        unsigned long child = 2 * index + 1;
+        if (child >= base->heap_count) {
+            break;
+        }
+        if (child + 1 < base->heap_count &&
+            base->heap[child + 1]->expires < base->heap[child]->expires) {
+            child++;
+        }
+        if (timer->expires <= base->heap[child]->expires) {
+            break;
+        }
+        hrtimer_heap_place(base, base->heap[child], index);
+        index = child;
+    }
+    hrtimer_heap_place(base, timer, index);
+}
+
+// Quitar un hrtimer del heap en O(log n): el último ocupa su hueco
+static void hrtimer_heap_remove(timer_base_t *base, hrtimer_t *timer) {
+    unsigned long index = (unsigned long)timer->heap_index;
+    hrtimer_t *last = base->heap[--base->heap_count];
+    
+    timer->heap_index = -1;
+    if (last != timer) {
+        hrtimer_heap_place(base, last, index);
+        hrtimer_sift_up(base, index);
+        hrtimer_sift_down(base, (unsigned long)last->heap_index);
+    }
+}
+
+static int base_hrtimer_start(timer_base_t *base, hrtimer_t *timer, uint64_t expires_ns) {
+    pthread_mutex_lock(&base->lock);
+    if (timer->heap_index >= 0) {
+        hrtimer_heap_remove(base, timer);
+    }
+    if (base->heap_count == base->heap_capacity) {
+        unsigned long capacity = base->heap_capacity ? base->heap_capacity * 2 : HRTIMER_HEAP_INITIAL;
+        hrtimer_t **heap = realloc(base->heap, capacity * sizeof(*heap));
+        if (!heap) {
+            pthread_mutex_unlock(&base->lock);
+            return ERROR_TRACE_STORAGE;
+        }
+        base->heap = heap;
+        base->heap_capacity = capacity;
+    }
+    timer->expires = expires_ns;
+    hrtimer_heap_place(base, timer, base->heap_count++);
+    hrtimer_sift_up(base, base->heap_count - 1);
+    pthread_mutex_unlock(&base->lock);
+    return SUCCESS;
+}
+
+static int base_hrtimer_cancel(timer_base_t *base, hrtimer_t *timer) {
+    int was_active;
+    
+    pthread_mutex_lock(&base->lock);
+    was_active = timer->heap_index >= 0;
+    if (was_active) {
+        hrtimer_heap_remove(base, timer);
+    }
+    pthread_mutex_unlock(&base->lock);
+    return was_active;
+}
+
+// Caducar los hrtimers vencidos en now (hrtimer_run_queues). Devuelve los
+// caducados y en max_late el mayor retraso respecto a su instante.
+static unsigned long hrtimer_run(timer_base_t *base, uint64_t now, uint64_t *max_late) {
+    unsigned long expired = 0;
+    
+    pthread_mutex_lock(&base->lock);
+    while (base->heap_count > 0 && base->heap[0]->expires <= now) {
+        hrtimer_t *timer = base->heap[0];
+        soft_timer_fn_t fn = timer->fn;
+        void *data = timer->data;
+        
+        if (now - timer->expires > *max_late) {
+            *max_late = now - timer->expires;
+        }
+        hrtimer_heap_remove(base, timer);
+        pthread_mutex_unlock(&base->lock);
+        fn(data);
+        pthread_mutex_lock(&base->lock);
+        expired++;
+    }
+    pthread_mutex_unlock(&base->lock);
+    return expired;
+}
+
+// Leer el par jiffies/stamp sin lock (lado lector del seqcount)
+static void jiffies_read(uint64_t *j, uint64_t *stamp) {
+    unsigned long seq;
+    
+    do {
+        seq = __atomic_load_n(&jiffies_seq, __ATOMIC_SEQ_CST);
+        *j = __atomic_load_n(&jiffies, __ATOMIC_SEQ_CST);
+        *stamp = __atomic_load_n(&jiffies_stamp_ns, __ATOMIC_SEQ_CST);
+    } while ((seq & 1) || seq != __atomic_load_n(&jiffies_seq, __ATOMIC_SEQ_CST));
+}
+
+// Fijar el par jiffies/stamp (solo el hilo del timer)
+static void jiffies_write(uint64_t j, uint64_t stamp) {
+    __atomic_fetch_add(&jiffies_seq, 1UL, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&jiffies, j, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&jiffies_stamp_ns, stamp, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&jiffies_seq, 1UL, __ATOMIC_SEQ_CST);
+}
+
+// Jiffy actual: lo último que fijó el hilo del timer más los periodos
+// enteros transcurridos desde entonces (el tick puede estar detenido)
+uint64_t timer_jiffies(void) {
+    uint64_t j, stamp;
+    uint64_t now = monotonic_ns();
+    
+    jiffies_read(&j, &stamp);
+    return now > stamp ? j + (now - stamp) / timer_period_ns() : j;
+}
+
+// Avanzar jiffies hasta now (tick_do_update_jiffies64). Solo lo llama el
+// hilo del timer antes de disparar IRQ0 y al cambiar de periodo.
+static void tick_do_update_jiffies(uint64_t now, uint64_t period) {
+    uint64_t j, stamp;
+    
+    jiffies_read(&j, &stamp);
+    if (now < stamp + period) {
+        return;
+    }
+    uint64_t ticks = (now - stamp) / period;
+    jiffies_write(j + ticks, stamp + ticks * period);
+}
+
+// Instante en que empieza el jiffy j (para programar el timer one-shot)
+static uint64_t jiffies_to_ns(uint64_t j) {
+    uint64_t now_j, stamp;
+    uint64_t period = timer_period_ns();
+    
+    jiffies_read(&now_j, &stamp);
+    
+    if (j <= now_j) {
+        return stamp;
+    }
+    if (j - now_j > (UINT64_MAX - stamp) / period) {
+        return UINT64_MAX - 1;
+    }
+    return stamp + (j - now_j) * period;
+}
+
+// En modo tickless, reprogramar el timer one-shot al próximo timer armado
+static void timer_reprogram(void) {
+    uint64_t next_ns = UINT64_MAX;
+    uint64_t next_jiffy;
+    
+    pthread_mutex_lock(&timer_base.lock);
+    next_jiffy = wheel_next_expiry(&timer_base);
+    if (timer_base.heap_count > 0) {
+        next_ns = timer_base.heap[0]->expires;
+    }
+    pthread_mutex_unlock(&timer_base.lock);
+    
+    if (next_jiffy != UINT64_MAX && jiffies_to_ns(next_jiffy) < next_ns) {
+        next_ns = jiffies_to_ns(next_jiffy);
+    }
+    if (next_ns != UINT64_MAX) {
+        timer_program_event(next_ns);
+    }
+}
+
+void timer_setup(soft_timer_t *timer, soft_timer_fn_t fn, void *data) {
+    memset(timer, 0, sizeof(*timer));
+    timer->fn = fn;
+    timer->data = data;
+}
+
+// Armar (o rearmar) un timer para el jiffy expires. Devuelve 1 si ya estaba armado.
+int mod_timer(soft_timer_t *timer, uint64_t expires) {
+    int was_pending = base_mod_timer(&timer_base, timer, expires);
+    
+    if (ATOMIC_LOAD_RELAXED(&timer_tickless)) {
+        timer_program_event(jiffies_to_ns(expires));
+    }
+    return was_pending;
+}
+
+// Cancelar un timer. Devuelve 1 si estaba armado (0 si ya caducó o nunca se armó).
+int del_timer(soft_timer_t *timer) {
+    return base_del_timer(&timer_base, timer);
+}
+
+void hrtimer_setup(hrtimer_t *timer, soft_timer_fn_t fn, void *data) {
+    memset(timer, 0, sizeof(*timer));
+    timer->fn = fn;
+    timer->data = data;
+    timer->heap_index = -1;
+}
+
+// Armar (o rearmar) un hrtimer para el instante expires_ns de CLOCK_MONOTONIC
+int hrtimer_start(hrtimer_t *timer, uint64_t expires_ns) {
+    int result = base_hrtimer_start(&timer_base, timer, expires_ns);
+    
+    if (result == SUCCESS && ATOMIC_LOAD_RELAXED(&timer_tickless)) {
+        timer_program_event(expires_ns);
+    }
+    return result;
+}
+
+int hrtimer_cancel(hrtimer_t *timer) {
+    return base_hrtimer_cancel(&timer_base, timer);
+}
+
+// Caducar los hrtimers vencidos (hrtimer_interrupt, en la propia IRQ0)
+static void run_hrtimers(int irq_num) {
+    uint64_t start_ns = monotonic_ns();
+    uint64_t max_late = 0;
+    unsigned long expired = hrtimer_run(&timer_base, start_ns, &max_late);
+    
+    ATOMIC_FETCH_ADD(&stats.timer_expiry_runs, 1UL);
+    ATOMIC_FETCH_ADD(&stats.timer_expiry_ns, monotonic_ns() - start_ns);
+    if (expired > 0) {
+        ATOMIC_FETCH_ADD(&stats.hrtimers_expired, expired);
+        add_trace_event_smart(TRACE_EV_HRTIMERS_EXPIRED, irq_num, 1, (int)expired, (int)(max_late / 1000));
+    }
+}
+
+// Caducar la rueda hasta el jiffy actual (run_timer_softirq)
+static void run_timers(int irq_num) {
+    uint64_t start_ns = monotonic_ns();
+    uint64_t now_jiffy = timer_jiffies();
+    unsigned long expired = wheel_run(&timer_base, now_jiffy);
+    
+    ATOMIC_FETCH_ADD(&stats.timer_expiry_runs, 1UL);
+    ATOMIC_FETCH_ADD(&stats.timer_expiry_ns, monotonic_ns() - start_ns);
+    if (expired > 0) {
+        ATOMIC_FETCH_ADD(&stats.soft_timers_expired, expired);
+        add_trace_event_smart(TRACE_EV_TIMERS_EXPIRED, irq_num, 1, (int)expired, (int)now_jiffy);
+    }
+    if (ATOMIC_LOAD_RELAXED(&timer_tickless)) {
+        timer_reprogram();
+    }
+}
+
+// Timers de prueba (opción 7 del submenú de logging): cada uno arma un timer
+// de la rueda y un hrtimer que caducan al azar en los próximos 5 s
+static soft_timer_t *test_timers = NULL;
+static hrtimer_t *test_hrtimers = NULL;
+static int test_timer_count = 0;
+static unsigned long test_timers_fired = 0;
+
+static void test_timer_fn(void *data) {
+    (void)data;
+    ATOMIC_FETCH_ADD(&test_timers_fired, 1UL);
+}
+
+int arm_test_timers(int count) {
+    if (count > test_timer_count) {
+        soft_timer_t *timers = calloc((size_t)count, sizeof(*timers));
+        hrtimer_t *hrtimers = calloc((size_t)count, sizeof(*hrtimers));
+        if (!timers || !hrtimers) {
+            free(timers);
+            free(hrtimers);
+            return ERROR_TRACE_STORAGE;
+        }
+        for (int i = 0; i < test_timer_count; i++) {
+            del_timer(&test_timers[i]);
+            hrtimer_cancel(&test_hrtimers[i]);
+        }
+        free(test_timers);
+        free(test_hrtimers);
+        for (int i = 0; i < count; i++) {
+            timer_setup(&timers[i], test_timer_fn, NULL);
+            hrtimer_setup(&hrtimers[i], test_timer_fn, NULL);
+        }
+        test_timers = timers;
+        test_hrtimers = hrtimers;
+        test_timer_count = count;
+    }
+    
+    const uint64_t span_ns = 5000000000ULL;
+    uint64_t span_jiffies = span_ns / timer_period_ns();
+    if (span_jiffies == 0) {
+        span_jiffies = 1;
+    }
+    for (int i = 0; i < count; i++) {
+        mod_timer(&test_timers[i], timer_jiffies() + 1 + (uint64_t)rand() % span_jiffies);
+        if (hrtimer_start(&test_hrtimers[i], monotonic_ns() + (uint64_t)rand() % span_ns) != SUCCESS) {
+            return ERROR_TRACE_STORAGE;
+        }
+    }
+    return SUCCESS;
+}
+
+// Bottom half del timer (softirq): timers de la rueda y verificación de quantum
+static void timer_softirq(int irq_num, void *data) {
+    (void)data;
+    run_timers(irq_num);
+    add_trace_event_smart(TRACE_EV_TIMER_QUANTUM, irq_num, 1);
+    
+    // Con HZ altos la simulación del scheduler no puede ocupar todo el periodo
+    uint64_t delay_us = timer_period_ns() / 4000;
+    sim_delay_us(delay_us < ISR_SIMULATION_DELAY_US ? (unsigned long)delay_us : ISR_SIMULATION_DELAY_US);
+    
+    add_trace_event_smart(TRACE_EV_TIMER_DONE, irq_num, 1);
+}
+
+// ISR del Timer del Sistema (IRQ 0)
+// La top half cuenta el tick y caduca los hrtimers; la rueda y el scheduler
+// corren en el softirq
+void timer_isr(int irq_num) {
+    timer_counter++;
+    
+    add_trace_event_smart(TRACE_EV_TIMER_TICK, irq_num, 1, timer_counter);
+    run_hrtimers(irq_num);
+    tasklet_schedule(irq_num, timer_softirq, NULL);
+}
+
+// Bottom half del teclado (tasklet)
+static void keyboard_tasklet(int irq_num, void *data) {
+    (void)data;
+    add_trace_event(TRACE_EV_KBD_KEYCODE, irq_num);
+    add_trace_event(TRACE_EV_KBD_EVENT, irq_num);
+    
+    sim_delay_us(KEYBOARD_DELAY_US);
+}
+
+// ISR del Teclado (IRQ 1)
+// La top half lee el scancode; la traducción y el evento van en un tasklet
+void keyboard_isr(int irq_num) {
+    add_trace_event(TRACE_EV_KBD_SCANCODE, irq_num);
+    tasklet_schedule(irq_num, keyboard_tasklet, NULL);
+}
+
+// Bottom half del dispositivo personalizado (workqueue)
+static void custom_work(int irq_num, void *data) {
+    (void)data;
+    add_trace_event(TRACE_EV_CUSTOM_DATA, irq_num);
+    
+    sim_delay_us(CUSTOM_DELAY_US);
+    
+    add_trace_event(TRACE_EV_CUSTOM_DONE, irq_num);
 }
 
 // ISR personalizada de ejemplo
+// La top half reconoce la interrupción; el intercambio de datos (que puede
+// dormir) va al workqueue
 void custom_isr(int irq_num) {
-    char trace_msg[MAX_TRACE_MSG_LEN];
-    
-    snprintf(trace_msg, sizeof(trace_msg), 
-        "    🔧 CUSTOM_ISR: Procesando interrupción de dispositivo personalizado");
-    add_trace_with_irq(trace_msg, irq_num);
+    add_trace_event(TRACE_EV_CUSTOM_BEGIN, irq_num);
+    queue_work(irq_num, custom_work, NULL);
+}
+
+// Handler primario del dispositivo personalizado en modo --threaded-irqs:
+// solo reconoce la interrupción y pide su hilo irq/N
+irqreturn_t custom_primary_handler(int irq_num) {
+    add_trace_event(TRACE_EV_CUSTOM_BEGIN, irq_num);
+    return IRQ_WAKE_THREAD;
+}
+
+// Parte lenta del dispositivo personalizado, en el hilo irq/N con la línea
+// enmascarada (puede dormir)
+irqreturn_t custom_thread_fn(int irq_num) {
+    add_trace_event(TRACE_EV_CUSTOM_DATA, irq_num);
     
-    snprintf(trace_msg, sizeof(trace_msg), 
-        "    💾 DEVICE_DRIVER: Intercambiando datos con hardware específico");
-    add_trace_with_irq(trace_msg, irq_num);
+    sim_delay_us(CUSTOM_DELAY_US);
     
-    snprintf(trace_msg, sizeof(trace_msg), 
-        "    ✅ CUSTOM_ISR: Operación completada - Hardware listo para nuevas operaciones");
-    add_trace_with_irq(trace_msg, irq_num);
+    add_trace_event(TRACE_EV_CUSTOM_DONE, irq_num);
+    return IRQ_HANDLED;
+}
+
+// Registrar el handler de un dispositivo de prueba: ISR con workqueue o,
+// con --threaded-irqs, handler primario + hilo irq/N. En tiempo virtual
+// siempre la ISR síncrona: solo el bucle de eventos puede avanzar el reloj
+// virtual, y un hilo irq/N lo haría desde fuera en sim_delay_us().
+static int register_device_isr(int irq_num, const char *description) {
+    if (sim_options.threaded_irqs && !sim_virtual_time) {
+        return register_threaded_isr(irq_num, custom_primary_handler, custom_thread_fn, description);
+    }
+    return register_isr(irq_num, custom_isr, description);
+}
+
+// Dispositivo de demostración en una línea compartida (--shared-irq)
+typedef struct {
+    int index;                           // Posición en su línea
+    int description_id;
+} shared_demo_dev_t;
+
+static shared_demo_dev_t shared_demo_devs[MAX_INTERRUPTS][MAX_SHARED_HANDLERS];
+
+// El evento e de una línea con N dispositivos lo levantó el dispositivo
+// e % (N + 1); con e % (N + 1) == N no fue ninguno (ruido en la línea) y la
+// interrupción acaba como espuria
+static irqreturn_t shared_demo_handler(int irq_num, void *dev_id) {
+    shared_demo_dev_t *dev = dev_id;
+    int count = idt[irq_num].action_count;
+    int event = ATOMIC_LOAD_RELAXED(&idt[irq_num].call_count);
     
-    usleep(CUSTOM_DELAY_US);
+    if (event % (count + 1) != dev->index) {
+        return IRQ_NONE;
+    }
+    add_trace_event(TRACE_EV_SHARED_HANDLED, irq_num, dev->description_id, irq_num);
+    sim_delay_us(CUSTOM_DELAY_US / 10);
+    return IRQ_HANDLED;
+}
+
+// Registrar count dispositivos de demostración en la misma línea
+static int register_shared_demo(int irq_num, int count) {
+    for (int i = 0; i < count; i++) {
+        shared_demo_dev_t *dev = &shared_demo_devs[irq_num][i];
+        char description[MAX_DESCRIPTION_LEN];
+        
+        snprintf(description, sizeof(description), "dev%d.%d", irq_num, i);
+        dev->index = i;
+        dev->description_id = trace_intern_string(description);
+        int result = request_shared_irq(irq_num, shared_demo_handler, dev, description);
+        if (result != SUCCESS) {
+            return result;
+        }
+    }
+    return SUCCESS;
+}
+
+// ISR de una cola del dispositivo MSI-X de demostración (--msix): cada cola
+// tiene su propio vector, así que la ISR sabe qué cola fue sin leer el
+// dispositivo y nunca hay una cadena que recorrer
+void msix_queue_isr(int irq_num) {
+    add_trace_event(TRACE_EV_MSIX_QUEUE, irq_num, irq_num, ATOMIC_LOAD_RELAXED(&irq_meta[irq_num].vector));
+    sim_delay_us(CUSTOM_DELAY_US / 10);
+}
+
+// IRQs del dispositivo MSI-X de demostración
+static int msix_demo_irqs[MAX_MSIX_VECTORS];
+
+static int register_msix_demo(int count) {
+    return msix_alloc_vectors("nic0", count, msix_queue_isr, msix_demo_irqs);
 }
 
 // ISR de error
 void error_isr(int irq_num) {
-    char trace_msg[MAX_TRACE_MSG_LEN];
-    snprintf(trace_msg, sizeof(trace_msg), "    ERROR ISR: Manejando error en IRQ %d", irq_num);
-    add_trace_with_irq(trace_msg, irq_num);
+    add_trace_event(TRACE_EV_ERROR_ISR, irq_num, irq_num);
+    
+    sim_delay_us(50000); // 50ms
+}
+
+// Frecuencia del tick. hz = 0 vuelve al periodo de TIMER_INTERVAL_SEC
+// segundos. Se puede cambiar en marcha: se aplica desde el siguiente tick.
+int timer_set_hz(int hz) {
+    if (hz < 0 || hz > TIMER_MAX_HZ) {
+        return ERROR_INVALID_IRQ;
+    }
+    uint64_t period = hz > 0 ? 1000000000ULL / (uint64_t)hz : TIMER_INTERVAL_SEC * 1000000000ULL;
+    ATOMIC_STORE_REL(&timer_hz, hz);
+    ATOMIC_STORE_REL(&timer_period, period);
+    add_trace_event_smart(TRACE_EV_TIMER_CONFIG, -1, 1, (int)(period / 1000), hz);
+    return SUCCESS;
+}
+
+int timer_get_hz(void) {
+    return ATOMIC_LOAD_ACQ(&timer_hz);
+}
+
+uint64_t timer_period_ns(void) {
+    return ATOMIC_LOAD_ACQ(&timer_period);
+}
+
+// Activar o desactivar el modo tickless. Se puede cambiar en marcha.
+void timer_set_tickless(int enabled) {
+    ATOMIC_STORE_REL(&timer_tickless, enabled ? 1 : 0);
+    timer_kick();
+}
+
+// Programar un evento one-shot del timer (como clockevents_program_event):
+// el dispositivo guarda solo el más temprano y, con el tick detenido,
+// despierta para disparar IRQ0 en ese instante
+int timer_program_event(uint64_t expires_ns) {
+    uint64_t next = ATOMIC_LOAD_ACQ(&timer_next_event);
+    
+    while (expires_ns < next) {
+        if (__atomic_compare_exchange_n(&timer_next_event, &next, expires_ns, 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            timer_kick();
+            return SUCCESS;
+        }
+    }
+    return SUCCESS;
+}
+
+// Despertar al hilo del timer si tiene el tick detenido
+void timer_kick(void) {
+    if (__atomic_load_n(&timer_idle, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&timer_mutex);
+        pthread_cond_signal(&timer_cond);
+        pthread_mutex_unlock(&timer_mutex);
+    }
+}
+
+// Registrar el retraso de un tick respecto a su deadline (solo lo escribe el hilo del timer)
+static void timer_account_tick(uint64_t lateness_ns) {
+    ATOMIC_FETCH_ADD(&stats.timer_ticks, 1UL);
+    __atomic_store_n(&stats.timer_lateness_last_ns, lateness_ns, __ATOMIC_RELAXED);
+    ATOMIC_FETCH_ADD(&stats.timer_lateness_total_ns, lateness_ns);
+    if (lateness_ns > ATOMIC_LOAD_RELAXED(&stats.timer_lateness_max_ns)) {
+        __atomic_store_n(&stats.timer_lateness_max_ns, lateness_ns, __ATOMIC_RELAXED);
+    }
+}
+
+// CPU consumida por el hilo actual (CLOCK_THREAD_CPUTIME_ID)
+static uint64_t thread_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// ¿Queda trabajo en vuelo? IRQs en el IRR/ISR o en colas de CPU, vectores
+// ejecutándose o enmascarados y bottom halves pendientes impiden parar el tick
+static int nohz_system_busy(void) {
+    for (int w = 0; w < IRQ_BITMAP_WORDS; w++) {
+        if (__atomic_load_n(&pic_irr[w], __ATOMIC_ACQUIRE) || __atomic_load_n(&pic_isr[w], __ATOMIC_ACQUIRE)) {
+            return 1;
+        }
+    }
+    for (int c = 0; c < smp_cpu_count; c++) {
+        if (ATOMIC_LOAD_ACQ(&sim_cpus[c].completed) < ATOMIC_LOAD_ACQ(&sim_cpus[c].enqueue_pos)) {
+            return 1;
+        }
+    }
+    for (int q = 0; q < softirq_queue_count; q++) {
+        if (ATOMIC_LOAD_ACQ(&softirq_queues[q].completed) <
+            ATOMIC_LOAD_ACQ(&softirq_queues[q].enqueue_pos)) {
+            return 1;
+        }
+    }
+    if (workqueue_started &&
+        ATOMIC_LOAD_ACQ(&workqueue.completed) < ATOMIC_LOAD_ACQ(&workqueue.enqueue_pos)) {
+        return 1;
+    }
+    for_each_active_irq(i) {
+        irq_state_t state = ATOMIC_LOAD_ACQ(&idt[i].state);
+        if (state == IRQ_STATE_EXECUTING || state == IRQ_STATE_MASKED) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// En modo SMP el tick recién disparado solo se ha encolado: esperar (como
+// mucho hasta until) a que alguna CPU lo atienda, con sus bottom halves, para
+// que nohz_system_busy() no tome el propio tick por trabajo en vuelo.
+// Devuelve 0 si el tick sigue en vuelo al vencer el plazo.
+static int nohz_wait_timer_tick(uint64_t until) {
+    while (ATOMIC_LOAD_ACQ(&smp_running)) {
+        irq_state_t state = ATOMIC_LOAD_ACQ(&idt[IRQ_TIMER].state);
+        uint64_t pending = __atomic_load_n(&pic_irr[IRQ_WORD(IRQ_TIMER)], __ATOMIC_SEQ_CST) |
+                           __atomic_load_n(&pic_isr[IRQ_WORD(IRQ_TIMER)], __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&nohz_timer_queued, __ATOMIC_SEQ_CST) == 0 &&
+            !(pending & IRQ_BIT(IRQ_TIMER)) && state != IRQ_STATE_EXECUTING) {
+            return 1;
+        }
+        if (monotonic_ns() >= until || !system_running) {
+            return 0;
+        }
+        usleep(50);
+    }
+    return 1;
+}
+
+// Disparar el evento one-shot programado si ya venció (tick detenido)
+static void nohz_fire_event(uint64_t now) {
+    uint64_t next = ATOMIC_LOAD_ACQ(&timer_next_event);
     
-    usleep(50000); // 50ms
+    if (next > now ||
+        !__atomic_compare_exchange_n(&timer_next_event, &next, UINT64_MAX, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+    ATOMIC_FETCH_ADD(&stats.nohz_oneshot_ticks, 1UL);
+    add_trace_event_smart(TRACE_EV_NOHZ_ONESHOT, IRQ_TIMER, 1, (int)((now - next) / 1000));
+    tick_do_update_jiffies(now, timer_period_ns());
+    dispatch_interrupt(IRQ_TIMER);
+}
+
+// Tick detenido (tick_nohz_idle_enter): dormir hasta el próximo evento
+// programado o hasta que la actividad, un cambio de HZ/modo o la salida lo
+// reanuden. Devuelve al volver al modo periódico.
+static void nohz_idle(uint64_t period, unsigned long activity) {
+    uint64_t stop_ns = monotonic_ns();
+    uint64_t next = ATOMIC_LOAD_ACQ(&timer_next_event);
+    
+    ATOMIC_FETCH_ADD(&stats.nohz_stops, 1UL);
+    add_trace_event_smart(TRACE_EV_NOHZ_STOP, -1, 1,
+                          next == UINT64_MAX ? -1 : (int)((next > stop_ns ? next - stop_ns : 0) / 1000000));
+    
+    ATOMIC_STORE_REL(&nohz_stop_ns, stop_ns);
+    pthread_mutex_lock(&timer_mutex);
+    __atomic_store_n(&timer_idle, 1, __ATOMIC_SEQ_CST);
+    while (system_running && ATOMIC_LOAD_ACQ(&timer_tickless) &&
+           timer_period_ns() == period &&
+           __atomic_load_n(&nohz_activity, __ATOMIC_SEQ_CST) == activity) {
+        next = __atomic_load_n(&timer_next_event, __ATOMIC_SEQ_CST);
+        uint64_t now = monotonic_ns();
+        if (next <= now) {
+            pthread_mutex_unlock(&timer_mutex);
+            nohz_fire_event(now);
+            pthread_mutex_lock(&timer_mutex);
+            continue;
+        }
+        if (next == UINT64_MAX) {
+            pthread_cond_wait(&timer_cond, &timer_mutex);
+        } else {
+            struct timespec wake = {
+                .tv_sec = (time_t)(next / 1000000000ULL),
+                .tv_nsec = (long)(next % 1000000000ULL)
+            };
+            pthread_cond_timedwait(&timer_cond, &timer_mutex, &wake);
+        }
+    }
+    __atomic_store_n(&timer_idle, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&timer_mutex);
+    
+    uint64_t idle_ns = monotonic_ns() - stop_ns;
+    unsigned long saved = (unsigned long)(idle_ns / period);
+    ATOMIC_STORE_REL(&nohz_stop_ns, 0);
+    ATOMIC_FETCH_ADD(&stats.nohz_idle_ns, idle_ns);
+    ATOMIC_FETCH_ADD(&stats.nohz_ticks_saved, saved);
+    add_trace_event_smart(TRACE_EV_NOHZ_RESTART, -1, 1, (int)(idle_ns / 1000000), (int)saved);
 }
 
-// Hilo del timer automático
+// Hilo del timer automático. Duerme hasta deadlines absolutos (deadline +=
+// periodo), así que ni el retraso al despertar ni lo que tarda el despacho se
+// acumulan de un tick al siguiente, como ocurriría con sleep() relativo.
+// En modo tickless, un periodo entero sin IRQs no-timer y sin trabajo en
+// vuelo detiene el tick hasta que vuelva la actividad.
 void* timer_thread_func(void* arg) {
     (void)arg;
+    pthread_condattr_t cond_attr;
+    
+    trace_set_thread_name("timer-pit");
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&timer_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
     
     add_trace("🕐 HARDWARE: Hilo del timer PIT (Programmable Interval Timer) iniciado");
-    add_trace("⚙️  TIMER: Configurado para generar IRQ0 cada 3 segundos");
+    add_trace_event_smart(TRACE_EV_TIMER_CONFIG, -1, 1, (int)(timer_period_ns() / 1000), timer_get_hz());
+    
+    uint64_t period = timer_period_ns();
+    uint64_t deadline = monotonic_ns() + period;
+    uint64_t start_jiffy, old_stamp;
+    jiffies_read(&start_jiffy, &old_stamp);
+    jiffies_write(start_jiffy, deadline - period);
+    unsigned long activity = __atomic_load_n(&nohz_activity, __ATOMIC_SEQ_CST);
+    uint64_t cycle_cpu = thread_cpu_ns();
     
     while (system_running) {
-        sleep(TIMER_INTERVAL_SEC);
-        if (system_running) {
-            char trace_msg[MAX_TRACE_MSG_LEN];
-            snprintf(trace_msg, sizeof(trace_msg), 
-                "⏲️  HARDWARE: Timer PIT disparando IRQ0 - Señal de reloj del sistema");
-            add_trace_smart(trace_msg, -1, 1);
-            
-            dispatch_interrupt(IRQ_TIMER);
+        // Cambio de HZ en marcha: el siguiente deadline se ancla al nuevo periodo
+        if (timer_period_ns() != period) {
+            uint64_t now = monotonic_ns();
+            uint64_t j, stamp;
+            tick_do_update_jiffies(now, period);
+            jiffies_read(&j, &stamp);
+            jiffies_write(j, now);
+            period = timer_period_ns();
+            deadline = now + period;
+        }
+        
+        // Los periodos largos se duermen por tramos para ver cambios de HZ y la salida
+        uint64_t wake_ns = deadline;
+        uint64_t recheck_ns = monotonic_ns() + TIMER_RECHECK_NS;
+        if (wake_ns > recheck_ns) {
+            wake_ns = recheck_ns;
+        }
+        struct timespec wake = {
+            .tv_sec = (time_t)(wake_ns / 1000000000ULL),
+            .tv_nsec = (long)(wake_ns % 1000000000ULL)
+        };
+        if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) != 0) {
+            continue;   // EINTR: volver a dormir hasta el mismo deadline
+        }
+        if (!system_running) {
+            break;
+        }
+        
+        uint64_t now = monotonic_ns();
+        if (now < deadline) {
+            continue;
+        }
+        uint64_t lateness = now - deadline;
+        
+        // ✅ TICKS PERDIDOS: el tick anterior (o el despertar) se comió uno o más periodos
+        uint64_t missed = lateness / period;
+        if (missed > 0) {
+            ATOMIC_FETCH_ADD(&stats.timer_missed_ticks, (unsigned long)missed);
+            add_trace_event_smart(TRACE_EV_TIMER_MISSED, IRQ_TIMER, 1, (int)missed, (int)(lateness / 1000));
+        }
+        timer_account_tick(lateness);
+        add_trace_event_smart(TRACE_EV_PIT_FIRE, IRQ_TIMER, 1,
+                              (int)ATOMIC_LOAD_RELAXED(&stats.timer_ticks), (int)(lateness / 1000));
+        
+        // El tick periódico también atiende los eventos one-shot vencidos
+        if (ATOMIC_LOAD_RELAXED(&timer_next_event) <= now) {
+            __atomic_store_n(&timer_next_event, UINT64_MAX, __ATOMIC_SEQ_CST);
+        }
+        
+        tick_do_update_jiffies(now, period);
+        dispatch_interrupt(IRQ_TIMER);
+        
+        // Lo que un sleep() relativo habría sumado: retraso + tiempo del despacho
+        ATOMIC_FETCH_ADD(&stats.timer_drift_ns, monotonic_ns() - deadline);
+        
+        // CPU de un ciclo periódico completo (despertar + tick + volver a dormir)
+        uint64_t cpu = thread_cpu_ns();
+        ATOMIC_FETCH_ADD(&stats.timer_cpu_ns, cpu - cycle_cpu);
+        ATOMIC_FETCH_ADD(&stats.timer_periodic_cycles, 1UL);
+        cycle_cpu = cpu;
+        
+        // Siguiente deadline saltando los periodos perdidos (hrtimer_forward)
+        deadline += (missed + 1) * period;
+        
+        // ✅ NO_HZ IDLE: un periodo entero sin IRQs no-timer ni trabajo en vuelo
+        if (ATOMIC_LOAD_ACQ(&timer_tickless)) {
+            unsigned long now_activity = __atomic_load_n(&nohz_activity, __ATOMIC_SEQ_CST);
+            if (now_activity == activity && nohz_wait_timer_tick(deadline) && !nohz_system_busy()) {
+                nohz_idle(period, now_activity);
+                now_activity = __atomic_load_n(&nohz_activity, __ATOMIC_SEQ_CST);
+                deadline = monotonic_ns() + timer_period_ns();
+                cycle_cpu = thread_cpu_ns();
+            }
+            activity = now_activity;
         }
     }
     
@@ -478,43 +4116,439 @@ void* timer_thread_func(void* arg) {
     return NULL;
 }
 
+// Retardo simulado de un handler: duerme en tiempo real o, con el motor de
+// eventos, adelanta el reloj virtual (el handler ocupa la CPU ese tiempo)
+void sim_delay_us(unsigned long us) {
+    if (sim_virtual_time) {
+        sim_vclock_ns += (uint64_t)us * 1000;
+        return;
+    }
+    usleep((useconds_t)us);
+}
+
+// Orden de la cola de eventos: instante virtual y, a igualdad, creación
+static int sim_event_before(const sim_event_t *a, const sim_event_t *b) {
+    return a->time_ns < b->time_ns || (a->time_ns == b->time_ns && a->seq < b->seq);
+}
+
+// Programar un evento en el instante virtual time_ns
+int sim_schedule_event(sim_engine_t *engine, uint64_t time_ns, sim_event_type_t type, int irq_num) {
+    if (engine->count == engine->capacity) {
+        unsigned long capacity = engine->capacity ? engine->capacity * 2 : SIM_EVENT_HEAP_INITIAL;
+        sim_event_t *heap = realloc(engine->heap, capacity * sizeof(*heap));
+        if (!heap) {
+            return ERROR_TRACE_STORAGE;
+        }
+        engine->heap = heap;
+        engine->capacity = capacity;
+    }
+    
+    sim_event_t event = { time_ns, engine->next_seq++, type, irq_num };
+    unsigned long index = engine->count++;
+    while (index > 0) {
+        unsigned long parent = (index - 1) / 2;
+        if (!sim_event_before(&event, &engine->heap[parent])) {
+            break;
+        }
+        engine->heap[index] = engine->heap[parent];
+        index = parent;
+    }
+    engine->heap[index] = event;
+    return SUCCESS;
+}
+
+// Sacar el evento más temprano. Devuelve 0 si la cola está vacía.
+int sim_next_event(sim_engine_t *engine, sim_event_t *out) {
+    if (engine->count == 0) {
+        return 0;
+    }
+    *out = engine->heap[0];
+    
+    sim_event_t last = engine->heap[--engine->count];
+    unsigned long index = 0;
+    while (1) {
+        unsigned long child = 2 * index + 1;
+        if (child >= engine->count) {
+            break;
+        }
+        if (child + 1 < engine->count && sim_event_before(&engine->heap[child + 1], &engine->heap[child])) {
+            child++;
+        }
+        if (!sim_event_before(&engine->heap[child], &last)) {
+            break;
+        }
+        engine->heap[index] = engine->heap[child];
+        index = child;
+    }
+    if (engine->count > 0) {
+        engine->heap[index] = last;
+    }
+    return 1;
+}
+
+// xorshift64 de las llegadas: determinista para una semilla dada
+static uint64_t sim_rand(sim_engine_t *engine) {
+    uint64_t x = engine->rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    engine->rng = x;
+    return x;
+}
+
+// Tiempo hasta la siguiente llegada de un proceso de Poisson de tasa rate
+static uint64_t sim_interarrival_ns(sim_engine_t *engine, double rate) {
+    double u = (double)(sim_rand(engine) >> 11) / 9007199254740992.0;   // [0, 1)
+    return (uint64_t)(-log(1.0 - u) / rate * 1e9) + 1;
+}
+
+// Tick del PIT en tiempo virtual: mismo camino que timer_thread_func() con
+// el retraso medido contra el reloj virtual
+static void sim_timer_tick(sim_engine_t *engine, uint64_t deadline) {
+    uint64_t period = timer_period_ns();
+    uint64_t now = sim_vclock_ns;
+    uint64_t lateness = now - deadline;
+    uint64_t missed = lateness / period;
+    
+    if (missed > 0) {
+        ATOMIC_FETCH_ADD(&stats.timer_missed_ticks, (unsigned long)missed);
+        add_trace_event_smart(TRACE_EV_TIMER_MISSED, IRQ_TIMER, 1, (int)missed, (int)(lateness / 1000));
+    }
+    timer_account_tick(lateness);
+    add_trace_event_smart(TRACE_EV_PIT_FIRE, IRQ_TIMER, 1,
+                          (int)ATOMIC_LOAD_RELAXED(&stats.timer_ticks), (int)(lateness / 1000));
+    tick_do_update_jiffies(now, period);
+    dispatch_interrupt_at(IRQ_TIMER, deadline + missed * period);
+    
+    sim_schedule_event(engine, deadline + (missed + 1) * period, SIM_EV_TIMER_TICK, IRQ_TIMER);
+}
+
+// Llegada de una IRQ de dispositivo: si la CPU sigue ocupada con un handler
+// anterior, el reloj ya pasó su instante y la diferencia es la espera
+static void sim_device_arrival(sim_engine_t *engine, const sim_event_t *event) {
+    uint64_t wait = sim_vclock_ns - event->time_ns;
+    
+    engine->arrivals++;
+    engine->wait_total_ns += wait;
+    if (wait > engine->wait_max_ns) {
+        engine->wait_max_ns = wait;
+    }
+    // Las IRQs dinámicas son de dispositivos MSI: llegan por su vector
+    int vector = ATOMIC_LOAD_RELAXED(&irq_meta[event->irq_num].vector);
+    if (event->irq_num >= NR_IRQS_LEGACY && vector >= 0) {
+        dispatch_vector_at(vector, event->time_ns);
+    } else {
+        dispatch_interrupt_at(event->irq_num, event->time_ns);
+    }
+    
+    double rate = engine->rate[event->irq_num];
+    sim_schedule_event(engine, event->time_ns + sim_interarrival_ns(engine, rate),
+                       SIM_EV_DEVICE, event->irq_num);
+}
+
+// Simular seconds segundos en tiempo virtual y mostrar el resultado. Todo
+// corre en el hilo actual sin timer, CPUs simuladas ni ksoftirqd/kworkers:
+// los bottom halves se ejecutan en línea y sus retardos también adelantan el reloj.
+int run_virtual_simulation(double seconds) {
+    sim_engine_t engine;
+    sim_event_t event;
+    
+    memset(&engine, 0, sizeof(engine));
+    engine.rng = sim_options.seed ? sim_options.seed : SIM_DEFAULT_SEED;
+    if (sim_options.vt_rate_set) {
+        memcpy(engine.rate, sim_options.vt_rate, sizeof(engine.rate));
+    } else {
+        engine.rate[IRQ_KEYBOARD] = SIM_DEFAULT_KBD_RATE;
+        for (size_t i = 0; i < sizeof(irq_table) / sizeof(irq_table[0]); i++) {
+            engine.rate[irq_table[i].irq] = SIM_DEFAULT_DEVICE_RATE;
+        }
+    }
+    if (sim_options.cpu_count > 0 || sim_options.threaded_irqs || sim_options.tickless) {
+        printf("Advertencia: --cpus, --threaded-irqs y --tickless se ignoran en tiempo virtual (una CPU)\n");
+    }
+    
+    // El reloj virtual arranca en el instante real para que las horas de pared de la traza tengan sentido
+    sim_vclock_ns = host_monotonic_ns();
+    sim_virtual_time = 1;
+    uint64_t start_ns = sim_vclock_ns;
+    uint64_t end_ns = start_ns + (uint64_t)(seconds * 1e9);
+    
+    init_idt();
+    init_system_stats();
+    register_isr(IRQ_TIMER, timer_isr, "Timer PIT - Reloj del sistema");
+    register_isr(IRQ_KEYBOARD, keyboard_isr, "Controlador de teclado 8042");
+    if (sim_options.timer_hz > 0) {
+        timer_set_hz(sim_options.timer_hz);
+    }
+    jiffies_write(0, start_ns);
+    
+    int result = sim_schedule_event(&engine, start_ns + timer_period_ns(), SIM_EV_TIMER_TICK, IRQ_TIMER);
+    for (int i = 0; i < MAX_INTERRUPTS && result == SUCCESS; i++) {
+        if (sim_options.shared_devices[i] > 0) {
+            result = register_shared_demo(i, sim_options.shared_devices[i]);
+        }
+    }
+    if (result == SUCCESS && sim_options.msix_vectors > 0) {
+        result = register_msix_demo(sim_options.msix_vectors);
+    }
+    for (int i = 0; i < MAX_INTERRUPTS && result == SUCCESS; i++) {
+        if (engine.rate[i] <= 0.0 || i == IRQ_TIMER) {
+            continue;
+        }
+        if (is_irq_available(i)) {
+            register_device_isr(i, get_irq_description(i));
+        }
+        set_irq_napi(i, sim_options.napi_rate[i], sim_options.napi_budget[i]);
+        result = sim_schedule_event(&engine, start_ns + sim_interarrival_ns(&engine, engine.rate[i]),
+                                    SIM_EV_DEVICE, i);
+    }
+    
+    printf("⏩ Simulando %.3f s en tiempo virtual (semilla %llu)...\n",
+           seconds, (unsigned long long)(sim_options.seed ? sim_options.seed : SIM_DEFAULT_SEED));
+    fflush(stdout);
+    uint64_t host_start = host_monotonic_ns();
+    
+    // ✅ BUCLE DE EVENTOS: el reloj salta al siguiente evento (o ya lo pasó un handler)
+    while (result == SUCCESS && sim_next_event(&engine, &event) && event.time_ns < end_ns) {
+        if (event.time_ns > sim_vclock_ns) {
+            sim_vclock_ns = event.time_ns;
+        }
+        engine.events++;
+        switch (event.type) {
+            case SIM_EV_DEVICE:
+                sim_device_arrival(&engine, &event);
+                break;
+            case SIM_EV_TIMER_TICK:
+                sim_timer_tick(&engine, event.time_ns);
+                break;
+        }
+    }
+    
+    // Sin más eventos antes del final, el reloj llega hasta él
+    if (result == SUCCESS && sim_vclock_ns < end_ns) {
+        sim_vclock_ns = end_ns;
+    }
+    uint64_t host_ns = host_monotonic_ns() - host_start;
+    uint64_t virtual_ns = sim_vclock_ns - start_ns;
+    
+    printf("\n=== SIMULACIÓN EN TIEMPO VIRTUAL ===\n");
+    printf("Tiempo virtual:        %.3f s (%.3f s de host, %.0fx)\n", virtual_ns / 1e9, host_ns / 1e9,
+           host_ns > 0 ? (double)virtual_ns / host_ns : 0.0);
+    printf("Eventos procesados:    %lu (%.0f por segundo de host)\n", engine.events,
+           host_ns > 0 ? engine.events / (host_ns / 1e9) : 0.0);
+    irq_counters_t counters;
+    stats_read_counters(&counters);
+    printf("IRQs atendidas:        %lu (%.0f por segundo de host)\n", counters.total_interrupts,
+           host_ns > 0 ? counters.total_interrupts / (host_ns / 1e9) : 0.0);
+    printf("Espera llegada->despacho: media %.1f μs, máx. %.1f μs (%lu llegadas)\n",
+           engine.arrivals > 0 ? engine.wait_total_ns / 1e3 / engine.arrivals : 0.0,
+           engine.wait_max_ns / 1e3, engine.arrivals);
+    if (result != SUCCESS) {
+        printf("❌ Sin memoria para la cola de eventos\n");
+    }
+    
+    show_idt_status();
+    show_system_stats();
+    
+    free(engine.heap);
+    return result;
+}
+
 void show_idt_status() {
     printf("\n╔══════════════════════════════════════════════════════════════════════════════╗\n");
     printf("║                ESTADO ACTUAL DE LA IDT (Solo IRQs utilizadas)              ║\n");
     printf("║                       Simulando: /proc/interrupts                          ║\n");
     printf("╠══════════════════════════════════════════════════════════════════════════════╣\n");
-    printf("║ IRQ │    Estado     │ Llamadas │ Tiempo Total (μs) │ Handler Descripción    ║\n");
-    printf("╠═════╪═══════════════╪══════════╪═══════════════════╪════════════════════════╣\n");
+    printf("║ IRQ │ Vec  │    Estado     │ Llamadas │ Tiempo (μs) │ Handler Descripción    ║\n");
+    printf("╠═════╪══════╪═══════════════╪══════════╪═════════════╪════════════════════════╣\n");
 
     int usados = 0;
 
-    LOCK_IDT();
-    for (int i = 0; i < MAX_INTERRUPTS; i++) {
-        if (idt[i].call_count == 0)
+    // Lectura sin lock: estado y contadores son atómicos por vector. Solo se
+    // visitan las IRQs del bitmap de activas, no toda la tabla.
+    for_each_active_irq(i) {
+        int call_count = ATOMIC_LOAD_RELAXED(&idt[i].call_count);
+        if (call_count == 0)
             continue; // Mostrar solo si fue usada en esta ejecución
 
-        const char* state_str = get_irq_state_string(idt[i].state);
+        irq_state_t state = ATOMIC_LOAD_ACQ(&idt[i].state);
+        const char* state_str = get_irq_state_string(state);
         const char* icon = "";
 
-        switch (idt[i].state) {
+        switch (state) {
             case IRQ_STATE_FREE:       icon = "⚪"; break;
             case IRQ_STATE_REGISTERED: icon = "🟢"; break;
             case IRQ_STATE_EXECUTING:  icon = "🔴"; break;
+            case IRQ_STATE_UPDATING:   icon = "🟡"; break;
+            case IRQ_STATE_MASKED:     icon = "🟠"; break;
+        }
+
+        printf("║ %s%3d │ 0x%02x │ %-12s │ %8d │ %11lu │ %-21s ║\n", 
+               icon, i, ATOMIC_LOAD_RELAXED(&irq_meta[i].vector), state_str, call_count, 
+               ATOMIC_LOAD_RELAXED(&idt[i].total_execution_time), irq_meta[i].description);
+        usados++;
+    }
+
+    if (usados == 0) {
+        printf("║                             ⚠️  Ninguna IRQ activa                            ║\n");
+    }
+
+    printf("╚══════════════════════════════════════════════════════════════════════════════╝\n");
+    printf("🟢 = Registrada y lista  🔴 = Ejecutándose  🟠 = Enmascarada  ⚪ = Disponible\n");
+    
+    // IRR/ISR: máscara de las legacy y cuántas dinámicas hay en cada registro
+    uint64_t irr_legacy = __atomic_load_n(&pic_irr[0], __ATOMIC_RELAXED) & 0xFFFF;
+    uint64_t isr_legacy = __atomic_load_n(&pic_isr[0], __ATOMIC_RELAXED) & 0xFFFF;
+    int irr_dynamic = -__builtin_popcountll(irr_legacy);
+    int isr_dynamic = -__builtin_popcountll(isr_legacy);
+    int vectors_used = -(IDT_VECTORS - NR_DYNAMIC_VECTORS);
+    for (int w = 0; w < IRQ_BITMAP_WORDS; w++) {
+        irr_dynamic += __builtin_popcountll(__atomic_load_n(&pic_irr[w], __ATOMIC_RELAXED));
+        isr_dynamic += __builtin_popcountll(__atomic_load_n(&pic_isr[w], __ATOMIC_RELAXED));
+    }
+    for (int w = 0; w < IDT_VECTORS / 64; w++) {
+        vectors_used += __builtin_popcountll(ATOMIC_LOAD_RELAXED(&vector_used[w]));
+    }
+    printf("📥 IRR (pendientes): 0x%04x + %d dinámicas   🔧 ISR (en servicio): 0x%04x + %d dinámicas\n",
+           (unsigned int)irr_legacy, irr_dynamic, (unsigned int)isr_legacy, isr_dynamic);
+    printf("🧭 Vectores: 0x00-0x1f excepciones │ 0x%02x-0x%02x legacy │ %d/%d dinámicos (0x%02x-0x%02x) │ "
+           "0x%02x-0xff sistema\n",
+           IRQ0_VECTOR, IRQ0_VECTOR + NR_IRQS_LEGACY - 1, vectors_used, NR_DYNAMIC_VECTORS,
+           FIRST_DYNAMIC_VECTOR, FIRST_SYSTEM_VECTOR - 1, FIRST_SYSTEM_VECTOR);
+    
+    // Percentiles del histograma de cada IRQ: la media sola esconde la cola
+    int hist_header = 0;
+    for_each_active_irq(i) {
+        lat_summary_t lat;
+        lat_hist_summary(&isr_hist[i], &lat);
+        if (lat.count == 0) {
+            continue;
+        }
+        if (!hist_header) {
+            printf("⏱️  Latencia de ISR (μs):  IRQ │      p50 │      p90 │      p99 │    p99.9 │      máx\n");
+            hist_header = 1;
+        }
+        printf("                          %3d │ %8.1f │ %8.1f │ %8.1f │ %8.1f │ %8.1f", i,
+               lat.p50_ns / 1e3, lat.p90_ns / 1e3, lat.p99_ns / 1e3, lat.p999_ns / 1e3, lat.max_ns / 1e3);
+        if (lat.overflow > 0) {
+            printf(" (%lu fuera de escala)", lat.overflow);
+        }
+        printf("\n");
+    }
+    
+    // De la inyección al fin del handler: la espera en cola es lo que crece
+    // con la carga aunque el handler y el despacho no cambien
+    int split_header = 0;
+    for_each_active_irq(i) {
+        unsigned long samples = ATOMIC_LOAD_RELAXED(&irq_meta[i].lat_samples);
+        if (samples == 0) {
+            continue;
+        }
+        if (!split_header) {
+            printf("🛬 Desglose medio (μs):    IRQ │     cola │ p99 cola │ despacho │  handler │    total\n");
+            split_header = 1;
+        }
+        lat_summary_t queue;
+        lat_hist_summary(&queue_hist[i], &queue);
+        double queue_avg = ATOMIC_LOAD_RELAXED(&irq_meta[i].lat_queue_ns) / 1e3 / samples;
+        double dispatch_avg = ATOMIC_LOAD_RELAXED(&irq_meta[i].lat_dispatch_ns) / 1e3 / samples;
+        double handler_avg = ATOMIC_LOAD_RELAXED(&irq_meta[i].lat_handler_ns) / 1e3 / samples;
+        printf("                          %3d │ %8.1f │ %8.1f │ %8.1f │ %8.1f │ %8.1f\n", i,
+               queue_avg, queue.p99_ns / 1e3, dispatch_avg, handler_avg,
+               queue_avg + dispatch_avg + handler_avg);
+    }
+    
+    // Cadenas de las líneas compartidas: eventos reclamados por cada dispositivo
+    for_each_active_irq(i) {
+        int action_count = ATOMIC_LOAD_RELAXED(&idt[i].action_count);
+        if (action_count == 0) {
+            continue;
+        }
+        printf("🔗 IRQ%d compartida (%d handlers):", i, action_count);
+        for (int a = 0; a < action_count; a++) {
+            printf("%s %s (%lu)", a > 0 ? " ·" : "",
+                   trace_string_text(irq_meta[i].actions[a].description_id),
+                   ATOMIC_LOAD_RELAXED(&irq_meta[i].actions[a].handled));
+        }
+        printf(" │ %lu espurias\n", ATOMIC_LOAD_RELAXED(&irq_meta[i].spurious_count));
+    }
+    
+    // Latencia que los handlers en hilo sacan del camino de despacho: el
+    // primario corre en dispatch_interrupt() y el resto en irq/N
+    for_each_active_irq(i) {
+        int call_count = ATOMIC_LOAD_RELAXED(&idt[i].call_count);
+        int thread_runs = ATOMIC_LOAD_RELAXED(&irq_meta[i].thread_runs);
+        if (call_count == 0 || thread_runs == 0) {
+            continue;
+        }
+        double primary_avg = (double)ATOMIC_LOAD_RELAXED(&idt[i].total_execution_time) / call_count;
+        double thread_avg = (double)ATOMIC_LOAD_RELAXED(&irq_meta[i].total_thread_time) / thread_runs;
+        double offloaded = (primary_avg + thread_avg) > 0.0
+                               ? 100.0 * thread_avg / (primary_avg + thread_avg) : 0.0;
+        printf("🧶 irq/%d: primario %.1f μs en el despacho │ hilo %.1f μs (%d ejecuciones) │ "
+               "%.1f%% fuera del despacho\n",
+               i, primary_avg, thread_avg, thread_runs, offloaded);
+    }
+    
+    for_each_active_irq(i) {
+        unsigned int rate = ATOMIC_LOAD_RELAXED(&idt[i].napi_rate);
+        if (rate == 0) {
+            continue;
+        }
+        printf("📶 IRQ%d NAPI: umbral %u IRQs/s, budget %d │ %s │ %lu cambios a polling, "
+               "%lu eventos por polling\n",
+               i, rate, ATOMIC_LOAD_RELAXED(&irq_meta[i].napi_budget),
+               ATOMIC_LOAD_ACQ(&idt[i].napi_scheduled) ? "polling" : "interrupciones",
+               ATOMIC_LOAD_RELAXED(&irq_meta[i].napi_switches), ATOMIC_LOAD_RELAXED(&irq_meta[i].napi_polled));
+    }
+    
+    if (smp_cpu_count > 0) {
+        show_smp_status();
+    }
+}
+
+// Interrupciones atendidas por cada CPU simulada, con columnas por CPU como
+// /proc/interrupts, y carga de cada cola de pendientes
+void show_smp_status() {
+    printf("\n=== INTERRUPCIONES POR CPU (/proc/interrupts) ===\n");
+    printf("     ");
+    for (int c = 0; c < smp_cpu_count; c++) {
+        printf(" %10s%-2d", "CPU", c);
+    }
+    printf("  Afinidad  Handler\n");
+    
+    for_each_active_irq(i) {
+        unsigned long counts[MAX_SIM_CPUS];
+        unsigned long total = 0;
+        for (int c = 0; c < smp_cpu_count; c++) {
+            counts[c] = ATOMIC_LOAD_RELAXED(&sim_cpus[c].irq_count[i]);
+            total += counts[c];
         }
-
-        printf("║ %s%2d │ %-12s │ %8d │ %17lu │ %-21s ║\n", 
-               icon, i, state_str, idt[i].call_count, 
-               idt[i].total_execution_time, idt[i].description);
-        usados++;
+        if (total == 0) {
+            continue;
+        }
+        printf(" %3d:", i);
+        for (int c = 0; c < smp_cpu_count; c++) {
+            printf(" %12lu", counts[c]);
+        }
+        printf("  %8x  %s\n", ATOMIC_LOAD_RELAXED(&idt[i].smp_affinity), irq_meta[i].description);
     }
-    UNLOCK_IDT();
-
-    if (usados == 0) {
-        printf("║                             ⚠️  Ninguna IRQ activa                            ║\n");
+    
+    printf("\n CPU │ Atendidas │ Ocupada (ms) │ Espera media (μs) │ Cola llena │ Robadas │ Ahorro (ms)\n");
+    for (int c = 0; c < smp_cpu_count; c++) {
+        sim_cpu_t *cpu = &sim_cpus[c];
+        unsigned long handled = ATOMIC_LOAD_RELAXED(&cpu->handled);
+        uint64_t wait_ns = ATOMIC_LOAD_RELAXED(&cpu->queue_wait_ns);
+        printf(" %3d │ %9lu │ %12.1f │ %17.1f │ %10lu │ %7lu │ %11.1f\n", c, handled,
+               ATOMIC_LOAD_RELAXED(&cpu->busy_ns) / 1e6,
+               handled > 0 ? (double)wait_ns / handled / 1e3 : 0.0,
+               ATOMIC_LOAD_RELAXED(&cpu->queue_full),
+               ATOMIC_LOAD_RELAXED(&cpu->steals),
+               ATOMIC_LOAD_RELAXED(&cpu->steal_saved_ns) / 1e6);
+    }
+    if (!smp_work_stealing) {
+        printf(" (work stealing desactivado: use --work-stealing)\n");
     }
-
-    printf("╚══════════════════════════════════════════════════════════════════════════════╝\n");
-    printf("🟢 = Registrada y lista  🔴 = Ejecutándose  ⚪ = Disponible\n");
 }
 
 
@@ -522,181 +4556,108 @@ void show_idt_status() {
 void show_recent_trace() {
     printf("\n=== TRAZA RECIENTE ===\n");
     
-    pthread_mutex_lock(&trace_mutex);
-    int entries_to_show = (trace_index < 10) ? trace_index : 10;
-    int start = (trace_index - entries_to_show + MAX_TRACE_LINES) % MAX_TRACE_LINES;
-    
-    for (int i = 0; i < entries_to_show; i++) {
-        int idx = (start + i) % MAX_TRACE_LINES;
-        if (strlen(trace_log[idx].event) > 0) {
-            if (trace_log[idx].irq_num >= 0) {
-                printf("[%s] [IRQ%d] %s\n", 
-                       trace_log[idx].timestamp, trace_log[idx].irq_num, trace_log[idx].event);
-            } else {
-                printf("[%s] %s\n", trace_log[idx].timestamp, trace_log[idx].event);
-            }
-        }
-    }
-    pthread_mutex_unlock(&trace_mutex);
-    printf("\n");
-}
-
-// Función auxiliar mejorada para detectar trazas del timer
-int is_timer_related_trace(const trace_entry_t *entry) {
-    // Verificar por IRQ número
-    if (entry->irq_num == IRQ_TIMER) {
-        return 1;
+    // Merge de los buffers por hilo: los escritores siguen avanzando mientras leemos
+    trace_entry_t recent[10];
+    int count = 0;
+    trace_iter_t it;
+    trace_iter_init(&it);
+    while (count < 10 && trace_iter_prev(&it, &recent[count])) {
+        count++;
     }
     
-    // Verificar por contenido del mensaje (patrones más completos)
-    const char* timer_patterns[] = {
-        "TIMER", "Timer", "timer",
-        "TICK", "Tick", "tick",
-        "Hilo del timer", "timer_thread",
-        "DESPACHANDO IRQ 0", "FINALIZANDO IRQ 0",
-        ">>> DESPACHANDO IRQ 0", "<<< FINALIZANDO IRQ 0",
-        "iniciado", "finalizando"  // Para mensajes del hilo del timer
-    };
-    
-    int num_patterns = sizeof(timer_patterns) / sizeof(timer_patterns[0]);
-    
-    for (int i = 0; i < num_patterns; i++) {
-        if (strstr(entry->event, timer_patterns[i]) != NULL) {
-            return 1;
-        }
+    for (int i = count - 1; i >= 0; i--) {
+        print_trace_entry("", &recent[i], 1);
     }
-    
-    return 0;
+    printf("\n");
 }
 
 // Función corregida para mostrar última traza (excluyendo timer)
 void show_last_trace() {
     printf("\n=== ÚLTIMA TRAZA NO-TIMER ===\n");
-    pthread_mutex_lock(&trace_mutex);
-    
-    int found = 0;
-    int entries_checked = 0;
     
-    // Calcular el número real de entradas en el buffer circular
-    int total_entries = 0;
-    int start_search = trace_index;
+    trace_iter_t it;
+    trace_entry_t entry;
     
-    // Si trace_index es 0, empezar desde el final del buffer
-    if (trace_index == 0) {
-        start_search = MAX_TRACE_LINES;
-    }
-    
-    // Buscar hacia atrás desde la entrada más reciente
-    for (int i = 0; i < MAX_TRACE_LINES && !found; i++) {
-        int idx = (start_search - 1 - i + MAX_TRACE_LINES) % MAX_TRACE_LINES;
-        entries_checked++;
-        
-        // Solo procesar entradas que tienen contenido válido
-        if (strlen(trace_log[idx].event) > 0) {
-            total_entries++;
-            
-            // Verificar si es traza del timer usando la función auxiliar
-            if (!is_timer_related_trace(&trace_log[idx])) {
-                printf("Entrada encontrada (posición %d desde el final):\n", i + 1);
-                
-                if (trace_log[idx].irq_num >= 0) {
-                    printf("[%s] [IRQ%d] %s\n",
-                           trace_log[idx].timestamp, 
-                           trace_log[idx].irq_num, 
-                           trace_log[idx].event);
-                } else {
-                    printf("[%s] %s\n", 
-                           trace_log[idx].timestamp, 
-                           trace_log[idx].event);
-                }
-                found = 1;
-            }
-        }
-    }
-    
-    if (!found) {
-        if (total_entries == 0) {
+    // El índice no-timer da directamente la entrada más reciente de cualquier hilo
+    trace_iter_init_user(&it);
+    if (trace_iter_prev(&it, &entry)) {
+        print_trace_entry("", &entry, 1);
+    } else {
+        trace_iter_init(&it);
+        if (!trace_iter_prev(&it, &entry)) {
             printf("El log de trazas está vacío\n");
         } else {
             printf("No se encontraron trazas que no sean del timer\n");
-            printf("Total de entradas válidas revisadas: %d\n", total_entries);
-            printf("Todas las trazas recientes parecen ser del timer del sistema\n");
+            printf("Todas las trazas recientes son del timer del sistema\n");
         }
     }
     
-    pthread_mutex_unlock(&trace_mutex);
     printf("\n");
 }
 
 // Función adicional para mostrar las últimas N trazas no-timer
 void show_last_n_non_timer_traces(int n) {
     printf("\n=== ÚLTIMAS %d TRAZAS NO-TIMER ===\n", n);
-    pthread_mutex_lock(&trace_mutex);
     
     int found_count = 0;
-    int entries_checked = 0;
-    int start_search = trace_index;
+    trace_iter_t it;
+    trace_entry_t entry;
     
-    if (trace_index == 0) {
-        start_search = MAX_TRACE_LINES;
-    }
-    
-    printf("Buscando las últimas %d trazas que no sean del timer...\n\n", n);
-    
-    // Buscar hacia atrás desde la entrada más reciente
-    for (int i = 0; i < MAX_TRACE_LINES && found_count < n; i++) {
-        int idx = (start_search - 1 - i + MAX_TRACE_LINES) % MAX_TRACE_LINES;
-        entries_checked++;
-        
-        // Solo procesar entradas que tienen contenido válido
-        if (strlen(trace_log[idx].event) > 0) {
-            // Verificar si es traza del timer
-            if (!is_timer_related_trace(&trace_log[idx])) {
-                found_count++;
-                printf("%d. ", found_count);
-                
-                if (trace_log[idx].irq_num >= 0) {
-                    printf("[%s] [IRQ%d] %s\n",
-                           trace_log[idx].timestamp, 
-                           trace_log[idx].irq_num, 
-                           trace_log[idx].event);
-                } else {
-                    printf("[%s] %s\n", 
-                           trace_log[idx].timestamp, 
-                           trace_log[idx].event);
-                }
-            }
-        }
+    // Recorre solo el índice no-timer: O(N) entradas leídas, sin filtrar
+    trace_iter_init_user(&it);
+    while (found_count < n && trace_iter_prev(&it, &entry)) {
+        found_count++;
+        printf("%d. ", found_count);
+        print_trace_entry("", &entry, 1);
     }
     
     if (found_count == 0) {
         printf("No se encontraron trazas que no sean del timer\n");
-        printf("Entradas totales revisadas: %d\n", entries_checked);
     } else if (found_count < n) {
         printf("\nSolo se encontraron %d trazas no-timer (de %d solicitadas)\n", found_count, n);
     }
     
-    pthread_mutex_unlock(&trace_mutex);
     printf("\n");
 }
 
 // Función mejorada para debug del buffer de trazas
 void debug_trace_buffer() {
     printf("\n=== DEBUG DEL BUFFER DE TRAZAS ===\n");
-    pthread_mutex_lock(&trace_mutex);
     
-    printf("trace_index actual: %d\n", trace_index);
-    printf("MAX_TRACE_LINES: %d\n\n", MAX_TRACE_LINES);
+    static const char *state_names[] = { "LIBRE", "ACTIVO", "HUÉRFANO" };
+    trace_entry_t entry;
+    
+    printf("Capacidad por hilo: %lu entradas en %d buffers (%s)\n", trace_capacity, trace_buffers,
+           trace_region_fd >= 0 ? "archivo mapeado" : "memoria anónima");
+    printf("Entradas descartadas (sin buffer libre): %lu\n", ATOMIC_LOAD_RELAXED(&trace_dropped));
+    printf("Líneas de consola descartadas por el logger (%s): %lu\n\n",
+           logger_policy == LOG_POLICY_DROP ? "drop" : "block", ATOMIC_LOAD_RELAXED(&log_dropped));
     
     int valid_entries = 0;
     int timer_entries = 0;
     int non_timer_entries = 0;
+    int skipped_entries = 0;
     
-    printf("Análisis del contenido del buffer:\n");
-    for (int i = 0; i < MAX_TRACE_LINES; i++) {
-        if (strlen(trace_log[i].event) > 0) {
+    printf("Buffers por hilo:\n");
+    for (int i = 0; i < trace_buffers && trace_capacity > 0; i++) {
+        const trace_buffer_t *buffer = trace_buffer_at(i);
+        unsigned int state = ATOMIC_LOAD_ACQ(&buffer->state);
+        if (state == TRACE_BUFFER_FREE) {
+            continue;
+        }
+        
+        unsigned long head = ATOMIC_LOAD_ACQ(&buffer->head);
+        printf("  [%2d] %-16s %-9s tickets emitidos: %lu (no-timer: %lu)\n",
+               i, buffer->owner_name, state_names[state], head,
+               ATOMIC_LOAD_ACQ(&buffer->user_head));
+        
+        for (unsigned long t = trace_oldest_ticket(head); t < head; t++) {
+            if (!trace_read(buffer, t, &entry)) {
+                skipped_entries++;  // Sobrescrita o en escritura durante la lectura
+                continue;
+            }
             valid_entries++;
-            if (is_timer_related_trace(&trace_log[i])) {
+            if (entry.flags & TRACE_FLAG_TIMER) {
                 timer_entries++;
             } else {
                 non_timer_entries++;
@@ -704,22 +4665,25 @@ void debug_trace_buffer() {
         }
     }
     
+    printf("\nAnálisis del contenido de los buffers:\n");
     printf("Entradas válidas: %d\n", valid_entries);
     printf("Entradas del timer: %d\n", timer_entries);
     printf("Entradas no-timer: %d\n", non_timer_entries);
+    printf("Entradas en escritura/sobrescritas: %d\n", skipped_entries);
     
-    // Mostrar las últimas 5 entradas con su clasificación
+    // Mostrar las últimas 5 entradas (merge de todos los hilos) con su clasificación
     printf("\nÚltimas 5 entradas (con clasificación):\n");
-    int start = (trace_index - 5 + MAX_TRACE_LINES) % MAX_TRACE_LINES;
-    for (int i = 0; i < 5; i++) {
-        int idx = (start + i) % MAX_TRACE_LINES;
-        if (strlen(trace_log[idx].event) > 0) {
-            const char* type = is_timer_related_trace(&trace_log[idx]) ? "[TIMER]" : "[USER]";
-            printf("%s [%s] %s\n", type, trace_log[idx].timestamp, trace_log[idx].event);
-        }
+    trace_entry_t recent[5];
+    int count = 0;
+    trace_iter_t it;
+    trace_iter_init(&it);
+    while (count < 5 && trace_iter_prev(&it, &recent[count])) {
+        count++;
+    }
+    for (int i = count - 1; i >= 0; i--) {
+        print_trace_entry((recent[i].flags & TRACE_FLAG_TIMER) ? "[TIMER] " : "[USER] ", &recent[i], 0);
     }
     
-    pthread_mutex_unlock(&trace_mutex);
     printf("\n");
 }
 
@@ -730,7 +4694,11 @@ void show_system_stats() {
     printf("║                     Simulando: /proc/stat y /proc/uptime                    ║\n");
     printf("╠══════════════════════════════════════════════════════════════════════════════╣\n");
     
-    time_t uptime = time(NULL) - stats.system_start_time;
+    // Uptime del reloj del simulador: en tiempo virtual cuenta el tiempo simulado
+    irq_counters_t counters;
+    stats_read_counters(&counters);
+    
+    time_t uptime = (time_t)((monotonic_ns() - stats.system_start_ns) / 1000000000ULL);
     int hours = uptime / 3600;
     int minutes = (uptime % 3600) / 60;
     int seconds = uptime % 60;
@@ -738,18 +4706,104 @@ void show_system_stats() {
     printf("║ 🕐 Uptime del sistema:           %02d:%02d:%02d (%ld segundos)        ║\n", 
            hours, minutes, seconds, uptime);
     printf("║ 📊 Total de interrupciones:      %-10lu                           ║\n", 
-           stats.total_interrupts);
+           counters.total_interrupts);
     printf("║ ⏰ Interrupciones de timer:       %-10lu (IRQ 0)                  ║\n", 
-           stats.timer_interrupts);
+           counters.timer_interrupts);
     printf("║ ⌨️  Interrupciones de teclado:     %-10lu (IRQ 1)                  ║\n", 
-           stats.keyboard_interrupts);
-    printf("║ 🔧 Interrupciones personalizadas: %-10lu (IRQ 2-15)               ║\n", 
-           stats.custom_interrupts);
-    printf("║ ⚡ Tiempo promedio de ISR:        %.2f μs                          ║\n", 
-           stats.average_response_time);
+           counters.keyboard_interrupts);
+    printf("║ 🔧 Interrupciones personalizadas: %-10lu (IRQ 2-15 y MSI)         ║\n", 
+           counters.custom_interrupts);
+    unsigned long total_interrupts = counters.total_interrupts;
+    printf("║ ⚡ Tiempo promedio de ISR:        %.2f μs (hard IRQ)               ║\n", 
+           total_interrupts > 0
+               ? (double)counters.total_response_time / total_interrupts
+               : 0.0);
+    lat_summary_t lat;
+    lat_hist_t global;
+    stats_read_isr_hist(&global);
+    lat_hist_summary(&global, &lat);
+    printf("║    ... p50 / p90 / p99:           %.1f / %.1f / %.1f μs               ║\n",
+           lat.p50_ns / 1e3, lat.p90_ns / 1e3, lat.p99_ns / 1e3);
+    printf("║    ... p99.9 / máx:               %.1f / %.1f μs                      ║\n",
+           lat.p999_ns / 1e3, lat.max_ns / 1e3);
+    if (lat.overflow > 0) {
+        printf("║    ... fuera de escala (≥ 2^%d ns): %-6lu                            ║\n",
+               LAT_HIST_MAX_BITS, lat.overflow);
+    }
+    printf("║ ⏱️  Tiempo en hard IRQ:           %-10lu μs                        ║\n",
+           counters.total_response_time);
+    printf("║ 🧵 Softirqs/tasklets:             %-6lu en %-10lu μs (%lu lotes) ║\n",
+           ATOMIC_LOAD_RELAXED(&stats.softirq_items), ATOMIC_LOAD_RELAXED(&stats.softirq_time),
+           ATOMIC_LOAD_RELAXED(&stats.softirq_batches));
+    printf("║    ... terminados por ksoftirqd:  %-10lu                           ║\n",
+           ATOMIC_LOAD_RELAXED(&stats.ksoftirqd_items));
+    printf("║ 🛠️  Workqueue (kworkers):          %-6lu en %-10lu μs             ║\n",
+           ATOMIC_LOAD_RELAXED(&stats.work_items), ATOMIC_LOAD_RELAXED(&stats.work_time));
+    printf("║ 🧶 Hilos irq/N:                   %-6lu en %-10lu μs             ║\n",
+           ATOMIC_LOAD_RELAXED(&stats.irq_thread_items), ATOMIC_LOAD_RELAXED(&stats.irq_thread_time));
+    printf("║ 📶 NAPI: a polling / a IRQs:      %-6lu / %-6lu                    ║\n",
+           ATOMIC_LOAD_RELAXED(&stats.napi_poll_entries), ATOMIC_LOAD_RELAXED(&stats.napi_poll_exits));
+    printf("║    ... eventos por polling:       %-6lu en %-6lu pasadas (%lu sin budget) ║\n",
+           ATOMIC_LOAD_RELAXED(&stats.napi_polled), ATOMIC_LOAD_RELAXED(&stats.napi_polls),
+           ATOMIC_LOAD_RELAXED(&stats.napi_budget_exhausted));
+    
+    printf("║ 📥 Retenidas en el IRR:           %-10lu                           ║\n",
+           ATOMIC_LOAD_RELAXED(&stats.irq_latched));
+    printf("║ 🔁 Fusionadas (coalesced):        %-10lu                           ║\n",
+           ATOMIC_LOAD_RELAXED(&stats.irq_coalesced));
+    printf("║ 💨 Perdidas:                      %-10lu                           ║\n",
+           ATOMIC_LOAD_RELAXED(&stats.irq_lost));
+    printf("║ 👻 Espurias (nadie las reclamó):  %-10lu                           ║\n",
+           ATOMIC_LOAD_RELAXED(&stats.irq_spurious));
+    
+    unsigned long ticks = ATOMIC_LOAD_RELAXED(&stats.timer_ticks);
+    printf("║ ⏲️  Periodo del timer:            %-10.3f ms (HZ=%d)               ║\n",
+           timer_period_ns() / 1e6, timer_get_hz());
+    printf("║    ... retraso último/medio/máx:  %.1f / %.1f / %.1f μs               ║\n",
+           ATOMIC_LOAD_RELAXED(&stats.timer_lateness_last_ns) / 1e3,
+           ticks > 0 ? ATOMIC_LOAD_RELAXED(&stats.timer_lateness_total_ns) / 1e3 / ticks : 0.0,
+           ATOMIC_LOAD_RELAXED(&stats.timer_lateness_max_ns) / 1e3);
+    printf("║    ... ticks / perdidos:          %-6lu / %-6lu                    ║\n",
+           ticks, ATOMIC_LOAD_RELAXED(&stats.timer_missed_ticks));
+    printf("║    ... deriva evitada (vs sleep): %.3f ms                          ║\n",
+           ATOMIC_LOAD_RELAXED(&stats.timer_drift_ns) / 1e6);
+    unsigned long cycles = ATOMIC_LOAD_RELAXED(&stats.timer_periodic_cycles);
+    double cycle_cpu_us = cycles > 0 ? ATOMIC_LOAD_RELAXED(&stats.timer_cpu_ns) / 1e3 / cycles : 0.0;
+    unsigned long ticks_saved = ATOMIC_LOAD_RELAXED(&stats.nohz_ticks_saved);
+    uint64_t nohz_idle = ATOMIC_LOAD_RELAXED(&stats.nohz_idle_ns);
+    uint64_t idle_since = ATOMIC_LOAD_ACQ(&nohz_stop_ns);
+    if (idle_since != 0) {
+        // Parada en curso: contar también lo que lleva detenido el tick
+        uint64_t ongoing = monotonic_ns() - idle_since;
+        nohz_idle += ongoing;
+        ticks_saved += (unsigned long)(ongoing / timer_period_ns());
+    }
+    printf("║    ... CPU por tick periódico:    %.1f μs (%lu ticks medidos)        ║\n",
+           cycle_cpu_us, cycles);
+    printf("║ 💤 NO_HZ: paradas / one-shot:     %-6lu / %-6lu                    ║\n",
+           ATOMIC_LOAD_RELAXED(&stats.nohz_stops), ATOMIC_LOAD_RELAXED(&stats.nohz_oneshot_ticks));
+    printf("║    ... ticks ahorrados:           %-6lu en %.1f s ocioso            ║\n",
+           ticks_saved, nohz_idle / 1e9);
+    printf("║    ... CPU del timer ahorrada:    %.3f ms (estimada)               ║\n",
+           ticks_saved * cycle_cpu_us / 1e3);
+    pthread_mutex_lock(&timer_base.lock);
+    unsigned long wheel_armed = timer_base.wheel_armed;
+    unsigned long cascaded = timer_base.cascaded;
+    unsigned long hrtimers_armed = timer_base.heap_count;
+    pthread_mutex_unlock(&timer_base.lock);
+    unsigned long expiry_runs = ATOMIC_LOAD_RELAXED(&stats.timer_expiry_runs);
+    printf("║ ⏱️  Rueda: armados / caducados:    %-8lu / %-8lu (jiffy %llu)   ║\n",
+           wheel_armed, ATOMIC_LOAD_RELAXED(&stats.soft_timers_expired),
+           (unsigned long long)timer_jiffies());
+    printf("║    ... recolocados en cascada:    %-8lu                          ║\n", cascaded);
+    printf("║ ⏱️  hrtimers: armados / caducados: %-8lu / %-8lu                ║\n",
+           hrtimers_armed, ATOMIC_LOAD_RELAXED(&stats.hrtimers_expired));
+    printf("║    ... coste de expiración:       %.2f μs por pasada (%lu)          ║\n",
+           expiry_runs > 0 ? ATOMIC_LOAD_RELAXED(&stats.timer_expiry_ns) / 1e3 / expiry_runs : 0.0,
+           expiry_runs);
     
     // Calcular estadísticas adicionales
-    float irq_rate = uptime > 0 ? (float)stats.total_interrupts / uptime : 0;
+    float irq_rate = uptime > 0 ? (float)counters.total_interrupts / uptime : 0;
     printf("║ 📈 Tasa de interrupciones:        %.2f IRQs/segundo                ║\n", irq_rate);
     
     printf("╚══════════════════════════════════════════════════════════════════════════════╝\n");
@@ -757,6 +4811,14 @@ void show_system_stats() {
 
 // Mostrar ayuda
 void show_help() {
+    char period[40];
+    int hz = timer_get_hz();
+    
+    if (hz > 0) {
+        snprintf(period, sizeof(period), "a %d Hz", hz);
+    } else {
+        snprintf(period, sizeof(period), "cada %d segundos", TIMER_INTERVAL_SEC);
+    }
     printf("\n╔════════════════════════════════════════════════════════════════════════════════╗\n");
     printf("║                    SIMULADOR DE INTERRUPCIONES LINUX                           ║\n");
     printf("║                        Basado en la arquitectura x86                           ║\n");
@@ -767,17 +4829,20 @@ void show_help() {
     printf("║                                                                                ║\n");
     printf("║ 🔧 IDT (Interrupt Descriptor Table) - Tabla de vectores                        ║\n");
     printf("║ ⚡ ISR (Interrupt Service Routines) - Manejadores de interrupción              ║\n");
-    printf("║ 🕐 Timer PIT - Generador automático de IRQ0 cada 3 segundos                    ║\n");
+    printf("║ 🕐 Timer PIT - Generador automático de IRQ0 %-34s ║\n", period);
     printf("║ ⌨️  Controlador de teclado - Simulación de entrada de usuario                  ║\n");
     printf("║ 📊 Sistema de trazabilidad - Log detallado de eventos                          ║\n");
     printf("║                                                                                ║\n");
     printf("╠════════════════════════════════════════════════════════════════════════════════╣\n");
     printf("║                            MAPA DE INTERRUPCIONES                              ║\n");
     printf("╠════════════════════════════════════════════════════════════════════════════════╣\n");
-    printf("║ IRQ 0  - Timer del sistema (PIT) - Automático cada 3 segundos                  ║\n");
+    printf("║ IRQ 0  - Timer del sistema (PIT) - Automático %-32s ║\n", period);
     printf("║ IRQ 1  - Controlador de teclado (8042) - Manual                                ║\n");
     printf("║ IRQ 2  - Cascada del PIC secundario (reservada)                                ║\n");
-    printf("║ IRQ 3-15 - Dispositivos personalizados - Disponibles                           ║\n");
+    printf("║ IRQ 3-%-4d - Legacy (PIC 8259), vector fijo %#04x-%#04x - Disponibles            ║\n",
+           NR_IRQS_LEGACY - 1, IRQ0_VECTOR + 3, IRQ0_VECTOR + NR_IRQS_LEGACY - 1);
+    printf("║ IRQ %d-%-3d - Dinámicas (MSI/MSI-X y personalizadas), vector asignado %#04x-%#04x ║\n",
+           NR_IRQS_LEGACY, MAX_INTERRUPTS - 1, FIRST_DYNAMIC_VECTOR, FIRST_SYSTEM_VECTOR - 1);
     printf("╠════════════════════════════════════════════════════════════════════════════════╣\n");
     printf("║                              FLUJO DE INTERRUPCIÓN                             ║\n");
     printf("╠════════════════════════════════════════════════════════════════════════════════╣\n");
@@ -793,135 +4858,1131 @@ void show_help() {
 void debug_all_irq_states() {
     printf("\n=== DEBUG: TODOS LOS ESTADOS DE IRQ ===\n");
     
-    LOCK_IDT();
-    
     int free_count = 0;
     int registered_count = 0;
     int executing_count = 0;
+    int updating_count = 0;
+    int masked_count = 0;
+    int shown = 0;
     
-    for (int i = 0; i < MAX_INTERRUPTS; i++) {
-        const char* state_str = get_irq_state_string(idt[i].state);
+    // Las legacy siempre; de las dinámicas, solo las que tienen handler
+    for (int i = 0; i >= 0; i = (i + 1 < NR_IRQS_LEGACY) ? i + 1 : irq_next_active(i)) {
+        shown++;
+        irq_state_t state = ATOMIC_LOAD_ACQ(&idt[i].state);
+        int call_count = ATOMIC_LOAD_RELAXED(&idt[i].call_count);
+        const char* state_str = get_irq_state_string(state);
         const char* icon = "";
         
-        switch (idt[i].state) {
-            case IRQ_STATE_FREE:       icon = "⚪"; free_count++; break;
-            case IRQ_STATE_REGISTERED: icon = "🟢"; registered_count++; break;
-            case IRQ_STATE_EXECUTING:  icon = "🔴"; executing_count++; break;
+        switch (state) {
+            case IRQ_STATE_FREE:       icon = "⚪"; free_count++; break;
+            case IRQ_STATE_REGISTERED: icon = "🟢"; registered_count++; break;
+            case IRQ_STATE_EXECUTING:  icon = "🔴"; executing_count++; break;
+            case IRQ_STATE_UPDATING:   icon = "🟡"; updating_count++; break;
+            case IRQ_STATE_MASKED:     icon = "🟠"; masked_count++; break;
+        }
+        
+        printf("IRQ%2d: %s %-12s │ Vector 0x%02x │ Calls: %3d │ %s\n", 
+               i, icon, state_str, ATOMIC_LOAD_RELAXED(&irq_meta[i].vector), call_count, 
+               (call_count > 0) ? irq_meta[i].description : "Sin actividad");
+    }
+    
+    printf("\n📊 RESUMEN DE ESTADOS:\n");
+    printf("  🟢 Registradas: %d\n", registered_count);
+    printf("  🔴 Ejecutándose: %d\n", executing_count);
+    if (updating_count > 0) {
+        printf("  🟡 Actualizándose: %d\n", updating_count);
+    }
+    if (masked_count > 0) {
+        printf("  🟠 Enmascaradas (hilo irq/N en curso): %d\n", masked_count);
+    }
+    printf("  ⚪ Libres: %d\n", free_count + MAX_INTERRUPTS - shown);
+    printf("  📋 Total: %d\n", MAX_INTERRUPTS);
+    printf("\n");
+}
+
+// Menú interactivo
+void show_menu() {
+    logger_flush();
+    printf("\n╔══════════════════════════════════════════════════════════════════════════════╗\n");
+    printf("║                    🐧 SIMULADOR KERNEL LINUX - INTERRUPCIONES 🐧             ║\n");
+    printf("╠══════════════════════════════════════════════════════════════════════════════╣\n");
+    printf("║  1. 🔥 Generar interrupción manual     │  6. 🗑️  Desregistrar ISR            ║\n");
+    printf("║  2. 📝 Registrar ISR personalizada     │  7. 📊 Estadísticas del sistema     ║\n");
+    printf("║  3. 🎯 Estado de la IDT                │  8. ⚙️  Configurar logging          ║\n");
+    printf("║  4. 📜 Mostrar traza reciente          │  9. ❓ Ayuda del simulador          ║\n");
+    printf("║  5. 🧪 Suite de pruebas múltiples      │  0. 🚪 Salir del programa           ║\n");
+    printf("╚══════════════════════════════════════════════════════════════════════════════╝\n");
+    printf("Seleccione una opción [0-9]: ");
+    fflush(stdout);
+}
+
+void logging_submenu() {
+    int option;
+    
+    while (1) {
+        logger_flush();
+        printf("\n=== CONFIGURACIÓN DE LOGGING ===\n");
+        printf("Estado actual: ");
+        
+        switch (current_log_level) {
+            case LOG_LEVEL_SILENT:
+                printf("SILENCIOSO");
+                break;
+            case LOG_LEVEL_USER_ONLY:
+                printf("SOLO USUARIO (Timer logs: %s)", show_timer_logs ? "ON" : "OFF");
+                break;
+            case LOG_LEVEL_VERBOSE:
+                printf("VERBOSE");
+                break;
+        }
+        
+        printf("\n\n1. Modo silencioso (solo guardar en historial)\n");
+        printf("2. Modo usuario (solo acciones del usuario)\n");
+        printf("3. Modo verbose (mostrar todo)\n");
+        printf("4. Toggle logs del timer (actual: %s)\n", show_timer_logs ? "ON" : "OFF");
+        printf("5. Mostrar logs del timer en tiempo real por 30 segundos\n");
+        printf("6. Frecuencia del timer (actual: ");
+        if (timer_get_hz() > 0) {
+            printf("%d Hz)\n", timer_get_hz());
+        } else {
+            printf("cada %d s)\n", TIMER_INTERVAL_SEC);
+        }
+        printf("7. Armar timers de prueba (caducados: %lu)\n", ATOMIC_LOAD_RELAXED(&test_timers_fired));
+        printf("0. Volver al menú principal\n");
+        printf("Seleccione una opción: ");
+        fflush(stdout);
+        
+        option = get_valid_input(0, 7);
+        
+        switch (option) {
+            case 1:
+                set_log_level(LOG_LEVEL_SILENT);
+                break;
+            case 2:
+                set_log_level(LOG_LEVEL_USER_ONLY);
+                break;
+            case 3:
+                set_log_level(LOG_LEVEL_VERBOSE);
+                break;
+            case 4:
+                toggle_timer_logs();
+                break;
+            case 5:
+                printf("Mostrando logs del timer por 30 segundos...\n");
+                int old_show_timer = show_timer_logs;
+                log_level_t old_level = current_log_level;
+                show_timer_logs = 1;
+                current_log_level = LOG_LEVEL_USER_ONLY;
+                sleep(30);
+                show_timer_logs = old_show_timer;
+                current_log_level = old_level;
+                printf("Volviendo a la configuración anterior.\n");
+                break;
+            case 6:
+                printf("Nueva frecuencia en Hz (1-%d, 0 = cada %d s): ", TIMER_MAX_HZ, TIMER_INTERVAL_SEC);
+                fflush(stdout);
+                timer_set_hz(get_valid_input(0, TIMER_MAX_HZ));
+                break;
+            case 7:
+                printf("Timers a armar (1-100000; cada uno en la rueda y como hrtimer): ");
+                fflush(stdout);
+                if (arm_test_timers(get_valid_input(1, 100000)) != SUCCESS) {
+                    printf("✗ Sin memoria para los timers de prueba.\n");
+                }
+                break;
+            case 0:
+                return;
+        }
+    }
+}
+
+
+void test_concurrent_interrupts() {
+    printf("Probando interrupciones concurrentes...\n");
+    
+    // Generar múltiples interrupciones rápidamente
+    for (int i = 0; i < 5; i++) {
+        dispatch_interrupt(IRQ_TIMER);
+        dispatch_interrupt(IRQ_KEYBOARD);
+        usleep(100000); // 100ms
+    }
+    
+    printf("Prueba de concurrencia completada.\n");
+}
+
+void test_stress_interrupts() {
+    printf("Ejecutando prueba de stress...\n");
+    
+    for (int i = 0; i < 20; i++) {
+        dispatch_interrupt(i % NR_IRQS_LEGACY);
+        usleep(50000); // 50ms
+    }
+    
+    printf("Prueba de stress completada.\n");
+}
+
+// Estado del benchmark de timers: los callbacks se rearman solos para que
+// el número de timers armados se mantenga constante durante la medición
+static struct {
+    timer_base_t *base;
+    uint64_t now;                        // Jiffy (rueda) o ns (hrtimers) en curso
+    uint64_t range;                      // Caducidad aleatoria en [now + 1, now + range]
+    uint64_t rng;
+    unsigned long fired;
+} bench_timer_ctx;
+
+// xorshift64: determinista y sin el lock interno de rand()
+static uint64_t bench_rand(void) {
+    uint64_t x = bench_timer_ctx.rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    bench_timer_ctx.rng = x;
+    return x;
+}
+
+static void bench_wheel_fn(void *data) {
+    bench_timer_ctx.fired++;
+    base_mod_timer(bench_timer_ctx.base, data, bench_timer_ctx.now + 1 + bench_rand() % bench_timer_ctx.range);
+}
+
+static void bench_hrtimer_fn(void *data) {
+    bench_timer_ctx.fired++;
+    base_hrtimer_start(bench_timer_ctx.base, data, bench_timer_ctx.now + 1 + bench_rand() % bench_timer_ctx.range);
+}
+
+// Coste por tick de la rueda, de un heap de hrtimers y de una lista lineal
+// (lo que cuesta revisar todos los timers en cada tick) según crece el
+// número de timers armados. Las caducidades se reparten en 4 * N ticks, así
+// que caducan entre 0.25 y 0.5 timers por tick con cualquier N y la
+// diferencia es solo el coste de la estructura.
+int bench_timers(void) {
+    static const unsigned long counts[] = {1000, 10000, 100000, 500000};
+    const uint64_t ticks = 1 << 18;
+    const uint64_t list_ticks = 256;
+    const uint64_t tick_ns = 1000000;    // Jiffy de 1 ms (HZ=1000) para los hrtimers
+    
+    printf("⏱️  BENCHMARK: timers de software (rueda jerárquica vs heap de hrtimers vs lista)\n");
+    printf("   %lu ticks por medida (%lu con la lista); caducidades en [1, 4N] ticks\n\n",
+           (unsigned long)ticks, (unsigned long)list_ticks);
+    printf("%9s │ %27s │ %27s │ %11s │ %9s\n", "", "rueda (ns)", "hrtimers (ns)", "lista (ns)", "caducados");
+    printf("%9s │ %7s %7s %11s │ %7s %7s %11s │ %11s │ %9s\n",
+           "timers", "alta", "baja", "por tick", "alta", "baja", "por tick", "por tick", "por tick");
+    
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        unsigned long n = counts[c];
+        timer_base_t *base = calloc(1, sizeof(*base));
+        soft_timer_t *timers = calloc(n, sizeof(*timers));
+        hrtimer_t *hrtimers = calloc(n, sizeof(*hrtimers));
+        uint64_t *list = calloc(n, sizeof(*list));
+        if (!base || !timers || !hrtimers || !list) {
+            free(base);
+            free(timers);
+            free(hrtimers);
+            free(list);
+            fprintf(stderr, "❌ Sin memoria para %lu timers\n", n);
+            return ERROR_TRACE_STORAGE;
+        }
+        pthread_mutex_init(&base->lock, NULL);
+        bench_timer_ctx.base = base;
+        bench_timer_ctx.rng = 0x9E3779B97F4A7C15ULL;
+        
+        // Rueda: alta, ticks en régimen estable y baja
+        bench_timer_ctx.range = 4 * n;
+        bench_timer_ctx.now = 0;
+        uint64_t t0 = monotonic_ns();
+        for (unsigned long i = 0; i < n; i++) {
+            timer_setup(&timers[i], bench_wheel_fn, &timers[i]);
+            base_mod_timer(base, &timers[i], 1 + bench_rand() % bench_timer_ctx.range);
+        }
+        uint64_t t1 = monotonic_ns();
+        bench_timer_ctx.fired = 0;
+        for (uint64_t j = 1; j <= ticks; j++) {
+            bench_timer_ctx.now = j;
+            wheel_run(base, j);
+        }
+        uint64_t t2 = monotonic_ns();
+        double fired_per_tick = (double)bench_timer_ctx.fired / ticks;
+        for (unsigned long i = 0; i < n; i++) {
+            base_del_timer(base, &timers[i]);
+        }
+        uint64_t t3 = monotonic_ns();
+        double wheel_add = (double)(t1 - t0) / n;
+        double wheel_tick = (double)(t2 - t1) / ticks;
+        double wheel_del = (double)(t3 - t2) / n;
+        
+        // hrtimers: mismas caducidades en ns, un "tick" cada tick_ns
+        bench_timer_ctx.range = 4 * n * tick_ns;
+        bench_timer_ctx.now = 0;
+        t0 = monotonic_ns();
+        for (unsigned long i = 0; i < n; i++) {
+            hrtimer_setup(&hrtimers[i], bench_hrtimer_fn, &hrtimers[i]);
+            if (base_hrtimer_start(base, &hrtimers[i], 1 + bench_rand() % bench_timer_ctx.range) != SUCCESS) {
+                fprintf(stderr, "❌ Sin memoria para el heap de %lu hrtimers\n", n);
+                n = i;
+                break;
+            }
+        }
+        t1 = monotonic_ns();
+        for (uint64_t j = 1; j <= ticks; j++) {
+            uint64_t max_late = 0;
+            bench_timer_ctx.now = j * tick_ns;
+            hrtimer_run(base, bench_timer_ctx.now, &max_late);
+        }
+        t2 = monotonic_ns();
+        for (unsigned long i = 0; i < n; i++) {
+            base_hrtimer_cancel(base, &hrtimers[i]);
+        }
+        t3 = monotonic_ns();
+        double hr_add = (double)(t1 - t0) / n;
+        double hr_tick = (double)(t2 - t1) / ticks;
+        double hr_del = (double)(t3 - t2) / n;
+        
+        // Lista lineal: cada tick revisa todos los timers
+        for (unsigned long i = 0; i < n; i++) {
+            list[i] = 1 + bench_rand() % (4 * n);
+        }
+        t0 = monotonic_ns();
+        for (uint64_t j = 1; j <= list_ticks; j++) {
+            for (unsigned long i = 0; i < n; i++) {
+                if (list[i] <= j) {
+                    list[i] = j + 1 + bench_rand() % (4 * n);
+                }
+            }
+        }
+        t1 = monotonic_ns();
+        double list_tick = (double)(t1 - t0) / list_ticks;
+        
+        printf("%9lu │ %7.1f %7.1f %11.1f │ %7.1f %7.1f %11.1f │ %11.1f │ %9.2f\n",
+               n, wheel_add, wheel_del, wheel_tick, hr_add, hr_del, hr_tick, list_tick, fired_per_tick);
+        
+        pthread_mutex_destroy(&base->lock);
+        free(base->heap);
+        free(base);
+        free(timers);
+        free(hrtimers);
+        free(list);
+    }
+    printf("\nRueda: alta y baja O(1); el coste por tick solo depende de los timers que caducan\n"
+           "y de las cascadas. Heap: alta y baja O(log n). Lista: cada tick es O(n).\n");
+    return SUCCESS;
+}
+
+// Timer de la comprobación de la rueda y del heap: caducidad esperada y
+// cuántas veces y en qué instante ha caducado
+typedef struct {
+    uint64_t expires;
+    uint64_t fired_at;
+    unsigned int fired;
+    int cancelled;                       // Cancelado antes de caducar: no debe caducar
+    int rearm;                           // Rearmarse desde su callback a expires + rearm
+    soft_timer_t timer;
+    hrtimer_t hrtimer;
+} check_timer_t;
+
+static struct {
+    timer_base_t *base;
+    uint64_t now;
+    uint64_t last_hr_expires;            // Caducidad del último hrtimer (orden del heap)
+    unsigned long out_of_order;
+    unsigned long early;                 // Caducados antes de tiempo antes de rearmarse
+} check_timer_ctx;
+
+static void check_wheel_fn(void *data) {
+    check_timer_t *t = data;
+    
+    t->fired++;
+    t->fired_at = check_timer_ctx.now;
+    if (t->rearm) {
+        if (t->fired_at < t->expires) {
+            check_timer_ctx.early++;
+        }
+        t->expires += (uint64_t)t->rearm;
+        t->rearm = 0;
+        t->fired = 0;
+        base_mod_timer(check_timer_ctx.base, &t->timer, t->expires);
+    }
+}
+
+static void check_hrtimer_fn(void *data) {
+    check_timer_t *t = data;
+    
+    t->fired++;
+    t->fired_at = check_timer_ctx.now;
+    if (t->expires < check_timer_ctx.last_hr_expires) {
+        check_timer_ctx.out_of_order++;
+    }
+    check_timer_ctx.last_hr_expires = t->expires;
+}
+
+// Comprobar que cada timer caduca exactamente una vez y no antes de su
+// instante. Devuelve los errores encontrados.
+static unsigned long check_timers_verify(const char *what, check_timer_t *timers, size_t n, uint64_t origin) {
+    unsigned long errors = 0;
+    
+    for (size_t i = 0; i < n; i++) {
+        check_timer_t *t = &timers[i];
+        unsigned int expected = t->cancelled ? 0 : 1;
+        if (t->fired != expected) {
+            printf("❌ %s: timer a +%llu caducado %u veces (esperadas %u)\n", what,
+                   (unsigned long long)(t->expires - origin), t->fired, expected);
+            errors++;
+        } else if (t->fired && t->fired_at < t->expires) {
+            printf("❌ %s: timer a +%llu caducado antes de tiempo (+%llu)\n", what,
+                   (unsigned long long)(t->expires - origin), (unsigned long long)(t->fired_at - origin));
+            errors++;
+        }
+    }
+    return errors;
+}
+
+// Comprobación de la rueda en cascada y del heap de hrtimers (--bench
+// timers-check): timers en los límites de nivel de la rueda (255/256, 2^14,
+// 2^20 jiffies), desde un jiffy alineado y otro que no lo está, con bajas y
+// rearmes antes y después de bajar en cascada, y hrtimers con las mismas
+// distancias en ns procesados a saltos.
+int check_timers(void) {
+    static const uint64_t deltas[] = {
+        1, 2, 255, 256, 257, 511, 512,
+        (1 << 14) - 1, 1 << 14, (1 << 14) + 1,
+        (1 << 20) - 1, 1 << 20, (1 << 20) + 1, (1 << 20) + 300
+    };
+    static const uint64_t origins[] = {0, 1000};
+    const size_t n_deltas = sizeof(deltas) / sizeof(deltas[0]);
+    // Cubre el rearme más lejano: caducar a 2^20 + 300 y volver a armarse a esa distancia
+    const uint64_t end = (1 << 21) + (1 << 15);
+    unsigned long errors = 0;
+    unsigned long checked = 0;
+    
+    printf("⏱️  COMPROBACIÓN: rueda jerárquica en cascada y heap de hrtimers\n");
+    
+    for (size_t o = 0; o < sizeof(origins) / sizeof(origins[0]); o++) {
+        uint64_t origin = origins[o];
+        // Por cada distancia: uno normal, uno que se cancela, uno que se
+        // rearma y uno que se rearma desde su propio callback
+        size_t n = n_deltas * 4;
+        timer_base_t *base = calloc(1, sizeof(*base));
+        check_timer_t *timers = calloc(n, sizeof(*timers));
+        if (!base || !timers) {
+            free(base);
+            free(timers);
+            fprintf(stderr, "❌ Sin memoria para la comprobación de timers\n");
+            return ERROR_TRACE_STORAGE;
+        }
+        pthread_mutex_init(&base->lock, NULL);
+        check_timer_ctx.base = base;
+        check_timer_ctx.early = 0;
+        base->clk = origin;
+        
+        for (size_t d = 0; d < n_deltas; d++) {
+            for (int k = 0; k < 4; k++) {
+                check_timer_t *t = &timers[d * 4 + k];
+                t->expires = origin + deltas[d];
+                t->rearm = k == 3 ? (int)deltas[(d + 5) % n_deltas] : 0;
+                timer_setup(&t->timer, check_wheel_fn, t);
+                base_mod_timer(base, &t->timer, t->expires);
+            }
+        }
+        
+        for (uint64_t j = origin; j <= origin + end; j++) {
+            check_timer_ctx.now = j;
+            // A mitad de camino de cada timer: cancelar el segundo y rearmar
+            // el tercero (a más distancia o a menos, según la posición), ya
+            // bajado o no en cascada
+            for (size_t d = 0; d < n_deltas; d++) {
+                if (j != origin + deltas[d] / 2) {
+                    continue;
+                }
+                check_timer_t *cancel = &timers[d * 4 + 1];
+                check_timer_t *move = &timers[d * 4 + 2];
+                if (base_del_timer(base, &cancel->timer) != 1) {
+                    printf("❌ Rueda: del_timer de un timer armado a +%llu no lo encontró\n",
+                           (unsigned long long)deltas[d]);
+                    errors++;
+                }
+                cancel->cancelled = 1;
+                if (base_del_timer(base, &cancel->timer) != 0) {
+                    printf("❌ Rueda: del_timer repetido a +%llu devolvió armado\n",
+                           (unsigned long long)deltas[d]);
+                    errors++;
+                }
+                move->expires = j + deltas[(d + n_deltas / 2) % n_deltas];
+                if (base_mod_timer(base, &move->timer, move->expires) != 1) {
+                    printf("❌ Rueda: mod_timer de un timer armado a +%llu no lo encontró\n",
+                           (unsigned long long)deltas[d]);
+                    errors++;
+                }
+            }
+            wheel_run(base, j);
+        }
+        
+        errors += check_timers_verify("Rueda", timers, n, origin);
+        if (check_timer_ctx.early) {
+            printf("❌ Rueda: %lu timers caducados antes de tiempo antes de rearmarse\n", check_timer_ctx.early);
+            errors++;
+        }
+        if (base->wheel_armed != 0) {
+            printf("❌ Rueda: %lu timers siguen armados al final\n", base->wheel_armed);
+            errors++;
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (base_del_timer(base, &timers[i].timer) != 0) {
+                printf("❌ Rueda: del_timer de un timer ya caducado devolvió armado\n");
+                errors++;
+                break;
+            }
+        }
+        printf("   Rueda desde el jiffy %llu: %zu timers, %lu recolocados en cascada\n",
+               (unsigned long long)origin, n, base->cascaded);
+        checked += n;
+        
+        // hrtimers: mismas distancias en ns, el reloj avanza a saltos de
+        // 1000 ns, así que caducan en el primer salto igual o posterior
+        memset(timers, 0, n * sizeof(*timers));
+        check_timer_ctx.last_hr_expires = 0;
+        check_timer_ctx.out_of_order = 0;
+        for (size_t d = 0; d < n_deltas; d++) {
+            for (int k = 0; k < 3; k++) {
+                check_timer_t *t = &timers[d * 3 + k];
+                t->expires = origin + deltas[d] * 7;
+                hrtimer_setup(&t->hrtimer, check_hrtimer_fn, t);
+                if (base_hrtimer_start(base, &t->hrtimer, t->expires) != SUCCESS) {
+                    fprintf(stderr, "❌ Sin memoria para el heap de hrtimers\n");
+                    errors++;
+                }
+            }
+        }
+        for (size_t d = 0; d < n_deltas; d++) {
+            check_timer_t *cancel = &timers[d * 3 + 1];
+            check_timer_t *move = &timers[d * 3 + 2];
+            if (base_hrtimer_cancel(base, &cancel->hrtimer) != 1) {
+                printf("❌ hrtimers: cancelar un hrtimer activo no lo encontró\n");
+                errors++;
+            }
+            cancel->cancelled = 1;
+            move->expires = origin + deltas[(d + n_deltas / 2) % n_deltas] * 7 + 3;
+            base_hrtimer_start(base, &move->hrtimer, move->expires);
+        }
+        for (uint64_t now = origin; base->heap_count > 0; now += 1000) {
+            uint64_t max_late = 0;
+            check_timer_ctx.now = now;
+            hrtimer_run(base, now, &max_late);
         }
+        errors += check_timers_verify("hrtimers", timers, n_deltas * 3, origin);
+        if (check_timer_ctx.out_of_order) {
+            printf("❌ hrtimers: %lu caducados fuera de orden\n", check_timer_ctx.out_of_order);
+            errors++;
+        }
+        checked += n_deltas * 3;
         
-        printf("IRQ%2d: %s %-12s │ Calls: %3d │ %s\n", 
-               i, icon, state_str, idt[i].call_count, 
-               (idt[i].call_count > 0) ? idt[i].description : "Sin actividad");
+        pthread_mutex_destroy(&base->lock);
+        free(base->heap);
+        free(base);
+        free(timers);
     }
     
-    UNLOCK_IDT();
+    if (errors) {
+        printf("❌ Timers: %lu errores en %lu timers comprobados\n", errors, checked);
+        return ERROR_INVALID_IRQ;
+    }
+    printf("✅ Timers: %lu timers comprobados, todos caducados una vez y a tiempo\n", checked);
+    return SUCCESS;
+}
+
+// Dispositivo del benchmark de líneas compartidas: su handler solo lee su
+// registro de estado (active) y reclama la IRQ si indica actividad
+typedef struct {
+    int active;
+    unsigned long claimed;
+} bench_shared_dev_t;
+
+static irqreturn_t bench_shared_handler(int irq_num, void *dev_id) {
+    bench_shared_dev_t *dev = dev_id;
+    (void)irq_num;
     
-    printf("\n📊 RESUMEN DE ESTADOS:\n");
-    printf("  🟢 Registradas: %d\n", registered_count);
-    printf("  🔴 Ejecutándose: %d\n", executing_count);
-    printf("  ⚪ Libres: %d\n", free_count);
-    printf("  📋 Total: %d\n", MAX_INTERRUPTS);
-    printf("\n");
+    if (!__atomic_load_n(&dev->active, __ATOMIC_RELAXED)) {
+        return IRQ_NONE;
+    }
+    dev->claimed++;
+    return IRQ_HANDLED;
 }
 
-// Menú interactivo
-void show_menu() {
-    printf("\n╔══════════════════════════════════════════════════════════════════════════════╗\n");
-    printf("║                    🐧 SIMULADOR KERNEL LINUX - INTERRUPCIONES 🐧             ║\n");
-    printf("╠══════════════════════════════════════════════════════════════════════════════╣\n");
-    printf("║  1. 🔥 Generar interrupción manual     │  6. 🗑️  Desregistrar ISR            ║\n");
-    printf("║  2. 📝 Registrar ISR personalizada     │  7. 📊 Estadísticas del sistema     ║\n");
-    printf("║  3. 🎯 Estado de la IDT                │  8. ⚙️  Configurar logging          ║\n");
-    printf("║  4. 📜 Mostrar traza reciente          │  9. ❓ Ayuda del simulador          ║\n");
-    printf("║  5. 🧪 Suite de pruebas múltiples      │  0. 🚪 Salir del programa           ║\n");
-    printf("╚══════════════════════════════════════════════════════════════════════════════╝\n");
-    printf("Seleccione una opción [0-9]: ");
-    fflush(stdout);
+// La misma cadena como lista enlazada de nodos sueltos en el heap, para comparar
+typedef struct bench_action_node {
+    irq_action_t action;
+    struct bench_action_node *next;
+} bench_action_node_t;
+
+// Soltar la línea y las reservas de una medida de bench_shared(): los
+// handlers registrados, la lista enlazada y los primeros count rellenos
+static void bench_shared_release(int irq_num, bench_action_node_t *head, void **padding, int count) {
+    if (ATOMIC_LOAD_RELAXED(&idt[irq_num].action_count) > 0) {
+        unregister_isr(irq_num);
+    }
+    while (head) {
+        bench_action_node_t *next = head->next;
+        free(head);
+        head = next;
+    }
+    for (int i = 0; i < count; i++) {
+        free(padding[i]);
+    }
 }
 
-void logging_submenu() {
-    int option;
+// Coste de despacho de una línea compartida según crece su cadena. Solo el
+// último dispositivo reclama cada IRQ, aunque la cadena se recorre entera
+// siempre (cualquier dispositivo puede haber levantado la línea). Se mide
+// el despacho completo, el recorrido de la cadena contigua y el de una
+// lista enlazada equivalente. Una pasada final sin actividad en ningún
+// dispositivo comprueba la contabilidad de espurias.
+int bench_shared(void) {
+    static const int lengths[] = {1, 2, 4, 8, 16};
+    const int irq_num = 5;
+    const unsigned long dispatches = 100000;
+    const unsigned long walks = 1000000;
+    const unsigned long spurious_rounds = 1000;
+    static bench_shared_dev_t devs[MAX_SHARED_HANDLERS];
     
-    while (1) {
-        printf("\n=== CONFIGURACIÓN DE LOGGING ===\n");
-        printf("Estado actual: ");
+    trace_console_muted = 1;
+    init_idt();
+    init_system_stats();
+    
+    printf("🔗 BENCHMARK: líneas compartidas (IRQF_SHARED) - IRQ %d\n", irq_num);
+    printf("   %lu despachos y %lu recorridos por medida; reclama el último dispositivo\n\n",
+           dispatches, walks);
+    printf("%9s │ %14s │ %14s │ %14s │ %9s\n",
+           "handlers", "despacho (ns)", "contigua (ns)", "lista (ns)", "espurias");
+    
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        int count = lengths[l];
+        bench_action_node_t *head = NULL;
+        bench_action_node_t **tail = &head;
+        void *padding[MAX_SHARED_HANDLERS];
         
-        switch (current_log_level) {
-            case LOG_LEVEL_SILENT:
-                printf("SILENCIOSO");
-                break;
-            case LOG_LEVEL_USER_ONLY:
-                printf("SOLO USUARIO (Timer logs: %s)", show_timer_logs ? "ON" : "OFF");
-                break;
-            case LOG_LEVEL_VERBOSE:
-                printf("VERBOSE");
-                break;
+        for (int i = 0; i < count; i++) {
+            devs[i].active = (i == count - 1);
+            devs[i].claimed = 0;
+            if (request_shared_irq(irq_num, bench_shared_handler, &devs[i], "bench") != SUCCESS) {
+                fprintf(stderr, "❌ No se pudo compartir la IRQ %d entre %d handlers\n", irq_num, count);
+                bench_shared_release(irq_num, head, padding, i);
+                trace_console_muted = 0;
+                return ERROR_IRQ_BUSY;
+            }
+            // Nodos separados por otras reservas, como en un heap con uso real
+            bench_action_node_t *node = malloc(sizeof(*node));
+            padding[i] = malloc(256 + (size_t)(i * 64));
+            if (!node || !padding[i]) {
+                free(node);
+                free(padding[i]);
+                bench_shared_release(irq_num, head, padding, i);
+                fprintf(stderr, "❌ Sin memoria para la lista de %d handlers\n", count);
+                trace_console_muted = 0;
+                return ERROR_TRACE_STORAGE;
+            }
+            node->action = irq_meta[irq_num].actions[i];
+            node->next = NULL;
+            *tail = node;
+            tail = &node->next;
         }
         
-        printf("\n\n1. Modo silencioso (solo guardar en historial)\n");
-        printf("2. Modo usuario (solo acciones del usuario)\n");
-        printf("3. Modo verbose (mostrar todo)\n");
-        printf("4. Toggle logs del timer (actual: %s)\n", show_timer_logs ? "ON" : "OFF");
-        printf("5. Mostrar logs del timer en tiempo real por 30 segundos\n");
-        printf("0. Volver al menú principal\n");
-        printf("Seleccione una opción: ");
-        fflush(stdout);
+        uint64_t t0 = monotonic_ns();
+        for (unsigned long n = 0; n < dispatches; n++) {
+            dispatch_interrupt(irq_num);
+        }
+        uint64_t t1 = monotonic_ns();
         
-        option = get_valid_input(0, 5);
+        // Recorridos sin el resto del despacho (trazas, IRR/ISR, EOI, estadísticas)
+        unsigned long handled = 0;
+        for (unsigned long n = 0; n < walks; n++) {
+            handled += irq_run_actions(&irq_meta[irq_num], irq_num, count) == IRQ_HANDLED;
+        }
+        uint64_t t2 = monotonic_ns();
+        for (unsigned long n = 0; n < walks; n++) {
+            irqreturn_t ret = IRQ_NONE;
+            for (bench_action_node_t *node = head; node != NULL; node = node->next) {
+                if (node->action.handler(irq_num, node->action.dev_id) == IRQ_HANDLED) {
+                    __atomic_store_n(&node->action.handled, node->action.handled + 1, __ATOMIC_RELAXED);
+                    ret = IRQ_HANDLED;
+                }
+            }
+            handled += ret == IRQ_HANDLED;
+        }
+        uint64_t t3 = monotonic_ns();
         
-        switch (option) {
-            case 1:
-                set_log_level(LOG_LEVEL_SILENT);
-                break;
-            case 2:
-                set_log_level(LOG_LEVEL_USER_ONLY);
+        devs[count - 1].active = 0;
+        unsigned long spurious_before = ATOMIC_LOAD_RELAXED(&irq_meta[irq_num].spurious_count);
+        for (unsigned long n = 0; n < spurious_rounds; n++) {
+            dispatch_interrupt(irq_num);
+        }
+        unsigned long spurious = ATOMIC_LOAD_RELAXED(&irq_meta[irq_num].spurious_count) - spurious_before;
+        
+        printf("%9d │ %14.1f │ %14.1f │ %14.1f │ %4lu/%-4lu\n", count,
+               (double)(t1 - t0) / dispatches, (double)(t2 - t1) / walks,
+               (double)(t3 - t2) / walks, spurious, spurious_rounds);
+        if (handled != 2 * walks || devs[count - 1].claimed != dispatches + 2 * walks) {
+            fprintf(stderr, "⚠️  El último dispositivo no reclamó todas las IRQs\n");
+        }
+        
+        bench_shared_release(irq_num, head, padding, count);
+    }
+    
+    trace_console_muted = 0;
+    printf("\nCada handler suma una llamada indirecta y la lectura de su registro de estado.\n"
+           "Con la cadena en caché ambos recorridos cuestan lo mismo; la contigua ocupa\n"
+           "líneas consecutivas del descriptor en vez de un nodo suelto del heap por handler.\n");
+    return SUCCESS;
+}
+
+// Réplica del descriptor antes de separar la parte caliente de la fría (888
+// bytes, sin alinear): el final de un descriptor (action_count, que lee cada
+// despacho) comparte línea con el principio del siguiente (isr, state, call_count)
+typedef struct {
+    void (*isr)(int);
+    irq_state_t state;
+    int call_count;
+    time_t last_call;
+    unsigned long total_execution_time;
+    char cold[840];                      // Descripción, hilo irq/N, NAPI, latencias y cadena
+    int action_count;
+    unsigned long spurious_count;
+} bench_aos_desc_t;
+
+// Tabla caliente densa pero sin alinear: dos IRQs por línea de caché
+typedef struct {
+    irq_state_t state;
+    int call_count;
+    void (*isr)(int);
+    unsigned long total_execution_time;
+    int action_count;
+} bench_dense_desc_t;
+
+// Operaciones de memoria de un despacho sobre un descriptor: CAS de entrada,
+// lectura del handler, contadores y EOI
+#define BENCH_IDT_DISPATCH(desc) do {                                              \
+        irq_state_t expected = IRQ_STATE_REGISTERED;                               \
+        if (ATOMIC_CAS(&(desc)->state, &expected, IRQ_STATE_EXECUTING)) {         \
+            if (ATOMIC_LOAD_RELAXED(&(desc)->action_count) == 0) {                 \
+                (desc)->isr(0);                                                    \
+            }                                                                      \
+            ATOMIC_FETCH_ADD(&(desc)->call_count, 1);                              \
+            ATOMIC_FETCH_ADD(&(desc)->total_execution_time, 1UL);                  \
+            __atomic_store_n(&(desc)->state, IRQ_STATE_REGISTERED, __ATOMIC_SEQ_CST); \
+        }                                                                          \
+    } while (0)
+
+#define BENCH_IDT_MAX_INJECTORS 8
+
+typedef enum {
+    BENCH_IDT_AOS,                       // bench_aos_desc_t
+    BENCH_IDT_DENSE,                     // bench_dense_desc_t
+    BENCH_IDT_SPLIT,                     // irq_descriptor_t (el de idt[])
+    BENCH_IDT_DISPATCH_REAL              // dispatch_interrupt() sobre idt[]
+} bench_idt_mode_t;
+
+// Inyector del benchmark: despacha una y otra vez su propia IRQ
+typedef struct {
+    bench_idt_mode_t mode;
+    int index;                           // Posición del inyector (IRQ vecina de la del siguiente)
+    unsigned long iterations;
+} bench_idt_injector_t;
+
+static bench_aos_desc_t bench_aos_descs[BENCH_IDT_MAX_INJECTORS];
+static bench_dense_desc_t bench_dense_descs[BENCH_IDT_MAX_INJECTORS] __attribute__((aligned(CACHE_LINE_SIZE)));
+static irq_descriptor_t bench_split_descs[BENCH_IDT_MAX_INJECTORS];
+static int bench_idt_go = 0;
+
+static void bench_idt_isr(int irq_num) {
+    (void)irq_num;
+}
+
+static void *bench_idt_injector(void *arg) {
+    bench_idt_injector_t *injector = arg;
+    int i = injector->index;
+    
+    while (!__atomic_load_n(&bench_idt_go, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+    for (unsigned long n = 0; n < injector->iterations; n++) {
+        switch (injector->mode) {
+            case BENCH_IDT_AOS:
+                BENCH_IDT_DISPATCH(&bench_aos_descs[i]);
                 break;
-            case 3:
-                set_log_level(LOG_LEVEL_VERBOSE);
+            case BENCH_IDT_DENSE:
+                BENCH_IDT_DISPATCH(&bench_dense_descs[i]);
                 break;
-            case 4:
-                toggle_timer_logs();
+            case BENCH_IDT_SPLIT:
+                BENCH_IDT_DISPATCH(&bench_split_descs[i]);
                 break;
-            case 5:
-                printf("Mostrando logs del timer por 30 segundos...\n");
-                int old_show_timer = show_timer_logs;
-                log_level_t old_level = current_log_level;
-                show_timer_logs = 1;
-                current_log_level = LOG_LEVEL_USER_ONLY;
-                sleep(30);
-                show_timer_logs = old_show_timer;
-                current_log_level = old_level;
-                printf("Volviendo a la configuración anterior.\n");
+            case BENCH_IDT_DISPATCH_REAL:
+                dispatch_interrupt(NR_IRQS_LEGACY + i);
                 break;
-            case 0:
-                return;
         }
     }
+    return NULL;
 }
 
+// Lanzar count inyectores en paralelo y devolver el coste agregado en ns por
+// despacho (tiempo de pared entre todos los despachos): si escala, baja con
+// cada inyector que se añade
+static double bench_idt_run(bench_idt_mode_t mode, int count, unsigned long iterations) {
+    pthread_t threads[BENCH_IDT_MAX_INJECTORS];
+    bench_idt_injector_t injectors[BENCH_IDT_MAX_INJECTORS];
+    int started = 0;
+    
+    __atomic_store_n(&bench_idt_go, 0, __ATOMIC_RELEASE);
+    for (int i = 0; i < count; i++) {
+        injectors[i].mode = mode;
+        injectors[i].index = i;
+        injectors[i].iterations = iterations;
+        if (pthread_create(&threads[i], NULL, bench_idt_injector, &injectors[i]) != 0) {
+            break;
+        }
+        started++;
+    }
+    uint64_t start = host_monotonic_ns();
+    __atomic_store_n(&bench_idt_go, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    uint64_t wall_ns = host_monotonic_ns() - start;
+    return started == count ? (double)wall_ns / ((double)iterations * count) : -1.0;
+}
 
-void test_concurrent_interrupts() {
-    printf("Probando interrupciones concurrentes...\n");
+// Falso compartido en la IDT: cada inyector despacha su propia IRQ, vecina
+// de la del siguiente, así que no hay contención real entre ellos. Se miden
+// las operaciones de memoria del despacho sobre tres disposiciones (el
+// descriptor de 888 bytes anterior, una tabla caliente densa sin alinear y
+// idt[] con una línea por IRQ) y, al final, dispatch_interrupt() completo.
+int bench_idt(void) {
+    static const int injectors[] = {1, 2, 4, BENCH_IDT_MAX_INJECTORS};
+    const unsigned long iterations = 2000000;
+    const unsigned long dispatches = 100000;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
     
-    // Generar múltiples interrupciones rápidamente
-    for (int i = 0; i < 5; i++) {
-        dispatch_interrupt(IRQ_TIMER);
-        dispatch_interrupt(IRQ_KEYBOARD);
-        usleep(100000); // 100ms
+    trace_console_muted = 1;
+    init_idt();
+    init_system_stats();
+    for (int i = 0; i < BENCH_IDT_MAX_INJECTORS; i++) {
+        bench_aos_descs[i].isr = bench_idt_isr;
+        bench_aos_descs[i].state = IRQ_STATE_REGISTERED;
+        bench_dense_descs[i].isr = bench_idt_isr;
+        bench_dense_descs[i].state = IRQ_STATE_REGISTERED;
+        bench_split_descs[i].isr = bench_idt_isr;
+        bench_split_descs[i].state = IRQ_STATE_REGISTERED;
+        if (register_isr(NR_IRQS_LEGACY + i, bench_idt_isr, "bench") != SUCCESS) {
+            fprintf(stderr, "❌ No se pudo registrar la IRQ %d\n", NR_IRQS_LEGACY + i);
+            trace_console_muted = 0;
+            return ERROR_IRQ_BUSY;
+        }
     }
     
-    printf("Prueba de concurrencia completada.\n");
+    printf("🧊 BENCHMARK: IDT caliente/fría con inyectores en paralelo (%ld CPUs en línea)\n", cpus);
+    printf("   %lu despachos simulados y %lu con dispatch_interrupt() por inyector;\n"
+           "   cada inyector usa su propia IRQ, contigua a la del siguiente (IRQ %d en adelante)\n\n",
+           iterations, dispatches, NR_IRQS_LEGACY);
+    printf("ns por despacho, agregados sobre el tiempo de pared de todos los inyectores\n");
+    printf("%10s │ %15s │ %15s │ %15s │ %18s\n",
+           "inyectores", "AoS 888 B", "densa 32 B", "idt[] 64 B", "dispatch_interrupt");
+    
+    for (size_t t = 0; t < sizeof(injectors) / sizeof(injectors[0]); t++) {
+        int count = injectors[t];
+        double aos = bench_idt_run(BENCH_IDT_AOS, count, iterations);
+        double dense = bench_idt_run(BENCH_IDT_DENSE, count, iterations);
+        double split = bench_idt_run(BENCH_IDT_SPLIT, count, iterations);
+        double real = bench_idt_run(BENCH_IDT_DISPATCH_REAL, count, dispatches);
+        if (aos < 0 || dense < 0 || split < 0 || real < 0) {
+            fprintf(stderr, "❌ No se pudieron crear %d inyectores\n", count);
+            trace_console_muted = 0;
+            return ERROR_TRACE_STORAGE;
+        }
+        printf("%10d │ %15.1f │ %15.1f │ %15.1f │ %18.1f\n", count, aos, dense, split, real);
+    }
+    
+    unsigned long expected = 0, served = 0;
+    for (size_t t = 0; t < sizeof(injectors) / sizeof(injectors[0]); t++) {
+        expected += dispatches * (unsigned long)injectors[t];
+    }
+    for (int i = 0; i < BENCH_IDT_MAX_INJECTORS; i++) {
+        served += (unsigned long)ATOMIC_LOAD_RELAXED(&idt[NR_IRQS_LEGACY + i].call_count);
+        unregister_isr(NR_IRQS_LEGACY + i);
+    }
+    if (served != expected) {
+        fprintf(stderr, "⚠️  Despachos atendidos: %lu de %lu\n", served, expected);
+    }
+    
+    trace_console_muted = 0;
+    printf("\nCon un inyector las tres disposiciones cuestan lo mismo. Con varios en CPUs\n"
+           "distintas, la densa y la AoS hacen rebotar líneas entre IRQs vecinas y el\n"
+           "coste agregado deja de bajar; idt[] no comparte ninguna y baja con cada CPU.\n");
+    if (cpus < BENCH_IDT_MAX_INJECTORS) {
+        printf("⚠️  Solo hay %ld CPUs en línea: los inyectores de más se turnan en la misma\n"
+               "   CPU, no compiten por las líneas y esas filas no muestran el falso compartido.\n", cpus);
+    }
+    return SUCCESS;
 }
 
-void test_stress_interrupts() {
-    printf("Ejecutando prueba de stress...\n");
-    
-    for (int i = 0; i < 20; i++) {
-        dispatch_interrupt(i % MAX_INTERRUPTS);
-        usleep(50000); // 50ms
+// Ejecutar el microbenchmark pedido con --bench
+int run_benchmark(const char *name) {
+    if (strcmp(name, "timers") == 0) {
+        return bench_timers();
+    }
+    if (strcmp(name, "timers-check") == 0) {
+        return check_timers();
+    }
+    if (strcmp(name, "shared") == 0) {
+        return bench_shared();
     }
+    if (strcmp(name, "idt") == 0) {
+        return bench_idt();
+    }
+    fprintf(stderr, "Benchmark desconocido: %s (disponibles: timers, timers-check, shared, idt)\n", name);
+    return ERROR_INVALID_IRQ;
+}
+
+// Mostrar uso de la línea de comandos
+void show_usage(const char *program) {
+    printf("Uso: %s [opciones]\n\n", program);
+    printf("Opciones:\n");
+    printf("  --trace-capacity N   Entradas de traza por hilo (por defecto %d, máx. %lu)\n",
+           TRACE_DEFAULT_CAPACITY, TRACE_MAX_CAPACITY);
+    printf("  --trace-file RUTA    Mantener el anillo de trazas en un archivo mapeado (mmap)\n");
+    printf("  --trace-export RUTA  Al salir, exportar la traza a formato offline (.trace)\n");
+    printf("  --log-policy P       Cola del logger llena: block (esperar, por defecto) o drop\n");
+    printf("  --cpus N             Simular N CPUs (1-%d) con colas de IRQs pendientes propias\n",
+           MAX_SIM_CPUS);
+    printf("  --irq-affinity I=M   Máscara hexadecimal de CPUs para la IRQ I (repetible)\n");
+    printf("  --work-stealing      CPUs ociosas roban IRQs pendientes de CPUs ocupadas\n");
+    printf("  --burst I=N          Al arrancar, disparar N IRQs I seguidas sin esperar a que\n"
+           "                       se atiendan (repetible)\n");
+    printf("  --threaded-irqs      Dispositivos de prueba con handler primario + hilo irq/N\n");
+    printf("  --hz N               Frecuencia del tick del timer (1-%d Hz; por defecto cada %d s)\n",
+           TIMER_MAX_HZ, TIMER_INTERVAL_SEC);
+    printf("  --tickless           NO_HZ idle: detener el tick del timer con el sistema ocioso\n");
+    printf("  --napi I=R[:B]       Polling NAPI en la IRQ I por encima de R IRQs/s, B eventos\n");
+    printf("                       por pasada (por defecto %d; repetible)\n", NAPI_DEFAULT_BUDGET);
+    printf("  --bench NOMBRE       Ejecutar un microbenchmark y salir (timers, timers-check, shared, idt)\n");
+    printf("  --virtual-time S     Simular S segundos en tiempo virtual (eventos discretos) y salir\n");
+    printf("  --vt-rate I=R        Llegadas de la IRQ I en tiempo virtual, R IRQs/s (repetible)\n");
+    printf("  --seed N             Semilla de las llegadas en tiempo virtual\n");
+    printf("  --hist-export RUTA   Al salir, exportar los histogramas de latencia a CSV\n");
+    printf("  --shared-irq I=N     Compartir la IRQ I entre N dispositivos de demostración\n");
+    printf("                       (IRQF_SHARED, 1-%d; repetible)\n", MAX_SHARED_HANDLERS);
+    printf("  --msix N             Dispositivo MSI-X de demostración con N colas (1-%d), cada una\n",
+           MAX_MSIX_VECTORS);
+    printf("                       con su IRQ dinámica desde la %d y su propio vector\n", NR_IRQS_LEGACY);
+    printf("  -h, --help           Mostrar esta ayuda\n");
+}
+
+// Procesar argumentos de línea de comandos. Devuelve SUCCESS, 1 si solo se
+// pidió ayuda, o ERROR_INVALID_IRQ si algún argumento es inválido.
+int parse_command_line(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        {"trace-capacity", required_argument, NULL, 'c'},
+        {"trace-file",     required_argument, NULL, 'f'},
+        {"trace-export",   required_argument, NULL, 'e'},
+        {"log-policy",     required_argument, NULL, 'l'},
+        {"cpus",           required_argument, NULL, 'p'},
+        {"irq-affinity",   required_argument, NULL, 'a'},
+        {"work-stealing",  no_argument,       NULL, 'w'},
+        {"burst",          required_argument, NULL, 'B'},
+        {"threaded-irqs",  no_argument,       NULL, 't'},
+        {"napi",           required_argument, NULL, 'n'},
+        {"hz",             required_argument, NULL, 'z'},
+        {"tickless",       no_argument,       NULL, 'k'},
+        {"bench",          required_argument, NULL, 'b'},
+        {"virtual-time",   required_argument, NULL, 'v'},
+        {"vt-rate",        required_argument, NULL, 'r'},
+        {"seed",           required_argument, NULL, 's'},
+        {"hist-export",    required_argument, NULL, 'H'},
+        {"shared-irq",     required_argument, NULL, 'S'},
+        {"msix",           required_argument, NULL, 'm'},
+        {"help",           no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    char *endptr;
     
-    printf("Prueba de stress completada.\n");
+    while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'c':
+                sim_options.trace_capacity = strtoul(optarg, &endptr, 10);
+                if (*endptr != '\0' || sim_options.trace_capacity == 0 ||
+                    sim_options.trace_capacity > TRACE_MAX_CAPACITY) {
+                    fprintf(stderr, "Capacidad de traza inválida: %s\n", optarg);
+                    return ERROR_INVALID_IRQ;
+                }
+                break;
+            case 'f':
+                sim_options.trace_file = optarg;
+                break;
+            case 'e':
+                sim_options.trace_export = optarg;
+                break;
+            case 'l':
+                if (strcmp(optarg, "block") == 0) {
+                    sim_options.log_policy = LOG_POLICY_BLOCK;
+                } else if (strcmp(optarg, "drop") == 0) {
+                    sim_options.log_policy = LOG_POLICY_DROP;
+                } else {
+                    fprintf(stderr, "Política de logger inválida: %s (use block o drop)\n", optarg);
+                    return ERROR_INVALID_IRQ;
+                }
+                break;
+            case 'p':
+                sim_options.cpu_count = (int)strtol(optarg, &endptr, 10);
+                if (*endptr != '\0' || sim_options.cpu_count < 1 ||
+                    sim_options.cpu_count > MAX_SIM_CPUS) {
+                    fprintf(stderr, "Número de CPUs inválido: %s (1-%d)\n", optarg, MAX_SIM_CPUS);
+                    return ERROR_INVALID_IRQ;
+                }
+                break;
+            case 'a': {
+                long irq = strtol(optarg, &endptr, 10);
+                unsigned long mask = 0;
+                if (*endptr == '=') {
+                    char *mask_text = endptr + 1;
+                    mask = strtoul(mask_text, &endptr, 16);
+                    if (endptr == mask_text) {
+                        mask = 0;
+                    }
+                }
+                if (*endptr != '\0' || !IS_VALID_IRQ(irq) || mask == 0 || mask > SMP_AFFINITY_ALL) {
+                    fprintf(stderr, "Afinidad inválida: %s (use IRQ=MÁSCARA, p. ej. 3=2)\n", optarg);
+                    return ERROR_INVALID_IRQ;
+                }
+                sim_options.irq_affinity[irq] = (unsigned int)mask;
+                break;
+            }
+            case 'w':
+                sim_options.work_stealing = 1;
+                break;
+            case 'B': {
+                long irq = strtol(optarg, &endptr, 10);
+                long count = 0;
+                if (*endptr == '=') {
+                    count = strtol(endptr + 1, &endptr, 10);
+                }
+                if (*endptr != '\0' || !IS_VALID_IRQ(irq) || count < 1 || count > SMP_QUEUE_SIZE) {
+                    fprintf(stderr, "Ráfaga inválida: %s (use IRQ=N, N 1-%d)\n", optarg, SMP_QUEUE_SIZE);
+                    return ERROR_INVALID_IRQ;
+                }
+                sim_options.burst[irq] = (unsigned int)count;
+                break;
+            }
+            case 't':
+                sim_options.threaded_irqs = 1;
+                break;
+            case 'k':
+                sim_options.tickless = 1;
+                break;
+            case 'b':
+                sim_options.bench = optarg;
+                break;
+            case 'v':
+                sim_options.virtual_seconds = strtod(optarg, &endptr);
+                if (*endptr != '\0' || !(sim_options.virtual_seconds > 0.0) ||
+                    sim_options.virtual_seconds > 1e6) {
+                    fprintf(stderr, "Tiempo virtual inválido: %s (segundos, p. ej. 3600)\n", optarg);
+                    return ERROR_INVALID_IRQ;
+                }
+                break;
+            case 'r': {
+                long irq = strtol(optarg, &endptr, 10);
+                double rate = 0.0;
+                if (*endptr == '=') {
+                    char *rate_text = endptr + 1;
+                    rate = strtod(rate_text, &endptr);
+                    if (endptr == rate_text) {
+                        rate = 0.0;
+                    }
+                }
+                if (*endptr != '\0' || !IS_VALID_IRQ(irq) || irq == IRQ_TIMER ||
+                    !(rate > 0.0) || rate > 1e9) {
+                    fprintf(stderr, "Tasa virtual inválida: %s (use IRQ=IRQs/s, p. ej. 5=1000; IRQ0 es el tick)\n",
+                            optarg);
+                    return ERROR_INVALID_IRQ;
+                }
+                sim_options.vt_rate[irq] = rate;
+                sim_options.vt_rate_set = 1;
+                break;
+            }
+            case 'H':
+                sim_options.hist_export = optarg;
+                break;
+            case 'S': {
+                long irq = strtol(optarg, &endptr, 10);
+                long count = 0;
+                if (*endptr == '=') {
+                    count = strtol(endptr + 1, &endptr, 10);
+                }
+                if (*endptr != '\0' || !IS_VALID_IRQ(irq) || irq == IRQ_TIMER || irq == IRQ_KEYBOARD ||
+                    count < 1 || count > MAX_SHARED_HANDLERS) {
+                    fprintf(stderr, "Línea compartida inválida: %s (use IRQ=N, IRQ 2-%d, N 1-%d)\n",
+                            optarg, MAX_INTERRUPTS - 1, MAX_SHARED_HANDLERS);
+                    return ERROR_INVALID_IRQ;
+                }
+                sim_options.shared_devices[irq] = (int)count;
+                break;
+            }
+            case 'm':
+                sim_options.msix_vectors = (int)strtol(optarg, &endptr, 10);
+                if (*endptr != '\0' || sim_options.msix_vectors < 1 ||
+                    sim_options.msix_vectors > MAX_MSIX_VECTORS) {
+                    fprintf(stderr, "Colas MSI-X inválidas: %s (1-%d)\n", optarg, MAX_MSIX_VECTORS);
+                    return ERROR_INVALID_IRQ;
+                }
+                break;
+            case 's':
+                sim_options.seed = strtoull(optarg, &endptr, 0);
+                if (*endptr != '\0' || sim_options.seed == 0) {
+                    fprintf(stderr, "Semilla inválida: %s (entero distinto de 0)\n", optarg);
+                    return ERROR_INVALID_IRQ;
+                }
+                break;
+            case 'z':
+                sim_options.timer_hz = (int)strtol(optarg, &endptr, 10);
+                if (*endptr != '\0' || sim_options.timer_hz < 1 ||
+                    sim_options.timer_hz > TIMER_MAX_HZ) {
+                    fprintf(stderr, "Frecuencia del timer inválida: %s (1-%d Hz)\n", optarg, TIMER_MAX_HZ);
+                    return ERROR_INVALID_IRQ;
+                }
+                break;
+            case 'n': {
+                long irq = strtol(optarg, &endptr, 10);
+                unsigned long rate = 0;
+                long budget = 0;
+                if (*endptr == '=') {
+                    char *rate_text = endptr + 1;
+                    rate = strtoul(rate_text, &endptr, 10);
+                    if (endptr == rate_text) {
+                        rate = 0;
+                    }
+                    if (*endptr == ':') {
+                        char *budget_text = endptr + 1;
+                        budget = strtol(budget_text, &endptr, 10);
+                        if (endptr == budget_text || budget <= 0) {
+                            rate = 0;
+                        }
+                    }
+                }
+                if (*endptr != '\0' || !IS_VALID_IRQ(irq) || rate == 0 || rate > 100000000UL ||
+                    budget > 65536) {
+                    fprintf(stderr, "NAPI inválido: %s (use IRQ=TASA[:BUDGET], p. ej. 5=2000:16)\n", optarg);
+                    return ERROR_INVALID_IRQ;
+                }
+                sim_options.napi_rate[irq] = (unsigned int)rate;
+                sim_options.napi_budget[irq] = (int)budget;
+                break;
+            }
+            case 'h':
+                show_usage(argv[0]);
+                return 1;
+            default:
+                show_usage(argv[0]);
+                return ERROR_INVALID_IRQ;
+        }
+    }
+    return SUCCESS;
 }
 
 // Función para limpiar entrada inválida del buffer
@@ -976,6 +6037,7 @@ int get_valid_input(int min, int max) {
 
 // Función simple para esperar Enter
 void wait_for_enter() {
+    logger_flush();
     printf("\nPresione Enter para continuar...");
     fflush(stdout);
     
@@ -1013,6 +6075,12 @@ void improved_main_initialization() {
     // Iniciar hilo del timer
     printf("🕐 Iniciando hilo del timer automático...\n");
     fflush(stdout);
+    if (sim_options.timer_hz > 0) {
+        timer_set_hz(sim_options.timer_hz);
+    }
+    if (sim_options.tickless) {
+        timer_set_tickless(1);
+    }
     if (pthread_create(&timer_thread, NULL, timer_thread_func, NULL) != 0) {
         add_trace("❌ KERNEL PANIC: Error creando hilo del timer");
         printf("❌ ERROR CRÍTICO: No se pudo iniciar el timer del sistema\n");
@@ -1021,7 +6089,12 @@ void improved_main_initialization() {
     
     printf("\n✅ KERNEL INICIADO CORRECTAMENTE\n");
     printf("🎯 El sistema está listo para procesar interrupciones\n");
-    printf("⏰ Timer automático generará IRQ0 cada 3 segundos\n\n");
+    if (timer_get_hz() > 0) {
+        printf("⏰ Timer automático generará IRQ0 a %d Hz (cada %.3f ms)\n\n",
+               timer_get_hz(), timer_period_ns() / 1e6);
+    } else {
+        printf("⏰ Timer automático generará IRQ0 cada %d segundos\n\n", TIMER_INTERVAL_SEC);
+    }
     
     // Pequeña pausa para que el usuario vea la inicialización
     printf("Presione Enter para continuar al menú principal...");
@@ -1030,17 +6103,28 @@ void improved_main_initialization() {
 }
 
 // Función para guardar el estado actual de la IDT
-void save_idt_state(irq_descriptor_t *backup) {
+void save_idt_state(irq_backup_t *backup) {
     LOCK_IDT();
     
     for (int i = 0; i < MAX_INTERRUPTS; i++) {
-        backup[i].isr = idt[i].isr;
-        backup[i].state = idt[i].state;
-        backup[i].call_count = idt[i].call_count;
-        backup[i].last_call = idt[i].last_call;
-        backup[i].total_execution_time = idt[i].total_execution_time;
-        strncpy(backup[i].description, idt[i].description, sizeof(backup[i].description) - 1);
-        backup[i].description[sizeof(backup[i].description) - 1] = '\0';
+        // Reservar el vector para copiar un descriptor consistente
+        irq_state_t state = irq_begin_update(i, 1);
+        backup[i].hot.isr = idt[i].isr;
+        backup[i].hot.handler = idt[i].handler;
+        backup[i].hot.thread_fn = idt[i].thread_fn;
+        memcpy(backup[i].meta.actions, irq_meta[i].actions, sizeof(irq_meta[i].actions));
+        backup[i].hot.action_count = idt[i].action_count;
+        backup[i].meta.spurious_count = irq_meta[i].spurious_count;
+        backup[i].meta.thread_runs = irq_meta[i].thread_runs;
+        backup[i].meta.total_thread_time = irq_meta[i].total_thread_time;
+        backup[i].hot.state = state;
+        backup[i].hot.call_count = idt[i].call_count;
+        backup[i].meta.last_call = irq_meta[i].last_call;
+        backup[i].hot.total_execution_time = idt[i].total_execution_time;
+        strncpy(backup[i].meta.description, irq_meta[i].description, sizeof(backup[i].meta.description) - 1);
+        backup[i].meta.description[sizeof(backup[i].meta.description) - 1] = '\0';
+        backup[i].hot.description_id = idt[i].description_id;
+        irq_end_update(i, state);
     }
     
     UNLOCK_IDT();
@@ -1049,17 +6133,33 @@ void save_idt_state(irq_descriptor_t *backup) {
 }
 
 // Función para restaurar el estado previo de la IDT
-void restore_idt_state(const irq_descriptor_t *backup) {
+void restore_idt_state(const irq_backup_t *backup) {
     LOCK_IDT();
     
     for (int i = 0; i < MAX_INTERRUPTS; i++) {
-        idt[i].isr = backup[i].isr;
-        idt[i].state = backup[i].state;
-        idt[i].call_count = backup[i].call_count;
-        idt[i].last_call = backup[i].last_call;
-        idt[i].total_execution_time = backup[i].total_execution_time;
-        strncpy(idt[i].description, backup[i].description, sizeof(idt[i].description) - 1);
-        idt[i].description[sizeof(idt[i].description) - 1] = '\0';
+        irq_begin_update(i, 1);
+        irq_thread_stop(i);
+        idt[i].isr = backup[i].hot.isr;
+        idt[i].handler = backup[i].hot.handler;
+        idt[i].thread_fn = backup[i].hot.thread_fn;
+        memcpy(irq_meta[i].actions, backup[i].meta.actions, sizeof(irq_meta[i].actions));
+        idt[i].action_count = backup[i].hot.action_count;
+        irq_meta[i].spurious_count = backup[i].meta.spurious_count;
+        irq_meta[i].thread_runs = backup[i].meta.thread_runs;
+        irq_meta[i].total_thread_time = backup[i].meta.total_thread_time;
+        idt[i].call_count = backup[i].hot.call_count;
+        irq_meta[i].last_call = backup[i].meta.last_call;
+        idt[i].total_execution_time = backup[i].hot.total_execution_time;
+        strncpy(irq_meta[i].description, backup[i].meta.description, sizeof(irq_meta[i].description) - 1);
+        irq_meta[i].description[sizeof(irq_meta[i].description) - 1] = '\0';
+        idt[i].description_id = backup[i].hot.description_id;
+        if (idt[i].thread_fn != NULL && irq_thread_start(i) != SUCCESS) {
+            idt[i].handler = NULL;
+            idt[i].thread_fn = NULL;
+            irq_end_update(i, IRQ_STATE_FREE);
+            continue;
+        }
+        irq_end_update(i, backup[i].hot.state);
     }
     
     UNLOCK_IDT();
@@ -1079,25 +6179,31 @@ void cleanup_test_isrs(void) {
             continue;
         }
         
-        // Limpiar cualquier otra ISR registrada
-        if (idt[i].state != IRQ_STATE_FREE && idt[i].isr != NULL) {
+        // Limpiar cualquier otra ISR registrada (esperando a que termine si está en ejecución)
+        irq_state_t state = irq_begin_update(i, 1);
+        if (state != IRQ_STATE_FREE &&
+            (idt[i].isr != NULL || idt[i].thread_fn != NULL || idt[i].action_count > 0)) {
+            irq_thread_stop(i);
             idt[i].isr = NULL;
-            idt[i].state = IRQ_STATE_FREE;
+            idt[i].handler = NULL;
+            idt[i].thread_fn = NULL;
+            idt[i].action_count = 0;
             idt[i].call_count = 0;
             idt[i].total_execution_time = 0;
-            snprintf(idt[i].description, sizeof(idt[i].description), 
+            irq_meta[i].spurious_count = 0;
+            irq_latency_reset(i);
+            snprintf(irq_meta[i].description, sizeof(irq_meta[i].description), 
                 "IRQ %d - Disponible para asignación", i);
+            idt[i].description_id = 0;
+            state = IRQ_STATE_FREE;
             cleaned_count++;
         }
+        irq_end_update(i, state);
     }
     
     UNLOCK_IDT();
     
-    char trace_msg[MAX_TRACE_MSG_LEN];
-    snprintf(trace_msg, sizeof(trace_msg), 
-        "🧼 KERNEL: %d ISRs de prueba limpiadas - Solo ISRs del sistema preservadas", 
-        cleaned_count);
-    add_trace(trace_msg);
+    add_trace_event(TRACE_EV_TEST_CLEANUP, -1, cleaned_count);
 }
 const char *get_irq_description(int irq_num) {
     for (size_t i = 0; i < sizeof(irq_table) / sizeof(irq_table[0]); ++i) {
@@ -1113,14 +6219,14 @@ void run_interrupt_test_suite(void) {
     printf("═══════════════════════════════════════════════════════════════\n");
 
     // Guardar estado actual de la IDT
-    irq_descriptor_t idt_backup[MAX_INTERRUPTS];
+    static irq_backup_t idt_backup[MAX_INTERRUPTS];
     save_idt_state(idt_backup);
 
     // 1) Registrar todos los ISRs de la tabla (excluyendo IRQ0)
     printf("📝 Fase 1: Registrando controladores de interrupción...\n");
     for (size_t i = 0; i < sizeof(irq_table) / sizeof(irq_table[0]); ++i) {
         if (irq_table[i].irq == IRQ_TIMER) continue; // Evita IRQ0
-        register_isr(irq_table[i].irq, custom_isr, irq_table[i].desc);
+        register_device_isr(irq_table[i].irq, irq_table[i].desc);
     }
 
     // 2) Preparar generador de números aleatorios
@@ -1142,6 +6248,10 @@ void run_interrupt_test_suite(void) {
         int irq_num = irq_table[table_idx].irq;
         const char *irq_desc = irq_table[table_idx].desc;
 
+        smp_wait_idle();
+        irq_threads_wait_idle();
+        deferred_wait_idle();
+        logger_flush();
         printf("\n🔔 Evento %d/%d → IRQ%d: %s\n",
                ev, total_events, irq_num, irq_desc);
         
@@ -1153,6 +6263,10 @@ void run_interrupt_test_suite(void) {
     }
 
     // ✅ Mostrar estado modificado de la IDT antes de limpiar
+    smp_wait_idle();
+    irq_threads_wait_idle();
+    deferred_wait_idle();
+    logger_flush();
     printf("\n📋 Estado de la IDT tras ejecutar las interrupciones de prueba:\n");
     show_idt_status();
 
@@ -1172,14 +6286,14 @@ void run_advanced_interrupt_test_suite(void) {
     printf("═══════════════════════════════════════════════════════════════\n");
 
     // Guardar estado actual de la IDT
-    irq_descriptor_t idt_backup[MAX_INTERRUPTS];
+    static irq_backup_t idt_backup[MAX_INTERRUPTS];
     save_idt_state(idt_backup);
 
     // Registrar ISRs
     printf("📝 Registrando controladores...\n");
     for (size_t i = 0; i < sizeof(irq_table) / sizeof(irq_table[0]); ++i) {
         if (irq_table[i].irq == IRQ_TIMER) continue;
-        register_isr(irq_table[i].irq, custom_isr, irq_table[i].desc);
+        register_device_isr(irq_table[i].irq, irq_table[i].desc);
     }
 
     // Preparar aleatoriedad
@@ -1216,6 +6330,10 @@ void run_advanced_interrupt_test_suite(void) {
         usleep(delay);
     }
     // ✅ Mostrar estado modificado de la IDT antes de limpiar
+    smp_wait_idle();
+    irq_threads_wait_idle();
+    deferred_wait_idle();
+    logger_flush();
     printf("\n📋 Estado de la IDT tras ejecutar las interrupciones de prueba:\n");
     show_idt_status();
 
@@ -1226,12 +6344,115 @@ void run_advanced_interrupt_test_suite(void) {
 
 
 
+// Exportar los histogramas de latencia si se pidió con --hist-export
+static void export_histograms_on_exit(void) {
+    if (!sim_options.hist_export) {
+        return;
+    }
+    long rows = export_latency_histograms(sim_options.hist_export);
+    if (rows >= 0) {
+        printf("📦 Histogramas exportados: %ld buckets en %s\n", rows, sim_options.hist_export);
+    } else {
+        printf("Advertencia: No se pudieron exportar los histogramas a %s\n", sim_options.hist_export);
+    }
+}
+
+// Avisar al salir de las trazas perdidas por hilos sin buffer libre
+static void report_dropped_traces(void) {
+    unsigned long dropped = ATOMIC_LOAD_RELAXED(&trace_dropped);
+    if (dropped > 0) {
+        printf("⚠️  Trazas descartadas por falta de buffer (%d hilos con buffer): %lu\n",
+               trace_buffers, dropped);
+    }
+}
+
 // Función principal
-int main() {
+int main(int argc, char *argv[]) {
     int option, irq_num;
     
+    int parse_result = parse_command_line(argc, argv);
+    if (parse_result != SUCCESS) {
+        return parse_result == 1 ? SUCCESS : EXIT_FAILURE;
+    }
+    if (sim_options.bench) {
+        return run_benchmark(sim_options.bench) == SUCCESS ? SUCCESS : EXIT_FAILURE;
+    }
+    
+    if (trace_init(sim_options.trace_capacity, sim_options.trace_file,
+                   trace_thread_budget(sim_options.cpu_count, sim_options.threaded_irqs)) != SUCCESS) {
+        fprintf(stderr, "❌ No se pudo reservar el anillo de trazas%s%s: %s\n",
+                sim_options.trace_file ? " en " : "",
+                sim_options.trace_file ? sim_options.trace_file : "", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    
+    if (sim_options.virtual_seconds > 0.0) {
+        trace_set_thread_name("sim-events");
+        int result = run_virtual_simulation(sim_options.virtual_seconds);
+        export_histograms_on_exit();
+        if (sim_options.trace_export) {
+            long exported = export_trace_file(sim_options.trace_export);
+            if (exported >= 0) {
+                printf("📦 Traza exportada: %ld registros en %s\n", exported, sim_options.trace_export);
+            } else {
+                printf("Advertencia: No se pudo exportar la traza a %s\n", sim_options.trace_export);
+            }
+        }
+        report_dropped_traces();
+        trace_shutdown();
+        return result == SUCCESS ? SUCCESS : EXIT_FAILURE;
+    }
+    
+    trace_set_thread_name("menu");
     improved_main_initialization();
     
+    // A partir del menú la salida de trazas la escribe el hilo del logger
+    if (logger_start(sim_options.log_policy) != SUCCESS) {
+        printf("Advertencia: No se pudo iniciar el logger; las trazas se imprimirán en línea\n");
+    }
+    
+    if (smp_start(sim_options.cpu_count, sim_options.work_stealing) != SUCCESS) {
+        printf("Advertencia: No se pudieron iniciar las CPUs simuladas; modo UP\n");
+    }
+    if (deferred_start(smp_cpu_count) != SUCCESS) {
+        printf("Advertencia: No se pudieron iniciar ksoftirqd/kworkers; bottom halves en línea\n");
+    }
+    if (sim_options.msix_vectors > 0 && register_msix_demo(sim_options.msix_vectors) != SUCCESS) {
+        printf("Advertencia: No se pudieron reservar %d vectores MSI-X\n", sim_options.msix_vectors);
+    }
+    for (int i = 0; i < MAX_INTERRUPTS; i++) {
+        if (sim_options.irq_affinity[i] != 0 &&
+            set_irq_affinity(i, sim_options.irq_affinity[i]) != SUCCESS) {
+            printf("Advertencia: Afinidad %x de IRQ %d sin CPUs en línea\n",
+                   sim_options.irq_affinity[i], i);
+        }
+        if (sim_options.napi_rate[i] != 0) {
+            set_irq_napi(i, sim_options.napi_rate[i], sim_options.napi_budget[i]);
+        }
+        if (sim_options.shared_devices[i] > 0 &&
+            register_shared_demo(i, sim_options.shared_devices[i]) != SUCCESS) {
+            printf("Advertencia: No se pudo compartir la IRQ %d entre %d dispositivos\n",
+                   i, sim_options.shared_devices[i]);
+        }
+    }
+    
+    // --burst: las IRQs de cada ráfaga llegan de golpe; con varias CPUs se
+    // solapan en el mismo vector y pasan por el IRR
+    unsigned long burst_total = 0;
+    for (int i = 0; i < MAX_INTERRUPTS; i++) {
+        for (unsigned int n = 0; n < sim_options.burst[i]; n++) {
+            dispatch_interrupt(i);
+            burst_total++;
+        }
+    }
+    if (burst_total > 0) {
+        smp_wait_idle();
+        irq_threads_wait_idle();
+        deferred_wait_idle();
+        logger_flush();
+        printf("💥 Ráfagas atendidas: %lu IRQs disparadas con --burst\n", burst_total);
+    }
+    
     // Bucle principal del menú
    while (system_running) {
     show_menu();
@@ -1245,6 +6466,10 @@ int main() {
             irq_num = get_valid_input(0, MAX_INTERRUPTS - 1);
             printf("Despachando IRQ %d...\n", irq_num);
             dispatch_interrupt(irq_num);
+            smp_wait_idle();
+            irq_threads_wait_idle();
+            deferred_wait_idle();
+            logger_flush();
             
             // Mostrar última traza para explicar el proceso de interrupción
             printf("\n--- Proceso de interrupción ejecutado ---\n");
@@ -1259,7 +6484,8 @@ int main() {
             snprintf(desc, sizeof(desc), "ISR Personalizada %d", irq_num);
             printf("Registrando ISR para IRQ %d...\n", irq_num);
             
-            if (register_isr(irq_num, custom_isr, desc) == SUCCESS) {
+            if (register_device_isr(irq_num, desc) == SUCCESS) {
+                logger_flush();
                 printf("✓ ISR registrada exitosamente para IRQ %d.\n", irq_num);
                 
                 // Mostrar última traza para confirmar el registro
@@ -1299,6 +6525,7 @@ int main() {
             printf("Desregistrando ISR para IRQ %d...\n", irq_num);
             
             if (unregister_isr(irq_num) == SUCCESS) {
+                logger_flush();
                 printf("✓ ISR desregistrada exitosamente para IRQ %d.\n", irq_num);
                 
                 // Mostrar última traza para confirmar la desregistración
@@ -1347,13 +6574,33 @@ int main() {
     // Limpiar recursos
     add_trace("Finalizando sistema de interrupciones");
     
-    // Esperar a que termine el hilo del timer
+    // Esperar a que termine el hilo del timer (despertándolo si tiene el tick detenido)
+    timer_kick();
     if (pthread_join(timer_thread, NULL) != 0) {
         printf("Advertencia: Error al finalizar hilo del timer\n");
     }
     
+    smp_stop();
+    shutdown_irq_threads();
+    deferred_stop();
+    logger_stop();
+    if (log_dropped > 0) {
+        printf("⚠️  Líneas de consola descartadas por el logger: %lu\n", log_dropped);
+    }
+    
     pthread_mutex_destroy(&idt_mutex);
-    pthread_mutex_destroy(&trace_mutex);
+    
+    export_histograms_on_exit();
+    if (sim_options.trace_export) {
+        long exported = export_trace_file(sim_options.trace_export);
+        if (exported >= 0) {
+            printf("📦 Traza exportada: %ld registros en %s\n", exported, sim_options.trace_export);
+        } else {
+            printf("Advertencia: No se pudo exportar la traza a %s\n", sim_options.trace_export);
+        }
+    }
+    report_dropped_traces();
+    trace_shutdown();
     
     printf("Simulador finalizado correctamente.\n");
     return SUCCESS;
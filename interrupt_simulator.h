@@ -8,17 +8,68 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <errno.h>
+#include <stdint.h>
+#include <stddef.h>   // Para offsetof en las comprobaciones de layout
+#include <stdarg.h>
 #include <sys/time.h>   // Para gettimeofday
+#include <sys/mman.h>   // Para mmap del anillo de trazas
+#include <fcntl.h>
+#include <getopt.h>   // Para getopt_long
+#include <sched.h>    // Para sched_yield
+#include <math.h>     // Para log en las llegadas de Poisson
+#include "trace_format.h"
 #include <unistd.h>     // Para getpid
 
 // Configuración del simulador
-#define MAX_INTERRUPTS 16
-#define MAX_TRACE_LINES 100
+#define IDT_VECTORS 256                  // Vectores x86: 0-31 excepciones, 32-255 interrupciones externas
+#define NR_IRQS_LEGACY 16                // IRQs del PIC 8259, con vector fijo IRQ0_VECTOR + n
+#define IRQ0_VECTOR 0x20
+#define FIRST_DYNAMIC_VECTOR 0x30        // Vectores que reparte el asignador (MSI/MSI-X e IRQs >= 16)
+#define FIRST_SYSTEM_VECTOR 0xF0         // Reservados para el sistema (IPIs, timer del APIC...)
+#define NR_DYNAMIC_VECTORS (FIRST_SYSTEM_VECTOR - FIRST_DYNAMIC_VECTOR)
+#define MAX_INTERRUPTS (NR_IRQS_LEGACY + NR_DYNAMIC_VECTORS) // Una IRQ dinámica por vector dinámico
+#define IRQ_BITMAP_WORDS ((MAX_INTERRUPTS + 63) / 64)
+#define MAX_MSIX_VECTORS 32              // Colas por dispositivo MSI-X (--msix)
+#define TRACE_DEFAULT_CAPACITY 1024        // Entradas por hilo (potencia de 2)
+#define TRACE_MAX_CAPACITY (1UL << 22)     // 4M entradas por hilo
 #define MAX_TRACE_MSG_LEN 256
 #define MAX_DESCRIPTION_LEN 64
+#define TRACE_STRING_POOL_SIZE 512
+#define MAX_TRACE_THREADS 64             // Tope de buffers de trazas (tamaño de trace_iter_t)
+#define TRACE_CORE_THREADS 3             // Menú (o hilo de eventos), timer y un hilo de paso
+#define TRACE_SPARE_BUFFERS 8            // Hilos de pruebas, benchmarks e irq/N registrados desde el menú
+#define TRACE_USER_INDEX_SIZE 1024       // Tickets no-timer indexados por buffer (potencia de 2)
+#define CACHE_LINE_SIZE 64
+#define LOG_QUEUE_SIZE 4096              // Líneas pendientes del logger (potencia de 2)
+#define LOG_BATCH_BYTES 65536            // Bytes por write() del logger
+#define MAX_SIM_CPUS 16                  // CPUs simuladas en modo SMP (cabe en TRACE_FLAG_CPU_MASK)
+#define SMP_QUEUE_SIZE 256               // IRQs pendientes por CPU (potencia de 2)
+#define SMP_AFFINITY_ALL 0xFFFFFFFFu
+#define DEFERRED_QUEUE_SIZE 256          // Trabajos diferidos pendientes por cola (potencia de 2)
+#define SOFTIRQ_BATCH 10                 // Softirqs por pasada de irq_exit (MAX_SOFTIRQ_RESTART)
+#define SOFTIRQ_BUDGET_NS 2000000ULL     // Tiempo máximo de softirqs en irq_exit (MAX_SOFTIRQ_TIME)
+#define KWORKER_THREADS 2                // Hilos del workqueue compartido
+#define NAPI_DEFAULT_BUDGET 64           // Eventos por pasada de polling (peso de NAPI)
+#define NAPI_RATE_WINDOW_NS 100000000ULL // Ventana para medir la tasa de llegada (100 ms)
+#define MAX_SHARED_HANDLERS 16           // Handlers por línea compartida (IRQF_SHARED)
+#define LAT_HIST_SUB_BITS 6               // 64 sub-buckets por octava inicial: error relativo <= 1/32
+#define LAT_HIST_MAX_BITS 40               // Valores de hasta 2^40 ns (~18 min); más, al de desbordamiento
+#define LAT_HIST_OVERFLOW ((LAT_HIST_MAX_BITS - LAT_HIST_SUB_BITS + 2) << (LAT_HIST_SUB_BITS - 1)) // Bucket de >= 2^MAX_BITS
+#define LAT_HIST_BUCKETS (LAT_HIST_OVERFLOW + 1)
+#define STATS_SHARDS 32                  // Shards de contadores: uno por CPU simulada y el resto por hilo
+#define SIM_EVENT_HEAP_INITIAL 64        // Capacidad inicial de la cola de eventos virtuales
+#define SIM_DEFAULT_SEED 0x9E3779B97F4A7C15ULL
+#define SIM_DEFAULT_KBD_RATE 2           // IRQs/s del teclado sin --vt-rate
+#define SIM_DEFAULT_DEVICE_RATE 0.5      // IRQs/s de cada dispositivo de prueba sin --vt-rate
 
 // Intervalos de tiempo (en segundos y microsegundos)
-#define TIMER_INTERVAL_SEC 3
+#define TIMER_INTERVAL_SEC 3            // Periodo del timer sin --hz
+#define TIMER_MAX_HZ 10000              // Frecuencia máxima del tick (periodo de 100 μs)
+#define TIMER_RECHECK_NS 100000000ULL   // Tramo máximo de sueño del timer (cambios de HZ y salida)
+#define TIMER_WHEEL_ROOT_BITS 8         // Ranuras del nivel 0 de la rueda (256 jiffies)
+#define TIMER_WHEEL_LVL_BITS 6          // Ranuras de cada nivel superior (64)
+#define TIMER_WHEEL_LEVELS 5            // 8 + 4 * 6 = 32 bits de jiffies por delante
+#define HRTIMER_HEAP_INITIAL 64         // Capacidad inicial del heap de hrtimers
 #define ISR_SIMULATION_DELAY_US 100000  // 100ms
 #define KEYBOARD_DELAY_US 50000         // 50ms
 #define CUSTOM_DELAY_US 75000           // 75ms
@@ -32,25 +83,62 @@
 #define ERROR_INVALID_IRQ -1
 #define ERROR_ISR_EXECUTING -2
 #define ERROR_NO_ISR -3
+#define ERROR_TRACE_STORAGE -4
+#define ERROR_IRQ_BUSY -5                // Línea ocupada, cadena llena o sin IRQs dinámicas libres
 
 // Macros para validación y acceso seguro
 #define IS_VALID_IRQ(irq) ((irq) >= 0 && (irq) < MAX_INTERRUPTS)
+#define IRQ_WORD(irq) ((irq) >> 6)       // Palabra de un bitmap de IRQs (IRR, ISR, activas)
+#define IRQ_BIT(irq) (1ULL << ((irq) & 63))
+// Recorrer solo las IRQs con handler, sin mirar los descriptores libres
+#define for_each_active_irq(irq) \
+    for (int irq = irq_next_active(-1); irq >= 0; irq = irq_next_active(irq))
 #define LOCK_IDT() pthread_mutex_lock(&idt_mutex)
 #define UNLOCK_IDT() pthread_mutex_unlock(&idt_mutex)
 
+// Operaciones atómicas (builtins de GCC, sin locks)
+#define ATOMIC_LOAD_ACQ(ptr)        __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define ATOMIC_LOAD_RELAXED(ptr)    __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#define ATOMIC_STORE_REL(ptr, val)  __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+#define ATOMIC_FETCH_ADD(ptr, val)  __atomic_fetch_add((ptr), (val), __ATOMIC_RELAXED)
+#define ATOMIC_CAS(ptr, expected, desired) \
+    __atomic_compare_exchange_n((ptr), (expected), (desired), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define CPU_RELAX()                 __asm__ __volatile__("" ::: "memory")
+
 
 // Estados de IRQ
 typedef enum {
     IRQ_STATE_FREE,
     IRQ_STATE_REGISTERED,
-    IRQ_STATE_EXECUTING
+    IRQ_STATE_EXECUTING,
+    IRQ_STATE_UPDATING,  // Descriptor reservado por register/unregister/restore
+    IRQ_STATE_MASKED     // Línea enmascarada hasta que termine su hilo irq/N
 } irq_state_t;
 
+// Resultado del handler primario de una IRQ con hilo (request_threaded_irq)
+typedef enum {
+    IRQ_NONE,            // La interrupción no era de este dispositivo
+    IRQ_HANDLED,         // Atendida por completo en el handler primario
+    IRQ_WAKE_THREAD      // Despertar el hilo irq/N con la línea enmascarada
+} irqreturn_t;
+
+// Handler de una línea compartida (IRQF_SHARED): dev_id identifica al
+// dispositivo y el handler devuelve IRQ_NONE si la interrupción no era suya
+typedef irqreturn_t (*shared_handler_t)(int irq_num, void *dev_id);
+
+// Eslabón de la cadena de una línea compartida
+typedef struct {
+    shared_handler_t handler;
+    void *dev_id;
+    int description_id;                  // Nombre del dispositivo (cadena internada)
+    unsigned long handled;               // Eventos que reclamó este handler (atómico)
+} irq_action_t;
+
 // Tipos de IRQ según propósito
 typedef enum {
     IRQ_TYPE_SYSTEM,   // IRQ0, IRQ1
-    IRQ_TYPE_USER,     // IRQ2 - IRQ15
-    IRQ_TYPE_INVALID   // Para valores fuera de rango (negativo o > 15)
+    IRQ_TYPE_USER,     // IRQ2 - IRQ15 y las dinámicas (MSI/MSI-X)
+    IRQ_TYPE_INVALID   // Para valores fuera de rango (negativo o >= MAX_INTERRUPTS)
 } irq_type_t;
 
 // Niveles de logging
@@ -60,33 +148,369 @@ typedef enum {
     LOG_LEVEL_VERBOSE
 } log_level_t;
 
-// Descriptor de IRQ en la IDT
+// Política del logger de consola cuando su cola está llena
+typedef enum {
+    LOG_POLICY_BLOCK,   // El productor espera a que el logger libere espacio
+    LOG_POLICY_DROP     // La línea se descarta y se contabiliza en log_dropped
+} log_policy_t;
+
+// Descriptor de IRQ en la IDT, partido en estructura de arrays: idt[] es la
+// parte caliente, exactamente una línea de caché por IRQ con lo que lee o
+// escribe cada despacho, e irq_meta[] el resto. Así dos CPUs que despachan
+// IRQs vecinas nunca comparten líneas.
+// state se cambia solo con CAS: quien lo lleva a EXECUTING o UPDATING es el
+// único que toca el resto del descriptor (caliente y frío). Los contadores
+// son atómicos y pueden leerse sin lock.
 typedef struct {
+    irq_state_t state;                   // Estado actual del IRQ (atómico)
+    int call_count;                      // Número de veces llamada (atómico)
     void (*isr)(int);                    // Puntero a la función ISR
-    irq_state_t state;                   // Estado actual del IRQ
-    int call_count;                      // Número de veces llamada
+    irqreturn_t (*handler)(int);         // Handler primario de una IRQ con hilo (NULL = despertar siempre)
+    irqreturn_t (*thread_fn)(int);       // Parte lenta en el hilo irq/N (NULL = ISR síncrona)
+    unsigned long total_execution_time;  // Tiempo total de ejecución en μs (atómico)
+    int description_id;                  // Descripción internada para las trazas
+    int action_count;                    // Handlers en la cadena (0 = línea no compartida)
+    unsigned int smp_affinity;           // Máscara de CPUs que pueden atender la IRQ
+    unsigned int smp_next_cpu;           // Cursor round-robin dentro de la máscara (atómico)
+    unsigned int napi_rate;              // IRQs/s a partir de las que se pasa a polling (0 = NAPI apagado)
+    int napi_scheduled;                  // Poll programado: línea enmascarada (atómico)
+} __attribute__((aligned(CACHE_LINE_SIZE))) irq_descriptor_t;
+
+_Static_assert(sizeof(irq_descriptor_t) == CACHE_LINE_SIZE,
+               "irq_descriptor_t debe ocupar exactamente una línea de caché");
+
+// Parte fría del descriptor (irq_meta[]). La primera línea agrupa la
+// contabilidad que también escribe cada despacho; detrás van la descripción,
+// el hilo irq/N, NAPI y la cadena compartida, que solo tocan el registro,
+// los informes o los caminos lentos.
+typedef struct {
     time_t last_call;                    // Timestamp de última llamada
-    unsigned long total_execution_time;  // Tiempo total de ejecución en μs
+    uint64_t irr_raised_ns;              // Inyección de la petición pendiente en el IRR (0 = ninguna, atómico)
+    unsigned long lat_samples;           // IRQs con desglose de latencia (atómico)
+    uint64_t lat_queue_ns;               // Suma de esperas desde la inyección hasta el despacho (atómico)
+    uint64_t lat_dispatch_ns;            // Suma del coste de despacho: CAS, IDT, trazas y EOI (atómico)
+    uint64_t lat_handler_ns;             // Suma del tiempo dentro del handler (atómico)
+    unsigned long spurious_count;        // Eventos que ningún handler reclamó (atómico)
+    int vector;                          // Vector de la IDT (-1 = sin asignar, atómico)
+    int thread_runs;                     // Ejecuciones de thread_fn (atómico)
+    unsigned long total_thread_time;     // Tiempo total en thread_fn en μs (atómico)
     char description[MAX_DESCRIPTION_LEN]; // Descripción del handler
-} irq_descriptor_t;
+    pthread_t thread;                    // Hilo irq/N
+    pthread_mutex_t thread_mutex;
+    pthread_cond_t thread_cond;
+    int thread_pending;                  // El primario pidió una ejecución de thread_fn
+    int thread_stop;
+    int thread_running;                  // El hilo irq/N existe (solo con el vector reservado)
+    int napi_budget;                     // Eventos por pasada de polling
+    unsigned long napi_pending;          // Eventos llegados en modo polling sin atender (atómico)
+    uint64_t napi_window_start;          // Inicio de la ventana de medida de tasa (atómico)
+    unsigned long napi_window_count;     // Llegadas en la ventana actual (atómico)
+    unsigned long napi_switches;         // Veces que la línea pasó a polling (atómico)
+    unsigned long napi_polled;           // Eventos atendidos por polling (atómico)
+    unsigned long napi_episode_events;   // Eventos del episodio de polling en curso
+    unsigned long napi_episode_polls;    // Pasadas del episodio de polling en curso
+    irq_action_t actions[MAX_SHARED_HANDLERS]; // Cadena de una línea compartida, contigua
+} __attribute__((aligned(CACHE_LINE_SIZE))) irq_meta_t;
+
+_Static_assert(offsetof(irq_meta_t, thread_runs) + sizeof(int) <= CACHE_LINE_SIZE,
+               "la contabilidad de cada despacho debe caber en la primera línea de irq_meta_t");
+
+// Copia de un descriptor completo para save_idt_state()/restore_idt_state()
+typedef struct {
+    irq_descriptor_t hot;
+    irq_meta_t meta;
+} irq_backup_t;
+
+// Slot del anillo de trazas lock-free.
+// seq codifica el ticket que ocupa el slot: 0 = nunca escrito,
+// 2*ticket+1 = escritura en curso, 2*ticket+2 = entrada publicada.
+typedef struct {
+    unsigned long seq;
+    trace_entry_t entry;
+} trace_slot_t;
+
+// Estados de un buffer de trazas por hilo
+typedef enum {
+    TRACE_BUFFER_FREE,       // Nunca usado
+    TRACE_BUFFER_OWNED,      // Propiedad de un hilo vivo (único escritor)
+    TRACE_BUFFER_ORPHANED    // Su hilo terminó; conserva historial y puede reutilizarse
+} trace_buffer_state_t;
 
-// Entrada de traza
+// Buffer de trazas privado de un hilo productor. Alineado a línea de caché
+// para que dos escritores nunca compartan líneas.
 typedef struct {
-    char timestamp[16];
-    char event[MAX_TRACE_MSG_LEN];
+    unsigned long head __attribute__((aligned(CACHE_LINE_SIZE))); // Próximo ticket
+    unsigned long user_head;             // Próxima posición del índice no-timer
+    unsigned int state;                  // trace_buffer_state_t
+    char owner_name[16];                 // Nombre del hilo dueño (diagnóstico)
+    unsigned long user_index[TRACE_USER_INDEX_SIZE]; // Tickets de las entradas no-timer
+    trace_slot_t slots[] __attribute__((aligned(CACHE_LINE_SIZE)));  // trace_capacity slots
+} trace_buffer_t;
+
+// Cabecera del anillo de trazas en memoria (o en el archivo mapeado).
+// Tras ella vienen buffer_count buffers separados por buffer_stride bytes.
+#define TRACE_RING_MAGIC "IRQRING1"
+#define TRACE_RING_VERSION 2
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t slot_size;                  // sizeof(trace_slot_t)
+    uint64_t capacity;                   // Slots por buffer
+    uint64_t buffer_stride;              // Bytes entre buffers consecutivos
+    uint32_t buffer_count;               // Buffers reservados (hasta MAX_TRACE_THREADS)
+    uint32_t clean_shutdown;             // 0 mientras el simulador está vivo
+    int64_t realtime_offset_ns;          // CLOCK_REALTIME - CLOCK_MONOTONIC
+} __attribute__((aligned(CACHE_LINE_SIZE))) trace_ring_header_t;
+
+// Iterador de merge k-way sobre todos los buffers. Un iterador se recorre en
+// una sola dirección: trace_iter_prev (más reciente primero) o trace_iter_next.
+// Con user_only recorre el índice no-timer en lugar de los tickets.
+typedef struct {
+    unsigned long next[MAX_TRACE_THREADS];   // Límite superior (exclusivo) por buffer
+    unsigned long oldest[MAX_TRACE_THREADS]; // Límite inferior (inclusivo) por buffer
+    trace_entry_t pending[MAX_TRACE_THREADS];
+    int has_pending[MAX_TRACE_THREADS];
+    int buffer_count;
+    int user_only;
+} trace_iter_t;
+
+// IRQ pendiente en la cola de una CPU simulada. irq_num, raised_ns y from_irr
+// se acceden de forma atómica: un ladrón los inspecciona antes de reclamar la celda.
+typedef struct {
+    unsigned long seq;
     int irq_num;
-} trace_entry_t;
+    int from_irr;                        // Entregada desde el IRR con el vector ya en EJECUTANDO
+    uint64_t raised_ns;                  // Momento en que se disparó (para la espera en cola)
+} irq_queue_cell_t;
+
+// CPU simulada del modo SMP: un hilo con su propia cola MPMC de IRQs
+// pendientes y contadores que solo ella escribe. Alineada a línea de caché
+// para que dos CPUs nunca compartan líneas. Con work stealing otras CPUs
+// también desencolan de la cabeza (CAS sobre dequeue_pos).
+typedef struct {
+    unsigned long enqueue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+    unsigned long dequeue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+    unsigned long completed;             // IRQs de esta cola ya atendidas (por ella o por un ladrón)
+    uint64_t running_since_ns;           // Inicio del handler en curso (0 = ociosa)
+    irq_queue_cell_t cells[SMP_QUEUE_SIZE];
+    unsigned long irq_count[MAX_INTERRUPTS] __attribute__((aligned(CACHE_LINE_SIZE)));
+    unsigned long handled;               // IRQs atendidas
+    uint64_t busy_ns;                    // Tiempo ejecutando handlers
+    uint64_t queue_wait_ns;              // Suma de esperas en cola (disparo -> inicio)
+    unsigned long queue_full;            // IRQs perdidas con la cola llena (atómico)
+    unsigned long steals;                // IRQs robadas de otras CPUs
+    uint64_t steal_saved_ns;             // Espera estimada que se ahorraron las IRQs robadas
+    int sleeping;
+    int id;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} __attribute__((aligned(CACHE_LINE_SIZE))) sim_cpu_t;
+
+// Trabajo diferido (bottom half) de una ISR
+typedef void (*deferred_fn_t)(int irq_num, void *data);
 
-// Estadísticas del sistema
+typedef struct {
+    unsigned long seq;
+    deferred_fn_t fn;
+    void *data;
+    int irq_num;
+} deferred_cell_t;
+
+// Cola MPMC de trabajo diferido: una de softirqs por CPU (la vacían irq_exit
+// y su ksoftirqd) y una compartida para el workqueue (la vacían los kworkers)
+typedef struct {
+    unsigned long enqueue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+    unsigned long dequeue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+    unsigned long completed;             // Trabajos terminados (para deferred_wait_idle)
+    deferred_cell_t cells[DEFERRED_QUEUE_SIZE];
+    unsigned long handoffs __attribute__((aligned(CACHE_LINE_SIZE))); // Relevos a ksoftirqd
+    unsigned long overflows;             // Cola llena: el trabajo se ejecutó en línea
+    int sleeping;
+    pthread_t threads[KWORKER_THREADS];
+    int thread_count;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} __attribute__((aligned(CACHE_LINE_SIZE))) deferred_queue_t;
+
+// Callback de un timer de software (rueda o hrtimer)
+typedef void (*soft_timer_fn_t)(void *data);
+
+// Timer de baja resolución (timer_list): caduca en un jiffy. pprev apunta
+// al enlace que lo referencia, así que se desengancha en O(1) sin recorrer
+// su ranura; level/slot localizan el bit de ocupación a limpiar.
+typedef struct soft_timer {
+    struct soft_timer *next;
+    struct soft_timer **pprev;           // NULL = no armado
+    uint64_t expires;                    // Jiffy de caducidad
+    soft_timer_fn_t fn;
+    void *data;
+    uint16_t slot;
+    uint8_t level;
+} soft_timer_t;
+
+// Timer de alta resolución: caduca en un instante de CLOCK_MONOTONIC
+typedef struct {
+    uint64_t expires;                    // ns
+    soft_timer_fn_t fn;
+    void *data;
+    long heap_index;                     // Posición en el heap (-1 = no armado)
+} hrtimer_t;
+
+// Base de timers de software: rueda jerárquica en cascada (como la de los
+// kernels 2.6: el nivel 0 cubre 256 jiffies y cada nivel superior 64 veces
+// más) con un bitmap de ranuras ocupadas por nivel, y min-heap de hrtimers
+typedef struct {
+    pthread_mutex_t lock;
+    uint64_t clk;                        // Próximo jiffy por procesar
+    soft_timer_t *root[1 << TIMER_WHEEL_ROOT_BITS];
+    soft_timer_t *levels[TIMER_WHEEL_LEVELS - 1][1 << TIMER_WHEEL_LVL_BITS];
+    uint64_t root_bitmap[(1 << TIMER_WHEEL_ROOT_BITS) / 64];
+    uint64_t level_bitmap[TIMER_WHEEL_LEVELS - 1];
+    unsigned long wheel_armed;           // Timers en la rueda
+    unsigned long cascaded;              // Timers recolocados al bajar de nivel
+    hrtimer_t **heap;
+    unsigned long heap_count;
+    unsigned long heap_capacity;
+} timer_base_t;
+
+// Histograma log-lineal de latencias en ns (estilo HdrHistogram): los
+// valores < 2^LAT_HIST_SUB_BITS tienen bucket propio y cada octava
+// superior se divide en 2^(LAT_HIST_SUB_BITS-1) buckets lineales. Memoria
+// constante, registro O(1) con adds atómicos relajados y sin locks.
+typedef struct {
+    unsigned long counts[LAT_HIST_BUCKETS];
+    unsigned long total;                 // Muestras registradas (atómico)
+    uint64_t sum_ns;                     // Suma de las muestras (atómico)
+    uint64_t max_ns;                     // Máximo exacto (atómico)
+} __attribute__((aligned(CACHE_LINE_SIZE))) lat_hist_t;
+
+// Percentiles leídos de un histograma
+typedef struct {
+    unsigned long count;
+    uint64_t p50_ns;
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+    unsigned long overflow;              // Muestras >= 2^LAT_HIST_MAX_BITS ns, fuera de escala
+    uint64_t max_ns;
+    double mean_ns;
+} lat_summary_t;
+
+// Tipos de evento del motor de tiempo virtual
+typedef enum {
+    SIM_EV_DEVICE,                       // Llegada de una IRQ de dispositivo
+    SIM_EV_TIMER_TICK                    // Deadline del PIT
+} sim_event_type_t;
+
+// Evento de la simulación discreta. seq desempata eventos del mismo
+// instante por orden de creación, así que una semilla da siempre el mismo orden.
+typedef struct {
+    uint64_t time_ns;
+    uint64_t seq;
+    sim_event_type_t type;
+    int irq_num;
+} sim_event_t;
+
+// Motor de eventos discretos (--virtual-time): min-heap de eventos por
+// instante virtual. El reloj salta al siguiente evento y los retardos de las
+// ISRs (sim_delay_us) lo adelantan en vez de dormir, como una única CPU que
+// atiende las llegadas en orden.
+typedef struct {
+    sim_event_t *heap;
+    unsigned long count;
+    unsigned long capacity;
+    uint64_t next_seq;
+    uint64_t rng;                        // xorshift64 de las llegadas
+    double rate[MAX_INTERRUPTS];         // Llegadas por segundo de cada IRQ (0 = sin dispositivo)
+    unsigned long events;                // Eventos procesados
+    unsigned long arrivals;              // Llegadas de dispositivos
+    uint64_t wait_total_ns;              // Suma de esperas llegada -> despacho
+    uint64_t wait_max_ns;
+} sim_engine_t;
+
+// Contadores de interrupciones del camino de despacho
 typedef struct {
     unsigned long total_interrupts;
     unsigned long timer_interrupts;
     unsigned long keyboard_interrupts;
     unsigned long custom_interrupts;
-    double average_response_time;
+    unsigned long total_response_time;   // Suma de tiempos de ISR (hard IRQ) en μs
+} irq_counters_t;
+
+// Shard de estadísticas: cada CPU simulada escribe en el suyo y los demás
+// hilos se reparten el resto. Alineado a línea de caché para que dos
+// escritores nunca compartan líneas; los lectores suman todos los shards.
+typedef struct {
+    irq_counters_t counters;
+    lat_hist_t isr_hist;                 // Parte del histograma global de ISRs
+} __attribute__((aligned(CACHE_LINE_SIZE))) stats_shard_t;
+
+// Estadísticas del sistema
+typedef struct {
+    stats_shard_t shards[STATS_SHARDS];  // Contadores por shard (ver stats_read_counters)
+    unsigned long softirq_items;         // Softirqs/tasklets ejecutados
+    unsigned long softirq_batches;       // Pasadas de irq_exit o ksoftirqd con trabajo
+    unsigned long softirq_time;          // Tiempo en softirqs en μs
+    unsigned long ksoftirqd_items;       // Softirqs que terminó ejecutando ksoftirqd
+    unsigned long work_items;            // Trabajos del workqueue ejecutados
+    unsigned long work_time;             // Tiempo en el workqueue en μs
+    unsigned long irq_thread_items;      // Ejecuciones de handlers en hilos irq/N
+    unsigned long irq_thread_time;       // Tiempo en hilos irq/N en μs
+    unsigned long napi_poll_entries;     // Líneas que pasaron de interrupciones a polling
+    unsigned long napi_poll_exits;       // Vueltas a interrupciones con la cola vacía
+    unsigned long napi_polls;            // Pasadas de polling
+    unsigned long napi_budget_exhausted; // Pasadas que agotaron su budget
+    unsigned long napi_polled;           // Eventos atendidos por polling
+    unsigned long irq_latched;           // Llegaron con el vector ocupado y quedaron en el IRR
+    unsigned long irq_coalesced;         // Llegaron con la misma IRQ ya pendiente en el IRR
+    unsigned long irq_lost;              // Descartadas (vector liberado o cola de CPU llena)
+    unsigned long irq_spurious;          // Atendidas sin que ningún handler las reclamara
+    unsigned long timer_ticks;           // Ticks del PIT disparados
+    unsigned long timer_missed_ticks;    // Periodos saltados porque el tick anterior se pasó
+    uint64_t timer_lateness_last_ns;     // Retraso del último tick respecto a su deadline
+    uint64_t timer_lateness_max_ns;
+    uint64_t timer_lateness_total_ns;
+    uint64_t timer_drift_ns;             // Deriva que habría acumulado un sleep() relativo
+    uint64_t timer_cpu_ns;               // CPU del hilo del timer en modo periódico
+    unsigned long timer_periodic_cycles; // Ciclos periódicos medidos en timer_cpu_ns
+    unsigned long nohz_stops;            // Veces que se detuvo el tick (NO_HZ idle)
+    unsigned long nohz_ticks_saved;      // Ticks periódicos que no se dispararon
+    uint64_t nohz_idle_ns;               // Tiempo con el tick detenido
+    unsigned long nohz_oneshot_ticks;    // IRQ0 one-shot por eventos programados
+    unsigned long soft_timers_expired;   // Timers de la rueda caducados
+    unsigned long hrtimers_expired;      // hrtimers caducados
+    unsigned long timer_expiry_runs;     // Pasadas de expiración (IRQ0 y softirq del timer)
+    uint64_t timer_expiry_ns;            // Tiempo en las pasadas de expiración
     time_t system_start_time;
+    uint64_t system_start_ns;            // monotonic_ns() al arrancar (virtual con --virtual-time)
 } system_stats_t;
 
+// Opciones de línea de comandos
+typedef struct {
+    unsigned long trace_capacity;        // Entradas de traza por hilo
+    const char *trace_file;              // Archivo para el anillo mapeado (NULL = memoria anónima)
+    const char *trace_export;            // Archivo .trace a generar al salir (NULL = no exportar)
+    log_policy_t log_policy;             // Cola del logger llena: esperar o descartar
+    int cpu_count;                       // CPUs simuladas (0 = despacho en el hilo que dispara)
+    int work_stealing;                   // CPUs ociosas roban IRQs pendientes de otras
+    unsigned int irq_affinity[MAX_INTERRUPTS]; // --irq-affinity (0 = todas las CPUs)
+    int threaded_irqs;                   // Dispositivos de prueba con handler en hilo irq/N
+    unsigned int napi_rate[MAX_INTERRUPTS]; // --napi: umbral de polling en IRQs/s (0 = apagado)
+    int napi_budget[MAX_INTERRUPTS];     // --napi: budget por pasada (0 = NAPI_DEFAULT_BUDGET)
+    int timer_hz;                        // --hz: frecuencia del tick (0 = cada TIMER_INTERVAL_SEC s)
+    int tickless;                        // --tickless: detener el tick con el sistema ocioso
+    const char *bench;                   // --bench: microbenchmark a ejecutar (NULL = simulador)
+    double virtual_seconds;              // --virtual-time: segundos simulados (0 = tiempo real)
+    double vt_rate[MAX_INTERRUPTS];      // --vt-rate: llegadas por segundo en tiempo virtual
+    int vt_rate_set;                     // Alguna --vt-rate explícita (si no, tasas por defecto)
+    uint64_t seed;                       // --seed: semilla de las llegadas virtuales
+    const char *hist_export;             // --hist-export: CSV de histogramas al salir (NULL = no)
+    int shared_devices[MAX_INTERRUPTS];  // --shared-irq: dispositivos de demostración por línea
+    int msix_vectors;                    // --msix: colas del dispositivo MSI-X de demostración (0 = ninguno)
+    unsigned int burst[MAX_INTERRUPTS];  // --burst: IRQs seguidas a disparar al arrancar
+} sim_options_t;
+
 // Entrada para tabla de IRQs de prueba
 typedef struct {
     int irq;
@@ -109,19 +533,47 @@ static const irq_entry_t irq_table[] = {
 
 // Variables globales
 extern irq_descriptor_t idt[MAX_INTERRUPTS];
-extern trace_entry_t trace_log[MAX_TRACE_LINES];
-extern int trace_index;
+extern irq_meta_t irq_meta[MAX_INTERRUPTS];
+extern unsigned long trace_capacity;
+extern unsigned long trace_dropped;
+extern unsigned long log_dropped;
 extern int system_running;
 extern int timer_counter;
 extern pthread_t timer_thread;
 extern pthread_mutex_t idt_mutex;
-extern pthread_mutex_t trace_mutex;
 extern system_stats_t stats;
 extern log_level_t current_log_level;
 extern int show_timer_logs;
+extern sim_options_t sim_options;
+extern sim_cpu_t sim_cpus[MAX_SIM_CPUS];
+extern lat_hist_t isr_hist[MAX_INTERRUPTS];
+extern lat_hist_t queue_hist[MAX_INTERRUPTS];
+extern int vector_irq[IDT_VECTORS];
+extern uint64_t irq_active[IRQ_BITMAP_WORDS];
+extern int smp_cpu_count;
+extern int sim_virtual_time;
+extern uint64_t sim_vclock_ns;
+
+// Reloj monotónico del host (clock_gettime vía vDSO, sin syscalls ni locks)
+static inline uint64_t host_monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Reloj del simulador en nanosegundos: el del host o, con --virtual-time,
+// el reloj virtual del motor de eventos
+static inline uint64_t monotonic_ns(void) {
+    if (__builtin_expect(sim_virtual_time, 0)) {
+        return sim_vclock_ns;
+    }
+    return host_monotonic_ns();
+}
 
 // Funciones de utilidad
 void get_timestamp(char *buffer, size_t size);
+void format_monotonic_timestamp(uint64_t timestamp_ns, char *buffer, size_t size);
+int64_t realtime_offset(void);
 int validate_irq_num(int irq_num);
 int is_irq_available(int irq_num);
 const char* get_irq_state_string(irq_state_t state);
@@ -133,6 +585,33 @@ void add_trace_with_irq(const char *event, int irq_num);
 void add_trace_silent(const char *event);
 void add_trace_with_irq_silent(const char *event, int irq_num);
 void add_trace_smart(const char *event, int irq_num, int is_timer_related);
+void add_trace_event(trace_event_id_t event_id, int irq_num, ...);
+void add_trace_event_smart(trace_event_id_t event_id, int irq_num, int is_timer_related, ...);
+int trace_init(unsigned long capacity, const char *file_path, int buffers);
+int trace_thread_budget(int cpu_count, int threaded_irqs);
+void trace_shutdown(void);
+trace_buffer_t *trace_buffer_at(int index);
+unsigned long trace_write(const trace_entry_t *entry);
+int trace_read(const trace_buffer_t *buffer, unsigned long ticket, trace_entry_t *out);
+unsigned long trace_oldest_ticket(unsigned long head);
+void trace_set_thread_name(const char *name);
+void trace_iter_init(trace_iter_t *it);
+void trace_iter_init_user(trace_iter_t *it);
+int trace_iter_prev(trace_iter_t *it, trace_entry_t *out);
+int trace_iter_next(trace_iter_t *it, trace_entry_t *out);
+long export_trace_file(const char *path);
+int trace_intern_string(const char *text);
+const char* trace_string_text(int string_id);
+void format_trace_entry(const trace_entry_t *entry, char *buffer, size_t size);
+void format_trace_timestamp(const trace_entry_t *entry, char *buffer, size_t size);
+void print_trace_entry(const char *prefix, const trace_entry_t *entry, int with_irq_tag);
+int format_trace_line(const char *prefix, const trace_entry_t *entry, int with_irq_tag,
+                      char *buffer, size_t size);
+
+// Logger de consola asíncrono
+int logger_start(log_policy_t policy);
+void logger_stop(void);
+void logger_flush(void);
 
 // Funciones de configuración
 void set_log_level(log_level_t level);
@@ -141,24 +620,105 @@ void toggle_timer_logs(void);
 // Funciones de inicialización
 void init_idt(void);
 void init_system_stats(void);
-void update_stats(int irq_num, unsigned long execution_time);
+void update_stats(int irq_num, uint64_t execution_ns);
+void update_stats_batch(int irq_num, unsigned long count, uint64_t execution_ns);
+void stats_read_counters(irq_counters_t *out);
+void stats_read_isr_hist(lat_hist_t *out);
+
+// Histogramas de latencia de las ISRs (por IRQ y global)
+void lat_hist_record(lat_hist_t *hist, uint64_t value_ns, unsigned long count);
+void lat_hist_reset(lat_hist_t *hist);
+void lat_hist_summary(const lat_hist_t *hist, lat_summary_t *out);
+long export_latency_histograms(const char *path);
 
 // Funciones de manejo de ISR
 int register_isr(int irq_num, void (*isr_function)(int), const char *description);
+int register_threaded_isr(int irq_num, irqreturn_t (*handler)(int),
+                          irqreturn_t (*thread_fn)(int), const char *description);
 int unregister_isr(int irq_num);
+int request_shared_irq(int irq_num, shared_handler_t handler, void *dev_id, const char *description);
+int free_shared_irq(int irq_num, void *dev_id);
 void dispatch_interrupt(int irq_num);
+void dispatch_interrupt_at(int irq_num, uint64_t raised_ns);
+int dispatch_vector(int vector);
+int dispatch_vector_at(int vector, uint64_t raised_ns);
+int irq_next_active(int irq_num);
+const char *idt_vector_name(int vector);
+
+// MSI/MSI-X: IRQs dinámicas con un vector de la IDT por cola
+int msix_alloc_vectors(const char *device, int count, void (*isr)(int), int *irqs);
+int msix_free_vectors(const int *irqs, int count);
+void shutdown_irq_threads(void);
+void irq_threads_wait_idle(void);
+
+// Modo SMP: CPUs simuladas con colas de IRQs pendientes
+int smp_start(int cpu_count, int work_stealing);
+void smp_stop(void);
+void smp_wait_idle(void);
+int set_irq_affinity(int irq_num, unsigned int mask);
+
+// NAPI: por encima de napi_rate IRQs/s la línea se enmascara y un poll en
+// softirq atiende los eventos en lotes de napi_budget
+int set_irq_napi(int irq_num, unsigned int rate, int budget);
+
+// Bottom halves: softirq/tasklet (no duerme, corre en irq_exit o ksoftirqd)
+// y workqueue (puede dormir, corre en kworkers)
+int tasklet_schedule(int irq_num, deferred_fn_t fn, void *data);
+int queue_work(int irq_num, deferred_fn_t fn, void *data);
+int deferred_start(int cpu_count);
+void deferred_stop(void);
+void deferred_wait_idle(void);
 
 // ISRs predefinidas
 void timer_isr(int irq_num);
 void keyboard_isr(int irq_num);
 void custom_isr(int irq_num);
+irqreturn_t custom_primary_handler(int irq_num);
+irqreturn_t custom_thread_fn(int irq_num);
+void msix_queue_isr(int irq_num);
 void error_isr(int irq_num);
 
 // Funciones de hilo
 void* timer_thread_func(void* arg);
 
+// Timer periódico de alta resolución (clock_nanosleep con TIMER_ABSTIME)
+int timer_set_hz(int hz);
+int timer_get_hz(void);
+uint64_t timer_period_ns(void);
+
+// Modo tickless (NO_HZ idle): con el sistema ocioso el tick se detiene y el
+// timer solo dispara one-shot en el próximo evento programado
+void timer_set_tickless(int enabled);
+int timer_program_event(uint64_t expires_ns);
+void timer_kick(void);
+
+// Timers de software expirados desde la IRQ0: la rueda (jiffies) en el
+// softirq del timer y los hrtimers (ns) en la propia ISR
+uint64_t timer_jiffies(void);
+void timer_setup(soft_timer_t *timer, soft_timer_fn_t fn, void *data);
+int mod_timer(soft_timer_t *timer, uint64_t expires);
+int del_timer(soft_timer_t *timer);
+void hrtimer_setup(hrtimer_t *timer, soft_timer_fn_t fn, void *data);
+int hrtimer_start(hrtimer_t *timer, uint64_t expires_ns);
+int hrtimer_cancel(hrtimer_t *timer);
+int arm_test_timers(int count);
+
+// Motor de eventos discretos en tiempo virtual (--virtual-time)
+void sim_delay_us(unsigned long us);
+int sim_schedule_event(sim_engine_t *engine, uint64_t time_ns, sim_event_type_t type, int irq_num);
+int sim_next_event(sim_engine_t *engine, sim_event_t *out);
+int run_virtual_simulation(double seconds);
+
+// Microbenchmarks (--bench)
+int run_benchmark(const char *name);
+int bench_timers(void);
+int check_timers(void);
+int bench_shared(void);
+int bench_idt(void);
+
 // Funciones de visualización
 void show_idt_status(void);
+void show_smp_status(void);
 void show_recent_trace(void);
 void show_last_trace(void);
 void show_last_n_non_timer_traces(int n);
@@ -174,17 +734,17 @@ void test_concurrent_interrupts(void);
 void test_stress_interrupts(void);
 
 // Funciones auxiliares
+int parse_command_line(int argc, char *argv[]);
+void show_usage(const char *program);
 void clear_input_buffer(void);
 int get_valid_input(int min, int max);
 void wait_for_enter(void);
 void improved_main_initialization(void);
+const char *get_irq_description(int irq_num);
 
 // Funciones de backup/restore
-void save_idt_state(irq_descriptor_t *backup);
-void restore_idt_state(const irq_descriptor_t *backup);
+void save_idt_state(irq_backup_t *backup);
+void restore_idt_state(const irq_backup_t *backup);
 void cleanup_test_isrs(void);
 
-// Funciones auxiliares para detección de trazas
-int is_timer_related_trace(const trace_entry_t *entry);
-
 #endif // INTERRUPT_SIMULATOR_H
@@ -199,6 +199,163 @@ EOF
     rm -f concurrency_test.txt concurrency_output.log
 }
 
+# Función para probar el modo SMP (CPUs simuladas con afinidad)
+test_smp_mode() {
+    print_status "INFO" "Probando modo SMP con 2 CPUs simuladas..."
+    
+    # 1 = IRQ 1 (afinidad fijada en CPU1), 3 = estado de la IDT, 0 = salir
+    cat > smp_test.txt << EOF
+
+1
+1
+
+3
+
+0
+EOF
+    
+    # Con work stealing activo una IRQ fijada a CPU1 nunca debe moverse
+    timeout 15s ./interrupt_simulator --cpus 2 --irq-affinity 1=2 --work-stealing \
+        < smp_test.txt > smp_output.log 2>&1
+    
+    if grep -q "\[CPU1\] \[IRQ1\]" smp_output.log && \
+       grep -q "INTERRUPCIONES POR CPU" smp_output.log && \
+       grep -q "Work stealing activo" smp_output.log && \
+       grep -qE "^ +1: +0 +1 +2 " smp_output.log; then
+        print_status "PASS" "IRQs repartidas por CPU según smp_affinity"
+    else
+        print_status "FAIL" "Error en modo SMP"
+    fi
+    
+    rm -f smp_test.txt smp_output.log
+}
+
+# Función para probar la entrega SMP de IRQs retenidas en el IRR
+test_smp_latch() {
+    print_status "INFO" "Probando entrega de IRQs retenidas en modo SMP..."
+    
+    # 3 = estado de la IDT, 7 = estadísticas, 0 = salir
+    printf '\n3\n\n7\n\n0\n' > smp_latch.txt
+    
+    # 20 IRQs seguidas sobre CPU0-1: las que encuentran el vector ocupado se
+    # retienen o se fusionan, y las retenidas deben ejecutarse en una CPU de
+    # la afinidad, no en el hilo que hace el EOI
+    timeout 30s ./interrupt_simulator --cpus 2 --irq-affinity 1=3 --burst 1=20 \
+        < smp_latch.txt > smp_latch.log 2>&1
+    
+    local calls cpu_sum coalesced lost
+    calls=$(grep "│ 0x21 │" smp_latch.log | head -1 | awk -F'│' '{gsub(/ /, "", $4); print $4}')
+    cpu_sum=$(grep -E "^ +1: " smp_latch.log | awk '{print $2 + $3}')
+    coalesced=$(grep "Fusionadas (coalesced):" smp_latch.log | grep -oE "[0-9]+" | head -1)
+    lost=$(grep "Perdidas:" smp_latch.log | grep -oE "[0-9]+" | head -1)
+    
+    if grep -q "Ráfagas atendidas: 20" smp_latch.log && \
+       [ -n "$calls" ] && [ -n "$cpu_sum" ] && [ -n "$coalesced" ] && [ -n "$lost" ] && \
+       [ "$cpu_sum" -eq "$calls" ] && \
+       [ $((calls + coalesced + lost)) -eq 20 ]; then
+        print_status "PASS" "IRR entregado a CPUs de la afinidad con contadores coherentes"
+    else
+        print_status "FAIL" "Contadores incoherentes al entregar el IRR en SMP (llamadas=$calls, CPUs=$cpu_sum, fusionadas=$coalesced, perdidas=$lost)"
+    fi
+    
+    rm -f smp_latch.txt smp_latch.log
+}
+
+# Función para comprobar la rueda de timers en cascada y el heap de hrtimers
+test_timers() {
+    print_status "INFO" "Comprobando rueda de timers y hrtimers..."
+    
+    # Timers en los límites de nivel (255/256, 2^14, 2^20 jiffies) con bajas y
+    # rearmes: cada uno debe caducar una sola vez y nunca antes de su instante
+    if timeout 60s ./interrupt_simulator --bench timers-check > timers_output.log 2>&1 && \
+       grep -q "todos caducados una vez y a tiempo" timers_output.log && \
+       ! grep -q "❌" timers_output.log; then
+        print_status "PASS" "Rueda en cascada y hrtimers caducan una vez y a tiempo"
+    else
+        grep "❌" timers_output.log | head -5
+        print_status "FAIL" "Error en la rueda de timers o en los hrtimers"
+    fi
+    
+    # Tickless con CPUs simuladas: el tick propio, encolado en una CPU, no
+    # debe contar como trabajo en vuelo. 2 s ociosos a 250 Hz son ~500 ticks
+    (printf '\n'; sleep 2; printf '7\n\n0\n') | \
+        timeout 30s ./interrupt_simulator --tickless --hz 250 --cpus 2 > nohz_output.log 2>&1
+    local saved
+    saved=$(grep "ticks ahorrados:" nohz_output.log | grep -oE "[0-9]+" | head -1)
+    
+    if [ -n "$saved" ] && [ "$saved" -ge 250 ]; then
+        print_status "PASS" "Tick detenido con CPUs simuladas ($saved ticks ahorrados)"
+    else
+        print_status "FAIL" "El modo tickless no detiene el tick con --cpus (ahorrados=$saved)"
+    fi
+    
+    rm -f timers_output.log nohz_output.log
+}
+
+# Función para probar el motor de eventos en tiempo virtual
+test_virtual_time() {
+    print_status "INFO" "Probando simulación en tiempo virtual..."
+    
+    # Una hora simulada debe tardar segundos y repetirse igual con la misma semilla
+    timeout 30s ./interrupt_simulator --virtual-time 3600 --seed 7 2>&1 | grep -v "host" > vt_a.log
+    timeout 30s ./interrupt_simulator --virtual-time 3600 --seed 7 2>&1 | grep -v "host" > vt_b.log
+    
+    # --threaded-irqs se ignora en tiempo virtual: sin hilos irq/N que toquen el
+    # reloj virtual la salida sigue siendo determinista y ninguna línea queda enmascarada
+    timeout 30s ./interrupt_simulator --virtual-time 600 --seed 7 --threaded-irqs 2>&1 | grep -v "host" > vt_c.log
+    timeout 30s ./interrupt_simulator --virtual-time 600 --seed 7 --threaded-irqs 2>&1 | grep -v "host" > vt_d.log
+    
+    if grep -q "SIMULACIÓN EN TIEMPO VIRTUAL" vt_a.log && \
+       grep -q "01:00:00" vt_a.log && \
+       cmp -s vt_a.log vt_b.log && \
+       grep -q "SIMULACIÓN EN TIEMPO VIRTUAL" vt_c.log && \
+       cmp -s vt_c.log vt_d.log && \
+       ! grep -q "ENMASCARADO" vt_c.log; then
+        print_status "PASS" "Tiempo virtual determinista"
+    else
+        print_status "FAIL" "Error en simulación en tiempo virtual"
+    fi
+    
+    rm -f vt_a.log vt_b.log vt_c.log vt_d.log
+}
+
+# Función para probar líneas compartidas (IRQF_SHARED)
+test_shared_irq() {
+    print_status "INFO" "Probando IRQ compartida entre 3 dispositivos..."
+    
+    # Uno de cada cuatro eventos no es de ningún dispositivo y debe contarse como espurio
+    timeout 30s ./interrupt_simulator --virtual-time 60 --seed 3 --shared-irq 5=3 --vt-rate 5=20 \
+        > shared_output.log 2>&1
+    
+    if grep -qE "IRQ5 compartida \(3 handlers\): dev5.0 \([0-9]+\) · dev5.1 \([0-9]+\) · dev5.2 \([0-9]+\) │ [1-9][0-9]* espurias" \
+            shared_output.log; then
+        print_status "PASS" "Cadena de handlers y espurias contabilizadas"
+    else
+        print_status "FAIL" "Error en IRQs compartidas"
+    fi
+    
+    rm -f shared_output.log
+}
+
+# Función para probar MSI-X: IRQs dinámicas con vector propio asignado
+test_msix() {
+    print_status "INFO" "Probando dispositivo MSI-X con 4 colas..."
+    
+    # Las colas toman las IRQs 16-19 y los primeros vectores dinámicos (0x30-0x33)
+    timeout 30s ./interrupt_simulator --virtual-time 60 --seed 3 --msix 4 --vt-rate 16=20 --vt-rate 19=10 \
+        > msix_output.log 2>&1
+    
+    if grep -qE "16 │ 0x30 │ REGISTRADO +│ +[1-9][0-9]* │ .*nic0-msix-0" msix_output.log && \
+       grep -qE "19 │ 0x33 │ REGISTRADO +│ +[1-9][0-9]* │ .*nic0-msix-3" msix_output.log && \
+       grep -q "4/192 dinámicos" msix_output.log; then
+        print_status "PASS" "Vectores MSI-X asignados y despachados"
+    else
+        print_status "FAIL" "Error en la asignación de vectores MSI-X"
+    fi
+    
+    rm -f msix_output.log
+}
+
 # Función para verificar sintaxis del código
 test_code_syntax() {
     print_status "INFO" "Verificando sintaxis del código..."
@@ -329,6 +486,48 @@ EOF
     rm -f trace_test.txt trace_output.log
 }
 
+# Función para probar exportación y analizador offline de trazas
+test_trace_analyzer() {
+    print_status "INFO" "Probando exportación y analizador de trazas..."
+    
+    if [ ! -x "./trace_analyzer" ]; then
+        print_status "FAIL" "Analizador de trazas no encontrado"
+        return 1
+    fi
+    
+    cat > analyzer_test.txt << EOF
+
+1
+1
+
+1
+2
+
+0
+EOF
+    
+    rm -f analyzer_test.trace
+    timeout 15s ./interrupt_simulator --trace-export analyzer_test.trace < analyzer_test.txt > /dev/null 2>&1
+    ./trace_analyzer --summary --gaps 100 --bursts 2:1000 analyzer_test.trace > analyzer_output.log 2>&1
+    local exit_code=$?
+    
+    # Los nombres de los handlers salen de la tabla de cadenas del propio archivo
+    if [ $exit_code -eq 0 ] && \
+       grep -q "RESUMEN DE TRAZA" analyzer_output.log && \
+       grep -qE "^1 +[0-9]+ +1 .*Controlador de teclado 8042" analyzer_output.log && \
+       ./trace_analyzer --dump --irq 1 analyzer_test.trace | \
+           grep -q 'Ejecutando ISR "Controlador de teclado 8042"' && \
+       ! ./trace_analyzer --irq -5 analyzer_test.trace > /dev/null 2>&1 && \
+       ! ./trace_analyzer --irq abc analyzer_test.trace > /dev/null 2>&1 && \
+       ! ./trace_analyzer --gaps abc analyzer_test.trace > /dev/null 2>&1; then
+        print_status "PASS" "Traza exportada y analizada correctamente"
+    else
+        print_status "FAIL" "Error en exportación o análisis de trazas"
+    fi
+    
+    rm -f analyzer_test.txt analyzer_output.log analyzer_test.trace
+}
+
 # Función para generar reporte de pruebas
 generate_report() {
     print_status "INFO" "Generando reporte de pruebas..."
@@ -368,8 +567,10 @@ cleanup() {
     print_status "INFO" "Limpiando archivos temporales..."
     rm -f test_input.txt test_output.log auto_test.txt concurrency_test.txt
     rm -f concurrency_output.log stress_test.txt stress_output.log
+    rm -f smp_test.txt smp_output.log
     rm -f valgrind_output.log stats_test.txt stats_output.log
     rm -f trace_test.txt trace_output.log
+    rm -f analyzer_test.txt analyzer_output.log analyzer_test.trace
 }
 
 # Función para mostrar ayuda
@@ -476,6 +677,7 @@ main() {
             check_dependencies
             compile_project
             test_trace_system
+            test_trace_analyzer
             ;;
         "stats")
             check_dependencies
@@ -489,7 +691,14 @@ main() {
             test_code_syntax
             test_basic_functionality
             test_concurrency
+            test_smp_mode
+            test_smp_latch
+            test_timers
+            test_virtual_time
+            test_shared_irq
+            test_msix
             test_trace_system
+            test_trace_analyzer
             test_statistics
             test_stress
             test_memory_leaks
@@ -0,0 +1,584 @@
+/*
+ * Analizador offline de trazas del Simulador de Interrupciones Linux
+ *
+ * Lee archivos .trace generados con `interrupt_simulator --trace-export`
+ * (formato en trace_format.h) sin ejecutar el simulador. El archivo se mapea
+ * en modo solo lectura y se recorre secuencialmente: la memoria usada no
+ * depende del tamaño de la traza.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace_format.h"
+
+#define ANALYZER_MAX_IRQS 256            // Límite de entradas del índice por IRQ aceptadas
+#define ANALYZER_MAX_BURST 1024          // Límite de N en --bursts N:MS
+#define ANALYZER_MAX_SECONDS 1e9        // Límite de --gaps, --bursts, --from y --to
+#define NS_PER_MS 1000000ULL
+#define NS_PER_SEC 1000000000ULL
+
+// Archivo de traza mapeado
+typedef struct {
+    const unsigned char *base;
+    size_t size;
+    const trace_file_header_t *header;
+    const trace_entry_t *records;
+    const trace_irq_index_t *irq_index;
+    const trace_time_index_t *time_index;
+    const trace_file_string_t *events;   // Plantillas (event_count)
+    const trace_file_string_t *strings;  // Cadenas citadas (string_count)
+} trace_file_t;
+
+// Opciones de consulta
+typedef struct {
+    int summary;
+    int dump;                            // Listar los registros con su texto
+    int irq;                             // -1 = todas
+    uint64_t gap_ns;                     // 0 = no buscar gaps
+    unsigned int burst_count;            // 0 = no buscar ráfagas
+    uint64_t burst_window_ns;
+    double from_sec;                     // Relativo al primer registro
+    double to_sec;                       // < 0 = hasta el final
+} analyzer_options_t;
+
+// Estadísticas acumuladas por IRQ (tamaño fijo)
+typedef struct {
+    uint64_t events;
+    uint64_t raised;
+    uint64_t pending_raise_ns;           // Último IRQ_RAISED sin IRQ_DONE
+    uint64_t latency_count;
+    uint64_t latency_min_ns;
+    uint64_t latency_max_ns;
+    uint64_t latency_total_ns;
+    uint64_t isr_count;
+    int64_t isr_min_us;
+    int64_t isr_max_us;
+    int64_t isr_total_us;
+    uint64_t last_raise_ns;              // Para detección de gaps
+    uint64_t gaps;
+    uint64_t max_gap_ns;
+    uint64_t bursts;
+    uint64_t burst_until_ns;             // Fin de la ráfaga ya reportada
+    uint64_t ticks;                      // Disparos del timer PIT con su retraso
+    int64_t tick_late_total_us;
+    int64_t tick_late_max_us;
+    uint64_t missed_ticks;
+    uint64_t oneshot_ticks;          // IRQ0 one-shot con el tick detenido (NO_HZ)
+    uint32_t handler_id;                 // Cadena del último handler registrado (0 = ninguno)
+    int32_t shared_handlers;             // Handlers en la cadena si la línea es compartida
+    unsigned int ring_head;
+    unsigned int ring_fill;
+} irq_stats_t;
+
+// Mostrar ayuda
+static void show_usage(const char *program) {
+    printf("Uso: %s [opciones] ARCHIVO.trace\n", program);
+    printf("  --summary            Resumen por IRQ: eventos, latencia y tiempo de ISR (por defecto)\n");
+    printf("  --dump               Listar los registros con su texto (handlers, dispositivos, mensajes)\n");
+    printf("  --gaps MS            Reportar silencios mayores a MS ms entre disparos de una IRQ\n");
+    printf("  --bursts N:MS        Reportar ráfagas de N disparos de una IRQ en menos de MS ms\n");
+    printf("  --irq N              Limitar el análisis a la IRQ N\n");
+    printf("  --from S             Empezar S segundos después del primer registro\n");
+    printf("  --to S               Terminar S segundos después del primer registro\n");
+    printf("  -h, --help           Mostrar esta ayuda\n");
+}
+
+// Leer un número de segundos o milisegundos de la línea de comandos: todo
+// el texto debe ser numérico y el valor estar en [0, ANALYZER_MAX_SECONDS]
+// (ya convertido a ns cabe de sobra en 64 bits). Devuelve 0 si es válido.
+static int parse_duration(const char *text, double *value) {
+    char *endptr;
+    
+    *value = strtod(text, &endptr);
+    if (endptr == text || *endptr != '\0' ||
+        !(*value >= 0.0 && *value <= ANALYZER_MAX_SECONDS)) {
+        return -1;
+    }
+    return 0;
+}
+
+// Mapear y validar el archivo de traza
+static int open_trace_file(const char *path, trace_file_t *file) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(trace_file_header_t)) {
+        fprintf(stderr, "Error: %s no es un archivo de traza válido\n", path);
+        close(fd);
+        return -1;
+    }
+
+    file->size = (size_t)st.st_size;
+    file->base = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file->base == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    posix_madvise((void *)file->base, file->size, POSIX_MADV_SEQUENTIAL);
+
+    const trace_file_header_t *h = (const trace_file_header_t *)file->base;
+    file->header = h;
+
+    if (memcmp(h->magic, TRACE_FILE_MAGIC, sizeof(h->magic)) != 0) {
+        fprintf(stderr, "Error: %s: magic inválido (no es un archivo .trace)\n", path);
+        return -1;
+    }
+    if (h->version != TRACE_FILE_VERSION || h->header_size != sizeof(trace_file_header_t) ||
+        h->record_size != sizeof(trace_entry_t)) {
+        fprintf(stderr, "Error: %s: versión %u no soportada (esperada %d)\n",
+                path, h->version, TRACE_FILE_VERSION);
+        return -1;
+    }
+    if (h->irq_count > ANALYZER_MAX_IRQS ||
+        h->records_offset + h->record_count * sizeof(trace_entry_t) > file->size ||
+        h->irq_index_offset + h->irq_count * sizeof(trace_irq_index_t) > file->size ||
+        h->time_index_offset + h->time_index_count * sizeof(trace_time_index_t) > file->size ||
+        h->event_table_offset + h->event_count * sizeof(trace_file_string_t) > file->size ||
+        h->string_table_offset + h->string_count * sizeof(trace_file_string_t) > file->size) {
+        fprintf(stderr, "Error: %s: archivo truncado o índices fuera de rango\n", path);
+        return -1;
+    }
+
+    file->records = (const trace_entry_t *)(file->base + h->records_offset);
+    file->irq_index = (const trace_irq_index_t *)(file->base + h->irq_index_offset);
+    file->time_index = (const trace_time_index_t *)(file->base + h->time_index_offset);
+    file->events = (const trace_file_string_t *)(file->base + h->event_table_offset);
+    file->strings = (const trace_file_string_t *)(file->base + h->string_table_offset);
+    return 0;
+}
+
+// Texto con un id dado en una tabla del archivo (búsqueda binaria: va ordenada)
+static const char *lookup_text(const trace_file_string_t *table, uint64_t count, int64_t id) {
+    uint64_t lo = 0, hi = count;
+
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if ((int64_t)table[mid].id < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < count && (int64_t)table[lo].id == id) {
+        return table[lo].text;
+    }
+    return NULL;
+}
+
+// Texto de una cadena citada por un registro (%s)
+static const char *trace_file_string(const trace_file_t *file, int32_t id) {
+    const char *text = lookup_text(file->strings, file->header->string_count, id);
+    return text ? text : "<texto no disponible>";
+}
+
+// Generar el texto de un registro con la plantilla guardada en el archivo
+static void format_record(const trace_file_t *file, const trace_entry_t *e, char *buffer, size_t size) {
+    const char *fmt = lookup_text(file->events, file->header->event_count, e->event_id);
+    size_t pos = 0;
+    int arg = 0;
+
+    if (!fmt) {
+        snprintf(buffer, size, "<evento %u desconocido>", e->event_id);
+        return;
+    }
+    while (*fmt && pos + 1 < size) {
+        if (fmt[0] == '%' && (fmt[1] == 'd' || fmt[1] == 's') && arg < TRACE_MAX_ARGS) {
+            int written = (fmt[1] == 'd')
+                ? snprintf(buffer + pos, size - pos, "%d", (int)e->args[arg])
+                : snprintf(buffer + pos, size - pos, "%s", trace_file_string(file, e->args[arg]));
+            if (written < 0) {
+                break;
+            }
+            pos += (size_t)written < size - pos ? (size_t)written : size - pos - 1;
+            arg++;
+            fmt += 2;
+        } else {
+            buffer[pos++] = *fmt++;
+        }
+    }
+    buffer[pos] = '\0';
+}
+
+// Primer registro a examinar para un instante dado (búsqueda binaria en el índice temporal)
+static uint64_t find_start_record(const trace_file_t *file, uint64_t from_ns) {
+    uint64_t lo = 0, hi = file->header->time_index_count;
+
+    // Último punto del índice con timestamp <= from_ns
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (file->time_index[mid].timestamp_ns <= from_ns) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo == 0 ? 0 : file->time_index[lo - 1].record_number;
+}
+
+// Formatear un instante de la traza como hora de pared
+static void format_wall_time(const trace_file_t *file, uint64_t ns, char *buffer, size_t size) {
+    int64_t wall_ns = (int64_t)ns + file->header->realtime_offset_ns;
+    time_t sec = (time_t)(wall_ns / (int64_t)NS_PER_SEC);
+    struct tm tm_info;
+
+    localtime_r(&sec, &tm_info);
+    size_t len = strftime(buffer, size, "%H:%M:%S", &tm_info);
+    snprintf(buffer + len, size - len, ".%06ld", (long)((wall_ns % (int64_t)NS_PER_SEC) / 1000));
+}
+
+// Mostrar un registro como línea de consola del simulador
+static void print_record(const trace_file_t *file, const trace_entry_t *e) {
+    char when[32], text[2 * TRACE_FILE_STRING_LEN];
+    int cpu = (e->flags & TRACE_FLAG_CPU_MASK) >> TRACE_FLAG_CPU_SHIFT;
+
+    format_wall_time(file, e->timestamp_ns, when, sizeof(when));
+    format_record(file, e, text, sizeof(text));
+    printf("[%s] ", when);
+    if (cpu > 0) {
+        printf("[CPU%d] ", cpu - 1);
+    }
+    if (e->irq_num >= 0) {
+        printf("[IRQ%d] ", e->irq_num);
+    }
+    printf("%s\n", text);
+}
+
+// Registrar un disparo para la detección de ráfagas (anillo de N timestamps por IRQ)
+static void track_burst(const trace_file_t *file, const analyzer_options_t *opts,
+                        irq_stats_t *stats, uint64_t *ring, int irq, uint64_t ts) {
+    ring[stats->ring_head] = ts;
+    stats->ring_head = (stats->ring_head + 1) % opts->burst_count;
+    if (stats->ring_fill < opts->burst_count) {
+        stats->ring_fill++;
+        if (stats->ring_fill < opts->burst_count) {
+            return;
+        }
+    }
+
+    // ring_head apunta ahora al disparo más antiguo de los últimos N
+    uint64_t oldest = ring[stats->ring_head];
+    if (ts - oldest <= opts->burst_window_ns && oldest > stats->burst_until_ns) {
+        char when[32];
+        format_wall_time(file, oldest, when, sizeof(when));
+        printf("💥 RÁFAGA IRQ %d: %u disparos en %.3f ms desde %s\n",
+               irq, opts->burst_count, (double)(ts - oldest) / NS_PER_MS, when);
+        stats->bursts++;
+        stats->burst_until_ns = ts;
+    }
+}
+
+// Recorrer los registros en la ventana pedida y acumular estadísticas
+static void analyze(const trace_file_t *file, const analyzer_options_t *opts,
+                    irq_stats_t *stats, uint64_t *burst_rings) {
+    const trace_file_header_t *h = file->header;
+    uint64_t from_ns = h->first_timestamp_ns + (uint64_t)(opts->from_sec * NS_PER_SEC);
+    uint64_t to_ns = opts->to_sec < 0 ? UINT64_MAX
+                                      : h->first_timestamp_ns + (uint64_t)(opts->to_sec * NS_PER_SEC);
+    uint64_t start = find_start_record(file, from_ns);
+    uint64_t end = h->record_count;
+
+    // Con --irq el índice por IRQ acota el recorrido
+    if (opts->irq >= 0) {
+        const trace_irq_index_t *idx = &file->irq_index[opts->irq];
+        if (idx->record_count == 0) {
+            return;
+        }
+        if (idx->first_record > start) {
+            start = idx->first_record;
+        }
+        if (idx->last_record + 1 < end) {
+            end = idx->last_record + 1;
+        }
+    }
+
+    for (uint64_t r = start; r < end; r++) {
+        const trace_entry_t *e = &file->records[r];
+        int irq = e->irq_num;
+
+        if (e->timestamp_ns < from_ns) {
+            continue;
+        }
+        if (e->timestamp_ns > to_ns) {
+            break;
+        }
+        if (opts->dump && (opts->irq < 0 || irq == opts->irq)) {
+            print_record(file, e);
+        }
+        if (irq < 0 || (uint32_t)irq >= h->irq_count || (opts->irq >= 0 && irq != opts->irq)) {
+            continue;
+        }
+
+        irq_stats_t *s = &stats[irq];
+        s->events++;
+
+        switch (e->event_id) {
+            case TRACE_EV_IRQ_RAISED:
+                s->raised++;
+                s->pending_raise_ns = e->timestamp_ns;
+                if (opts->gap_ns && s->last_raise_ns &&
+                    e->timestamp_ns - s->last_raise_ns > opts->gap_ns) {
+                    uint64_t gap = e->timestamp_ns - s->last_raise_ns;
+                    char when[32];
+                    format_wall_time(file, s->last_raise_ns, when, sizeof(when));
+                    printf("⏸️  GAP IRQ %d: %.3f ms sin disparos desde %s\n",
+                           irq, (double)gap / NS_PER_MS, when);
+                    s->gaps++;
+                    if (gap > s->max_gap_ns) {
+                        s->max_gap_ns = gap;
+                    }
+                }
+                s->last_raise_ns = e->timestamp_ns;
+                if (opts->burst_count) {
+                    track_burst(file, opts, s, burst_rings + (size_t)irq * opts->burst_count,
+                                irq, e->timestamp_ns);
+                }
+                break;
+            case TRACE_EV_CONTEXT_RESTORE:
+                if (s->isr_count == 0 || e->args[0] < s->isr_min_us) {
+                    s->isr_min_us = e->args[0];
+                }
+                if (s->isr_count == 0 || e->args[0] > s->isr_max_us) {
+                    s->isr_max_us = e->args[0];
+                }
+                s->isr_total_us += e->args[0];
+                s->isr_count++;
+                break;
+            case TRACE_EV_PIT_FIRE:
+                s->ticks++;
+                s->tick_late_total_us += e->args[1];
+                if (e->args[1] > s->tick_late_max_us) {
+                    s->tick_late_max_us = e->args[1];
+                }
+                break;
+            case TRACE_EV_ISR_REGISTERED:
+                s->handler_id = (uint32_t)e->args[1];
+                s->shared_handlers = 0;
+                break;
+            case TRACE_EV_SHARED_REGISTERED:
+                s->handler_id = (uint32_t)e->args[0];
+                s->shared_handlers = e->args[2];
+                break;
+            case TRACE_EV_TIMER_MISSED:
+                s->missed_ticks += (uint64_t)e->args[0];
+                break;
+            case TRACE_EV_NOHZ_ONESHOT:
+                s->oneshot_ticks++;
+                break;
+            case TRACE_EV_IRQ_DONE:
+                if (s->pending_raise_ns) {
+                    uint64_t latency = e->timestamp_ns - s->pending_raise_ns;
+                    if (s->latency_count == 0 || latency < s->latency_min_ns) {
+                        s->latency_min_ns = latency;
+                    }
+                    if (latency > s->latency_max_ns) {
+                        s->latency_max_ns = latency;
+                    }
+                    s->latency_total_ns += latency;
+                    s->latency_count++;
+                    s->pending_raise_ns = 0;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+// Mostrar la cabecera y el resumen por IRQ
+static void show_summary(const trace_file_t *file, const irq_stats_t *stats) {
+    const trace_file_header_t *h = file->header;
+    char first[32], last[32];
+
+    format_wall_time(file, h->first_timestamp_ns, first, sizeof(first));
+    format_wall_time(file, h->last_timestamp_ns, last, sizeof(last));
+
+    printf("\n=== RESUMEN DE TRAZA ===\n");
+    printf("Registros: %llu (sin IRQ: %llu)  Formato v%u\n",
+           (unsigned long long)h->record_count, (unsigned long long)h->untagged_count, h->version);
+    printf("Intervalo: %s -> %s (%.3f s)\n", first, last,
+           h->record_count ? (double)(h->last_timestamp_ns - h->first_timestamp_ns) / NS_PER_SEC : 0.0);
+
+    printf("\n%-4s %-9s %-9s %-28s %-22s %-14s %s\n",
+           "IRQ", "Eventos", "Disparos", "Latencia min/avg/max (μs)", "ISR min/avg/max (μs)", "Gaps/Ráfagas",
+           "Handler");
+    printf("------------------------------------------------------------------------------------------------------------------\n");
+
+    for (uint32_t i = 0; i < h->irq_count; i++) {
+        const irq_stats_t *s = &stats[i];
+        char latency[32] = "-", isr[32] = "-", gaps[32];
+        char handler[TRACE_FILE_STRING_LEN + 16] = "-";
+
+        if (s->events == 0) {
+            continue;
+        }
+        if (s->latency_count) {
+            snprintf(latency, sizeof(latency), "%.1f/%.1f/%.1f",
+                     s->latency_min_ns / 1000.0,
+                     (double)s->latency_total_ns / s->latency_count / 1000.0,
+                     s->latency_max_ns / 1000.0);
+        }
+        if (s->isr_count) {
+            snprintf(isr, sizeof(isr), "%lld/%.1f/%lld",
+                     (long long)s->isr_min_us, (double)s->isr_total_us / s->isr_count,
+                     (long long)s->isr_max_us);
+        }
+        if (s->handler_id) {
+            snprintf(handler, sizeof(handler), s->shared_handlers > 1 ? "%s (+%d)" : "%s",
+                     trace_file_string(file, (int32_t)s->handler_id), s->shared_handlers - 1);
+        }
+        snprintf(gaps, sizeof(gaps), "%llu/%llu",
+                 (unsigned long long)s->gaps, (unsigned long long)s->bursts);
+        printf("%-4u %-9llu %-9llu %-28s %-22s %-13s %s\n", i,
+               (unsigned long long)s->events, (unsigned long long)s->raised, latency, isr, gaps, handler);
+    }
+
+    // Retraso de cada tick del timer respecto a su deadline absoluto
+    for (uint32_t i = 0; i < h->irq_count; i++) {
+        const irq_stats_t *s = &stats[i];
+        if (s->ticks == 0 && s->oneshot_ticks == 0) {
+            continue;
+        }
+        printf("\n⏲️  Timer IRQ %u: %llu ticks, retraso medio %.1f μs, máx %lld μs, %llu ticks perdidos, %llu one-shot\n",
+               i, (unsigned long long)s->ticks,
+               s->ticks ? (double)s->tick_late_total_us / s->ticks : 0.0,
+               (long long)s->tick_late_max_us, (unsigned long long)s->missed_ticks,
+               (unsigned long long)s->oneshot_ticks);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    analyzer_options_t opts = { .summary = 0, .irq = -1, .to_sec = -1.0 };
+    static const struct option long_options[] = {
+        {"summary", no_argument,       NULL, 's'},
+        {"dump",    no_argument,       NULL, 'd'},
+        {"gaps",    required_argument, NULL, 'g'},
+        {"bursts",  required_argument, NULL, 'b'},
+        {"irq",     required_argument, NULL, 'i'},
+        {"from",    required_argument, NULL, 'F'},
+        {"to",      required_argument, NULL, 'T'},
+        {"help",    no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 's':
+                opts.summary = 1;
+                break;
+            case 'd':
+                opts.dump = 1;
+                break;
+            case 'g': {
+                double gap_ms;
+                if (parse_duration(optarg, &gap_ms) != 0 || gap_ms <= 0) {
+                    fprintf(stderr, "Error: --gaps espera MS > 0: %s\n", optarg);
+                    return 1;
+                }
+                opts.gap_ns = (uint64_t)(gap_ms * NS_PER_MS);
+                break;
+            }
+            case 'b': {
+                char *endptr;
+                long count = strtol(optarg, &endptr, 10);
+                double window_ms = 0;
+                if (endptr == optarg || *endptr != ':' ||
+                    parse_duration(endptr + 1, &window_ms) != 0 ||
+                    count < 2 || count > ANALYZER_MAX_BURST || window_ms <= 0) {
+                    fprintf(stderr, "Error: --bursts espera N:MS con 2 <= N <= %d\n", ANALYZER_MAX_BURST);
+                    return 1;
+                }
+                opts.burst_count = (unsigned int)count;
+                opts.burst_window_ns = (uint64_t)(window_ms * NS_PER_MS);
+                break;
+            }
+            case 'i': {
+                char *endptr;
+                long irq = strtol(optarg, &endptr, 10);
+                if (endptr == optarg || *endptr != '\0' || irq < 0 || irq >= ANALYZER_MAX_IRQS) {
+                    fprintf(stderr, "Error: IRQ inválida: %s (0-%d)\n", optarg, ANALYZER_MAX_IRQS - 1);
+                    return 1;
+                }
+                opts.irq = (int)irq;
+                break;
+            }
+            case 'F':
+                if (parse_duration(optarg, &opts.from_sec) != 0) {
+                    fprintf(stderr, "Error: --from espera segundos entre 0 y %g: %s\n", ANALYZER_MAX_SECONDS, optarg);
+                    return 1;
+                }
+                break;
+            case 'T':
+                if (parse_duration(optarg, &opts.to_sec) != 0) {
+                    fprintf(stderr, "Error: --to espera segundos entre 0 y %g: %s\n", ANALYZER_MAX_SECONDS, optarg);
+                    return 1;
+                }
+                break;
+            case 'h':
+                show_usage(argv[0]);
+                return 0;
+            default:
+                show_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        show_usage(argv[0]);
+        return 1;
+    }
+    if (opts.to_sec >= 0 && opts.to_sec < opts.from_sec) {
+        fprintf(stderr, "Error: --to (%g s) es anterior a --from (%g s)\n", opts.to_sec, opts.from_sec);
+        return 1;
+    }
+    if (!opts.gap_ns && !opts.burst_count && !opts.dump) {
+        opts.summary = 1;
+    }
+
+    trace_file_t file;
+    if (open_trace_file(argv[optind], &file) != 0) {
+        return 1;
+    }
+    if (opts.irq >= (int)file.header->irq_count) {
+        if (file.header->irq_count == 0) {
+            fprintf(stderr, "Error: IRQ %d fuera de rango (la traza no tiene IRQs)\n", opts.irq);
+        } else {
+            fprintf(stderr, "Error: IRQ %d fuera de rango (0-%u)\n", opts.irq, file.header->irq_count - 1);
+        }
+        munmap((void *)file.base, file.size);
+        return 1;
+    }
+
+    irq_stats_t *stats = calloc(file.header->irq_count ? file.header->irq_count : 1, sizeof(*stats));
+    uint64_t *burst_rings = NULL;
+    if (opts.burst_count) {
+        burst_rings = calloc((size_t)file.header->irq_count * opts.burst_count, sizeof(*burst_rings));
+    }
+    if (!stats || (opts.burst_count && !burst_rings)) {
+        fprintf(stderr, "Error: sin memoria\n");
+        return 1;
+    }
+
+    analyze(&file, &opts, stats, burst_rings);
+    if (opts.summary) {
+        show_summary(&file, stats);
+    }
+
+    free(burst_rings);
+    free(stats);
+    munmap((void *)file.base, file.size);
+    return 0;
+}
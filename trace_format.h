@@ -0,0 +1,147 @@
+#ifndef TRACE_FORMAT_H
+#define TRACE_FORMAT_H
+
+#include <stdint.h>
+
+// Formato de traza compartido entre el simulador y el analizador offline
+// (trace_analyzer). Todo lo definido aquí forma parte del formato en disco:
+// los ids de eventos solo pueden añadirse al final, nunca reordenarse.
+
+#define TRACE_MAX_ARGS 3
+
+// Categoría de la entrada, decidida por quien la emite (trace_entry_t.flags)
+#define TRACE_FLAG_TIMER 0x01            // Generada por el timer del sistema (IRQ0/PIT)
+#define TRACE_FLAG_CPU_SHIFT 1           // Bits 1-6: CPU simulada + 1 (0 = fuera de una CPU)
+#define TRACE_FLAG_CPU_MASK 0x7E
+
+// Plantillas de eventos de traza: el texto se genera solo al mostrarlo.
+// Formato de plantilla: %d = argumento entero, %s = id de cadena interna.
+typedef enum {
+    TRACE_EV_TEXT,               // Texto libre internado (add_trace*)
+    TRACE_EV_ISR_REGISTERED,
+    TRACE_EV_IRQ_CONNECTED,
+    TRACE_EV_ISR_REMOVED,
+    TRACE_EV_IRQ_DISCONNECTED,
+    TRACE_EV_IRQ_REJECTED,
+    TRACE_EV_IRQ_NO_HANDLER,
+    TRACE_EV_IRQ_REENTRANT,
+    TRACE_EV_IRQ_RAISED,
+    TRACE_EV_CONTEXT_SAVE,
+    TRACE_EV_IDT_LOOKUP,
+    TRACE_EV_ISR_EXEC,
+    TRACE_EV_CONTEXT_RESTORE,
+    TRACE_EV_IRQ_DONE,
+    TRACE_EV_TIMER_TICK,
+    TRACE_EV_TIMER_QUANTUM,
+    TRACE_EV_TIMER_DONE,
+    TRACE_EV_KBD_SCANCODE,
+    TRACE_EV_KBD_KEYCODE,
+    TRACE_EV_KBD_EVENT,
+    TRACE_EV_CUSTOM_BEGIN,
+    TRACE_EV_CUSTOM_DATA,
+    TRACE_EV_CUSTOM_DONE,
+    TRACE_EV_ERROR_ISR,
+    TRACE_EV_PIT_FIRE,
+    TRACE_EV_TEST_CLEANUP,
+    TRACE_EV_IRQ_QUEUE_FULL,
+    TRACE_EV_SMP_STARTED,
+    TRACE_EV_IRQ_AFFINITY,
+    TRACE_EV_IRQ_STOLEN,
+    TRACE_EV_IRQ_LATCHED,
+    TRACE_EV_IRQ_COALESCED,
+    TRACE_EV_IRQ_PENDING_DELIVERED,
+    TRACE_EV_IRQ_LOST,
+    TRACE_EV_SOFTIRQ_HANDOFF,
+    TRACE_EV_DEFERRED_STARTED,
+    TRACE_EV_IRQ_THREAD_REGISTERED,
+    TRACE_EV_IRQ_THREAD_WAKE,
+    TRACE_EV_IRQ_THREAD_DONE,
+    TRACE_EV_NAPI_CONFIG,
+    TRACE_EV_NAPI_POLL_ON,
+    TRACE_EV_NAPI_POLL_OFF,
+    TRACE_EV_TIMER_CONFIG,
+    TRACE_EV_TIMER_MISSED,
+    TRACE_EV_NOHZ_STOP,
+    TRACE_EV_NOHZ_RESTART,
+    TRACE_EV_NOHZ_ONESHOT,
+    TRACE_EV_TIMERS_EXPIRED,
+    TRACE_EV_HRTIMERS_EXPIRED,
+    TRACE_EV_IRQ_SPURIOUS,
+    TRACE_EV_SHARED_REGISTERED,
+    TRACE_EV_SHARED_HANDLED,
+    TRACE_EV_VECTOR_UNASSIGNED,
+    TRACE_EV_MSIX_ALLOCATED,
+    TRACE_EV_MSIX_FAILED,
+    TRACE_EV_MSIX_QUEUE,
+    TRACE_EV_COUNT
+} trace_event_id_t;
+
+// Entrada de traza binaria (24 bytes): el texto y la hora se formatean al leerla
+typedef struct {
+    uint64_t timestamp_ns;               // CLOCK_MONOTONIC en ns (clave de orden del merge)
+    uint8_t event_id;                    // Plantilla (trace_event_id_t)
+    uint8_t flags;                       // TRACE_FLAG_*
+    int16_t irq_num;                     // IRQ asociada o -1
+    int32_t args[TRACE_MAX_ARGS];        // Argumentos de la plantilla
+} trace_entry_t;
+
+// Archivo de traza offline (.trace):
+//   [trace_file_header_t]
+//   [trace_entry_t x record_count]         ordenados por timestamp_ns
+//   [trace_irq_index_t x irq_count]        resumen por IRQ
+//   [trace_time_index_t x time_index_count] un punto cada time_index_stride registros
+//   [trace_file_string_t x event_count]    plantilla de cada evento (id = trace_event_id_t)
+//   [trace_file_string_t x string_count]   cadenas internadas que citan los registros, por id
+#define TRACE_FILE_MAGIC "IRQTRACE"
+// Versión 3: TRACE_EV_PIT_FIRE pasa a llevar tick y retraso, con irq_num = IRQ0
+// Versión 4: tablas de plantillas y de cadenas (el archivo se basta a sí mismo)
+#define TRACE_FILE_VERSION 4
+#define TRACE_TIME_INDEX_STRIDE 1024
+#define TRACE_FILE_STRING_LEN 256        // Bytes por texto, terminador incluido
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;                // sizeof(trace_file_header_t)
+    uint32_t record_size;                // sizeof(trace_entry_t)
+    uint32_t irq_count;                  // Entradas del índice por IRQ
+    uint64_t record_count;
+    uint64_t untagged_count;             // Registros sin IRQ asociada (irq_num < 0)
+    uint64_t records_offset;
+    uint64_t irq_index_offset;
+    uint64_t time_index_offset;
+    uint64_t time_index_count;
+    uint32_t time_index_stride;
+    uint32_t event_count;                // TRACE_EV_COUNT del simulador que lo escribió
+    uint64_t first_timestamp_ns;
+    uint64_t last_timestamp_ns;
+    int64_t realtime_offset_ns;          // CLOCK_REALTIME - CLOCK_MONOTONIC al grabar
+    uint64_t event_table_offset;         // event_count plantillas
+    uint64_t string_table_offset;
+    uint64_t string_count;               // Cadenas distintas citadas con %s
+} trace_file_header_t;
+
+// Índice por IRQ: permite resumir o saltar a una IRQ sin recorrer el archivo
+typedef struct {
+    uint64_t record_count;
+    uint64_t first_record;
+    uint64_t last_record;
+    uint64_t first_timestamp_ns;
+    uint64_t last_timestamp_ns;
+} trace_irq_index_t;
+
+// Texto de la tabla de plantillas o de cadenas. En la de cadenas id es el
+// que guardan los argumentos %s de los registros; en la de plantillas, el
+// trace_event_id_t. Ambas van ordenadas por id.
+typedef struct {
+    uint32_t id;
+    char text[TRACE_FILE_STRING_LEN];
+} trace_file_string_t;
+
+// Índice temporal: búsqueda binaria del primer registro de una ventana
+typedef struct {
+    uint64_t timestamp_ns;
+    uint64_t record_number;
+} trace_time_index_t;
+
+#endif // TRACE_FORMAT_H